@@ -39,6 +39,23 @@ if test x"$[]enable_$2" = xno; then
   AC_DEFINE([OTTERY_NO_$3], [1], [If defined to 1, disables $4])
 fi])
 
+# As OTTERY_ARG_DISABLE, for an option that is off unless the user asks for
+# it.  Defines OTTERY_$3 rather than OTTERY_NO_$3.
+AC_DEFUN([OTTERY_ARG_ENABLE],
+[_OTTERY_ARG_ENABLE([$1],
+                    m4_translit([$1], [-], [_]),
+                    m4_translit([$1], [-a-z], [_A-Z]),
+                    [$2])])
+
+# Internal macro which must be called as follows:
+# _OTTERY_ARG_ENABLE([thing-one], [thing_one], [THING_ONE], [help text])
+AC_DEFUN([_OTTERY_ARG_ENABLE],
+[AC_ARG_ENABLE([$1], [AS_HELP_STRING([--enable-$1], [enable $4])],
+               [], [enable_$2=no])
+if test x"$[]enable_$2" = xyes; then
+  AC_DEFINE([OTTERY_$3], [1], [If defined to 1, enables $4])
+fi])
+
 # Probing compiler and host CPU for SIMD intrinsics.
 
 # Internal: test for a specific type of SIMD.
@@ -47,12 +64,19 @@ fi])
 #  [comma-separated list of compiler options],
 #  [[code]], [[more code]])
 # [[code]] and [[more code]] will be passed to AC_LANG_PROGRAM.
+# An option of "none" means that no extra compiler options are needed.
+# Sets [output_variable]_OK to yes or no, depending on whether we found a
+# set of options that worked.
 AC_DEFUN([_OTTERY_CHECK_SIMD_SPECIFIC],
 [AC_CACHE_CHECK([for $1], [ac_cv_cpu_$2],
   [ac_cv_cpu_$2=no
   save_CFLAGS="$CFLAGS"
   for opts in ottery_map_args_sep(["], ["], [ ], $4); do
-    CFLAGS="$save_CFLAGS $opts"
+    if test x"$opts" = xnone; then
+      CFLAGS="$save_CFLAGS"
+    else
+      CFLAGS="$save_CFLAGS $opts"
+    fi
     AC_COMPILE_IFELSE([AC_LANG_PROGRAM([$5], [$6])],
       [ac_cv_cpu_$2="$opts"
        break])
@@ -61,8 +85,13 @@ AC_DEFUN([_OTTERY_CHECK_SIMD_SPECIFIC],
 ])
 if test x"$[]ac_cv_cpu_$2" = xno; then
   $3=
+  $3[]_OK=no
+elif test x"$[]ac_cv_cpu_$2" = xnone; then
+  $3=
+  $3[]_OK=yes
 else
   $3="$[]ac_cv_cpu_$2"
+  $3[]_OK=yes
 fi
 ])
 
@@ -104,6 +133,33 @@ AC_DEFUN([_OTTERY_CHECK_SIMD_SSSE3],
             _mm_set_epi8(14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3));
 ]])])
 
+AC_DEFUN([_OTTERY_CHECK_SIMD_AVX2],
+[_OTTERY_CHECK_SIMD_SPECIFIC([AVX2 intrinsics],
+  [x86_avx2_intrinsics], [SIMD3_CFLAGS], [-mavx2], [[
+#if !__AVX2__
+#error "AVX2 test macro should be defined"
+#endif
+#include <immintrin.h>
+]], [[
+ typedef unsigned vec __attribute__ ((vector_size (32)));
+ extern vec x, y;
+ y = (vec)_mm256_permute2x128_si256((__m256i)x, (__m256i)y, 0x20);
+]])])
+
+AC_DEFUN([_OTTERY_CHECK_SIMD_AVX512],
+[_OTTERY_CHECK_SIMD_SPECIFIC([AVX-512F intrinsics],
+  [x86_avx512f_intrinsics], [SIMD4_CFLAGS], [-mavx512f], [[
+#if !__AVX512F__
+#error "AVX-512F test macro should be defined"
+#endif
+#include <immintrin.h>
+]], [[
+ typedef unsigned vec __attribute__ ((vector_size (64)));
+ extern vec x, y;
+ y = (vec)_mm512_shuffle_i32x4(_mm512_rol_epi32((__m512i)x, 7),
+                               (__m512i)y, 0x44);
+]])])
+
 # ARM
 
 AC_DEFUN([_OTTERY_CHECK_SIMD_NEON],
@@ -119,6 +175,26 @@ AC_DEFUN([_OTTERY_CHECK_SIMD_NEON],
   v = (vec)vextq_u32((uint32x4_t)x,(uint32x4_t)x,1);
 ]])])
 
+# AArch64: NEON is part of the base architecture, so a compiler targeting it
+# shouldn't need any extra options.  We build one generic NEON flavor, and one
+# tuned for the wide out-of-order cores found in servers.
+
+AC_DEFUN([_OTTERY_CHECK_SIMD_NEON_AARCH64],
+[_OTTERY_CHECK_SIMD_SPECIFIC([AArch64 NEON intrinsics],
+  [aarch64_neon_intrinsics], [SIMD1_CFLAGS], [none, -march=armv8-a+simd], [[
+#if !__ARM_NEON
+#error "NEON test macro should be defined"
+#endif
+#include <arm_neon.h>
+]], [[
+  typedef unsigned vec __attribute__ ((vector_size (16)));
+  extern vec v, x;
+  v = (vec)vsriq_n_u32(vshlq_n_u32((uint32x4_t)x,7),(uint32x4_t)x,25);
+]])
+SIMD2_CFLAGS="$SIMD1_CFLAGS"
+SIMD2_CFLAGS_OK="$SIMD1_CFLAGS_OK"
+])
+
 # PPC
 
 AC_DEFUN([_OTTERY_CHECK_SIMD_ALTIVEC],
@@ -140,11 +216,22 @@ AC_DEFUN([OTTERY_USE_SIMD],
 [AC_REQUIRE([AC_CANONICAL_HOST])
 SIMD1_CFLAGS=
 SIMD2_CFLAGS=
+SIMD3_CFLAGS=
+SIMD4_CFLAGS=
+SIMD1_CFLAGS_OK=no
+SIMD2_CFLAGS_OK=no
+SIMD3_CFLAGS_OK=no
+SIMD4_CFLAGS_OK=no
 AS_IF([test $enable_simd = yes],
   [AS_CASE([$host_cpu],
   [i?86 | x86_64], [
     _OTTERY_CHECK_SIMD_SSE2
     _OTTERY_CHECK_SIMD_SSSE3
+    _OTTERY_CHECK_SIMD_AVX2
+    _OTTERY_CHECK_SIMD_AVX512
+  ],
+  [aarch64* | arm64*], [
+    _OTTERY_CHECK_SIMD_NEON_AARCH64
   ],
   [arm*], [
     _OTTERY_CHECK_SIMD_NEON
@@ -154,18 +241,41 @@ AS_IF([test $enable_simd = yes],
   ],
   [*], [
   ])])
-AS_IF([test x"$SIMD1_CFLAGS" = x && x"$SIMD2_CFLAGS" != x],
+AS_IF([test $SIMD1_CFLAGS_OK = no && test $SIMD2_CFLAGS_OK = yes],
   [SIMD1_CFLAGS="$SIMD2_CFLAGS"
-  SIMD2_CFLAGS=])
+  SIMD1_CFLAGS_OK=yes
+  SIMD2_CFLAGS=
+  SIMD2_CFLAGS_OK=no])
+dnl A fixed SIMD PRF is built from the baseline flavor alone, inside
+dnl ottery.c; see --with-fixed-prf.
+AS_IF([test x"$ottery_fixed_prf_simd" = xyes],
+  [SIMD2_CFLAGS=
+  SIMD2_CFLAGS_OK=no
+  SIMD3_CFLAGS=
+  SIMD3_CFLAGS_OK=no
+  SIMD4_CFLAGS=
+  SIMD4_CFLAGS_OK=no])
 AC_SUBST(SIMD1_CFLAGS)dnl
 AC_SUBST(SIMD2_CFLAGS)dnl
-AM_CONDITIONAL(SIMD_CHACHA_1, [test x"$SIMD1_CFLAGS" != x])
-AS_IF([test x"$SIMD1_CFLAGS" != x],
+AC_SUBST(SIMD3_CFLAGS)dnl
+AC_SUBST(SIMD4_CFLAGS)dnl
+AM_CONDITIONAL(SIMD_CHACHA_1, [test $SIMD1_CFLAGS_OK = yes &&
+                               test x"$ottery_fixed_prf_simd" != xyes])
+AS_IF([test $SIMD1_CFLAGS_OK = yes],
   [AC_DEFINE([HAVE_SIMD_CHACHA], [1],
     [Define to 1 if a SIMD-optimized ChaCha implementation is available.])])
-AM_CONDITIONAL(SIMD_CHACHA_2, [test x"$SIMD2_CFLAGS" != x])
-AS_IF([test x"$SIMD2_CFLAGS" != x],
+AM_CONDITIONAL(SIMD_CHACHA_2, [test $SIMD2_CFLAGS_OK = yes])
+AS_IF([test $SIMD2_CFLAGS_OK = yes],
   [AC_DEFINE([HAVE_SIMD_CHACHA_2], [1],
     [Define to 1 if a second SIMD-optimized ChaCha implementation is
      available.])])
+AM_CONDITIONAL(SIMD_CHACHA_3, [test $SIMD3_CFLAGS_OK = yes])
+AS_IF([test $SIMD3_CFLAGS_OK = yes],
+  [AC_DEFINE([HAVE_SIMD_CHACHA_3], [1],
+    [Define to 1 if an AVX2-optimized ChaCha implementation is available.])])
+AM_CONDITIONAL(SIMD_CHACHA_4, [test $SIMD4_CFLAGS_OK = yes])
+AS_IF([test $SIMD4_CFLAGS_OK = yes],
+  [AC_DEFINE([HAVE_SIMD_CHACHA_4], [1],
+    [Define to 1 if an AVX-512-optimized ChaCha implementation is
+     available.])])
 ])
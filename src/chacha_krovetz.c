@@ -20,8 +20,19 @@
 #include <assert.h>
 #include "ottery-internal.h"
 
+/* Ottery: with AVX2 or AVX-512, each vector holds the same row of 2 or 4
+ * consecutive blocks, one per 128-bit lane.  LANES is the number of blocks
+ * computed by a single set of four vectors. */
+#if __AVX512F__
+#define LANES 4
+#elif __AVX2__
+#define LANES 2
+#else
+#define LANES 1
+#endif
+
 /* Architecture-neutral way to specify 16-byte vector of ints              */
-typedef unsigned vec __attribute__ ((vector_size (16)));
+typedef unsigned vec __attribute__ ((vector_size (16 * LANES)));
 
 /* This implementation is designed for Neon, SSE and AltiVec machines. The
  * following specify how to do certain vector operations efficiently on
@@ -29,10 +40,18 @@ typedef unsigned vec __attribute__ ((vector_size (16)));
  * This implementation supports parallel processing of multiple blocks,
  * including potentially using general-purpose registers.
  */
-#if __ARM_NEON__
+#if __ARM_NEON__ || __ARM_NEON
 #include <arm_neon.h>
 #define GPR_TOO   1
+#if defined(__aarch64__) && defined(OTTERY_BUILDING_SIMD2)
+/* Ottery: AArch64 has 32 vector registers, and the wide cores we find on
+ * servers can keep more independent blocks in flight, so our second
+ * AArch64 flavor interleaves three vector blocks with the GPR block. */
+#define OTTERY_NEON_WIDE
+#define VBPI      3
+#else
 #define VBPI      2
+#endif
 #define ONE       (vec)vsetq_lane_u32(1,vdupq_n_u32(0),0)
 #define NONCE(ctr,p)  (vec)vcombine_u32(vcreate_u32(ctr),vcreate_u32(*(uint64_t *)p))
 #define ROTV1(x)  (vec)vextq_u32((uint32x4_t)x,(uint32x4_t)x,1)
@@ -64,6 +83,59 @@ typedef unsigned vec __attribute__ ((vector_size (16)));
 #define ROTW8(x)   vec_rl(x,vec_splat_u32(8))
 #define ROTW12(x)  vec_rl(x,vec_splat_u32(12))
 #define ROTW16(x)  vec_rl(x,vec_splat_u32(-16)) /* trick to get 16 */
+#elif __AVX512F__
+#include <immintrin.h>
+#define GPR_TOO   0
+#define VBPI      4
+#define LOOP_ITERATIONS 1
+#define ONE       (vec)_mm512_set_epi32(0,0,0,4,0,0,0,4,0,0,0,4,0,0,0,4)
+#define NONCE(ctr,p)  (vec)(_mm512_broadcast_i32x4(_mm_slli_si128(_mm_loadl_epi64((__m128i *)(p)),8))+_mm512_set_epi64(0,(ctr)+3,0,(ctr)+2,0,(ctr)+1,0,(ctr)))
+#define LOAD_ROW(p) (vec)_mm512_broadcast_i32x4(_mm_load_si128((__m128i *)(p)))
+#define ROTV1(x)  (vec)_mm512_shuffle_epi32((__m512i)x,(_MM_PERM_ENUM)_MM_SHUFFLE(0,3,2,1))
+#define ROTV2(x)  (vec)_mm512_shuffle_epi32((__m512i)x,(_MM_PERM_ENUM)_MM_SHUFFLE(1,0,3,2))
+#define ROTV3(x)  (vec)_mm512_shuffle_epi32((__m512i)x,(_MM_PERM_ENUM)_MM_SHUFFLE(2,1,0,3))
+#define ROTW7(x)  (vec)_mm512_rol_epi32((__m512i)x, 7)
+#define ROTW8(x)  (vec)_mm512_rol_epi32((__m512i)x, 8)
+#define ROTW12(x) (vec)_mm512_rol_epi32((__m512i)x,12)
+#define ROTW16(x) (vec)_mm512_rol_epi32((__m512i)x,16)
+/* Transpose the 128-bit lanes of v0..v3, so that each block comes out
+ * contiguously. */
+#define WRITE(aligned, op, d, v0, v1, v2, v3) {                           \
+    __m512i t0_, t1_, t2_, t3_;                                           \
+    t0_ = _mm512_shuffle_i32x4((__m512i)(v0), (__m512i)(v1), 0x44);       \
+    t1_ = _mm512_shuffle_i32x4((__m512i)(v2), (__m512i)(v3), 0x44);       \
+    t2_ = _mm512_shuffle_i32x4((__m512i)(v0), (__m512i)(v1), 0xee);       \
+    t3_ = _mm512_shuffle_i32x4((__m512i)(v2), (__m512i)(v3), 0xee);       \
+    STORE_VEC(aligned, op + d +  0, (vec)_mm512_shuffle_i32x4(t0_, t1_, 0x88)); \
+    STORE_VEC(aligned, op + d + 16, (vec)_mm512_shuffle_i32x4(t0_, t1_, 0xdd)); \
+    STORE_VEC(aligned, op + d + 32, (vec)_mm512_shuffle_i32x4(t2_, t3_, 0x88)); \
+    STORE_VEC(aligned, op + d + 48, (vec)_mm512_shuffle_i32x4(t2_, t3_, 0xdd)); \
+  }
+#elif __AVX2__
+#include <immintrin.h>
+#define GPR_TOO   0
+#define VBPI      4
+#define LOOP_ITERATIONS 2
+#define ONE       (vec)_mm256_set_epi32(0,0,0,2,0,0,0,2)
+#define NONCE(ctr,p)  (vec)(_mm256_broadcastsi128_si256(_mm_slli_si128(_mm_loadl_epi64((__m128i *)(p)),8))+_mm256_set_epi64x(0,(ctr)+1,0,(ctr)))
+#define LOAD_ROW(p) (vec)_mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(p)))
+#define ROTV1(x)  (vec)_mm256_shuffle_epi32((__m256i)x,_MM_SHUFFLE(0,3,2,1))
+#define ROTV2(x)  (vec)_mm256_shuffle_epi32((__m256i)x,_MM_SHUFFLE(1,0,3,2))
+#define ROTV3(x)  (vec)_mm256_shuffle_epi32((__m256i)x,_MM_SHUFFLE(2,1,0,3))
+#define ROTW7(x)  (vec)(_mm256_slli_epi32((__m256i)x, 7) ^ _mm256_srli_epi32((__m256i)x,25))
+#define ROTW12(x) (vec)(_mm256_slli_epi32((__m256i)x,12) ^ _mm256_srli_epi32((__m256i)x,20))
+#define ROTW8(x)  (vec)_mm256_shuffle_epi8((__m256i)x,_mm256_set_epi8(14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3,14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3))
+#define ROTW16(x) (vec)_mm256_shuffle_epi8((__m256i)x,_mm256_set_epi8(13,12,15,14,9,8,11,10,5,4,7,6,1,0,3,2,13,12,15,14,9,8,11,10,5,4,7,6,1,0,3,2))
+/* Put the low lanes of v0..v3 (one block) before their high lanes (the
+ * next block). */
+#define WRITE(aligned, op, d, v0, v1, v2, v3) {                           \
+    __m256i t0_ = (__m256i)(v0), t1_ = (__m256i)(v1);                     \
+    __m256i t2_ = (__m256i)(v2), t3_ = (__m256i)(v3);                     \
+    STORE_VEC(aligned, op + d +  0, (vec)_mm256_permute2x128_si256(t0_, t1_, 0x20)); \
+    STORE_VEC(aligned, op + d +  8, (vec)_mm256_permute2x128_si256(t2_, t3_, 0x20)); \
+    STORE_VEC(aligned, op + d + 16, (vec)_mm256_permute2x128_si256(t0_, t1_, 0x31)); \
+    STORE_VEC(aligned, op + d + 24, (vec)_mm256_permute2x128_si256(t2_, t3_, 0x31)); \
+  }
 #elif __SSE2__
 #include <emmintrin.h>
 #define GPR_TOO   0
@@ -99,7 +171,19 @@ typedef unsigned vec __attribute__ ((vector_size (16)));
 #define REVW_BE(x)  (x)
 #endif
 
-#define BPI      (VBPI + GPR_TOO)  /* Blocks computed per loop iteration   */
+#ifndef LOAD_ROW
+#define LOAD_ROW(p) (*(vec *)(p))
+#endif
+
+#ifndef LOOP_ITERATIONS
+#define LOOP_ITERATIONS 4
+#endif
+
+#if GPR_TOO && LANES > 1
+#error "GPR_TOO doesn't work with multi-lane vectors"
+#endif
+
+#define BPI      (VBPI*LANES + GPR_TOO)  /* Blocks computed per loop iteration */
 
 #define DQROUND_VECTORS(a,b,c,d)                \
     a += b; d ^= a; d = ROTW16(d);              \
@@ -119,44 +203,66 @@ typedef unsigned vec __attribute__ ((vector_size (16)));
   a = a+b; d ^= a; d = d<< 8 | d>>24; \
   c = c+d; b ^= c; b = b<< 7 | b>>25;
 
-#define WRITE(op, d, v0, v1, v2, v3)                   \
-*(vec *)(op + d +  0) = REVV_BE(v0);    \
-*(vec *)(op + d +  4) = REVV_BE(v1);    \
-*(vec *)(op + d +  8) = REVV_BE(v2);    \
-*(vec *)(op + d + 12) = REVV_BE(v3);
+/* Store a vector or a word at p; p only needs to be aligned if 'aligned' is
+ * true.  (The memcpy calls turn into single unaligned stores.)  Our output
+ * is never more than 16-byte aligned, so wider vectors always use unaligned
+ * stores. */
+#define STORE_VEC(aligned, p, v) do {                   \
+    vec v_ = (v);                                       \
+    if ((aligned) && sizeof(vec) == 16)                 \
+      *(vec *)(p) = v_;                                 \
+    else                                                \
+      memcpy((p), &v_, sizeof(vec));                    \
+  } while (0)
+#define STORE_WORD(aligned, p, w) do {                  \
+    unsigned w_ = (w);                                  \
+    if (aligned)                                        \
+      *(unsigned *)(p) = w_;                            \
+    else                                                \
+      memcpy((p), &w_, sizeof(unsigned));               \
+  } while (0)
+
+#ifndef WRITE
+#define WRITE(aligned, op, d, v0, v1, v2, v3)           \
+STORE_VEC(aligned, op + d +  0, REVV_BE(v0));           \
+STORE_VEC(aligned, op + d +  4, REVV_BE(v1));           \
+STORE_VEC(aligned, op + d +  8, REVV_BE(v2));           \
+STORE_VEC(aligned, op + d + 12, REVV_BE(v3));
+#endif
 
 struct chacha_state_krovetz {
   __attribute__ ((aligned (16))) uint8_t key[32];
   __attribute__ ((aligned (16))) uint8_t nonce[8];
 };
 
-#define LOOP_ITERATIONS 4
-
 static inline int
 ottery_blocks_chacha_krovetz(
         const int chacha_rounds,
+        const int aligned,
         uint8_t *out,
         uint32_t block_idx,
         struct chacha_state_krovetz *st)
   __attribute__((always_inline));
 
 /** Generates 64 * BPI * LOOP_ITERATIONS bytes of output using the key and
- * nonce in st and the counter in block_idx, and store them in out.
+ * nonce in st and the counter in block_idx, and store them in out.  If
+ * aligned is false, out need not be aligned.
  */
 static inline int
 ottery_blocks_chacha_krovetz(
         const int chacha_rounds,
+        const int aligned,
         uint8_t *out,
         uint32_t block_idx,
         struct chacha_state_krovetz *st)
-/* Assumes all pointers are aligned properly for vector reads */
+/* Assumes st is aligned properly for vector reads */
 {
     const unsigned char *k = st->key;
     const unsigned char *n = st->nonce;
     unsigned i, j, *op=(unsigned *)out, *kp, *np;
     __attribute__ ((aligned (16))) unsigned chacha_const[] =
                                 {0x61707865,0x3320646E,0x79622D32,0x6B206574};
-#if ( __ARM_NEON__ || __SSE2__)
+#if ( __ARM_NEON__ || __ARM_NEON || __SSE2__)
     kp = (unsigned *)k;
     np = (unsigned *)n;
 #else
@@ -168,9 +274,9 @@ ottery_blocks_chacha_krovetz(
     kp = (unsigned *)key;
     np = (unsigned *)nonce;
 #endif
-    vec s0 = *(vec *)chacha_const;
-    vec s1 = ((vec *)kp)[0];
-    vec s2 = ((vec *)kp)[1];
+    vec s0 = LOAD_ROW(chacha_const);
+    vec s1 = LOAD_ROW(kp);
+    vec s2 = LOAD_ROW(kp + 4);
     vec s3 = NONCE(block_idx, np);
     for (j = 0; j < LOOP_ITERATIONS; ++j) {
         vec v0,v1,v2,v3,v4,v5,v6,v7;
@@ -216,36 +322,36 @@ ottery_blocks_chacha_krovetz(
             QROUND_WORDS( x3, x4, x9,x14)
             #endif
         }
-        WRITE(op, 0, v0+s0, v1+s1, v2+s2, v3+s3)
+        WRITE(aligned, op, 0, v0+s0, v1+s1, v2+s2, v3+s3)
         s3 += ONE;
-        WRITE(op, 16, v4+s0, v5+s1, v6+s2, v7+s3)
+        WRITE(aligned, op, 16*LANES, v4+s0, v5+s1, v6+s2, v7+s3)
         s3 += ONE;
         #if VBPI > 2
-        WRITE(op, 32, v8+s0, v9+s1, v10+s2, v11+s3)
+        WRITE(aligned, op, 32*LANES, v8+s0, v9+s1, v10+s2, v11+s3)
         s3 += ONE;
         #endif
         #if VBPI > 3
-        WRITE(op, 48, v12+s0, v13+s1, v14+s2, v15+s3)
+        WRITE(aligned, op, 48*LANES, v12+s0, v13+s1, v14+s2, v15+s3)
         s3 += ONE;
         #endif
-        op += VBPI*16;
+        op += VBPI*16*LANES;
         #if GPR_TOO
-        op[0]  = REVW_BE((x0  + chacha_const[0]));
-        op[1]  = REVW_BE((x1  + chacha_const[1]));
-        op[2]  = REVW_BE((x2  + chacha_const[2]));
-        op[3]  = REVW_BE((x3  + chacha_const[3]));
-        op[4]  = REVW_BE((x4  + kp[0]));
-        op[5]  = REVW_BE((x5  + kp[1]));
-        op[6]  = REVW_BE((x6  + kp[2]));
-        op[7]  = REVW_BE((x7  + kp[3]));
-        op[8]  = REVW_BE((x8  + kp[4]));
-        op[9]  = REVW_BE((x9  + kp[5]));
-        op[10] = REVW_BE((x10 + kp[6]));
-        op[11] = REVW_BE((x11 + kp[7]));
-        op[12] = REVW_BE((x12 + (x_ctr & 0xffffffff)));
-        op[13] = REVW_BE((x13 + (x_ctr >> 32)));
-        op[14] = REVW_BE((x14 + np[0]));
-        op[15] = REVW_BE((x15 + np[1]));
+        STORE_WORD(aligned, op + 0, REVW_BE((x0  + chacha_const[0])));
+        STORE_WORD(aligned, op + 1, REVW_BE((x1  + chacha_const[1])));
+        STORE_WORD(aligned, op + 2, REVW_BE((x2  + chacha_const[2])));
+        STORE_WORD(aligned, op + 3, REVW_BE((x3  + chacha_const[3])));
+        STORE_WORD(aligned, op + 4, REVW_BE((x4  + kp[0])));
+        STORE_WORD(aligned, op + 5, REVW_BE((x5  + kp[1])));
+        STORE_WORD(aligned, op + 6, REVW_BE((x6  + kp[2])));
+        STORE_WORD(aligned, op + 7, REVW_BE((x7  + kp[3])));
+        STORE_WORD(aligned, op + 8, REVW_BE((x8  + kp[4])));
+        STORE_WORD(aligned, op + 9, REVW_BE((x9  + kp[5])));
+        STORE_WORD(aligned, op + 10, REVW_BE((x10 + kp[6])));
+        STORE_WORD(aligned, op + 11, REVW_BE((x11 + kp[7])));
+        STORE_WORD(aligned, op + 12, REVW_BE((x12 + (x_ctr & 0xffffffff))));
+        STORE_WORD(aligned, op + 13, REVW_BE((x13 + (x_ctr >> 32))));
+        STORE_WORD(aligned, op + 14, REVW_BE((x14 + np[0])));
+        STORE_WORD(aligned, op + 15, REVW_BE((x15 + np[1])));
         s3 += ONE;
         op += 16;
         #endif
@@ -270,26 +376,77 @@ static void
 chacha8_krovetz_generate(void *state, uint8_t *output, uint32_t idx)
 {
   struct chacha_state_krovetz *st = state;
-  ottery_blocks_chacha_krovetz(8, output, idx * IDX_STEP, st);
+  ottery_blocks_chacha_krovetz(8, 1, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha8_krovetz_generate_blocks(void *state, uint8_t *output, uint32_t idx,
+                                size_t nblocks)
+{
+  struct chacha_state_krovetz *st = state;
+  if (((uintptr_t)output & 15) == 0) {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(8, 1, output, idx * IDX_STEP, st);
+  } else {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(8, 0, output, idx * IDX_STEP, st);
+  }
 }
 
 static void
 chacha12_krovetz_generate(void *state, uint8_t *output, uint32_t idx)
 {
   struct chacha_state_krovetz *st = state;
-  ottery_blocks_chacha_krovetz(12, output, idx * IDX_STEP, st);
+  ottery_blocks_chacha_krovetz(12, 1, output, idx * IDX_STEP, st);
+}
+
+static void
+chacha12_krovetz_generate_blocks(void *state, uint8_t *output, uint32_t idx,
+                                 size_t nblocks)
+{
+  struct chacha_state_krovetz *st = state;
+  if (((uintptr_t)output & 15) == 0) {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(12, 1, output, idx * IDX_STEP, st);
+  } else {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(12, 0, output, idx * IDX_STEP, st);
+  }
 }
 
 static void
 chacha20_krovetz_generate(void *state, uint8_t *output, uint32_t idx)
 {
   struct chacha_state_krovetz *st = state;
-  ottery_blocks_chacha_krovetz(20, output, idx * IDX_STEP, st);
+  ottery_blocks_chacha_krovetz(20, 1, output, idx * IDX_STEP, st);
 }
 
-#ifdef __SSSE3__
+static void
+chacha20_krovetz_generate_blocks(void *state, uint8_t *output, uint32_t idx,
+                                 size_t nblocks)
+{
+  struct chacha_state_krovetz *st = state;
+  if (((uintptr_t)output & 15) == 0) {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(20, 1, output, idx * IDX_STEP, st);
+  } else {
+    for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN)
+      ottery_blocks_chacha_krovetz(20, 0, output, idx * IDX_STEP, st);
+  }
+}
+
+#if __AVX512F__
+#define NEED_CPUCAP OTTERY_CPUCAP_AVX512|OTTERY_CPUCAP_SIMD
+#define FLAV "-AVX512"
+#elif __AVX2__
+#define NEED_CPUCAP OTTERY_CPUCAP_AVX2|OTTERY_CPUCAP_SIMD
+#define FLAV "-AVX2"
+#elif defined(__SSSE3__)
 #define NEED_CPUCAP OTTERY_CPUCAP_SSSE3|OTTERY_CPUCAP_SIMD
 #define FLAV "-SSSE3"
+#elif defined(OTTERY_NEON_WIDE)
+#define NEED_CPUCAP OTTERY_CPUCAP_SIMD
+#define FLAV "-NEON-WIDE"
 #else
 #define NEED_CPUCAP OTTERY_CPUCAP_SIMD
 #define FLAV "-DEFAULT"
@@ -304,7 +461,8 @@ chacha20_krovetz_generate(void *state, uint8_t *output, uint32_t idx)
   OUTPUT_LEN,                                   \
   NEED_CPUCAP,                                  \
   chacha_krovetz_state_setup,                   \
-  chacha ## r ## _krovetz_generate              \
+  chacha ## r ## _krovetz_generate,             \
+  chacha ## r ## _krovetz_generate_blocks       \
 }
 
 #if defined OTTERY_BUILDING_SIMD1
@@ -315,6 +473,14 @@ const struct ottery_prf ottery_prf_chacha20_krovetz_1_ = PRF_CHACHA(20);
 const struct ottery_prf ottery_prf_chacha8_krovetz_2_ = PRF_CHACHA(8);
 const struct ottery_prf ottery_prf_chacha12_krovetz_2_ = PRF_CHACHA(12);
 const struct ottery_prf ottery_prf_chacha20_krovetz_2_ = PRF_CHACHA(20);
+#elif defined OTTERY_BUILDING_SIMD3
+const struct ottery_prf ottery_prf_chacha8_krovetz_3_ = PRF_CHACHA(8);
+const struct ottery_prf ottery_prf_chacha12_krovetz_3_ = PRF_CHACHA(12);
+const struct ottery_prf ottery_prf_chacha20_krovetz_3_ = PRF_CHACHA(20);
+#elif defined OTTERY_BUILDING_SIMD4
+const struct ottery_prf ottery_prf_chacha8_krovetz_4_ = PRF_CHACHA(8);
+const struct ottery_prf ottery_prf_chacha12_krovetz_4_ = PRF_CHACHA(12);
+const struct ottery_prf ottery_prf_chacha20_krovetz_4_ = PRF_CHACHA(20);
 #else
 #error "Which PRF symbols am I supposed to define?"
 #endif
@@ -68,12 +68,17 @@ static void ECRYPT_ivsetup(ECRYPT_ctx *x,const u8 *iv)
 #define IDX_STEP    16
 #define OUTPUT_LEN  (IDX_STEP * 64)
 
-static inline void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c) __attribute__((always_inline));
+/** As IDX_STEP and OUTPUT_LEN, for the small-output versions that we use
+ * with ottery_lean_state. */
+#define LEAN_IDX_STEP    2
+#define LEAN_OUTPUT_LEN_ (LEAN_IDX_STEP * 64)
 
-/** Generate OUTPUT_LEN bytes of output using the key, nonce, and counter in x,
- * and store them in c.
+static inline void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c, const unsigned nblocks) __attribute__((always_inline));
+
+/** Generate nblocks*64 bytes of output using the key, nonce, and counter in
+ * x, and store them in c.
  */
-static void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c)
+static void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c, const unsigned nblocks)
 {
   u32 x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
   u32 j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -96,7 +101,7 @@ static void chacha_merged_getblocks(const int chacha_rounds, ECRYPT_ctx *x,u8 *c
   j14 = x->input[14];
   j15 = x->input[15];
 
-  for (block = 0; block < IDX_STEP; ++block) {
+  for (block = 0; block < nblocks; ++block) {
     x0 = j0;
     x1 = j1;
     x2 = j2;
@@ -181,7 +186,18 @@ chacha8_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(8, x, output);
+  chacha_merged_getblocks(8, x, output, IDX_STEP);
+}
+
+static void
+chacha8_merged_generate_blocks(void *state_, uint8_t *output, uint32_t idx,
+                               size_t nblocks)
+{
+  ECRYPT_ctx *x = state_;
+  for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN) {
+    x->input[12] = idx * IDX_STEP;
+    chacha_merged_getblocks(8, x, output, IDX_STEP);
+  }
 }
 
 static void
@@ -189,7 +205,18 @@ chacha12_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(12, x, output);
+  chacha_merged_getblocks(12, x, output, IDX_STEP);
+}
+
+static void
+chacha12_merged_generate_blocks(void *state_, uint8_t *output, uint32_t idx,
+                                size_t nblocks)
+{
+  ECRYPT_ctx *x = state_;
+  for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN) {
+    x->input[12] = idx * IDX_STEP;
+    chacha_merged_getblocks(12, x, output, IDX_STEP);
+  }
 }
 
 static void
@@ -197,7 +224,18 @@ chacha20_merged_generate(void *state_, uint8_t *output, uint32_t idx)
 {
   ECRYPT_ctx *x = state_;
   x->input[12] = idx * IDX_STEP;
-  chacha_merged_getblocks(20, x, output);
+  chacha_merged_getblocks(20, x, output, IDX_STEP);
+}
+
+static void
+chacha20_merged_generate_blocks(void *state_, uint8_t *output, uint32_t idx,
+                                size_t nblocks)
+{
+  ECRYPT_ctx *x = state_;
+  for ( ; nblocks; --nblocks, ++idx, output += OUTPUT_LEN) {
+    x->input[12] = idx * IDX_STEP;
+    chacha_merged_getblocks(20, x, output, IDX_STEP);
+  }
 }
 
 #define PRF_CHACHA(r) {                         \
@@ -209,10 +247,42 @@ chacha20_merged_generate(void *state_, uint8_t *output, uint32_t idx)
   OUTPUT_LEN,                                   \
   0,                                            \
   chacha_merged_state_setup,                    \
-  chacha ## r ## _merged_generate               \
+  chacha ## r ## _merged_generate,              \
+  chacha ## r ## _merged_generate_blocks        \
 }
 
 const struct ottery_prf ottery_prf_chacha8_merged_ = PRF_CHACHA(8);
 const struct ottery_prf ottery_prf_chacha12_merged_ = PRF_CHACHA(12);
 const struct ottery_prf ottery_prf_chacha20_merged_ = PRF_CHACHA(20);
 
+#define LEAN_GENERATE(r)                                                \
+  static void                                                           \
+  chacha ## r ## _merged_lean_generate(void *state_, uint8_t *output,   \
+                                       uint32_t idx)                    \
+  {                                                                     \
+    ECRYPT_ctx *x = state_;                                             \
+    x->input[12] = idx * LEAN_IDX_STEP;                                 \
+    chacha_merged_getblocks(r, x, output, LEAN_IDX_STEP);               \
+  }
+
+LEAN_GENERATE(8)
+LEAN_GENERATE(12)
+LEAN_GENERATE(20)
+
+#define PRF_CHACHA_LEAN(r) {                    \
+  "CHACHA" #r,                                  \
+  "CHACHA" #r "-NOSIMD",                        \
+  "CHACHA" #r "-NOSIMD-LEAN",                   \
+  STATE_LEN,                                    \
+  STATE_BYTES,                                  \
+  LEAN_OUTPUT_LEN_,                             \
+  0,                                            \
+  chacha_merged_state_setup,                    \
+  chacha ## r ## _merged_lean_generate,         \
+  NULL                                          \
+}
+
+const struct ottery_prf ottery_prf_chacha8_merged_lean_ = PRF_CHACHA_LEAN(8);
+const struct ottery_prf ottery_prf_chacha12_merged_lean_ = PRF_CHACHA_LEAN(12);
+const struct ottery_prf ottery_prf_chacha20_merged_lean_ = PRF_CHACHA_LEAN(20);
+
@@ -69,7 +69,12 @@ typedef struct
 
 #ifdef U32TO32_LITTLE
 #define U8TO32_LITTLE(p) U32TO32_LITTLE(((u32*)(p))[0])
-#define U32TO8_LITTLE(p, v) (((u32*)(p))[0] = U32TO32_LITTLE(v))
+/* Ottery: use memcpy so that we can write to unaligned output. */
+#define U32TO8_LITTLE(p, v) \
+  do { \
+    u32 v_le_ = U32TO32_LITTLE(v); \
+    memcpy((p), &v_le_, 4); \
+  } while (0)
 #else
 #define U8TO32_LITTLE(p) \
   (((u32)((p)[0])      ) | \
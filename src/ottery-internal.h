@@ -13,9 +13,11 @@
  */
 #ifndef OTTERY_INTERNAL_H_HEADER_INCLUDED_
 #define OTTERY_INTERNAL_H_HEADER_INCLUDED_
+/* ottery-config.h may define _GNU_SOURCE and friends, so it has to come
+ * before any system header. */
+#include "ottery-config.h"
 #include <stdint.h>
 #include <sys/types.h>
-#include "ottery-config.h"
 #include "ottery-threading.h"
 
 /** Largest possible state_bytes value. */
@@ -24,6 +26,20 @@
 #define MAX_STATE_LEN 256
 /** Largest possible output_len value. */
 #define MAX_OUTPUT_LEN 1024
+/** Largest possible buffer_len value for a state.  (Every index into the
+ * buffer has to fit in the 16-bit pos field.) */
+#define MAX_BUFFER_LEN 65536
+
+/** Size of a cache line, for keeping structures that different threads
+ * write off each other's lines.  Apple's ARM64 parts and POWER have 128-byte
+ * lines; for other ARM64 parts, 128 is merely a little wasteful. */
+#ifndef OTTERY_CACHE_LINE_LEN
+#if defined(__aarch64__) || defined(_M_ARM64) || defined(__powerpc64__)
+#define OTTERY_CACHE_LINE_LEN 128
+#else
+#define OTTERY_CACHE_LINE_LEN 64
+#endif
+#endif
 
 /**
  * @brief Flags for external entropy sources.
@@ -78,10 +94,27 @@ struct ottery_entropy_config {
   unsigned allow_nondev_urandom;
 };
 
+struct ottery_stats;
 struct ottery_entropy_state {
   /* Cached value for the inode of the urandom device.  If this value changes,
    * we assume that somebody messed with the fd by accident. */
   uint64_t urandom_fd_inode;
+  /* An fd that we opened for the urandom device, and kept open so we don't
+   * need to open it again. Only meaningful if urandom_fd_is_cached. */
+  int urandom_fd;
+  /* True iff urandom_fd is set. */
+  unsigned urandom_fd_is_cached : 1;
+  /* True iff egd_fd is set. */
+  unsigned egd_fd_is_cached : 1;
+  /* A connection to the EGD server that we kept open for next time.  Only
+   * meaningful if egd_fd_is_cached. */
+  int egd_fd;
+  /* The process that opened egd_fd. */
+  pid_t egd_pid;
+#ifdef OTTERY_STATS
+  /* If not NULL, where we count our calls to each entropy source. */
+  struct ottery_stats *stats;
+#endif
 };
 
 /**
@@ -89,6 +122,73 @@ struct ottery_entropy_state {
  * entropy source.  We might not actually need so many. */
 size_t ottery_get_entropy_bufsize_(size_t n);
 
+/**
+ * Release any resources held by an ottery_entropy_state, and wipe it.
+ */
+void ottery_entropy_state_clear_(struct ottery_entropy_state *state);
+
+/**
+ * Copy src into dst, so that we can collect entropy with dst while somebody
+ * else uses src.  If src counts statistics, dst counts them in scratch
+ * instead.  A connection to EGD can only serve one caller at a time, so dst
+ * takes it away from src.  Pass dst to ottery_entropy_state_merge_() when
+ * done.
+ */
+void ottery_entropy_state_snapshot_(struct ottery_entropy_state *dst,
+                                    struct ottery_entropy_state *src,
+                                    struct ottery_stats *scratch);
+
+/**
+ * Fold what happened to src, a snapshot of dst from
+ * ottery_entropy_state_snapshot_(), back into dst: keep any fd that src
+ * cached, and give back its EGD connection, unless dst has cached one of its
+ * own meanwhile.  Add up its statistics.  Wipe src afterwards.
+ */
+void ottery_entropy_state_merge_(struct ottery_entropy_state *dst,
+                                 struct ottery_entropy_state *src);
+
+/**
+ * Return true iff we have a fast entropy source on the CPU (RDRAND or
+ * RDSEED) that we can use for prediction resistance, and config doesn't
+ * disable it.
+ */
+int ottery_have_fast_entropy_(const struct ottery_entropy_config *config);
+
+/**
+ * Fill n bytes at out from the CPU's fast entropy source, preferring
+ * RDSEED to RDRAND.  Return 0 on success, or an OTTERY_ERR_* code on
+ * failure.
+ */
+int ottery_get_fast_entropy_(uint8_t *out, size_t n);
+
+#ifdef OTTERY_STATS
+/**
+ * Set up the entropy source fields of a newly zeroed ottery_stats, so that
+ * it describes the entropy sources that this build knows about.
+ */
+void ottery_entropy_stats_init_(struct ottery_stats *stats);
+#endif
+
+/**
+ * Return a monotonic timestamp in nanoseconds.  It's only good for
+ * measuring intervals.
+ */
+uint64_t ottery_monotonic_nsec_(void);
+
+/** Return the number of CPUs that the system has configured; at least 1. */
+unsigned ottery_get_n_cpus_(void);
+
+#ifdef OTTERY_STATS
+/** Add n to the field'th performance counter of the state st, if it has
+ * any. */
+#define OTTERY_STAT_ADD_(st, field, n) do {                     \
+    if ((st)->entropy_state.stats)                              \
+      (st)->entropy_state.stats->field += (n);                  \
+  } while (0)
+#else
+#define OTTERY_STAT_ADD_(st, field, n) ((void)0)
+#endif
+
 /**
  * Interface to underlying strong RNGs.  If this were fast, we'd just use it
  * for everything, and forget about having a userspace PRNG.  Unfortunately,
@@ -114,6 +214,20 @@ int ottery_get_entropy_(const struct ottery_entropy_config *config,
                          uint8_t *bytes, size_t n, size_t *bufsize,
                          uint32_t *flags_out);
 
+/**
+ * As ottery_get_entropy_(), but skip every source in a domain that
+ * have_flags already includes, and if stop_when_strong is true, stop after
+ * the first strong source that works.  Succeed if have_flags or the sources
+ * we ran include a strong source, even if we got nothing new; *flags_out
+ * only covers the sources we ran.
+ */
+int ottery_get_entropy_partial_(const struct ottery_entropy_config *config,
+                                struct ottery_entropy_state *state,
+                                uint32_t require_flags,
+                                uint32_t have_flags, int stop_when_strong,
+                                uint8_t *bytes, size_t n, size_t *bufsize,
+                                uint32_t *flags_out);
+
 /**
  * Clear all bytes stored in a structure. Unlike memset, the compiler is not
  * going to optimize this out of existence because the target is about to go
@@ -131,7 +245,8 @@ void ottery_memclear_(void *mem, size_t len);
  *
  * Broadly speaking, every ottery_prf has an underlying function from an
  * (state_bytes)-byte state and a 4 byte counter to an output_len-byte
- * output block.
+ * output block.  Each output block is output_len / 64 64-byte blocks of a
+ * stream cipher with a 32-bit block counter; see PRF_MAX_IDX().
  **/
 struct ottery_prf {
   /** The name of this algorithm. */
@@ -149,7 +264,8 @@ struct ottery_prf {
    * greater than MAX_STATE_BYTES.  It must be no grater than output_len. */
   unsigned state_bytes;
   /** The number of bytes generated by a single call to the generate
-   * function. It must be no larger than MAX_OUTPUT_LEN.
+   * function. It must be a multiple of 64, and no larger than
+   * MAX_OUTPUT_LEN.
    */
   unsigned output_len;
   /** Bitmask of CPU flags required to run this PRF. */
@@ -171,6 +287,21 @@ struct ottery_prf {
    * @param idx A counter value for the function.
    */
   void (*generate)(void *state, uint8_t *output, uint32_t idx);
+  /** Optional pointer to a function that calculates the PRF for several
+   * consecutive counter values at once.  Its output must be the same as
+   * calling generate() for idx, idx+1, ... idx+nblocks-1 in turn.  May be
+   * NULL.
+   *
+   * @param state A state object previously initialized by the setup
+   *     function.
+   * @param output An array of (output_len * nblocks) bytes in which to
+   *     store the result of the function.  Unlike the output argument to
+   *     generate, it need not be aligned.
+   * @param idx The counter value for the first block.
+   * @param nblocks The number of blocks to generate.
+   */
+  void (*generate_blocks)(void *state, uint8_t *output, uint32_t idx,
+                          size_t nblocks);
 };
 
 #ifdef OTTERY_INTERNAL
@@ -180,24 +311,146 @@ struct ottery_config {
 
   /** Configuration for how we will set up our entropy sources. */
   struct ottery_entropy_config entropy_config;
+
+  /** One of the OTTERY_GLOBAL_MODE_* values.  Only used by ottery_init(). */
+  int global_mode;
+
+  /** How many blocks of PRF output each state buffers at once. */
+  unsigned buffer_blocks;
+
+  /** One of the OTTERY_CLEAR_MODE_* values. */
+  int clear_mode;
+
+  /** One of the OTTERY_WIPE_STACK_* values. */
+  int wipe_stack_mode;
+
+  /** A bitwise OR of OTTERY_ALLOC_* values, for ottery_st_new(). */
+  unsigned alloc_flags;
+
+  /** If nonzero, mix fast CPU entropy into the key whenever we have
+   * generated at least this many blocks since the last time. */
+  unsigned pr_every_blocks;
+
+  /** If nonzero, mix fast CPU entropy into the key whenever at least this
+   * many milliseconds have passed since the last time. */
+  unsigned pr_every_msec;
+
+  /** True iff we seed from the first strong entropy source only, and mix
+   * in the rest later.  See ottery_config_set_fast_start(). */
+  unsigned fast_start;
 };
 
 #define ottery_state_nolock ottery_state
 
+/**
+ * A block of output, and the PRF state that follows from it, computed ahead
+ * of time by ottery_st_refill() so that ottery_st_nextblock_nolock() only
+ * needs to copy it into place.
+ */
+struct ottery_spare_block {
+  /** The buffer_len bytes of output, with their first prf.state_bytes
+   * bytes cleared (since they make up the next key). This points just after
+   * this structure, in the same allocation. */
+  uint8_t *buffer;
+  /** The PRF state we get from setting up the PRF with the block. */
+  __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
+  /** The PRF state we used to generate the block.  We only use the block if
+   * the shared state still matches this. */
+  __attribute__ ((aligned (16))) uint8_t key[MAX_STATE_LEN];
+  /** The counter value we used to generate the block. */
+  uint32_t idx;
+  /** True iff the fields above hold a block that we haven't used yet. */
+  int ready;
+  /** True iff ottery_st_refill() is filling in this block right now,
+   * without holding the lock. */
+  int busy;
+  /** The pointer we got from malloc, and need to pass to free. */
+  void *allocation;
+};
+
+/** Number of bytes of fast CPU entropy that we fetch at once for
+ * prediction resistance. */
+#define PR_POOL_LEN 256
+/** Number of bytes of fast CPU entropy that we mix into each new key. */
+#define PR_MIX_LEN 16
+
+/**
+ * What a state needs to mix fast CPU entropy into its key from time to
+ * time; see ottery_config_set_prediction_resistance().
+ */
+struct ottery_pr_pool {
+  /** Entropy that we fetched ahead of time.  The last avail bytes are
+   * unused. */
+  uint8_t bytes[PR_POOL_LEN];
+  /** Number of unused bytes at the end of bytes. */
+  uint32_t avail;
+  /** As pr_every_blocks in ottery_config. */
+  uint32_t every_blocks;
+  /** The number of blocks that we've generated since the last mix. */
+  uint32_t blocks_since;
+  /** As pr_every_msec in ottery_config. */
+  uint32_t every_msec;
+  /** When we last mixed, from ottery_monotonic_nsec_(). */
+  uint64_t last_nsec;
+};
+
+/**
+ * Evaluate to the largest counter value that the generate functions of the
+ * struct ottery_prf prf may be given.  Past it, the stream cipher's own
+ * 32-bit block counter would wrap around and repeat earlier output.  (We
+ * work this out instead of storing it, so that it costs no space in each
+ * state's copy of the PRF.)
+ */
+#define PRF_MAX_IDX(prf) (UINT32_MAX / ((prf).output_len / 64))
+
+/**
+ * Evaluate to the struct ottery_prf that the ottery_state st is using.
+ *
+ * In a build with a fixed PRF, this is a constant object whose fields the
+ * compiler can see, so that calls through it become direct calls.
+ */
+#ifdef OTTERY_FIXED_PRF
+#define ST_PRF(st) (OTTERY_FIXED_PRF)
+#else
+#define ST_PRF(st) ((st)->prf)
+#endif
+
+/**
+ * @brief Values for ottery_state.entropy_deferred.
+ *
+ * @{ */
+/** We have mixed in every entropy source that we're going to. */
+#define ENTROPY_DEFERRED_NONE    0
+/** Fast start skipped some sources; we'll mix them in once we've used up
+ * the first buffer of output. */
+#define ENTROPY_DEFERRED_WAITING 1
+/** Fast start skipped some sources, and it's time to mix them in. */
+#define ENTROPY_DEFERRED_DUE     2
+/** @} */
+
 struct __attribute__((aligned(16))) ottery_state {
   /**
-   * Holds up to prf.output_len bytes that have been generated by the
-   * pseudorandom function. */
-  __attribute__ ((aligned (16))) uint8_t buffer[MAX_OUTPUT_LEN];
+   * Holds up to buffer_len bytes that have been generated by the
+   * pseudorandom function.  This points either to inline_buffer, or to
+   * memory that we allocated when buffer_blocks is more than one. */
+  uint8_t *buffer;
+  /**
+   * Holds prf.output_len bytes for states that only buffer a single block
+   * at a time. */
+  __attribute__ ((aligned (16))) uint8_t inline_buffer[MAX_OUTPUT_LEN];
   /**
    * Holds the state information (typically nonces and keys) used by the
    * pseudorandom function. */
 
   __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
+#ifndef OTTERY_FIXED_PRF
   /**
    * Parameters and function pointers for the cryptographic pseudorandom
-   * function that we're using. */
+   * function that we're using.  (When libottery is built with
+   * --with-fixed-prf, there is only one, so we don't store it here; see
+   * ST_PRF.) */
   struct ottery_prf prf;
+#endif
   /**
    * Index of the *next* block counter to use when generating random bytes
    * with prf.  When this equals or exceeds prf.stir_after, we should stir
@@ -207,16 +460,60 @@ struct __attribute__((aligned(16))) ottery_state {
    * Magic number; used to tell whether this state is initialized.
    */
   uint32_t magic;
+  /**
+   * A precomputed next block, or NULL if ottery_st_refill() has never been
+   * called on this state.
+   */
+  struct ottery_spare_block *spare;
+  /**
+   * Our supply of fast CPU entropy for prediction resistance, or NULL if
+   * we don't mix any in. */
+  struct ottery_pr_pool *pr;
+  /**
+   * The pointer we got from malloc for buffer, or NULL if buffer is
+   * inline_buffer.
+   */
+  void *buffer_allocation;
+  /**
+   * The number of bytes in buffer: buffer_blocks * prf.output_len.
+   */
+  uint32_t buffer_len;
+  /**
+   * The number of PRF blocks we generate each time we refill buffer.
+   * We rekey the PRF once for each refill, not once for each block.
+   */
+  uint16_t buffer_blocks;
   /**
    * Index of the next byte in (buffer) to yield to the user.
    *
-   * Invariant: this is less than prf.output_len. */
+   * Invariant: this is less than buffer_len. */
   uint16_t pos;
+  /**
+   * One of the OTTERY_CLEAR_MODE_* values: how we erase bytes from
+   * (buffer) after we yield them. */
+  uint8_t clear_mode;
+  /**
+   * One of the OTTERY_WIPE_STACK_* values: how often we wipe the stack
+   * after running the PRF. */
+  uint8_t wipe_stack_mode;
+  /**
+   * True iff we seed from the first strong entropy source only, and mix in
+   * the rest later. */
+  uint8_t fast_start;
+  /**
+   * One of the ENTROPY_DEFERRED_* values: whether we still owe the
+   * entropy sources that fast start skipped. */
+  uint8_t entropy_deferred;
   /**
    * The pid of the process in which this PRF was most recently seeded
    * from the OS. We use this to avoid use-after-fork problems; see
    * ottery_st_rand_lock_and_check(). */
   pid_t pid;
+  /**
+   * The fork generation in which this PRF was most recently seeded from the
+   * OS.  When we have a way to notice forks without calling getpid(), we
+   * use this instead of pid; see ottery_st_rand_check_pid(). */
+  uint32_t fork_generation;
   /**
    * Combined flags_out results from all calls to the entropy source that
    * have influenced our current state.
@@ -244,6 +541,50 @@ struct __attribute__((aligned(16))) ottery_state {
 DECL_LOCK(mutex);
   /**@}*/
 };
+
+/** Largest state_len for a PRF that an ottery_lean_state can use. */
+#define LEAN_STATE_LEN 64
+/** Largest output_len for a PRF that an ottery_lean_state can use. */
+#define LEAN_OUTPUT_LEN 128
+
+/**
+ * A small, non-thread-safe PRNG state, for programs that need a great many
+ * of them.  Unlike an ottery_state, it shares its PRF and its configuration
+ * with other states, rather than keeping its own copies, and it only ever
+ * holds a single small block of output.
+ */
+struct __attribute__((aligned(16))) ottery_lean_state {
+  /**
+   * Holds up to prf->output_len bytes that have been generated by the
+   * pseudorandom function. */
+  __attribute__ ((aligned (16))) uint8_t buffer[LEAN_OUTPUT_LEN];
+  /**
+   * Holds the state information (typically nonces and keys) used by the
+   * pseudorandom function. */
+  __attribute__ ((aligned (16))) uint8_t state[LEAN_STATE_LEN];
+  /**
+   * The pseudorandom function that we're using. */
+  const struct ottery_prf *prf;
+  /**
+   * The configuration that we use when we need to reseed from the OS, or
+   * NULL for the defaults.  It belongs to the caller. */
+  const struct ottery_config *config;
+  /**
+   * Magic number; used to tell whether this state is initialized.
+   */
+  uint32_t magic;
+  /**
+   * As in ottery_state. */
+  pid_t pid;
+  /**
+   * As in ottery_state. */
+  uint32_t fork_generation;
+  /**
+   * Index of the next byte in (buffer) to yield to the user.
+   *
+   * Invariant: this is less than prf->output_len. */
+  uint8_t pos;
+};
 #endif
 
 struct ottery_config;
@@ -258,10 +599,20 @@ void ottery_config_set_manual_prf_(struct ottery_config *cfg,
  * ottery_fatal_handler. */
 void ottery_fatal_error_(int error);
 
+struct ottery_state;
+/**
+ * Return 0 if st has been initialized.  Otherwise, report a fatal
+ * OTTERY_ERR_STATE_INIT error, and return -1.
+ */
+int ottery_st_check_init_(struct ottery_state *st);
+
 #define OTTERY_CPUCAP_SIMD (1<<0)
 #define OTTERY_CPUCAP_SSSE3 (1<<1)
 #define OTTERY_CPUCAP_AES  (1<<2)
 #define OTTERY_CPUCAP_RAND (1<<3)
+#define OTTERY_CPUCAP_AVX2 (1<<4)
+#define OTTERY_CPUCAP_AVX512 (1<<5)
+#define OTTERY_CPUCAP_RDSEED (1<<6)
 
 /** Return a mask of OTTERY_CPUCAP_* for what the CPU will offer us. */
 uint32_t ottery_get_cpu_capabilities_(void);
@@ -280,6 +631,17 @@ extern const struct ottery_prf ottery_prf_chacha12_merged_;
 extern const struct ottery_prf ottery_prf_chacha20_merged_;
 /**@}*/
 
+/**
+ * @brief pure-C ChaCha implementations with small outputs, for use with
+ * ottery_lean_state.
+ *
+ * @{
+ */
+extern const struct ottery_prf ottery_prf_chacha8_merged_lean_;
+extern const struct ottery_prf ottery_prf_chacha12_merged_lean_;
+extern const struct ottery_prf ottery_prf_chacha20_merged_lean_;
+/**@}*/
+
 /**
  * @brief SIMD-basd ChaCha implementations.
  *
@@ -297,6 +659,18 @@ extern const struct ottery_prf ottery_prf_chacha8_krovetz_2_;
 extern const struct ottery_prf ottery_prf_chacha12_krovetz_2_;
 extern const struct ottery_prf ottery_prf_chacha20_krovetz_2_;
 #endif
+
+#ifdef HAVE_SIMD_CHACHA_3
+extern const struct ottery_prf ottery_prf_chacha8_krovetz_3_;
+extern const struct ottery_prf ottery_prf_chacha12_krovetz_3_;
+extern const struct ottery_prf ottery_prf_chacha20_krovetz_3_;
+#endif
+
+#ifdef HAVE_SIMD_CHACHA_4
+extern const struct ottery_prf ottery_prf_chacha8_krovetz_4_;
+extern const struct ottery_prf ottery_prf_chacha12_krovetz_4_;
+extern const struct ottery_prf ottery_prf_chacha20_krovetz_4_;
+#endif
 /** @} */
 
 #endif
@@ -54,6 +54,9 @@
 #define DESTROY_LOCK(mutex) do {                \
     pthread_mutex_destroy(mutex);               \
   } while (0)
+/** Try to acquire a lock without blocking; evaluate to true on success. */
+#define TRY_LOCK(mutex)                         \
+  (pthread_mutex_trylock(mutex) == 0)
 
 #elif defined(OTTERY_CRITICAL_SECTION)
 #define INIT_LOCK(mutex)                        \
@@ -67,6 +70,8 @@
 #define DESTROY_LOCK(mutex) do {                \
     DeleteCriticalSection(mutex);               \
   } while (0)
+#define TRY_LOCK(mutex)                         \
+  (TryEnterCriticalSection(mutex) != 0)
 
 #elif defined(OTTERY_OSATOMIC_LOCKS)
 #define INIT_LOCK(mutex)                        \
@@ -78,14 +83,47 @@
     OSSpinLockUnlock(mutex);           \
   } while (0)
 #define DESTROY_LOCK(mutex) ((void)0)
+#define TRY_LOCK(mutex)                         \
+  (OSSpinLockTry(mutex))
 
 #elif defined(OTTERY_NO_LOCKS)
 #define INIT_LOCK(mutex)    (0)
 #define DESTROY_LOCK(mutex) ((void)0)
 #define ACQUIRE_LOCK(mutex) ((void)0)
 #define RELEASE_LOCK(mutex) ((void)0)
+#define TRY_LOCK(mutex)     (1)
 #else
 #error How do I lock?
 #endif
 
+/* Atomic access to the few words that threads share without a lock.  A
+ * load with ATOMIC_LOAD_ACQUIRE() that sees a value stored with
+ * ATOMIC_STORE_RELEASE() also sees everything the storing thread wrote
+ * before it. */
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_INCREMENT(p)        \
+  ((void)__atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL))
+#else
+/* Without the builtins, we fall back to plain accesses.  That's only safe
+ * for a single aligned word whose value doesn't depend on any other: which
+ * is all we share on the platforms (Windows) where we get here, since fork
+ * detection is Unix-only. */
+#define ATOMIC_LOAD_ACQUIRE(p)     (*(p))
+#define ATOMIC_STORE_RELEASE(p, v) (*(p) = (v))
+#define ATOMIC_INCREMENT(p)        ((void)++*(p))
+#endif
+
+/* Sharded global states only make sense if we have locks. */
+#ifndef OTTERY_NO_LOCKS
+#define OTTERY_SHARDED_STATES
+#endif
+
+/* Thread-local storage, used for the per-thread global states. */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define OTTERY_TLS_PTHREADS
+#include <pthread.h>
+#endif
+
 #endif
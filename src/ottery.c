@@ -16,11 +16,18 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "ottery_lean.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <time.h>
+#endif
 
 #include <stdio.h>
 
@@ -33,11 +40,42 @@
 #define OTTERY_NO_PID_CHECK
 #endif
 
+#ifndef OTTERY_NO_PID_CHECK
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#if defined(MADV_WIPEONFORK) || \
+  (defined(HAVE_MINHERIT) && defined(INHERIT_ZERO))
+/* We can ask the kernel for a page that gets zeroed in the child whenever
+ * we fork. */
+#define OTTERY_FORK_WIPE_PAGE
+#endif
+#endif
+#if defined(HAVE_PTHREAD)
+/* We can ask the C library to tell us whenever we fork. */
+#define OTTERY_FORK_ATFORK
+#endif
+#endif
+
 /**
  * Evaluate the condition 'x', while hinting to the compiler that it is
  * likely to be false.
  */
 #define UNLIKELY(x) __builtin_expect((x), 0)
+/**
+ * Evaluate the condition 'x', while hinting to the compiler that it is
+ * likely to be true.
+ */
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+
+#if defined(_WIN32)
+/* We can split big requests across threads that we start with
+ * CreateThread. */
+#define OTTERY_PARALLEL_WIN32
+#elif defined(OTTERY_TLS_PTHREADS)
+/* We can split big requests across threads that we start with
+ * pthread_create. */
+#define OTTERY_PARALLEL_PTHREADS
+#endif
 
 /** Magic number for deciding whether an ottery_state is initialized. */
 #define MAGIC_BASIS 0x11b07734
@@ -48,6 +86,7 @@
 
 static inline int ottery_st_rand_lock_and_check(struct ottery_state *st)
 __attribute__((always_inline));
+static inline int ottery_st_rand_check_nolock(struct ottery_state_nolock *st);
 static int ottery_st_reseed(struct ottery_state *state);
 static int ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n, int locking, int check_magic);
 
@@ -55,9 +94,33 @@ static int ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed,
 static void ottery_wipe_stack_(void) __attribute__((noinline));
 #endif
 
+#ifdef OTTERY_STATS
+/** Acquire the lock on st, counting whether we had to wait for it. */
+#define LOCK(st) do {                                   \
+    if (!TRY_LOCK(&(st)->mutex)) {                      \
+      ACQUIRE_LOCK(&(st)->mutex);                       \
+      OTTERY_STAT_ADD_((st), lock_contended, 1);        \
+    }                                                   \
+    OTTERY_STAT_ADD_((st), lock_acquisitions, 1);       \
+  } while (0)
+#else
 #define LOCK(st)   ACQUIRE_LOCK(&(st)->mutex)
+#endif
 #define UNLOCK(st) RELEASE_LOCK(&(st)->mutex)
 
+/**
+ * Fail to compile if the structure named by type is bigger than the dummy
+ * size that the public headers reserve for it.  We check again at run time
+ * in ottery_st_initialize(), but this way a build option that makes a
+ * structure too big can't get as far as the tests.
+ */
+#define CHECK_DUMMY_SIZE_(type, dummy_size)                     \
+  typedef char ottery_size_check_ ## type ## _                  \
+    [(sizeof(struct type) <= (dummy_size)) ? 1 : -1]
+CHECK_DUMMY_SIZE_(ottery_state, OTTERY_STATE_DUMMY_SIZE_);
+CHECK_DUMMY_SIZE_(ottery_config, OTTERY_CONFIG_DUMMY_SIZE_);
+CHECK_DUMMY_SIZE_(ottery_lean_state, OTTERY_LEAN_STATE_DUMMY_SIZE_);
+
 size_t
 ottery_get_sizeof_config(void)
 {
@@ -76,6 +139,12 @@ ottery_get_sizeof_state_nolock(void)
   return sizeof(struct ottery_state_nolock);
 }
 
+size_t
+ottery_get_sizeof_lean_state(void)
+{
+  return sizeof(struct ottery_lean_state);
+}
+
 const char *
 ottery_get_version_string(void)
 {
@@ -109,6 +178,12 @@ ottery_get_build_flags(void)
 #endif
 #ifdef OTTERY_NO_SIMD
   result |= OTTERY_BLDFLG_NO_SIMD;
+#endif
+#ifdef OTTERY_STATS
+  result |= OTTERY_BLDFLG_STATS;
+#endif
+#ifdef OTTERY_FIXED_PRF
+  result |= OTTERY_BLDFLG_FIXED_PRF;
 #endif
   return result;
 }
@@ -121,6 +196,10 @@ ottery_get_build_flags(void)
 #define CLEARBUF(ptr,n) ((void)0)
 #endif
 
+/** Size of the chunks that OTTERY_CLEAR_MODE_BY_LINE erases at once: one
+ * cache line on most CPUs. */
+#define CLEAR_LINE_LEN 64
+
 /**
  * Volatile pointer to memset: we use this to keep the compiler from
  * eliminating our call to memset.  (Don't make this static.)
@@ -159,6 +238,27 @@ ottery_wipe_stack_(void)
 #define ottery_wipe_stack_() ((void)0)
 #endif
 
+/**
+ * Wipe the stack after generating a single block of PRF output, if
+ * wipe_stack_mode (one of the OTTERY_WIPE_STACK_* values) says to wipe it
+ * after every block.
+ */
+#define ottery_wipe_stack_after_block_(wipe_stack_mode)         \
+  do {                                                          \
+    if ((wipe_stack_mode) == OTTERY_WIPE_STACK_EACH_BLOCK)      \
+      ottery_wipe_stack_();                                     \
+  } while (0)
+/**
+ * Wipe the stack before returning from a call that ran the PRF, unless
+ * wipe_stack_mode (one of the OTTERY_WIPE_STACK_* values) says never to
+ * wipe it.
+ */
+#define ottery_wipe_stack_after_call_(wipe_stack_mode)          \
+  do {                                                          \
+    if ((wipe_stack_mode) != OTTERY_WIPE_STACK_NONE)            \
+      ottery_wipe_stack_();                                     \
+  } while (0)
+
 int
 ottery_config_init(struct ottery_config *cfg)
 {
@@ -171,44 +271,75 @@ ottery_config_init(struct ottery_config *cfg)
   cfg->entropy_config.egd_sockaddr = NULL;
   cfg->entropy_config.egd_socklen = 0;
   cfg->entropy_config.allow_nondev_urandom = 0;
+  cfg->global_mode = OTTERY_GLOBAL_MODE_SHARED;
+  cfg->buffer_blocks = 1;
+  cfg->clear_mode = OTTERY_CLEAR_MODE_EACH_YIELD;
+  cfg->wipe_stack_mode = OTTERY_WIPE_STACK_EACH_CALL;
+  cfg->alloc_flags = 0;
+  cfg->pr_every_blocks = 0;
+  cfg->pr_every_msec = 0;
+  cfg->fast_start = 0;
   return 0;
 }
 
-static const struct ottery_prf *
-ottery_get_impl(const char *impl)
-{
-  int i;
-  const struct ottery_prf *ALL_PRFS[] = {
+/** Every PRF implementation that we know about, best first. */
+static const struct ottery_prf *const ALL_PRFS[] = {
+#ifdef OTTERY_FIXED_PRF
+  /* We were built to use this one only. */
+  &OTTERY_FIXED_PRF,
+#else
+#ifdef HAVE_SIMD_CHACHA_4
+  &ottery_prf_chacha20_krovetz_4_,
+  &ottery_prf_chacha12_krovetz_4_,
+  &ottery_prf_chacha8_krovetz_4_,
+#endif
+#ifdef HAVE_SIMD_CHACHA_3
+  &ottery_prf_chacha20_krovetz_3_,
+  &ottery_prf_chacha12_krovetz_3_,
+  &ottery_prf_chacha8_krovetz_3_,
+#endif
 #ifdef HAVE_SIMD_CHACHA_2
-    &ottery_prf_chacha20_krovetz_2_,
-    &ottery_prf_chacha12_krovetz_2_,
-    &ottery_prf_chacha8_krovetz_2_,
+  &ottery_prf_chacha20_krovetz_2_,
+  &ottery_prf_chacha12_krovetz_2_,
+  &ottery_prf_chacha8_krovetz_2_,
 #endif
 #ifdef HAVE_SIMD_CHACHA
-    &ottery_prf_chacha20_krovetz_1_,
-    &ottery_prf_chacha12_krovetz_1_,
-    &ottery_prf_chacha8_krovetz_1_,
+  &ottery_prf_chacha20_krovetz_1_,
+  &ottery_prf_chacha12_krovetz_1_,
+  &ottery_prf_chacha8_krovetz_1_,
+#endif
+  &ottery_prf_chacha20_merged_,
+  &ottery_prf_chacha12_merged_,
+  &ottery_prf_chacha8_merged_,
 #endif
-    &ottery_prf_chacha20_merged_,
-    &ottery_prf_chacha12_merged_,
-    &ottery_prf_chacha8_merged_,
 
-    NULL,
-  };
+  NULL,
+};
+
+/** Return true iff 'prf' can run on a CPU with capabilities 'cap', and
+ * 'impl' is NULL or names 'prf', its implementation, or its flavor. */
+static int
+ottery_prf_matches(const struct ottery_prf *prf, uint32_t cap,
+                   const char *impl)
+{
+  if ((prf->required_cpucap & cap) != prf->required_cpucap)
+    return 0;
+  if (impl == NULL)
+    return 1;
+  return !strcmp(impl, prf->name) ||
+         !strcmp(impl, prf->impl) ||
+         !strcmp(impl, prf->flav);
+}
+
+static const struct ottery_prf *
+ottery_get_impl(const char *impl)
+{
+  int i;
   const uint32_t cap = ottery_get_cpu_capabilities_();
 
   for (i = 0; ALL_PRFS[i]; ++i) {
-    const struct ottery_prf *prf = ALL_PRFS[i];
-    if ((prf->required_cpucap & cap) != prf->required_cpucap)
-      continue;
-    if (impl == NULL)
-      return prf;
-    if (!strcmp(impl, prf->name))
-      return prf;
-    if (!strcmp(impl, prf->impl))
-      return prf;
-    if (!strcmp(impl, prf->flav))
-      return prf;
+    if (ottery_prf_matches(ALL_PRFS[i], cap, impl))
+      return ALL_PRFS[i];
   }
   return NULL;
 }
@@ -225,6 +356,202 @@ ottery_config_force_implementation(struct ottery_config *cfg,
   return OTTERY_ERR_INVALID_ARGUMENT;
 }
 
+uint64_t
+ottery_monotonic_nsec_(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)(now.QuadPart * (1000000000.0 / freq.QuadPart));
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec) * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/** How many blocks do we generate in each timing trial? */
+#define AUTOTUNE_BLOCKS 32
+/** How many timing trials do we run for each PRF? We take the fastest. */
+#define AUTOTUNE_TRIALS 3
+
+/**
+ * Measure how long 'prf' takes to generate one byte of output, in
+ * picoseconds.  (The units don't matter, so long as they're consistent.)
+ */
+static uint64_t
+ottery_autotune_measure_(const struct ottery_prf *prf)
+{
+  __attribute__((aligned(16))) uint8_t state[MAX_STATE_LEN];
+  __attribute__((aligned(16))) uint8_t buf[MAX_OUTPUT_LEN];
+  uint64_t best = UINT64_MAX;
+  int trial, i;
+
+  /* The key doesn't matter: we throw away the output. */
+  memset(buf, 0, sizeof(buf));
+  prf->setup(state, buf);
+  prf->generate(state, buf, 0); /* warm up */
+
+  for (trial = 0; trial < AUTOTUNE_TRIALS; ++trial) {
+    uint64_t start, elapsed;
+    start = ottery_monotonic_nsec_();
+    for (i = 0; i < AUTOTUNE_BLOCKS; ++i)
+      prf->generate(state, buf, i);
+    elapsed = ottery_monotonic_nsec_() - start;
+    elapsed = elapsed * 1000 / ((uint64_t)AUTOTUNE_BLOCKS * prf->output_len);
+    if (elapsed < best)
+      best = elapsed;
+  }
+
+  ottery_memclear_(state, sizeof(state));
+  ottery_memclear_(buf, sizeof(buf));
+  ottery_wipe_stack_();
+  return best;
+}
+
+/** Number of autotuning results that we remember. */
+#define AUTOTUNE_CACHE_LEN 8
+/** Results from previous calls to ottery_config_autotune. */
+static struct {
+  /** The impl argument that was passed to ottery_config_autotune. */
+  char impl[32];
+  /** The PRF we picked for it. */
+  const struct ottery_prf *prf;
+} autotune_cache[AUTOTUNE_CACHE_LEN];
+/** Number of entries in autotune_cache that are set. */
+static int autotune_cache_n = 0;
+
+int
+ottery_config_autotune(struct ottery_config *cfg, const char *impl)
+{
+  const uint32_t cap = ottery_get_cpu_capabilities_();
+  const struct ottery_prf *best_prf = NULL;
+  uint64_t best_time = UINT64_MAX;
+  int i;
+
+  if (impl == NULL)
+    impl = OTTERY_PRF_CHACHA20;
+
+  for (i = 0; i < autotune_cache_n; ++i) {
+    const struct ottery_prf *prf = autotune_cache[i].prf;
+    if (!strcmp(autotune_cache[i].impl, impl) &&
+        ottery_prf_matches(prf, cap, NULL)) {
+      cfg->impl = prf;
+      return 0;
+    }
+  }
+
+  for (i = 0; ALL_PRFS[i]; ++i) {
+    const struct ottery_prf *prf = ALL_PRFS[i];
+    uint64_t t;
+    if (!ottery_prf_matches(prf, cap, impl))
+      continue;
+    t = ottery_autotune_measure_(prf);
+    /* Break ties in favor of the earlier, "better" entries. */
+    if (t < best_time || best_prf == NULL) {
+      best_time = t;
+      best_prf = prf;
+    }
+  }
+
+  if (!best_prf)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+
+  if (autotune_cache_n < AUTOTUNE_CACHE_LEN &&
+      strlen(impl) < sizeof(autotune_cache[0].impl)) {
+    strcpy(autotune_cache[autotune_cache_n].impl, impl);
+    autotune_cache[autotune_cache_n].prf = best_prf;
+    ++autotune_cache_n;
+  }
+
+  cfg->impl = best_prf;
+  return 0;
+}
+
+int
+ottery_config_set_global_mode(struct ottery_config *cfg, int mode)
+{
+  switch (mode) {
+  case OTTERY_GLOBAL_MODE_SHARED:
+    break;
+#ifdef OTTERY_TLS_PTHREADS
+  case OTTERY_GLOBAL_MODE_PER_THREAD:
+    break;
+#endif
+#ifdef OTTERY_SHARDED_STATES
+  case OTTERY_GLOBAL_MODE_SHARDED:
+    break;
+#endif
+  default:
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  }
+  cfg->global_mode = mode;
+  return 0;
+}
+
+int
+ottery_config_set_clear_mode(struct ottery_config *cfg, int mode)
+{
+  switch (mode) {
+  case OTTERY_CLEAR_MODE_EACH_YIELD:
+  case OTTERY_CLEAR_MODE_BY_LINE:
+  case OTTERY_CLEAR_MODE_NONE:
+    break;
+  default:
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  }
+  cfg->clear_mode = mode;
+  return 0;
+}
+
+int
+ottery_config_set_wipe_stack_mode(struct ottery_config *cfg, int mode)
+{
+  switch (mode) {
+  case OTTERY_WIPE_STACK_EACH_CALL:
+  case OTTERY_WIPE_STACK_EACH_BLOCK:
+  case OTTERY_WIPE_STACK_NONE:
+    break;
+  default:
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  }
+  cfg->wipe_stack_mode = mode;
+  return 0;
+}
+
+int
+ottery_config_set_prediction_resistance(struct ottery_config *cfg,
+                                        unsigned every_n_blocks,
+                                        unsigned every_msec)
+{
+  if ((every_n_blocks || every_msec) &&
+      !ottery_have_fast_entropy_(&cfg->entropy_config))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  cfg->pr_every_blocks = every_n_blocks;
+  cfg->pr_every_msec = every_msec;
+  return 0;
+}
+
+void
+ottery_config_set_fast_start(struct ottery_config *cfg, int enable)
+{
+  cfg->fast_start = enable ? 1 : 0;
+}
+
+int
+ottery_config_set_buffer_blocks(struct ottery_config *cfg, unsigned n_blocks)
+{
+  if (n_blocks < 1 || n_blocks > OTTERY_MAX_BUFFER_BLOCKS)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  cfg->buffer_blocks = n_blocks;
+  return 0;
+}
+
 void
 ottery_config_set_manual_prf_(struct ottery_config *cfg,
                               const struct ottery_prf *prf)
@@ -273,21 +600,172 @@ ottery_config_mark_entropy_sources_weak(struct ottery_config *cfg,
 }
 
 /**
- * As ottery_st_nextblock_nolock(), but fill the entire block with
- * entropy, and don't try to rekey the state.
+ * Record that st has generated nblocks blocks without rekeying, so that we
+ * count them toward its next prediction resistance mix.
+ */
+static inline void
+ottery_st_pr_count_(struct ottery_state_nolock *st, size_t nblocks)
+{
+  if (st->pr) {
+    const uint64_t total = (uint64_t)st->pr->blocks_since + nblocks;
+    st->pr->blocks_since = total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+  }
+}
+
+/**
+ * As ottery_st_nextblock_nolock(), but fill only the first block of the
+ * buffer, fill it entirely with entropy, and don't try to rekey the state.
  */
 static void
 ottery_st_nextblock_nolock_norekey(struct ottery_state *st)
 {
-  st->prf.generate(st->state, st->buffer, st->block_counter);
-  ottery_wipe_stack_();
+  ST_PRF(st).generate(st->state, st->buffer, st->block_counter);
+  ottery_wipe_stack_after_block_(st->wipe_stack_mode);
+  OTTERY_STAT_ADD_(st, prf_blocks, 1);
+  ottery_st_pr_count_(st, 1);
   ++st->block_counter;
 }
 
 /**
- * Generate (st->output_len) bytes of pseudorandom data from the PRF into
+ * Generate nblocks consecutive blocks from the PRF into output, starting with
+ * the counter value idx.  Output must be aligned to a 16-byte boundary.
+ */
+static void
+ottery_prf_generate_n_(const struct ottery_prf *prf, void *state,
+                       uint8_t *output, uint32_t idx, size_t nblocks)
+{
+  if (prf->generate_blocks && nblocks > 1) {
+    prf->generate_blocks(state, output, idx, nblocks);
+  } else {
+    for ( ; nblocks; --nblocks, ++idx, output += prf->output_len)
+      prf->generate(state, output, idx);
+  }
+}
+
+/**
+ * Return true iff the n bytes at a and b are the same.  Takes the same time
+ * no matter where they differ.
+ */
+static int
+ottery_ct_equal_(const uint8_t *a, const uint8_t *b, size_t n)
+{
+  uint8_t d = 0;
+  size_t i;
+  for (i = 0; i < n; ++i)
+    d |= a[i] ^ b[i];
+  return d == 0;
+}
+
+/** Wipe any unused block in a spare for a state with buffer_len bytes of
+ * buffer, so that nobody can use it. */
+static void
+ottery_spare_clear_(struct ottery_spare_block *spare, size_t buffer_len)
+{
+  ottery_memclear_(spare->buffer, buffer_len);
+  ottery_memclear_(spare->state, sizeof(spare->state));
+  ottery_memclear_(spare->key, sizeof(spare->key));
+  spare->idx = 0;
+  spare->ready = 0;
+}
+
+/**
+ * Fill in the nblocks blocks and next state of spare, using the key and
+ * counter value already stored in its key and idx fields.  Wipe the stack
+ * afterwards as wipe_stack_mode says.  This doesn't mark the spare ready:
+ * the caller does that, while it holds whatever lock protects the state.
+ */
+static void
+ottery_spare_compute_(const struct ottery_prf *prf, size_t nblocks,
+                      int wipe_stack_mode,
+                      struct ottery_spare_block *spare)
+{
+  /* Some PRFs write their counter into the state, so generate from a copy
+   * of the key; we still need it intact to tell whether the block is
+   * current. */
+  memcpy(spare->state, spare->key, prf->state_len);
+  ottery_prf_generate_n_(prf, spare->state, spare->buffer, spare->idx,
+                         nblocks);
+  prf->setup(spare->state, spare->buffer);
+  CLEARBUF(spare->buffer, prf->state_bytes);
+  ottery_wipe_stack_after_call_(wipe_stack_mode);
+}
+
+/**
+ * If st has a precomputed block that ottery_st_nextblock_nolock() would
+ * generate right now, put it in place and return true.  Otherwise
+ * return false.  Either way, wipe the precomputed block.
+ */
+static int
+ottery_st_use_spare_nolock(struct ottery_state_nolock *st)
+{
+  struct ottery_spare_block *spare = st->spare;
+  int used = 0;
+  if (spare->idx == st->block_counter &&
+      ottery_ct_equal_(spare->key, st->state, ST_PRF(st).state_len)) {
+    memcpy(st->state, spare->state, ST_PRF(st).state_len);
+    memcpy(st->buffer, spare->buffer, st->buffer_len);
+    st->block_counter = 0;
+    st->pos = ST_PRF(st).state_bytes;
+    used = 1;
+  }
+  ottery_spare_clear_(spare, st->buffer_len);
+  return used;
+}
+
+/**
+ * Record that st is about to generate nblocks more blocks, and return true
+ * iff it's time to mix fast CPU entropy into its next key.
+ */
+static int
+ottery_st_pr_due_(struct ottery_state_nolock *st, size_t nblocks)
+{
+  struct ottery_pr_pool *pr = st->pr;
+  ottery_st_pr_count_(st, nblocks);
+  if (pr->every_blocks && pr->blocks_since >= pr->every_blocks)
+    return 1;
+  if (pr->every_msec &&
+      ottery_monotonic_nsec_() - pr->last_nsec >=
+      (uint64_t)pr->every_msec * 1000000)
+    return 1;
+  return 0;
+}
+
+/**
+ * Mix PR_MIX_LEN bytes from st's fast entropy pool into the start of its
+ * buffer, from which it is about to take its next key.  Fetch a new batch
+ * first if the pool is empty; if we can't, leave the key alone and try
+ * again next time.
+ */
+static void
+ottery_st_pr_mix_nolock(struct ottery_state_nolock *st)
+{
+  struct ottery_pr_pool *pr = st->pr;
+  const size_t n = ST_PRF(st).state_bytes < PR_MIX_LEN ?
+    ST_PRF(st).state_bytes : PR_MIX_LEN;
+  uint8_t *bytes;
+  size_t i;
+
+  if (pr->avail < n) {
+    if (ottery_get_fast_entropy_(pr->bytes, PR_POOL_LEN))
+      return;
+    pr->avail = PR_POOL_LEN;
+  }
+  bytes = pr->bytes + (PR_POOL_LEN - pr->avail);
+  for (i = 0; i < n; ++i)
+    st->buffer[i] ^= bytes[i];
+  ottery_memclear_(bytes, n);
+  pr->avail -= (uint32_t)n;
+  pr->blocks_since = 0;
+  if (pr->every_msec)
+    pr->last_nsec = ottery_monotonic_nsec_();
+  OTTERY_STAT_ADD_(st, pr_mixes, 1);
+}
+
+/**
+ * Generate (st->buffer_len) bytes of pseudorandom data from the PRF into
  * (st->buffer).  Use the first st->prf.state_bytes of those bytes to replace
- * the PRF state and advance (st->pos) to point after them.
+ * the PRF state and advance (st->pos) to point after them.  If it's time,
+ * mix fast CPU entropy into the new state too.
  *
  * This function does not acquire the lock on the state; use it within
  * another function that does.
@@ -297,11 +775,184 @@ ottery_st_nextblock_nolock_norekey(struct ottery_state *st)
 static void
 ottery_st_nextblock_nolock(struct ottery_state_nolock *st)
 {
-  ottery_st_nextblock_nolock_norekey(st);
-  st->prf.setup(st->state, st->buffer);
-  CLEARBUF(st->buffer, st->prf.state_bytes);
+  const int mix = st->pr && ottery_st_pr_due_(st, st->buffer_blocks);
+  /* Once fast start has used up the first buffer, it's time to mix in the
+   * sources that it skipped. */
+  if (UNLIKELY(st->entropy_deferred == ENTROPY_DEFERRED_WAITING))
+    st->entropy_deferred = ENTROPY_DEFERRED_DUE;
+  OTTERY_STAT_ADD_(st, prf_blocks, st->buffer_blocks);
+  OTTERY_STAT_ADD_(st, rekeys, 1);
+  /* A precomputed block has no entropy in its key, so we can't use it
+   * when we're mixing. */
+  if (!mix && st->spare && st->spare->ready && ottery_st_use_spare_nolock(st))
+    return;
+  ottery_prf_generate_n_(&ST_PRF(st), st->state, st->buffer,
+                         st->block_counter, st->buffer_blocks);
+  if (mix)
+    ottery_st_pr_mix_nolock(st);
+  ST_PRF(st).setup(st->state, st->buffer);
+  CLEARBUF(st->buffer, ST_PRF(st).state_bytes);
+  ottery_wipe_stack_after_call_(st->wipe_stack_mode);
+  st->block_counter = 0;
+  st->pos = ST_PRF(st).state_bytes;
+}
+
+/**
+ * Allocate n bytes aligned to a 16-byte boundary.  Set *allocation_out to
+ * the pointer to pass to free() when we're done.  Return NULL on failure.
+ */
+static void *
+ottery_aligned_alloc_(size_t n, void **allocation_out)
+{
+  char *allocation = malloc(n + 16);
+  size_t misalign;
+  if (!allocation)
+    return NULL;
+  misalign = ((uintptr_t)allocation) & 15;
+  *allocation_out = allocation;
+  return allocation + ((16 - misalign) & 15);
+}
+
+/**
+ * Wipe and free everything that st has allocated: its spare block, its
+ * fast entropy pool, and its buffer if that isn't inline_buffer.
+ */
+static void
+ottery_st_free_buffers_(struct ottery_state_nolock *st)
+{
+  if (st->spare) {
+    void *allocation = st->spare->allocation;
+    ottery_memclear_(st->spare->buffer, st->buffer_len);
+    ottery_memclear_(st->spare, sizeof(*st->spare));
+    free(allocation);
+    st->spare = NULL;
+  }
+  if (st->pr) {
+    ottery_memclear_(st->pr, sizeof(*st->pr));
+    free(st->pr);
+    st->pr = NULL;
+  }
+  if (st->buffer_allocation) {
+    ottery_memclear_(st->buffer, st->buffer_len);
+    free(st->buffer_allocation);
+    st->buffer_allocation = NULL;
+  }
+  st->buffer = st->inline_buffer;
+#ifdef OTTERY_STATS
+  if (st->entropy_state.stats) {
+    ottery_memclear_(st->entropy_state.stats, sizeof(struct ottery_stats));
+    free(st->entropy_state.stats);
+    st->entropy_state.stats = NULL;
+  }
+#endif
+}
+
+#ifndef OTTERY_NO_PID_CHECK
+/**
+ * Incremented in the child every time we fork.  A state whose
+ * fork_generation doesn't match this needs to be reseeded.
+ */
+static uint32_t ottery_fork_generation_ = 1;
+/**
+ * True iff we have a way to keep ottery_fork_generation_ up to date; if
+ * not, we fall back to comparing each state's pid with getpid().
+ */
+static int ottery_fork_detection_ok_ = 0;
+#ifdef OTTERY_FORK_WIPE_PAGE
+/** A byte that we set to 1, on a page that the kernel zeroes in the child
+ * whenever we fork. */
+static volatile uint8_t *ottery_fork_page_ = NULL;
+#endif
+
+#ifdef OTTERY_FORK_ATFORK
+/** Called by the C library in the child after a fork. */
+static void
+ottery_atfork_child_(void)
+{
+  ATOMIC_INCREMENT(&ottery_fork_generation_);
+}
+/** Used to set up fork detection exactly once. */
+static pthread_once_t ottery_fork_detection_once_ = PTHREAD_ONCE_INIT;
+#endif
+
+/**
+ * Helper: set up whatever ways we have of noticing a fork without calling
+ * getpid() all the time.
+ *
+ * A wiped page catches every sort of fork, including ones that don't go
+ * through the C library's fork().  A pthread_atfork() handler is the next
+ * best thing.
+ */
+static void
+ottery_fork_detection_setup_(void)
+{
+#ifdef OTTERY_FORK_WIPE_PAGE
+  {
+    const size_t sz = (size_t) sysconf(_SC_PAGESIZE);
+    void *page = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (page != MAP_FAILED) {
+#ifdef MADV_WIPEONFORK
+      const int ok = (madvise(page, sz, MADV_WIPEONFORK) == 0);
+#else
+      const int ok = (minherit(page, sz, INHERIT_ZERO) == 0);
+#endif
+      if (ok) {
+        ottery_fork_page_ = page;
+        *ottery_fork_page_ = 1;
+        ottery_fork_detection_ok_ = 1;
+      } else {
+        munmap(page, sz);
+      }
+    }
+  }
+#endif
+#ifdef OTTERY_FORK_ATFORK
+  if (pthread_atfork(NULL, NULL, ottery_atfork_child_) == 0)
+    ottery_fork_detection_ok_ = 1;
+#endif
+}
+
+/** Set up fork detection, if we haven't already. */
+static void
+ottery_fork_detection_init_(void)
+{
+#ifdef OTTERY_FORK_ATFORK
+  pthread_once(&ottery_fork_detection_once_, ottery_fork_detection_setup_);
+#else
+  static int initialized = 0;
+  if (!initialized) {
+    initialized = 1;
+    ottery_fork_detection_setup_();
+  }
+#endif
+}
+#endif
+
+/**
+ * Set up a PRNG state from seed alone, without asking the OS for anything:
+ * start from a key that holds only the length of the seed, and add the seed
+ * to it.  (Without the length, seeds that differed only in trailing zero
+ * bytes would give the same state.)
+ *
+ * @param st The state to seed.
+ * @param seed The seed; must not be NULL.
+ * @param n The number of bytes in seed; must not be zero.
+ */
+static void
+ottery_st_seed_deterministic_(struct ottery_state *st,
+                              const uint8_t *seed, size_t n)
+{
+  uint8_t key[MAX_STATE_BYTES];
+  unsigned i;
+  memset(key, 0, sizeof(key));
+  for (i = 0; i < 8; ++i)
+    key[i] = (uint8_t)(((uint64_t)n) >> (8*i));
+  ST_PRF(st).setup(st->state, key);
   st->block_counter = 0;
-  st->pos = st->prf.state_bytes;
+  ottery_st_add_seed_impl(st, seed, n, 0, 0);
+  st->last_entropy_flags = 0;
+  st->entropy_src_flags = 0;
 }
 
 /**
@@ -309,12 +960,17 @@ ottery_st_nextblock_nolock(struct ottery_state_nolock *st)
  *
  * @param st The state to initialize or reinitialize.
  * @param prf The configuration to use. (Ignored for reinit)
+ * @param locked True iff the state needs a lock.
+ * @param seed If not NULL, seed the state from these bytes alone, rather
+ *   than from the operating system.
+ * @param seed_len The number of bytes in seed.
  * @return An OTTERY_ERR_* value (zero on success, nonzero on failure).
  */
 static int
 ottery_st_initialize(struct ottery_state *st,
                      const struct ottery_config *config,
-                     int locked)
+                     int locked,
+                     const uint8_t *seed, size_t seed_len)
 {
   const struct ottery_prf *prf = NULL;
   struct ottery_config cfg_tmp;
@@ -335,6 +991,13 @@ ottery_st_initialize(struct ottery_state *st,
   if (!prf)
     prf = ottery_get_impl(NULL);
 
+#ifdef OTTERY_FIXED_PRF
+  /* We can only run the PRF we were built with, and only if this CPU can
+   * run it. */
+  if (prf != &OTTERY_FIXED_PRF)
+    return prf ? OTTERY_ERR_INVALID_ARGUMENT : OTTERY_ERR_INTERNAL;
+#endif
+
   memset(st, 0, sizeof(*st));
 
   if (locked) {
@@ -347,7 +1010,9 @@ ottery_st_initialize(struct ottery_state *st,
   if ((prf->state_len > MAX_STATE_LEN) ||
       (prf->state_bytes > MAX_STATE_BYTES) ||
       (prf->state_bytes > prf->output_len) ||
-      (prf->output_len > MAX_OUTPUT_LEN))
+      (prf->output_len > MAX_OUTPUT_LEN) ||
+      (prf->output_len % 64) ||
+      (PRF_MAX_IDX(*prf) < OTTERY_MAX_BUFFER_BLOCKS))
     return OTTERY_ERR_INTERNAL;
 
   /* Check whether some of our structure size assumptions are right. */
@@ -358,72 +1023,242 @@ ottery_st_initialize(struct ottery_state *st,
   memcpy(&st->entropy_config, &config->entropy_config,
          sizeof(struct ottery_entropy_config));
 
+#ifndef OTTERY_FIXED_PRF
   /* Copy the PRF into place. */
   memcpy(&st->prf, prf, sizeof(*prf));
+#endif
+
+  st->clear_mode = config->clear_mode;
+  st->wipe_stack_mode = config->wipe_stack_mode;
+  st->fast_start = config->fast_start ? 1 : 0;
+
+  /* Set up the buffer. */
+  st->buffer_blocks = config->buffer_blocks ? config->buffer_blocks : 1;
+  st->buffer_len = st->buffer_blocks * prf->output_len;
+  if (st->buffer_blocks > OTTERY_MAX_BUFFER_BLOCKS ||
+      st->buffer_len > MAX_BUFFER_LEN)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (st->buffer_blocks == 1) {
+    st->buffer = st->inline_buffer;
+  } else {
+    st->buffer = ottery_aligned_alloc_(st->buffer_len, &st->buffer_allocation);
+    if (!st->buffer)
+      return OTTERY_ERR_INTERNAL;
+  }
 
-  if ((err = ottery_st_reseed(st)))
+#ifdef OTTERY_STATS
+  /* The counters live on the heap: there's no room for them in the
+   * state. */
+  if (!(st->entropy_state.stats = calloc(1, sizeof(struct ottery_stats)))) {
+    ottery_st_free_buffers_(st);
+    return OTTERY_ERR_INTERNAL;
+  }
+  ottery_entropy_stats_init_(st->entropy_state.stats);
+#endif
+
+  if ((config->pr_every_blocks || config->pr_every_msec) &&
+      ottery_have_fast_entropy_(&st->entropy_config)) {
+    if (!(st->pr = calloc(1, sizeof(struct ottery_pr_pool)))) {
+      ottery_st_free_buffers_(st);
+      return OTTERY_ERR_INTERNAL;
+    }
+    st->pr->every_blocks = config->pr_every_blocks;
+    st->pr->every_msec = config->pr_every_msec;
+    st->pr->last_nsec = ottery_monotonic_nsec_();
+  }
+
+  if (seed) {
+    ottery_st_seed_deterministic_(st, seed, seed_len);
+  } else if ((err = ottery_st_reseed(st))) {
+    ottery_st_free_buffers_(st);
     return err;
+  }
 
   /* Set the magic number last, or else we might look like we succeeded
    * when we didn't */
   st->magic = MAGIC(st);
 
   st->pid = getpid();
+#ifndef OTTERY_NO_PID_CHECK
+  ottery_fork_detection_init_();
+  st->fork_generation = ATOMIC_LOAD_ACQUIRE(&ottery_fork_generation_);
+#endif
 
   return 0;
 }
 
+/**
+ * Collect entropy for st from the operating system into the *buflen bytes
+ * at buf, as ottery_get_entropy_partial_() does with have_flags and
+ * stop_when_strong, and set *buflen to the number of bytes we got.
+ *
+ * If locked is true, we hold st's lock on entry and on exit, but we
+ * release it while we're waiting for the entropy sources, so that other
+ * threads don't have to wait for our system calls.  Since somebody else
+ * may change st meanwhile, the caller must check whether the entropy is
+ * still needed before using it.
+ */
 static int
-ottery_st_reseed(struct ottery_state *st)
+ottery_st_collect_entropy_(struct ottery_state *st, int locked,
+                           uint32_t have_flags, int stop_when_strong,
+                           uint8_t *buf, size_t *buflen, uint32_t *flags)
 {
-  /* Now seed the PRF: Generate some random bytes from the OS, and use them
-   * as whatever keys/nonces/whatever the PRF wants to have. */
-  /* XXXX Add seed rather than starting from scratch? */
+  struct ottery_entropy_config config;
+  struct ottery_entropy_state es;
+  struct ottery_stats scratch;
+  const size_t state_bytes = ST_PRF(st).state_bytes;
   int err;
-  uint32_t flags=0;
-  size_t buflen = ottery_get_entropy_bufsize_(st->prf.state_bytes);
-  uint8_t *buf = alloca(buflen);
-  if (!buf)
-    return OTTERY_ERR_INIT_STRONG_RNG;
 
-  if ((err = ottery_get_entropy_(&st->entropy_config, &st->entropy_state, 0,
-                                  buf, st->prf.state_bytes,
-                                  &buflen,
-                                  &flags)))
-    return err;
-  if (buflen < st->prf.state_bytes)
-    return OTTERY_ERR_ACCESS_STRONG_RNG;
+  if (!locked)
+    return ottery_get_entropy_partial_(&st->entropy_config,
+                                       &st->entropy_state, 0,
+                                       have_flags, stop_when_strong,
+                                       buf, state_bytes, buflen, flags);
+
+  memcpy(&config, &st->entropy_config, sizeof(config));
+  ottery_entropy_state_snapshot_(&es, &st->entropy_state, &scratch);
+  UNLOCK(st);
+  err = ottery_get_entropy_partial_(&config, &es, 0,
+                                    have_flags, stop_when_strong,
+                                    buf, state_bytes, buflen, flags);
+  LOCK(st);
+  ottery_entropy_state_merge_(&st->entropy_state, &es);
+  return err;
+}
+
+/**
+ * Replace st's key with the buflen bytes of entropy at buf, which came
+ * from sources with the given flags, and generate its first block.
+ */
+static void
+ottery_st_install_seed_nolock_(struct ottery_state_nolock *st,
+                               const uint8_t *buf, size_t buflen,
+                               uint32_t flags)
+{
   /* The first state_bytes bytes become the initial key. */
-  st->prf.setup(st->state, buf);
+  ST_PRF(st).setup(st->state, buf);
   /* If there are more bytes, we mix them into the key with add_seed */
-  if (buflen > st->prf.state_bytes)
+  if (buflen > ST_PRF(st).state_bytes)
     ottery_st_add_seed_impl(st,
-                            buf + st->prf.state_bytes,
-                            buflen - st->prf.state_bytes,
+                            buf + ST_PRF(st).state_bytes,
+                            buflen - ST_PRF(st).state_bytes,
                             0,
                             0);
-  ottery_memclear_(buf, buflen);
   st->last_entropy_flags = flags;
   st->entropy_src_flags = flags;
+  OTTERY_STAT_ADD_(st, reseeds, 1);
 
   /* Generate the first block of output. */
   st->block_counter = 0;
+  st->entropy_deferred = ENTROPY_DEFERRED_NONE;
   ottery_st_nextblock_nolock(st);
+  /* With fast start, we probably skipped some sources. */
+  if (st->fast_start)
+    st->entropy_deferred = ENTROPY_DEFERRED_WAITING;
+}
 
-  return 0;
+/**
+ * Reseed st from the operating system.  If locked is true, we hold st's
+ * lock, and ottery_st_collect_entropy_() releases it while it waits for
+ * the entropy; if still_needed is not NULL, we only install the entropy if
+ * still_needed(st) is true once we have the lock back.
+ *
+ * @return Zero on success, or an OTTERY_ERR_* code on failure.
+ */
+static int
+ottery_st_reseed_impl_(struct ottery_state *st, int locked,
+                       int (*still_needed)(struct ottery_state *))
+{
+  /* Now seed the PRF: Generate some random bytes from the OS, and use them
+   * as whatever keys/nonces/whatever the PRF wants to have. */
+  /* XXXX Add seed rather than starting from scratch? */
+  int err;
+  uint32_t flags=0;
+  size_t buflen = ottery_get_entropy_bufsize_(ST_PRF(st).state_bytes);
+  uint8_t *buf = alloca(buflen);
+  if (!buf)
+    return OTTERY_ERR_INIT_STRONG_RNG;
+
+  if ((err = ottery_st_collect_entropy_(st, locked, 0, st->fast_start,
+                                        buf, &buflen, &flags)))
+    goto out;
+  if (buflen < ST_PRF(st).state_bytes) {
+    err = OTTERY_ERR_ACCESS_STRONG_RNG;
+    goto out;
+  }
+  /* If somebody else reseeded while we were collecting, their key is as
+   * good as ours. */
+  if (!still_needed || still_needed(st))
+    ottery_st_install_seed_nolock_(st, buf, buflen, flags);
+
+ out:
+  ottery_memclear_(buf, buflen);
+  return err;
+}
+
+static int
+ottery_st_reseed(struct ottery_state *st)
+{
+  return ottery_st_reseed_impl_(st, 0, NULL);
+}
+
+/**
+ * Mix the entropy sources that fast start skipped into st.  If locked is
+ * true, we hold st's lock, and release it while we wait for the sources.
+ * If they fail, we don't try again: st is already strongly seeded.
+ */
+static void
+ottery_st_mix_deferred_(struct ottery_state *st, int locked)
+{
+  uint32_t flags = 0;
+  const size_t bufsize = ottery_get_entropy_bufsize_(ST_PRF(st).state_bytes);
+  size_t buflen = bufsize;
+  uint8_t *buf = alloca(bufsize);
+  if (!buf)
+    return;
+
+  /* Nobody else should start on this while we've released the lock. */
+  st->entropy_deferred = ENTROPY_DEFERRED_NONE;
+  if (!ottery_st_collect_entropy_(st, locked, st->entropy_src_flags, 0,
+                                  buf, &buflen, &flags) && buflen) {
+    ottery_st_add_seed_impl(st, buf, buflen, 0, 0);
+    st->entropy_src_flags |= flags;
+    st->last_entropy_flags = flags;
+  }
+  ottery_memclear_(buf, bufsize);
 }
 
 int
 ottery_st_init(struct ottery_state *st, const struct ottery_config *cfg)
 {
-  return ottery_st_initialize(st, cfg, 1);
+  return ottery_st_initialize(st, cfg, 1, NULL, 0);
 }
 
 int
 ottery_st_init_nolock(struct ottery_state_nolock *st,
                       const struct ottery_config *cfg)
 {
-  return ottery_st_initialize(st, cfg, 0);
+  return ottery_st_initialize(st, cfg, 0, NULL, 0);
+}
+
+int
+ottery_st_init_from_seed(struct ottery_state *st,
+                         const struct ottery_config *cfg,
+                         const uint8_t *seed, size_t n)
+{
+  if (!seed || !n)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  return ottery_st_initialize(st, cfg, 1, seed, n);
+}
+
+int
+ottery_st_init_from_seed_nolock(struct ottery_state_nolock *st,
+                                const struct ottery_config *cfg,
+                                const uint8_t *seed, size_t n)
+{
+  if (!seed || !n)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  return ottery_st_initialize(st, cfg, 0, seed, n);
 }
 
 static int
@@ -443,24 +1278,31 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
   uint32_t flags = 0;
 
   if (!seed || !n) {
-    int err;
-    tmp_seed_len = ottery_get_entropy_bufsize_(st->prf.state_bytes);
+    tmp_seed_len = ottery_get_entropy_bufsize_(ST_PRF(st).state_bytes);
     tmp_seed = alloca(tmp_seed_len);
     if (!tmp_seed)
       return OTTERY_ERR_INIT_STRONG_RNG;
     n = tmp_seed_len;
-    if ((err = ottery_get_entropy_(&st->entropy_config, &st->entropy_state, 0,
-                                    tmp_seed, st->prf.state_bytes,
-                                    &n,
-                                    &flags)))
-      return err;
-    if (n < st->prf.state_bytes)
-      return OTTERY_ERR_ACCESS_STRONG_RNG;
-    seed = tmp_seed;
   }
 
   if (locking)
     LOCK(st);
+  if (tmp_seed) {
+    /* This releases the lock while it waits for the entropy sources. */
+    int err = ottery_st_collect_entropy_(st, locking, 0, 0,
+                                         tmp_seed, &n, &flags);
+    if (!err && n < ST_PRF(st).state_bytes)
+      err = OTTERY_ERR_ACCESS_STRONG_RNG;
+    if (err) {
+      if (locking)
+        UNLOCK(st);
+      ottery_memclear_(tmp_seed, tmp_seed_len);
+      return err;
+    }
+    seed = tmp_seed;
+  }
+  if (check_magic)
+    OTTERY_STAT_ADD_(st, add_seed_calls, 1);
   /* The algorithm here is really easy. We grab a block of output from the
    * PRNG, that the first (state_bytes) bytes of that, XOR it with up to
    * (state_bytes) bytes of our new seed data, and use that to set our new
@@ -468,12 +1310,12 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
    */
   while (n) {
     unsigned i;
-    size_t m = n > st->prf.state_bytes/2 ? st->prf.state_bytes/2 : n;
+    size_t m = n > ST_PRF(st).state_bytes/2 ? ST_PRF(st).state_bytes/2 : n;
     ottery_st_nextblock_nolock_norekey(st);
     for (i = 0; i < m; ++i) {
       st->buffer[i] ^= seed[i];
     }
-    st->prf.setup(st->state, st->buffer);
+    ST_PRF(st).setup(st->state, st->buffer);
     st->block_counter = 0;
     n -= m;
     seed += m;
@@ -484,6 +1326,9 @@ ottery_st_add_seed_impl(struct ottery_state *st, const uint8_t *seed, size_t n,
 
   st->entropy_src_flags |= flags;
   st->last_entropy_flags = flags;
+  /* We just asked every source, so we don't owe any. */
+  if (tmp_seed)
+    st->entropy_deferred = ENTROPY_DEFERRED_NONE;
 
   if (locking)
     UNLOCK(st);
@@ -518,17 +1363,133 @@ ottery_st_wipe(struct ottery_state *st)
 void
 ottery_st_wipe_nolock(struct ottery_state_nolock *st)
 {
+  ottery_st_free_buffers_(st);
+  ottery_entropy_state_clear_(&st->entropy_state);
   ottery_memclear_(st, sizeof(struct ottery_state));
 }
 
+/** Allocate a new, empty ottery_spare_block for a state with buffer_len
+ * bytes of buffer. */
+static struct ottery_spare_block *
+ottery_spare_new_(size_t buffer_len)
+{
+  /* Round up so that the buffer after the structure is aligned too. */
+  const size_t spare_len = (sizeof(struct ottery_spare_block) + 15) & ~15;
+  struct ottery_spare_block *spare;
+  void *allocation;
+  uint8_t *mem = ottery_aligned_alloc_(spare_len + buffer_len, &allocation);
+  if (!mem)
+    return NULL;
+  memset(mem, 0, spare_len + buffer_len);
+  spare = (void *)mem;
+  spare->buffer = mem + spare_len;
+  spare->allocation = allocation;
+  return spare;
+}
+
+/** True iff st has a fast entropy pool that's low enough for
+ * ottery_st_refill() to top up. */
+#define PR_POOL_LOW(st) ((st)->pr && (st)->pr->avail < PR_POOL_LEN / 2)
+
+/**
+ * Fetch a new batch of fast CPU entropy for st's pool, without holding the
+ * lock while we do.  On entry and on exit, we hold the lock.
+ */
+static void
+ottery_st_pr_refill_unlocked_(struct ottery_state *st)
+{
+  uint8_t batch[PR_POOL_LEN];
+  int err;
+  UNLOCK(st);
+  err = ottery_get_fast_entropy_(batch, sizeof(batch));
+  LOCK(st);
+  if (!err && st->pr) {
+    memcpy(st->pr->bytes, batch, PR_POOL_LEN);
+    st->pr->avail = PR_POOL_LEN;
+  }
+  ottery_memclear_(batch, sizeof(batch));
+}
+
+int
+ottery_st_refill(struct ottery_state *st)
+{
+  struct ottery_spare_block *spare;
+  struct ottery_prf prf;
+  size_t nblocks;
+  int wipe_stack_mode;
+
+  if (ottery_st_rand_lock_and_check(st))
+    return OTTERY_ERR_STATE_INIT;
+  if (st->entropy_deferred)
+    ottery_st_mix_deferred_(st, 1);
+  if (PR_POOL_LOW(st))
+    ottery_st_pr_refill_unlocked_(st);
+  if (st->spare && (st->spare->ready || st->spare->busy)) {
+    UNLOCK(st);
+    return 0;
+  }
+  if (!st->spare && !(st->spare = ottery_spare_new_(st->buffer_len))) {
+    UNLOCK(st);
+    return OTTERY_ERR_INTERNAL;
+  }
+  spare = st->spare;
+  prf = ST_PRF(st);
+  nblocks = st->buffer_blocks;
+  wipe_stack_mode = st->wipe_stack_mode;
+  memcpy(spare->key, st->state, prf.state_len);
+  spare->idx = st->block_counter;
+  /* Nobody else touches the spare while it's busy and not ready. */
+  spare->busy = 1;
+  UNLOCK(st);
+
+  /* Do the expensive part without holding the lock. */
+  ottery_spare_compute_(&prf, nblocks, wipe_stack_mode, spare);
+
+  LOCK(st);
+  spare->busy = 0;
+  /* If somebody else used the state in the meantime, our block may be out
+   * of date; if so, we just throw it away.  Only publish it once we hold
+   * the lock again, so that whoever takes the lock next and sees it ready
+   * also sees everything we wrote into it. */
+  if (spare->idx == st->block_counter &&
+      ottery_ct_equal_(spare->key, st->state, prf.state_len))
+    spare->ready = 1;
+  else
+    ottery_spare_clear_(spare, st->buffer_len);
+  UNLOCK(st);
+  return 0;
+}
+
+int
+ottery_st_refill_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return OTTERY_ERR_STATE_INIT;
+  if (st->entropy_deferred)
+    ottery_st_mix_deferred_(st, 0);
+  if (PR_POOL_LOW(st) && !ottery_get_fast_entropy_(st->pr->bytes, PR_POOL_LEN))
+    st->pr->avail = PR_POOL_LEN;
+  if (st->spare && st->spare->ready)
+    return 0;
+  if (!st->spare && !(st->spare = ottery_spare_new_(st->buffer_len)))
+    return OTTERY_ERR_INTERNAL;
+  memcpy(st->spare->key, st->state, ST_PRF(st).state_len);
+  st->spare->idx = st->block_counter;
+  ottery_spare_compute_(&ST_PRF(st), st->buffer_blocks, st->wipe_stack_mode,
+                        st->spare);
+  st->spare->ready = 1;
+  return 0;
+}
+
 void
 ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st)
 {
-#ifdef OTTERY_NO_CLEAR_AFTER_YIELD
-  memset(st->buffer, 0, st->pos);
-#else
-  (void)st;
+#ifndef OTTERY_NO_CLEAR_AFTER_YIELD
+  /* Everything we've yielded is already gone. */
+  if (st->clear_mode == OTTERY_CLEAR_MODE_EACH_YIELD)
+    return;
 #endif
+  memset(st->buffer, 0, st->pos);
 }
 
 void
@@ -576,35 +1537,89 @@ ottery_st_rand_check_init(struct ottery_state *st)
   return 0;
 }
 
-/* XXXX */
+#ifndef OTTERY_NO_PID_CHECK
+/**
+ * Return true iff we have forked since a state was last seeded in the
+ * process with the given pid and fork generation.
+ */
+static inline int
+ottery_forked_since_(pid_t pid, uint32_t fork_generation)
+{
+#ifdef OTTERY_FORK_WIPE_PAGE
+  if (ottery_fork_page_ &&
+      UNLIKELY(ATOMIC_LOAD_ACQUIRE(ottery_fork_page_) == 0)) {
+    /* The kernel wiped our page, so this is a new child process.  Count the
+     * fork before we mark the page again, so that any thread that sees the
+     * mark also sees the new generation.  (If two threads get here at once,
+     * we might count the fork twice; that only costs us an extra reseed.) */
+    ATOMIC_INCREMENT(&ottery_fork_generation_);
+    ATOMIC_STORE_RELEASE(ottery_fork_page_, 1);
+  }
+#endif
+  if (LIKELY(ottery_fork_detection_ok_))
+    return fork_generation != ATOMIC_LOAD_ACQUIRE(&ottery_fork_generation_);
+  else
+    return pid != getpid();
+}
+#endif
+
+#ifndef OTTERY_NO_PID_CHECK
+/** Return true iff st still needs its post-fork reseed. */
+static int
+ottery_st_needs_postfork_reseed_(struct ottery_state *st)
+{
+  return ottery_forked_since_(st->pid, st->fork_generation);
+}
+#endif
+
+/**
+ * If we have forked since st was last seeded, reseed it.  If locked is
+ * true, we hold st's lock; we release it while we wait for the entropy
+ * sources.
+ */
 static inline int
-ottery_st_rand_check_pid(struct ottery_state *st)
+ottery_st_rand_check_pid(struct ottery_state *st, int locked)
 {
 #ifndef OTTERY_NO_PID_CHECK
-  if (UNLIKELY(st->pid != getpid())) {
+  if (UNLIKELY(ottery_forked_since_(st->pid, st->fork_generation))) {
     int err;
-    if ((err = ottery_st_reseed(st))) {
+    if ((err = ottery_st_reseed_impl_(st, locked,
+                                      ottery_st_needs_postfork_reseed_))) {
       ottery_fatal_error_(OTTERY_ERR_FLAG_POSTFORK_RESEED|err);
       return -1;
     }
-    st->pid = getpid();
+    /* Another thread might have beaten us to it. */
+    if (ottery_forked_since_(st->pid, st->fork_generation)) {
+      OTTERY_STAT_ADD_(st, postfork_reseeds, 1);
+      st->pid = getpid();
+      st->fork_generation = ATOMIC_LOAD_ACQUIRE(&ottery_fork_generation_);
+    }
   }
 #else
   (void) st;
+  (void) locked;
 #endif
   return 0;
 }
 
+int
+ottery_st_check_init_(struct ottery_state *st)
+{
+  return ottery_st_rand_check_init(st);
+}
+
 static inline int
 ottery_st_rand_lock_and_check(struct ottery_state *st)
 {
   if (ottery_st_rand_check_init(st))
     return -1;
   LOCK(st);
-  if (ottery_st_rand_check_pid(st)) {
+  if (ottery_st_rand_check_pid(st, 1)) {
     UNLOCK(st);
     return -1;
   }
+  if (UNLIKELY(st->entropy_deferred == ENTROPY_DEFERRED_DUE))
+    ottery_st_mix_deferred_(st, 1);
   return 0;
 }
 
@@ -613,9 +1628,71 @@ ottery_st_rand_check_nolock(struct ottery_state_nolock *st)
 {
   if (ottery_st_rand_check_init(st))
     return -1;
-  if (ottery_st_rand_check_pid(st))
+  if (ottery_st_rand_check_pid(st, 0))
     return -1;
+  if (UNLIKELY(st->entropy_deferred == ENTROPY_DEFERRED_DUE))
+    ottery_st_mix_deferred_(st, 0);
+  return 0;
+}
+
+int
+ottery_st_get_stats_nolock(struct ottery_state_nolock *st,
+                           struct ottery_stats *stats_out)
+{
+  memset(stats_out, 0, sizeof(*stats_out));
+#ifdef OTTERY_STATS
+  if (ottery_st_rand_check_init(st))
+    return OTTERY_ERR_STATE_INIT;
+  memcpy(stats_out, st->entropy_state.stats, sizeof(*stats_out));
   return 0;
+#else
+  (void)st;
+  return OTTERY_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+int
+ottery_st_get_stats(struct ottery_state *st, struct ottery_stats *stats_out)
+{
+#ifdef OTTERY_STATS
+  int err;
+  if (ottery_st_rand_check_init(st)) {
+    memset(stats_out, 0, sizeof(*stats_out));
+    return OTTERY_ERR_STATE_INIT;
+  }
+  LOCK(st);
+  err = ottery_st_get_stats_nolock(st, stats_out);
+  UNLOCK(st);
+  return err;
+#else
+  return ottery_st_get_stats_nolock(st, stats_out);
+#endif
+}
+
+/**
+ * Erase the n bytes at st->pos in st->buffer, which we have just yielded to
+ * the user, as st->clear_mode says we should.  Call this before advancing
+ * st->pos.
+ */
+static inline void
+ottery_st_clear_yielded_(struct ottery_state *st, size_t n)
+{
+#ifndef OTTERY_NO_CLEAR_AFTER_YIELD
+  if (LIKELY(st->clear_mode == OTTERY_CLEAR_MODE_EACH_YIELD)) {
+    memset(st->buffer + st->pos, 0, n);
+  } else if (st->clear_mode == OTTERY_CLEAR_MODE_BY_LINE) {
+    /* Erase every chunk that we've finished with.  Everything before
+     * st->pos in the first such chunk has been yielded already, or was
+     * part of the key. */
+    const size_t start = st->pos & ~(size_t)(CLEAR_LINE_LEN - 1);
+    const size_t end = (st->pos + n) & ~(size_t)(CLEAR_LINE_LEN - 1);
+    if (end != start)
+      memset(st->buffer + start, 0, end - start);
+  }
+#else
+  (void)st;
+  (void)n;
+#endif
 }
 
 /**
@@ -626,26 +1703,26 @@ ottery_st_rand_check_nolock(struct ottery_state_nolock *st)
  * @param st The state to use.
  * @param out A location to write to.
  * @param n The number of bytes to write. Must not be greater than
- *     st->prf.output_len*2 - st->prf.state_bytes - st->pos - 1.
+ *     st->buffer_len*2 - st->prf.state_bytes - st->pos - 1.
  */
 static inline void
 ottery_st_rand_bytes_from_buf(struct ottery_state *st, uint8_t *out,
                               size_t n)
 {
-  if (n + st->pos < st->prf.output_len) {
+  if (n + st->pos < st->buffer_len) {
     memcpy(out, st->buffer+st->pos, n);
-    CLEARBUF(st->buffer+st->pos, n);
+    ottery_st_clear_yielded_(st, n);
     st->pos += n;
   } else {
-    unsigned cpy = st->prf.output_len - st->pos;
+    unsigned cpy = st->buffer_len - st->pos;
     memcpy(out, st->buffer+st->pos, cpy);
     n -= cpy;
     out += cpy;
     ottery_st_nextblock_nolock(st);
     memcpy(out, st->buffer+st->pos, n);
-    CLEARBUF(st->buffer, n);
+    ottery_st_clear_yielded_(st, n);
     st->pos += n;
-    assert(st->pos < st->prf.output_len);
+    assert(st->pos < st->buffer_len);
   }
 }
 
@@ -656,29 +1733,37 @@ ottery_st_rand_bytes_impl(struct ottery_state *st, void *out_,
   uint8_t *out = out_;
   size_t cpy;
 
-  if (n + st->pos < st->prf.output_len * 2 - st->prf.state_bytes - 1) {
+  OTTERY_STAT_ADD_(st, bytes_out, n);
+  if (n + st->pos < st->buffer_len * 2 - ST_PRF(st).state_bytes - 1) {
     /* Fulfill it all from the buffer simply if possible. */
     ottery_st_rand_bytes_from_buf(st, out, n);
     return;
   }
 
   /* Okay. That's not going to happen.  Well, take what we can... */
-  cpy = st->prf.output_len - st->pos;
+  cpy = st->buffer_len - st->pos;
   memcpy(out, st->buffer + st->pos, cpy);
   out += cpy;
   n -= cpy;
 
   /* Then take whole blocks so long as we need them, without stirring... */
-  while (n >= st->prf.output_len) {
-    /* (We could save a memcpy here if we generated the block directly at out
-     * rather than doing the memcpy here. First we'd need to make sure that we
-     * had gotten the block aligned to a 16-byte boundary, though, and we'd
-     * have some other tricky bookkeeping to do. Let's call this good enough
-     * for now.) */
+  if (ST_PRF(st).generate_blocks && n >= ST_PRF(st).output_len) {
+    /* If the PRF can do it, generate all of the whole blocks at once,
+     * directly into the output, without going through st->buffer. */
+    const size_t nblocks = n / ST_PRF(st).output_len;
+    ST_PRF(st).generate_blocks(st->state, out, st->block_counter, nblocks);
+    ottery_wipe_stack_after_block_(st->wipe_stack_mode);
+    OTTERY_STAT_ADD_(st, prf_blocks, nblocks);
+    ottery_st_pr_count_(st, nblocks);
+    st->block_counter += nblocks;
+    out += nblocks * ST_PRF(st).output_len;
+    n -= nblocks * ST_PRF(st).output_len;
+  }
+  while (n >= ST_PRF(st).output_len) {
     ottery_st_nextblock_nolock_norekey(st);
-    memcpy(out, st->buffer, st->prf.output_len);
-    out += st->prf.output_len;
-    n -= st->prf.output_len;
+    memcpy(out, st->buffer, ST_PRF(st).output_len);
+    out += ST_PRF(st).output_len;
+    n -= ST_PRF(st).output_len;
   }
 
   /* Then stir for the last part. */
@@ -686,91 +1771,546 @@ ottery_st_rand_bytes_impl(struct ottery_state *st, void *out_,
   ottery_st_rand_bytes_from_buf(st, out, n);
 }
 
-void
-ottery_st_rand_bytes(struct ottery_state *st, void *out_, size_t n)
-{
-  if (ottery_st_rand_lock_and_check(st))
-    return;
-  ottery_st_rand_bytes_impl(st, out_, n);
-  UNLOCK(st);
-}
-
-void
-ottery_st_rand_bytes_nolock(struct ottery_state_nolock *st, void *out_, size_t n)
-{
-  if (ottery_st_rand_check_nolock(st))
-    return;
-  ottery_st_rand_bytes_impl(st, out_, n);
-}
-
 /**
- * Assign an integer type from bytes at a possibly unaligned pointer.
- *
- * @param type the type of integer to assign.
- * @param r the integer lvalue to write to.
- * @param p a pointer to the bytes to read from.
- **/
-#define INT_ASSIGN_PTR(type, r, p) do { \
-    memcpy(&r, p, sizeof(type));        \
-} while (0)
-
+ * Requests that would need at least this many whole blocks beyond the
+ * buffered data get those blocks generated after we release the lock.
+ */
+#define UNLOCKED_GENERATE_MIN_BLOCKS 4
 /**
- * Shared code for implementing rand_unsigned() and rand_uint64().
- *
- * @param st The state to use.
- * @param inttype The type of integer to generate.
- **/
-#define OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, unlock) do {      \
-    inttype result;                                                    \
-    if (sizeof(inttype) + (st)->pos <= (st)->prf.output_len) {         \
-      INT_ASSIGN_PTR(inttype, result, (st)->buffer + (st)->pos);       \
-      CLEARBUF((st)->buffer + (st)->pos, sizeof(inttype));             \
-      (st)->pos += sizeof(inttype);                                    \
-      if (st->pos == (st)->prf.output_len) {                           \
-        ottery_st_nextblock_nolock(st);                                \
-      }                                                                \
-    } else {                                                           \
-      /* Our handling of this case here is significantly simpler */    \
-      /* than that of ottery_st_rand_bytes_from_buf, at the expense */ \
-      /* of wasting up to sizeof(inttype)-1 bytes. Since inttype */    \
-      /* is at most 8 bytes long, that's not such a big deal. */       \
-      ottery_st_nextblock_nolock(st);                                  \
-      INT_ASSIGN_PTR(inttype, result, (st)->buffer + (st)->pos);       \
-      CLEARBUF((st)->buffer, sizeof(inttype));                         \
-      (st)->pos += sizeof(inttype);                                    \
-    }                                                                  \
-    unlock;                                                            \
-    return result;                                                     \
-} while (0)
+ * The smallest request that gets UNLOCKED_GENERATE_MIN_BLOCKS whole blocks
+ * beyond the buffered data in st, however much of the buffer is left.
+ */
+#define UNLOCKED_GENERATE_MIN_LEN(st)                   \
+  ((st)->buffer_len +                                   \
+   ST_PRF(st).output_len * (UNLOCKED_GENERATE_MIN_BLOCKS + 1))
 
-#define OTTERY_RETURN_RAND_INTTYPE(st, inttype) do {          \
-    if (ottery_st_rand_lock_and_check(st))                    \
-      return (inttype)0;                                      \
-    OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, UNLOCK(st)); \
-} while (0)
+/** Requests smaller than this never get split across threads. */
+#define PARALLEL_MIN_LEN (1024*1024)
+/** Each thread in a parallel fill generates at least this many bytes. */
+#define PARALLEL_MIN_CHUNK_LEN (256*1024)
+/** The most threads that we use for a single parallel fill. */
+#define PARALLEL_MAX_THREADS 64
 
-#define OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, inttype) do { \
-    if (ottery_st_rand_check_nolock(st))                    \
-      return (inttype)0;                                    \
-    OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, );         \
-} while (0)
+/**
+ * One thread's share of a parallel fill: nblocks whole blocks of output,
+ * starting with the counter value idx.
+ */
+struct ottery_parallel_job_ {
+  /** The PRF to use. */
+  const struct ottery_prf *prf;
+  /** The PRF state to generate from.  Every job has its own copy. */
+  __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
+  /** Where to write the output. */
+  uint8_t *out;
+  /** The counter value for the first block. */
+  uint32_t idx;
+  /** The number of blocks to generate. */
+  size_t nblocks;
+  /** One of the OTTERY_WIPE_STACK_* values. */
+  int wipe_stack_mode;
+#if defined(OTTERY_PARALLEL_PTHREADS)
+  /** The thread running this job, if started is true. */
+  pthread_t thread;
+#elif defined(OTTERY_PARALLEL_WIN32)
+  /** The thread running this job, if started is true. */
+  HANDLE thread;
+#endif
+  /** True iff we started a thread for this job. */
+  int started;
+};
 
-unsigned
-ottery_st_rand_unsigned(struct ottery_state *st)
+/** Generate the output for job, then wipe its copy of the PRF state. */
+static void
+ottery_parallel_job_run_(struct ottery_parallel_job_ *job)
 {
-  OTTERY_RETURN_RAND_INTTYPE(st, unsigned);
+  const struct ottery_prf *prf = job->prf;
+  if (prf->generate_blocks) {
+    prf->generate_blocks(job->state, job->out, job->idx, job->nblocks);
+  } else {
+    __attribute__ ((aligned (16))) uint8_t buffer[MAX_OUTPUT_LEN];
+    uint8_t *out = job->out;
+    uint32_t idx = job->idx;
+    size_t nblocks = job->nblocks;
+    while (nblocks--) {
+      prf->generate(job->state, buffer, idx++);
+      ottery_wipe_stack_after_block_(job->wipe_stack_mode);
+      memcpy(out, buffer, prf->output_len);
+      out += prf->output_len;
+    }
+    ottery_memclear_(buffer, prf->output_len);
+  }
+  ottery_wipe_stack_after_call_(job->wipe_stack_mode);
+  ottery_memclear_(job->state, prf->state_len);
 }
 
-unsigned
-ottery_st_rand_unsigned_nolock(struct ottery_state_nolock *st)
+#if defined(OTTERY_PARALLEL_PTHREADS)
+/** Thread entry point for a parallel fill. */
+static void *
+ottery_parallel_thread_(void *arg)
 {
-  OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, unsigned);
+  ottery_parallel_job_run_(arg);
+  return NULL;
 }
-
-uint32_t
-ottery_st_rand_uint32(struct ottery_state *st)
+#elif defined(OTTERY_PARALLEL_WIN32)
+/** Thread entry point for a parallel fill. */
+static DWORD WINAPI
+ottery_parallel_thread_(LPVOID arg)
 {
-  OTTERY_RETURN_RAND_INTTYPE(st, uint32_t);
+  ottery_parallel_job_run_(arg);
+  return 0;
+}
+#endif
+
+/**
+ * Return the number of threads to use for a parallel fill of n bytes,
+ * when the caller asked for at most max_threads of them. (Zero means one
+ * per CPU.)
+ */
+static unsigned
+ottery_parallel_n_threads_(size_t n, unsigned max_threads)
+{
+#if defined(OTTERY_PARALLEL_PTHREADS) || defined(OTTERY_PARALLEL_WIN32)
+  size_t n_threads = max_threads ? max_threads : ottery_get_n_cpus_();
+  if (n < PARALLEL_MIN_LEN)
+    return 1;
+  if (n_threads > n / PARALLEL_MIN_CHUNK_LEN)
+    n_threads = n / PARALLEL_MIN_CHUNK_LEN;
+  if (n_threads > PARALLEL_MAX_THREADS)
+    n_threads = PARALLEL_MAX_THREADS;
+  return n_threads ? (unsigned)n_threads : 1;
+#else
+  (void) n;
+  (void) max_threads;
+  return 1;
+#endif
+}
+
+/**
+ * Generate nblocks whole blocks from the PRF with the given state, starting
+ * with the counter value idx, by splitting them among n_threads threads.
+ * The calling thread does a share too.  If we can't start a thread, the
+ * calling thread does its share instead.
+ */
+static void
+ottery_parallel_generate_(const struct ottery_prf *prf, const uint8_t *state,
+                          uint8_t *out, uint32_t idx, size_t nblocks,
+                          unsigned n_threads, int wipe_stack_mode)
+{
+  struct ottery_parallel_job_ *jobs;
+  void *allocation;
+  const size_t per_thread = nblocks / n_threads;
+  size_t extra = nblocks % n_threads;
+  unsigned i;
+
+  jobs = ottery_aligned_alloc_(n_threads * sizeof(*jobs), &allocation);
+  if (!jobs) {
+    struct ottery_parallel_job_ job;
+    job.prf = prf;
+    memcpy(job.state, state, prf->state_len);
+    job.out = out;
+    job.idx = idx;
+    job.nblocks = nblocks;
+    job.wipe_stack_mode = wipe_stack_mode;
+    ottery_parallel_job_run_(&job);
+    return;
+  }
+
+  for (i = 0; i < n_threads; ++i) {
+    struct ottery_parallel_job_ *job = &jobs[i];
+    job->prf = prf;
+    memcpy(job->state, state, prf->state_len);
+    job->out = out;
+    job->idx = idx;
+    job->nblocks = per_thread + (extra ? 1 : 0);
+    job->wipe_stack_mode = wipe_stack_mode;
+    job->started = 0;
+    if (extra)
+      --extra;
+    out += job->nblocks * prf->output_len;
+    idx += (uint32_t)job->nblocks;
+  }
+
+  /* Keep the first job for ourselves. */
+  for (i = 1; i < n_threads; ++i) {
+#if defined(OTTERY_PARALLEL_PTHREADS)
+    jobs[i].started = (pthread_create(&jobs[i].thread, NULL,
+                                      ottery_parallel_thread_, &jobs[i]) == 0);
+#elif defined(OTTERY_PARALLEL_WIN32)
+    jobs[i].thread = CreateThread(NULL, 0, ottery_parallel_thread_, &jobs[i],
+                                  0, NULL);
+    jobs[i].started = (jobs[i].thread != NULL);
+#endif
+  }
+  for (i = 0; i < n_threads; ++i) {
+    if (!jobs[i].started)
+      ottery_parallel_job_run_(&jobs[i]);
+  }
+  for (i = 1; i < n_threads; ++i) {
+    if (!jobs[i].started)
+      continue;
+#if defined(OTTERY_PARALLEL_PTHREADS)
+    pthread_join(jobs[i].thread, NULL);
+#elif defined(OTTERY_PARALLEL_WIN32)
+    WaitForSingleObject(jobs[i].thread, INFINITE);
+    CloseHandle(jobs[i].thread);
+#endif
+  }
+
+  ottery_memclear_(jobs, n_threads * sizeof(*jobs));
+  free(allocation);
+}
+
+/**
+ * As ottery_st_rand_bytes_impl(), but for a large request on a locked
+ * state: release the lock before generating most of the output, so other
+ * threads don't have to wait for us.  The caller must hold the lock; we
+ * release it.
+ *
+ * We produce exactly the same bytes, and leave the state exactly the same
+ * way, as ottery_st_rand_bytes_impl() would.  To do so, we reserve the
+ * counter values for the whole blocks, take a private copy of the key that
+ * goes with them, and then stir the shared state right away.  After that,
+ * nobody else can use that key or those counter values.
+ *
+ * With n_threads above 1, we split the whole blocks among that many
+ * threads; see ottery_parallel_generate_().
+ *
+ * @param st The state to use.
+ * @param out_ A location to write to.
+ * @param n The number of bytes to write. Must be at least
+ *     UNLOCKED_GENERATE_MIN_LEN(st).
+ * @param n_threads The number of threads to generate the whole blocks on.
+ * @param locked True iff st has a lock for us to release.
+ */
+static void
+ottery_st_rand_bytes_impl_unlock(struct ottery_state *st, void *out_,
+                                 size_t n, unsigned n_threads, int locked)
+{
+  __attribute__ ((aligned (16))) uint8_t state[MAX_STATE_LEN];
+  __attribute__ ((aligned (16))) uint8_t buffer[MAX_OUTPUT_LEN];
+  const struct ottery_prf prf = ST_PRF(st);
+  const int wipe_stack_mode = st->wipe_stack_mode;
+  uint8_t *out = out_;
+  uint32_t idx;
+  size_t cpy, nblocks;
+
+  OTTERY_STAT_ADD_(st, bytes_out, n);
+
+  /* Take what we can from the buffer... */
+  cpy = st->buffer_len - st->pos;
+  memcpy(out, st->buffer + st->pos, cpy);
+  out += cpy;
+  n -= cpy;
+
+  /* Then reserve the counter values for the whole blocks... */
+  nblocks = n / prf.output_len;
+  n -= nblocks * prf.output_len;
+  idx = st->block_counter;
+  st->block_counter += nblocks;
+  memcpy(state, st->state, prf.state_len);
+  OTTERY_STAT_ADD_(st, prf_blocks, nblocks);
+  ottery_st_pr_count_(st, nblocks);
+
+  /* Then stir for the last part, exactly as if we had generated the whole
+   * blocks already. */
+  ottery_st_nextblock_nolock(st);
+  ottery_st_rand_bytes_from_buf(st, out + nblocks * prf.output_len, n);
+  if (locked)
+    UNLOCK(st);
+
+  /* Now we can generate the whole blocks without holding up anybody. */
+  if (n_threads > 1) {
+    ottery_parallel_generate_(&prf, state, out, idx, nblocks, n_threads,
+                              wipe_stack_mode);
+  } else if (prf.generate_blocks) {
+    prf.generate_blocks(state, out, idx, nblocks);
+  } else {
+    while (nblocks--) {
+      prf.generate(state, buffer, idx++);
+      ottery_wipe_stack_after_block_(wipe_stack_mode);
+      memcpy(out, buffer, prf.output_len);
+      out += prf.output_len;
+    }
+    ottery_memclear_(buffer, prf.output_len);
+  }
+  ottery_wipe_stack_after_call_(wipe_stack_mode);
+  ottery_memclear_(state, prf.state_len);
+}
+
+/** Domain separator that ottery_st_split_impl_() adds to each child's
+ * seed. */
+static const uint8_t SPLIT_TAG[] = "ottery-split";
+/** Number of bytes of SPLIT_TAG that we use: all but the trailing NUL. */
+#define SPLIT_TAG_LEN (sizeof(SPLIT_TAG) - 1)
+
+/**
+ * Implementation for ottery_st_split() and ottery_st_split_nolock(): take
+ * prf.state_bytes bytes of output from parent, and seed child from them,
+ * a tag, and stream_id.  The caller must hold the parent's lock, if it has
+ * one.
+ */
+static int
+ottery_st_split_impl_(struct ottery_state *parent, struct ottery_state *child,
+                      uint64_t stream_id, int locked)
+{
+  struct ottery_config cfg;
+  uint8_t seed[MAX_STATE_BYTES + SPLIT_TAG_LEN + 8];
+  const size_t material_len = ST_PRF(parent).state_bytes;
+  unsigned i;
+  int err;
+
+  if (child == parent)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+
+  ottery_config_init(&cfg);
+  cfg.impl = &ST_PRF(parent);
+  memcpy(&cfg.entropy_config, &parent->entropy_config,
+         sizeof(struct ottery_entropy_config));
+  cfg.buffer_blocks = parent->buffer_blocks;
+  cfg.clear_mode = parent->clear_mode;
+  cfg.wipe_stack_mode = parent->wipe_stack_mode;
+  if (parent->pr) {
+    cfg.pr_every_blocks = parent->pr->every_blocks;
+    cfg.pr_every_msec = parent->pr->every_msec;
+  }
+
+  /* The parent never yields these bytes again, so nobody who sees the
+   * parent's output can learn the child's seed. */
+  ottery_st_rand_bytes_impl(parent, seed, material_len);
+  memcpy(seed + material_len, SPLIT_TAG, SPLIT_TAG_LEN);
+  for (i = 0; i < 8; ++i)
+    seed[material_len + SPLIT_TAG_LEN + i] = (uint8_t)(stream_id >> (8*i));
+
+  err = ottery_st_initialize(child, &cfg, locked,
+                             seed, material_len + SPLIT_TAG_LEN + 8);
+  ottery_memclear_(seed, sizeof(seed));
+  return err;
+}
+
+int
+ottery_st_split(struct ottery_state *parent, struct ottery_state *child,
+                uint64_t stream_id)
+{
+  int err;
+  if (ottery_st_rand_lock_and_check(parent))
+    return OTTERY_ERR_STATE_INIT;
+  err = ottery_st_split_impl_(parent, child, stream_id, 1);
+  UNLOCK(parent);
+  return err;
+}
+
+int
+ottery_st_split_nolock(struct ottery_state_nolock *parent,
+                       struct ottery_state_nolock *child,
+                       uint64_t stream_id)
+{
+  if (ottery_st_rand_check_nolock(parent))
+    return OTTERY_ERR_STATE_INIT;
+  return ottery_st_split_impl_(parent, child, stream_id, 0);
+}
+
+/**
+ * Implementation for ottery_st_seek() and ottery_st_seek_nolock().  The
+ * caller must hold the lock, if there is one.
+ */
+static int
+ottery_st_seek_impl_(struct ottery_state *st, uint64_t block_offset)
+{
+  /* Never go past the PRF's largest counter value: its own block counter
+   * would wrap around and repeat output. */
+  const uint64_t max_idx = PRF_MAX_IDX(ST_PRF(st));
+  if (block_offset > max_idx ||
+      st->block_counter + block_offset + st->buffer_blocks > max_idx + 1)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  st->block_counter += (uint32_t)block_offset;
+  ottery_st_nextblock_nolock(st);
+  return 0;
+}
+
+int
+ottery_st_seek(struct ottery_state *st, uint64_t block_offset)
+{
+  int err;
+  if (ottery_st_rand_lock_and_check(st))
+    return OTTERY_ERR_STATE_INIT;
+  err = ottery_st_seek_impl_(st, block_offset);
+  UNLOCK(st);
+  return err;
+}
+
+int
+ottery_st_seek_nolock(struct ottery_state_nolock *st, uint64_t block_offset)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return OTTERY_ERR_STATE_INIT;
+  return ottery_st_seek_impl_(st, block_offset);
+}
+
+/**
+ * Fill a buffer from a locked state, releasing the lock when we're done
+ * with the state.  The caller must hold the lock.
+ */
+static void
+ottery_st_rand_bytes_locked(struct ottery_state *st, void *out_, size_t n)
+{
+  if (n >= UNLOCKED_GENERATE_MIN_LEN(st)) {
+    ottery_st_rand_bytes_impl_unlock(st, out_, n, 1, 1);
+  } else {
+    ottery_st_rand_bytes_impl(st, out_, n);
+    UNLOCK(st);
+  }
+}
+
+void
+ottery_st_rand_bytes(struct ottery_state *st, void *out_, size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_rand_bytes_locked(st, out_, n);
+}
+
+void
+ottery_st_rand_bytes_nolock(struct ottery_state_nolock *st, void *out_, size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_rand_bytes_impl(st, out_, n);
+}
+
+/**
+ * Implementation for ottery_st_rand_bytes_parallel() and
+ * ottery_st_rand_bytes_parallel_nolock().  If locked is true, the caller
+ * must hold the lock on st; we release it.
+ */
+static void
+ottery_st_rand_bytes_parallel_impl_(struct ottery_state *st, void *out_,
+                                    size_t n, unsigned max_threads,
+                                    int locked)
+{
+  uint8_t *out = out_;
+  const unsigned n_threads = ottery_parallel_n_threads_(n, max_threads);
+  /* The most whole blocks that one segment can reserve, and still leave
+   * room below the PRF's largest counter value for the buffer we refill
+   * afterwards. */
+  const size_t max_segment_blocks =
+    (size_t)PRF_MAX_IDX(ST_PRF(st)) + 1 - st->buffer_blocks;
+  const size_t max_segment_len =
+    (SIZE_MAX / ST_PRF(st).output_len > max_segment_blocks) ?
+    max_segment_blocks * ST_PRF(st).output_len : SIZE_MAX;
+
+  if (n_threads <= 1) {
+    if (locked) {
+      ottery_st_rand_bytes_locked(st, out, n);
+    } else {
+      ottery_st_rand_bytes_impl(st, out, n);
+    }
+    return;
+  }
+
+  /* Reserve no more than a segment of blocks at a time, so that the PRF's
+   * counter can never wrap; we rekey after each segment.  Stop a little
+   * short of a full segment, so that the last one is still big enough to go
+   * through ottery_st_rand_bytes_impl_unlock(). */
+  while (n > max_segment_len) {
+    const size_t segment_len = max_segment_len - PARALLEL_MIN_LEN;
+    ottery_st_rand_bytes_impl_unlock(st, out, segment_len, n_threads,
+                                     locked);
+    out += segment_len;
+    n -= segment_len;
+    if (locked)
+      LOCK(st);
+  }
+  ottery_st_rand_bytes_impl_unlock(st, out, n, n_threads, locked);
+}
+
+void
+ottery_st_rand_bytes_parallel(struct ottery_state *st, void *out, size_t n,
+                              unsigned max_threads)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_rand_bytes_parallel_impl_(st, out, n, max_threads, 1);
+}
+
+void
+ottery_st_rand_bytes_parallel_nolock(struct ottery_state_nolock *st,
+                                     void *out, size_t n,
+                                     unsigned max_threads)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_rand_bytes_parallel_impl_(st, out, n, max_threads, 0);
+}
+
+/**
+ * Assign an integer type from bytes at a possibly unaligned pointer.
+ *
+ * @param type the type of integer to assign.
+ * @param r the integer lvalue to write to.
+ * @param p a pointer to the bytes to read from.
+ **/
+#define INT_ASSIGN_PTR(type, r, p) do { \
+    memcpy(&r, p, sizeof(type));        \
+} while (0)
+
+/**
+ * Shared code for implementing rand_unsigned() and rand_uint64().
+ *
+ * @param st The state to use.
+ * @param inttype The type of integer to generate.
+ **/
+#define OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, unlock) do {      \
+    inttype result;                                                    \
+    OTTERY_STAT_ADD_((st), bytes_out, sizeof(inttype));                \
+    if (sizeof(inttype) + (st)->pos <= (st)->buffer_len) {             \
+      INT_ASSIGN_PTR(inttype, result, (st)->buffer + (st)->pos);       \
+      ottery_st_clear_yielded_((st), sizeof(inttype));                 \
+      (st)->pos += sizeof(inttype);                                    \
+      if (st->pos == (st)->buffer_len) {                               \
+        ottery_st_nextblock_nolock(st);                                \
+      }                                                                \
+    } else {                                                           \
+      /* Our handling of this case here is significantly simpler */    \
+      /* than that of ottery_st_rand_bytes_from_buf, at the expense */ \
+      /* of wasting up to sizeof(inttype)-1 bytes. Since inttype */    \
+      /* is at most 8 bytes long, that's not such a big deal. */       \
+      ottery_st_nextblock_nolock(st);                                  \
+      INT_ASSIGN_PTR(inttype, result, (st)->buffer + (st)->pos);       \
+      ottery_st_clear_yielded_((st), sizeof(inttype));                 \
+      (st)->pos += sizeof(inttype);                                    \
+    }                                                                  \
+    unlock;                                                            \
+    return result;                                                     \
+} while (0)
+
+#define OTTERY_RETURN_RAND_INTTYPE(st, inttype) do {          \
+    if (ottery_st_rand_lock_and_check(st))                    \
+      return (inttype)0;                                      \
+    OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, UNLOCK(st)); \
+} while (0)
+
+#define OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, inttype) do { \
+    if (ottery_st_rand_check_nolock(st))                    \
+      return (inttype)0;                                    \
+    OTTERY_RETURN_RAND_INTTYPE_IMPL(st, inttype, );         \
+} while (0)
+
+unsigned
+ottery_st_rand_unsigned(struct ottery_state *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE(st, unsigned);
+}
+
+unsigned
+ottery_st_rand_unsigned_nolock(struct ottery_state_nolock *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, unsigned);
+}
+
+uint32_t
+ottery_st_rand_uint32(struct ottery_state *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE(st, uint32_t);
 }
 
 uint32_t
@@ -791,52 +2331,989 @@ ottery_st_rand_uint64_nolock(struct ottery_state_nolock *st)
   OTTERY_RETURN_RAND_INTTYPE_NOLOCK(st, uint64_t);
 }
 
-unsigned
-ottery_st_rand_range_nolock(struct ottery_state_nolock *st, unsigned upper)
-{
-  unsigned lim = upper+1;
-  unsigned divisor = lim ? (UINT_MAX / lim) : 1;
-  unsigned n;
-  do {
-    n = (ottery_st_rand_unsigned_nolock(st) / divisor);
-  } while (n > upper);
+/** A nonzero byte, for fast views to check when we have no page that the
+ * kernel wipes on fork. */
+static const uint8_t ottery_fast_view_nonzero_ = 1;
+#ifdef OTTERY_NO_PID_CHECK
+/** A generation counter that never changes, since we don't look for forks. */
+static const uint32_t ottery_fast_view_generation_ = 0;
+#endif
 
-  return n;
+/**
+ * Tell view which memory to check for a fork, and remember how it looks
+ * right now.
+ */
+static void
+ottery_fast_view_set_fork_check_(struct ottery_fast_view_nolock *view)
+{
+#ifdef OTTERY_NO_PID_CHECK
+  view->fork_page_ = &ottery_fast_view_nonzero_;
+  view->fork_gen_ = &ottery_fast_view_generation_;
+#else
+  view->fork_page_ = &ottery_fast_view_nonzero_;
+#ifdef OTTERY_FORK_WIPE_PAGE
+  if (ottery_fork_page_)
+    view->fork_page_ = ottery_fork_page_;
+#endif
+  view->fork_gen_ = &ottery_fork_generation_;
+#endif
+  view->fork_gen_value_ = ATOMIC_LOAD_ACQUIRE(view->fork_gen_);
 }
 
-uint64_t
-ottery_st_rand_range64_nolock(struct ottery_state_nolock *st, uint64_t upper)
+int
+ottery_st_fast_view_init_nolock(struct ottery_fast_view_nolock *view,
+                                struct ottery_state_nolock *st)
 {
-  uint64_t lim = upper+1;
-  uint64_t divisor = lim ? (UINT64_MAX / lim) : 1;
-  uint64_t n;
-  do {
-    n = (ottery_st_rand_uint64_nolock(st) / divisor);
-  } while (n > upper);
+  memset(view, 0, sizeof(*view));
+  if (ottery_st_rand_check_init(st))
+    return OTTERY_ERR_STATE_INIT;
+  view->st_ = st;
+  view->pos_ = OTTERY_FAST_VIEW_LEN;
+  ottery_fast_view_set_fork_check_(view);
+  return 0;
+}
 
-  return n;
+void
+ottery_fast_view_wipe_nolock(struct ottery_fast_view_nolock *view)
+{
+  ottery_memclear_(view, sizeof(*view));
 }
 
-unsigned
-ottery_st_rand_range(struct ottery_state *state, unsigned upper)
+int
+ottery_fast_view_refill_nolock_(struct ottery_fast_view_nolock *view)
 {
-  unsigned n;
-  if (ottery_st_rand_check_init(state))
+  ottery_memclear_(view->buf_, sizeof(view->buf_));
+  view->pos_ = OTTERY_FAST_VIEW_LEN;
+#ifndef OTTERY_NO_PID_CHECK
+  /* Without a cheap way to notice forks, only the state can check. */
+  if (!ottery_fork_detection_ok_)
     return 0;
-  LOCK(state);
-  n = ottery_st_rand_range_nolock(state, upper);
-  UNLOCK(state);
-  return n;
+#endif
+  /* This notices any fork, and reseeds the state, before we look at the
+   * fork generation. */
+  ottery_st_rand_bytes_nolock(view->st_, view->buf_, sizeof(view->buf_));
+  ottery_fast_view_set_fork_check_(view);
+  view->pos_ = 0;
+  return 1;
 }
 
-uint64_t
-ottery_st_rand_range64(struct ottery_state *state, uint64_t upper)
+/* Every bit pattern is a valid integer, so we can fill an array of them
+ * just as we would fill a byte buffer, taking the lock only once. */
+void
+ottery_st_rand_uint32_array(struct ottery_state *st, uint32_t *out, size_t n)
 {
-  uint64_t n;
-  if (ottery_st_rand_check_init(state))
-    return 0;
-  LOCK(state);
-  n = ottery_st_rand_range64_nolock(state, upper);
-  UNLOCK(state);
-  return n;
+  ottery_st_rand_bytes(st, out, n * sizeof(uint32_t));
+}
+
+void
+ottery_st_rand_uint32_array_nolock(struct ottery_state_nolock *st,
+                                   uint32_t *out, size_t n)
+{
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(uint32_t));
 }
+
+void
+ottery_st_rand_uint64_array(struct ottery_state *st, uint64_t *out, size_t n)
+{
+  ottery_st_rand_bytes(st, out, n * sizeof(uint64_t));
+}
+
+void
+ottery_st_rand_uint64_array_nolock(struct ottery_state_nolock *st,
+                                   uint64_t *out, size_t n)
+{
+  ottery_st_rand_bytes_nolock(st, out, n * sizeof(uint64_t));
+}
+
+/* Unchecked helpers to pull a single integer out of the buffer.  The caller
+ * must already hold the lock (if any) and have checked the state. */
+static inline uint32_t
+ottery_st_draw_uint32_nolock_(struct ottery_state_nolock *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE_IMPL(st, uint32_t, );
+}
+
+static inline uint64_t
+ottery_st_draw_uint64_nolock_(struct ottery_state_nolock *st)
+{
+  OTTERY_RETURN_RAND_INTTYPE_IMPL(st, uint64_t, );
+}
+
+/**
+ * Compute the full 128-bit product of a and b, returning the high 64 bits
+ * and storing the low 64 bits in *lo.
+ */
+static inline uint64_t
+ottery_mul64_hi_(uint64_t a, uint64_t b, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  *lo = (uint64_t)r;
+  return (uint64_t)(r >> 64);
+#else
+  const uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  const uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  const uint64_t ll = a_lo * b_lo;
+  const uint64_t lh = a_lo * b_hi;
+  const uint64_t hl = a_hi * b_lo;
+  const uint64_t hh = a_hi * b_hi;
+  const uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  *lo = (mid << 32) | (uint32_t)ll;
+  return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/*
+ * We map a random w-bit value x onto [0, lim) by taking the high w bits of
+ * x * lim.  That is biased only for the (2^w mod lim) values of x whose low
+ * w product bits fall below 2^w mod lim; we reject those.  Since the low
+ * bits are at least lim for nearly every draw, we hardly ever need to
+ * compute the modulus at all.  (This is Daniel Lemire's "nearly divisionless"
+ * method.)
+ */
+static inline uint32_t
+ottery_st_range32_nolock_(struct ottery_state_nolock *st, uint32_t top)
+{
+  const uint32_t lim = top + 1;
+  uint64_t m;
+  uint32_t lo;
+  if (lim == 0)
+    return ottery_st_draw_uint32_nolock_(st);
+  m = (uint64_t)ottery_st_draw_uint32_nolock_(st) * lim;
+  lo = (uint32_t)m;
+  if (lo < lim) {
+    const uint32_t threshold = (uint32_t)-lim % lim;
+    while (lo < threshold) {
+      m = (uint64_t)ottery_st_draw_uint32_nolock_(st) * lim;
+      lo = (uint32_t)m;
+    }
+  }
+  return (uint32_t)(m >> 32);
+}
+
+static inline uint64_t
+ottery_st_range64_nolock_(struct ottery_state_nolock *st, uint64_t top)
+{
+  const uint64_t lim = top + 1;
+  uint64_t hi, lo;
+  if (lim == 0)
+    return ottery_st_draw_uint64_nolock_(st);
+  hi = ottery_mul64_hi_(ottery_st_draw_uint64_nolock_(st), lim, &lo);
+  if (lo < lim) {
+    const uint64_t threshold = (uint64_t)-lim % lim;
+    while (lo < threshold)
+      hi = ottery_mul64_hi_(ottery_st_draw_uint64_nolock_(st), lim, &lo);
+  }
+  return hi;
+}
+
+#if UINT_MAX == UINT32_MAX
+#define ottery_st_range_unsigned_nolock_(st, top) \
+  ((unsigned)ottery_st_range32_nolock_((st), (top)))
+#else
+#define ottery_st_range_unsigned_nolock_(st, top) \
+  ((unsigned)ottery_st_range64_nolock_((st), (top)))
+#endif
+
+unsigned
+ottery_st_rand_range_nolock(struct ottery_state_nolock *st, unsigned upper)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  return ottery_st_range_unsigned_nolock_(st, upper);
+}
+
+uint64_t
+ottery_st_rand_range64_nolock(struct ottery_state_nolock *st, uint64_t upper)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0;
+  return ottery_st_range64_nolock_(st, upper);
+}
+
+unsigned
+ottery_st_rand_range(struct ottery_state *state, unsigned upper)
+{
+  unsigned n;
+  if (ottery_st_rand_lock_and_check(state))
+    return 0;
+  n = ottery_st_range_unsigned_nolock_(state, upper);
+  UNLOCK(state);
+  return n;
+}
+
+uint64_t
+ottery_st_rand_range64(struct ottery_state *state, uint64_t upper)
+{
+  uint64_t n;
+  if (ottery_st_rand_lock_and_check(state))
+    return 0;
+  n = ottery_st_range64_nolock_(state, upper);
+  UNLOCK(state);
+  return n;
+}
+
+/**
+ * Shared code for implementing the range_array functions.
+ *
+ * @param st The state to use.
+ * @param out The array to fill.
+ * @param n The number of elements in out.
+ * @param top_expr An expression for the upper bound of out[i].
+ * @param range_fn The function to use for generating a single element.
+ **/
+#define OTTERY_RANGE_ARRAY_IMPL(st, out, n, top_expr, range_fn) do { \
+    size_t i;                                                       \
+    for (i = 0; i < (n); ++i)                                       \
+      (out)[i] = range_fn((st), (top_expr));                        \
+} while (0)
+
+void
+ottery_st_rand_range_array_nolock(struct ottery_state_nolock *st,
+                                  unsigned *out, size_t n, unsigned top)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, top, ottery_st_range_unsigned_nolock_);
+}
+
+void
+ottery_st_rand_range_array_bounds_nolock(struct ottery_state_nolock *st,
+                                         unsigned *out, const unsigned *tops,
+                                         size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, tops[i],
+                          ottery_st_range_unsigned_nolock_);
+}
+
+void
+ottery_st_rand_range64_array_nolock(struct ottery_state_nolock *st,
+                                    uint64_t *out, size_t n, uint64_t top)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, top, ottery_st_range64_nolock_);
+}
+
+void
+ottery_st_rand_range64_array_bounds_nolock(struct ottery_state_nolock *st,
+                                           uint64_t *out,
+                                           const uint64_t *tops, size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, tops[i], ottery_st_range64_nolock_);
+}
+
+void
+ottery_st_rand_range_array(struct ottery_state *st,
+                           unsigned *out, size_t n, unsigned top)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, top, ottery_st_range_unsigned_nolock_);
+  UNLOCK(st);
+}
+
+void
+ottery_st_rand_range_array_bounds(struct ottery_state *st,
+                                  unsigned *out, const unsigned *tops,
+                                  size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, tops[i],
+                          ottery_st_range_unsigned_nolock_);
+  UNLOCK(st);
+}
+
+void
+ottery_st_rand_range64_array(struct ottery_state *st,
+                             uint64_t *out, size_t n, uint64_t top)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, top, ottery_st_range64_nolock_);
+  UNLOCK(st);
+}
+
+void
+ottery_st_rand_range64_array_bounds(struct ottery_state *st,
+                                    uint64_t *out, const uint64_t *tops,
+                                    size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  OTTERY_RANGE_ARRAY_IMPL(st, out, n, tops[i], ottery_st_range64_nolock_);
+  UNLOCK(st);
+}
+
+/* ================================================== */
+/* Shuffling and sampling. */
+
+/** Return a random index between 0 and top inclusive.  Uses only 32 bits
+ * of output when top is small enough. */
+static inline uint64_t
+ottery_st_index_nolock_(struct ottery_state_nolock *st, uint64_t top)
+{
+  if (top <= UINT32_MAX)
+    return ottery_st_range32_nolock_(st, (uint32_t)top);
+  return ottery_st_range64_nolock_(st, top);
+}
+
+/** Exchange the size-byte objects at a and b, which must not overlap. */
+static inline void
+ottery_memswap_(uint8_t *a, uint8_t *b, size_t size)
+{
+  uint8_t tmp[64];
+  if (size == sizeof(uint64_t)) {
+    uint64_t t;
+    memcpy(&t, a, sizeof(t));
+    memcpy(a, b, sizeof(t));
+    memcpy(b, &t, sizeof(t));
+    return;
+  }
+  if (size == sizeof(uint32_t)) {
+    uint32_t t;
+    memcpy(&t, a, sizeof(t));
+    memcpy(a, b, sizeof(t));
+    memcpy(b, &t, sizeof(t));
+    return;
+  }
+  while (size) {
+    const size_t n = size < sizeof(tmp) ? size : sizeof(tmp);
+    memcpy(tmp, a, n);
+    memcpy(a, b, n);
+    memcpy(b, tmp, n);
+    a += n;
+    b += n;
+    size -= n;
+  }
+}
+
+/**
+ * Fisher-Yates shuffle the nmemb size-byte elements at base.  The caller
+ * must already hold the lock (if any) and have checked the state.
+ */
+static void
+ottery_st_shuffle_nolock_(struct ottery_state_nolock *st, void *base,
+                          size_t nmemb, size_t size)
+{
+  uint8_t *b = base;
+  size_t i;
+  if (nmemb < 2 || !size)
+    return;
+  for (i = nmemb - 1; i > 0; --i) {
+    const size_t j = (size_t)ottery_st_index_nolock_(st, i);
+    if (j != i)
+      ottery_memswap_(b + i * size, b + j * size, size);
+  }
+}
+
+void
+ottery_st_shuffle_nolock(struct ottery_state_nolock *st, void *base,
+                         size_t nmemb, size_t size)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_shuffle_nolock_(st, base, nmemb, size);
+}
+
+void
+ottery_st_shuffle(struct ottery_state *st, void *base, size_t nmemb,
+                  size_t size)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_shuffle_nolock_(st, base, nmemb, size);
+  UNLOCK(st);
+}
+
+/**
+ * An open-addressed hash set of indices, for ottery_st_sample_indices().
+ * Each slot holds an index plus one, or zero if it's empty.
+ */
+struct ottery_index_set {
+  /** The slots; there are (1<<bits) of them. */
+  size_t *slots;
+  /** Log2 of the number of slots. */
+  unsigned bits;
+};
+
+/**
+ * Allocate set with room for at least 2*k slots, so that it never gets more
+ * than half full once it holds k indices.
+ *
+ * @return Zero on success, or an OTTERY_ERR_* code on failure.
+ */
+static int
+ottery_index_set_init_(struct ottery_index_set *set, size_t k)
+{
+  set->bits = 1;
+  while ((((size_t)1 << set->bits) >> 1) < k) {
+    if (++set->bits >= sizeof(size_t) * 8 - 1)
+      return OTTERY_ERR_INVALID_ARGUMENT;
+  }
+  if (((size_t)1 << set->bits) > SIZE_MAX / sizeof(size_t))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (!(set->slots = calloc((size_t)1 << set->bits, sizeof(size_t))))
+    return OTTERY_ERR_INTERNAL;
+  return 0;
+}
+
+/** Wipe and release set. */
+static void
+ottery_index_set_clear_(struct ottery_index_set *set)
+{
+  ottery_memclear_(set->slots, sizeof(size_t) << set->bits);
+  free(set->slots);
+  set->slots = NULL;
+}
+
+/** Add idx to set.  Return 1 if we added it, or 0 if it was already there. */
+static int
+ottery_index_set_add_(struct ottery_index_set *set, size_t idx)
+{
+  const size_t mask = ((size_t)1 << set->bits) - 1;
+  size_t pos = (size_t)(((uint64_t)idx * UINT64_C(0x9e3779b97f4a7c15)) >>
+                        (64 - set->bits));
+  for (;; pos = (pos + 1) & mask) {
+    if (set->slots[pos] == idx + 1)
+      return 0;
+    if (set->slots[pos] == 0) {
+      set->slots[pos] = idx + 1;
+      return 1;
+    }
+  }
+}
+
+/**
+ * Choose k distinct indices from [0, n) with Robert Floyd's algorithm,
+ * then shuffle them.  The caller must already hold the lock (if any) and
+ * have checked the state.
+ */
+static void
+ottery_st_sample_indices_nolock_(struct ottery_state_nolock *st,
+                                 struct ottery_index_set *set,
+                                 size_t n, size_t k, size_t *out)
+{
+  size_t i, j;
+  for (i = 0, j = n - k; j < n; ++i, ++j) {
+    size_t t = (size_t)ottery_st_index_nolock_(st, j);
+    if (!ottery_index_set_add_(set, t)) {
+      /* j is new: nothing before this round could be as big. */
+      t = j;
+      ottery_index_set_add_(set, t);
+    }
+    out[i] = t;
+  }
+  /* Floyd's algorithm picks each set with the right probability, but not
+   * each order. */
+  ottery_st_shuffle_nolock_(st, out, k, sizeof(size_t));
+}
+
+/**
+ * Implementation for ottery_st_sample_indices() and
+ * ottery_st_sample_indices_nolock().
+ */
+static int
+ottery_st_sample_indices_impl_(struct ottery_state *st, size_t n, size_t k,
+                               size_t *out, int locked)
+{
+  struct ottery_index_set set;
+  int err;
+  if (k > n || (k && !out))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (!k)
+    return 0;
+  if ((err = ottery_index_set_init_(&set, k)))
+    return err;
+  if (locked ? ottery_st_rand_lock_and_check(st) :
+               ottery_st_rand_check_nolock(st)) {
+    ottery_index_set_clear_(&set);
+    return OTTERY_ERR_STATE_INIT;
+  }
+  ottery_st_sample_indices_nolock_(st, &set, n, k, out);
+  if (locked)
+    UNLOCK(st);
+  ottery_index_set_clear_(&set);
+  return 0;
+}
+
+int
+ottery_st_sample_indices(struct ottery_state *st, size_t n, size_t k,
+                         size_t *out)
+{
+  return ottery_st_sample_indices_impl_(st, n, k, out, 1);
+}
+
+int
+ottery_st_sample_indices_nolock(struct ottery_state_nolock *st, size_t n,
+                                size_t k, size_t *out)
+{
+  return ottery_st_sample_indices_impl_(st, n, k, out, 0);
+}
+
+/**
+ * Decide where each of n stream items goes in a k-slot reservoir, when
+ * n_seen items came before them.  The caller must already hold the lock (if
+ * any) and have checked the state.
+ */
+static void
+ottery_st_reservoir_slots_nolock_(struct ottery_state_nolock *st,
+                                  uint64_t n_seen, size_t k,
+                                  size_t *slots, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    const uint64_t t = n_seen + i;
+    if (t < k) {
+      slots[i] = (size_t)t;
+    } else {
+      /* Keep item t with probability k/(t+1), in a random slot. */
+      const uint64_t j = ottery_st_index_nolock_(st, t);
+      slots[i] = j < k ? (size_t)j : OTTERY_RESERVOIR_SKIP;
+    }
+  }
+}
+
+void
+ottery_st_reservoir_slots(struct ottery_state *st, uint64_t n_seen,
+                          size_t k, size_t *slots, size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_reservoir_slots_nolock_(st, n_seen, k, slots, n);
+  UNLOCK(st);
+}
+
+void
+ottery_st_reservoir_slots_nolock(struct ottery_state_nolock *st,
+                                 uint64_t n_seen, size_t k,
+                                 size_t *slots, size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_reservoir_slots_nolock_(st, n_seen, k, slots, n);
+}
+
+/*
+ * To turn random bits into a uniform value in [0,1), we put them into the
+ * mantissa of a number with the exponent for [1,2), and subtract 1.  That
+ * gives us every multiple of 2^-52 (for doubles) or 2^-23 (for floats) in
+ * the range with equal probability.  Unlike an integer-to-float conversion,
+ * it uses only shifts, ORs and one subtraction, so the compiler can
+ * vectorize the array loops below on any SIMD unit that we have.
+ */
+#define DOUBLE_ONE_BITS UINT64_C(0x3ff0000000000000)
+#define FLOAT_ONE_BITS  UINT32_C(0x3f800000)
+
+static inline double
+ottery_bits_to_double_(uint64_t bits)
+{
+  double d;
+  bits = (bits >> 12) | DOUBLE_ONE_BITS;
+  memcpy(&d, &bits, sizeof(d));
+  return d - 1.0;
+}
+
+static inline float
+ottery_bits_to_float_(uint32_t bits)
+{
+  float f;
+  bits = (bits >> 9) | FLOAT_ONE_BITS;
+  memcpy(&f, &bits, sizeof(f));
+  return f - 1.0f;
+}
+
+/** Convert n random 64-bit values, stored in out, into doubles in place. */
+static void
+ottery_convert_double_array_(double *out, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    uint64_t bits;
+    memcpy(&bits, &out[i], sizeof(bits));
+    out[i] = ottery_bits_to_double_(bits);
+  }
+}
+
+/** Convert n random 32-bit values, stored in out, into floats in place. */
+static void
+ottery_convert_float_array_(float *out, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    uint32_t bits;
+    memcpy(&bits, &out[i], sizeof(bits));
+    out[i] = ottery_bits_to_float_(bits);
+  }
+}
+
+double
+ottery_st_rand_double(struct ottery_state *st)
+{
+  uint64_t bits;
+  if (ottery_st_rand_lock_and_check(st))
+    return 0.0;
+  bits = ottery_st_draw_uint64_nolock_(st);
+  UNLOCK(st);
+  return ottery_bits_to_double_(bits);
+}
+
+double
+ottery_st_rand_double_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0;
+  return ottery_bits_to_double_(ottery_st_draw_uint64_nolock_(st));
+}
+
+float
+ottery_st_rand_float(struct ottery_state *st)
+{
+  uint32_t bits;
+  if (ottery_st_rand_lock_and_check(st))
+    return 0.0f;
+  bits = ottery_st_draw_uint32_nolock_(st);
+  UNLOCK(st);
+  return ottery_bits_to_float_(bits);
+}
+
+float
+ottery_st_rand_float_nolock(struct ottery_state_nolock *st)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return 0.0f;
+  return ottery_bits_to_float_(ottery_st_draw_uint32_nolock_(st));
+}
+
+/* For the array functions, we fill the output with keystream exactly as
+ * rand_bytes would, and then convert it in place.  The conversion happens
+ * after we release the lock. */
+void
+ottery_st_rand_double_array(struct ottery_state *st, double *out, size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_rand_bytes_locked(st, out, n * sizeof(double));
+  ottery_convert_double_array_(out, n);
+}
+
+void
+ottery_st_rand_double_array_nolock(struct ottery_state_nolock *st,
+                                   double *out, size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_rand_bytes_impl(st, out, n * sizeof(double));
+  ottery_convert_double_array_(out, n);
+}
+
+void
+ottery_st_rand_float_array(struct ottery_state *st, float *out, size_t n)
+{
+  if (ottery_st_rand_lock_and_check(st))
+    return;
+  ottery_st_rand_bytes_locked(st, out, n * sizeof(float));
+  ottery_convert_float_array_(out, n);
+}
+
+void
+ottery_st_rand_float_array_nolock(struct ottery_state_nolock *st,
+                                  float *out, size_t n)
+{
+  if (ottery_st_rand_check_nolock(st))
+    return;
+  ottery_st_rand_bytes_impl(st, out, n * sizeof(float));
+  ottery_convert_float_array_(out, n);
+}
+
+/* ================================================== */
+/* Lean states. */
+
+/** Every small-output PRF that an ottery_lean_state can fall back to. The
+ * first one is the default. */
+static const struct ottery_prf *const LEAN_PRFS[] = {
+  &ottery_prf_chacha20_merged_lean_,
+  &ottery_prf_chacha12_merged_lean_,
+  &ottery_prf_chacha8_merged_lean_,
+  NULL,
+};
+
+/**
+ * Return the PRF that a lean state should use for cfg: the configured PRF
+ * if it's small enough, or else a small version of the same algorithm.
+ */
+static const struct ottery_prf *
+ottery_lean_get_prf_(const struct ottery_config *cfg)
+{
+  const struct ottery_prf *prf = cfg ? cfg->impl : NULL;
+  int i;
+  if (!prf)
+    return LEAN_PRFS[0];
+  if (prf->state_len <= LEAN_STATE_LEN &&
+      prf->output_len <= LEAN_OUTPUT_LEN &&
+      prf->state_bytes < prf->output_len)
+    return prf;
+  for (i = 0; LEAN_PRFS[i]; ++i) {
+    if (!strcmp(prf->name, LEAN_PRFS[i]->name))
+      return LEAN_PRFS[i];
+  }
+  return NULL;
+}
+
+/**
+ * As ottery_st_nextblock_nolock(), for a lean state.  Since a lean state
+ * rekeys after every block, it always uses the counter value 0.
+ */
+static void
+ottery_lean_nextblock_(struct ottery_lean_state *st)
+{
+  st->prf->generate(st->state, st->buffer, 0);
+  st->prf->setup(st->state, st->buffer);
+  CLEARBUF(st->buffer, st->prf->state_bytes);
+  ottery_wipe_stack_();
+  st->pos = st->prf->state_bytes;
+}
+
+/** As ottery_st_reseed(), for a lean state. */
+static int
+ottery_lean_reseed_(struct ottery_lean_state *st)
+{
+  const struct ottery_prf *prf = st->prf;
+  const struct ottery_entropy_config *ecfg =
+    st->config ? &st->config->entropy_config : NULL;
+  int err;
+  uint32_t flags = 0;
+  size_t buflen = ottery_get_entropy_bufsize_(prf->state_bytes);
+  uint8_t *buf = alloca(buflen);
+  size_t i, used;
+  if (!buf)
+    return OTTERY_ERR_INIT_STRONG_RNG;
+
+  if ((err = ottery_get_entropy_(ecfg, NULL, 0, buf, prf->state_bytes,
+                                 &buflen, &flags)))
+    return err;
+  if (buflen < prf->state_bytes)
+    return OTTERY_ERR_ACCESS_STRONG_RNG;
+  /* The first state_bytes bytes become the initial key.  If there are more
+   * bytes, we mix them in the same way that ottery_st_add_seed() would. */
+  prf->setup(st->state, buf);
+  for (used = prf->state_bytes; used < buflen; ) {
+    size_t m = buflen - used;
+    if (m > prf->state_bytes/2)
+      m = prf->state_bytes/2;
+    prf->generate(st->state, st->buffer, 0);
+    for (i = 0; i < m; ++i)
+      st->buffer[i] ^= buf[used + i];
+    prf->setup(st->state, st->buffer);
+    used += m;
+  }
+  ottery_memclear_(buf, buflen);
+
+  ottery_lean_nextblock_(st);
+  st->pid = getpid();
+#ifndef OTTERY_NO_PID_CHECK
+  st->fork_generation = ATOMIC_LOAD_ACQUIRE(&ottery_fork_generation_);
+#endif
+  return 0;
+}
+
+int
+ottery_lean_init(struct ottery_lean_state *st,
+                 const struct ottery_config *cfg)
+{
+  const struct ottery_prf *prf;
+  int err;
+  if (((uintptr_t)st) & 0xf)
+    return OTTERY_ERR_STATE_ALIGNMENT;
+  if (sizeof(struct ottery_lean_state) > OTTERY_LEAN_STATE_DUMMY_SIZE_)
+    return OTTERY_ERR_INTERNAL;
+  if (!(prf = ottery_lean_get_prf_(cfg)))
+    return OTTERY_ERR_INVALID_ARGUMENT;
+
+  memset(st, 0, sizeof(*st));
+  st->prf = prf;
+  st->config = cfg;
+#ifndef OTTERY_NO_PID_CHECK
+  ottery_fork_detection_init_();
+#endif
+  if ((err = ottery_lean_reseed_(st))) {
+    ottery_memclear_(st, sizeof(*st));
+    return err;
+  }
+  st->magic = MAGIC(st);
+  return 0;
+}
+
+void
+ottery_lean_wipe(struct ottery_lean_state *st)
+{
+  ottery_memclear_(st, sizeof(*st));
+}
+
+/**
+ * Shared prologue for functions generating random bytes from a lean state:
+ * make sure that it is initialized, and reseed it if we've forked.  Return 0
+ * on success, and -1 on failure.
+ */
+static inline int
+ottery_lean_check_(struct ottery_lean_state *st)
+{
+  (void)st;
+#ifndef OTTERY_NO_INIT_CHECK
+  if (UNLIKELY(st->magic != MAGIC(st))) {
+    ottery_fatal_error_(OTTERY_ERR_STATE_INIT);
+    return -1;
+  }
+#endif
+#ifndef OTTERY_NO_PID_CHECK
+  if (UNLIKELY(ottery_forked_since_(st->pid, st->fork_generation))) {
+    int err;
+    if ((err = ottery_lean_reseed_(st))) {
+      ottery_fatal_error_(OTTERY_ERR_FLAG_POSTFORK_RESEED|err);
+      return -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+/** Write n bytes from a lean state that has already been checked. */
+static inline void
+ottery_lean_rand_bytes_impl_(struct ottery_lean_state *st, uint8_t *out,
+                             size_t n)
+{
+  for (;;) {
+    const size_t avail = st->prf->output_len - st->pos;
+    if (n < avail) {
+      memcpy(out, st->buffer + st->pos, n);
+      CLEARBUF(st->buffer + st->pos, n);
+      st->pos += n;
+      return;
+    }
+    memcpy(out, st->buffer + st->pos, avail);
+    out += avail;
+    n -= avail;
+    /* No need to clear the buffer: we're about to overwrite it. */
+    ottery_lean_nextblock_(st);
+  }
+}
+
+void
+ottery_lean_rand_bytes(struct ottery_lean_state *st, void *out, size_t n)
+{
+  if (ottery_lean_check_(st))
+    return;
+  ottery_lean_rand_bytes_impl_(st, out, n);
+}
+
+static inline uint32_t
+ottery_lean_draw_uint32_(struct ottery_lean_state *st)
+{
+  uint32_t r;
+  ottery_lean_rand_bytes_impl_(st, (uint8_t *)&r, sizeof(r));
+  return r;
+}
+
+static inline uint64_t
+ottery_lean_draw_uint64_(struct ottery_lean_state *st)
+{
+  uint64_t r;
+  ottery_lean_rand_bytes_impl_(st, (uint8_t *)&r, sizeof(r));
+  return r;
+}
+
+unsigned
+ottery_lean_rand_unsigned(struct ottery_lean_state *st)
+{
+  unsigned r;
+  if (ottery_lean_check_(st))
+    return 0;
+  ottery_lean_rand_bytes_impl_(st, (uint8_t *)&r, sizeof(r));
+  return r;
+}
+
+uint32_t
+ottery_lean_rand_uint32(struct ottery_lean_state *st)
+{
+  if (ottery_lean_check_(st))
+    return 0;
+  return ottery_lean_draw_uint32_(st);
+}
+
+uint64_t
+ottery_lean_rand_uint64(struct ottery_lean_state *st)
+{
+  if (ottery_lean_check_(st))
+    return 0;
+  return ottery_lean_draw_uint64_(st);
+}
+
+/* These work the same way as ottery_st_range32_nolock_() and
+ * ottery_st_range64_nolock_(). */
+static uint32_t
+ottery_lean_range32_(struct ottery_lean_state *st, uint32_t top)
+{
+  const uint32_t lim = top + 1;
+  uint64_t m;
+  if (lim == 0)
+    return ottery_lean_draw_uint32_(st);
+  m = (uint64_t)ottery_lean_draw_uint32_(st) * lim;
+  if ((uint32_t)m < lim) {
+    const uint32_t threshold = (uint32_t)-lim % lim;
+    while ((uint32_t)m < threshold)
+      m = (uint64_t)ottery_lean_draw_uint32_(st) * lim;
+  }
+  return (uint32_t)(m >> 32);
+}
+
+static uint64_t
+ottery_lean_range64_(struct ottery_lean_state *st, uint64_t top)
+{
+  const uint64_t lim = top + 1;
+  uint64_t hi, lo;
+  if (lim == 0)
+    return ottery_lean_draw_uint64_(st);
+  hi = ottery_mul64_hi_(ottery_lean_draw_uint64_(st), lim, &lo);
+  if (lo < lim) {
+    const uint64_t threshold = (uint64_t)-lim % lim;
+    while (lo < threshold)
+      hi = ottery_mul64_hi_(ottery_lean_draw_uint64_(st), lim, &lo);
+  }
+  return hi;
+}
+
+unsigned
+ottery_lean_rand_range(struct ottery_lean_state *st, unsigned top)
+{
+  if (ottery_lean_check_(st))
+    return 0;
+#if UINT_MAX == UINT32_MAX
+  return (unsigned)ottery_lean_range32_(st, top);
+#else
+  return (unsigned)ottery_lean_range64_(st, top);
+#endif
+}
+
+uint64_t
+ottery_lean_rand_range64(struct ottery_lean_state *st, uint64_t top)
+{
+  if (ottery_lean_check_(st))
+    return 0;
+  return ottery_lean_range64_(st, top);
+}
+
+#ifdef OTTERY_FIXED_PRF
+/* Compile the one PRF we use into this file, so that the compiler can
+ * inline it into the functions above.  This has to come last, since the
+ * PRF code defines lots of short macros. */
+#ifdef OTTERY_FIXED_PRF_SIMD
+#include "chacha_krovetz.c"
+#else
+#include "chacha_merged.c"
+#endif
+#endif
@@ -35,6 +35,18 @@ struct ottery_config;
  * @param n The number of bytes to write.
  */
 void ottery_rand_bytes(void *buf, size_t n);
+
+/**
+ * Fill a large buffer with random bytes, using several threads at once.
+ *
+ * See ottery_st_rand_bytes_parallel() for details.
+ *
+ * @param buf The buffer to fill.
+ * @param n The number of bytes to write.
+ * @param max_threads The most threads to use, counting the calling thread,
+ *   or 0 for one per CPU.
+ */
+void ottery_rand_bytes_parallel(void *buf, size_t n, unsigned max_threads);
 /**
  * Generate a random number of type unsigned.
  *
@@ -56,6 +68,22 @@ uint32_t ottery_rand_uint32(void);
  *   chosen uniformly.
  */
 uint64_t ottery_rand_uint64(void);
+/**
+ * Fill an array with random numbers of type uint32_t.  This is much faster
+ * than calling ottery_rand_uint32() for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_uint32_array(uint32_t *out, size_t n);
+/**
+ * Fill an array with random numbers of type uint64_t.  This is much faster
+ * than calling ottery_rand_uint64() for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_uint64_array(uint64_t *out, size_t n);
 /**
  * Generate a random number of type unsigned in a given range.
  *
@@ -72,6 +100,113 @@ unsigned ottery_rand_range(unsigned top);
  *   chosen uniformly.
  */
 uint64_t ottery_rand_range64(uint64_t top);
+/**
+ * Fill an array with random numbers of type unsigned in a given range.  This
+ * is much faster than calling ottery_rand_range() for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_rand_range_array(unsigned *out, size_t n, unsigned top);
+/**
+ * Fill an array with random numbers of type unsigned, each in its own range.
+ * This is much faster than calling ottery_rand_range() for each element.
+ *
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_rand_range_array_bounds(unsigned *out, const unsigned *tops,
+                                    size_t n);
+/**
+ * Fill an array with random numbers of type uint64_t in a given range.  This
+ * is much faster than calling ottery_rand_range64() for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_rand_range64_array(uint64_t *out, size_t n, uint64_t top);
+/**
+ * Fill an array with random numbers of type uint64_t, each in its own range.
+ * This is much faster than calling ottery_rand_range64() for each element.
+ *
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_rand_range64_array_bounds(uint64_t *out, const uint64_t *tops,
+                                      size_t n);
+/**
+ * Put the nmemb elements of an array into a uniformly random order.  This is
+ * much faster than calling ottery_rand_range64() for each element.
+ *
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_shuffle(void *base, size_t nmemb, size_t size);
+/**
+ * Choose k distinct indices from [0, n), uniformly at random and in a
+ * random order.
+ *
+ * This takes time and temporary memory in proportion to k, not n.
+ *
+ * @param n The number of indices to choose from.
+ * @param k The number of indices to choose.  Must be no more than n.
+ * @param out An array of k elements to hold the indices.
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_sample_indices(size_t n, size_t k, size_t *out);
+/**
+ * Run reservoir sampling over a stream: decide what happens to each of the
+ * next n items after n_seen items have already gone by, when keeping a
+ * reservoir of k items.
+ *
+ * On return, slots[i] is the reservoir slot that item (n_seen + i) should
+ * be stored in, or OTTERY_RESERVOIR_SKIP if the item should be dropped.
+ *
+ * @param n_seen The number of items in the stream before these ones.
+ * @param k The size of the reservoir.
+ * @param slots The array to fill.
+ * @param n The number of items to handle.
+ */
+void ottery_reservoir_slots(uint64_t n_seen, size_t k, size_t *slots,
+                            size_t n);
+/**
+ * Generate a random number of type double, chosen uniformly from
+ * [0.0, 1.0).
+ *
+ * @return A random multiple of 2^-52 no less than 0.0 and less than 1.0.
+ */
+double ottery_rand_double(void);
+/**
+ * Generate a random number of type float, chosen uniformly from [0.0, 1.0).
+ *
+ * @return A random multiple of 2^-23 no less than 0.0 and less than 1.0.
+ */
+float ottery_rand_float(void);
+/**
+ * Fill an array with random numbers of type double, as returned by
+ * ottery_rand_double().  This is much faster than calling
+ * ottery_rand_double() for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_double_array(double *out, size_t n);
+/**
+ * Fill an array with random numbers of type float, as returned by
+ * ottery_rand_float().  This is much faster than calling ottery_rand_float()
+ * for each element.
+ *
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_rand_float_array(float *out, size_t n);
 
 /**
  * Initialize the libottery global state.
@@ -129,13 +264,58 @@ void ottery_wipe(void);
  *
  * You should not usually need to call this function: Libottery provides
  * backtracking resistance by default, so unless you have manually recompiled
- * with the OTTERY_NO_CLEAR_AFTER_YIELD option, this function isn't
- * necessary and has no effect.  Even *with* OTTERY_NO_CLEAR_AFTER_YIELD,
- * this function isn't necessary in ordinary operation: the libottery state is
- * implicitly "stirred" every 1k or so.
+ * with the OTTERY_NO_CLEAR_AFTER_YIELD option, or picked a different mode
+ * with ottery_config_set_clear_mode(), this function isn't necessary and has
+ * no effect.  Even then, this function isn't necessary in ordinary
+ * operation: the libottery state is implicitly "stirred" every 1k or so.
  */
 void ottery_prevent_backtracking(void);
 
+/**
+ * Precompute the next block of output for the global state, so that the next
+ * call that runs out of buffered output doesn't have to wait for the PRF.
+ *
+ * Whenever a state runs out of buffered output, it generates a new block and
+ * immediately rekeys itself from the start of that block.  Usually, that
+ * happens inside whichever call to ottery_rand_*() needed the bytes.  Once
+ * this function has been called, that call just copies the precomputed block
+ * and key into place instead.
+ *
+ * The precomputed block is derived from the current key, so keeping it
+ * around doesn't give an attacker who compromises the state anything that
+ * they couldn't compute from the state anyway: bytes that have already been
+ * returned remain unrecoverable.  If the state is reseeded or stirred before
+ * the block is used, the block is discarded and wiped.  ottery_wipe() wipes
+ * it too.
+ *
+ * You might call this from a helper thread, or whenever your program is
+ * idle.  The first call allocates room for a whole output buffer (up to 1k
+ * per block set with ottery_config_set_buffer_blocks()) plus about half a
+ * kilobyte of saved PRF state; all of it is released by ottery_wipe().
+ *
+ * With OTTERY_GLOBAL_MODE_PER_THREAD or OTTERY_GLOBAL_MODE_SHARDED, this
+ * refills the state that the calling thread would use right now.
+ *
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_refill(void);
+
+/**
+ * Get the performance counters for the global state.
+ *
+ * This only works if libottery was built with --enable-stats.
+ *
+ * With OTTERY_GLOBAL_MODE_SHARDED, this adds up the counters for all the
+ * shards.  With OTTERY_GLOBAL_MODE_PER_THREAD, it reports on the calling
+ * thread's state only.
+ *
+ * @param stats_out A structure to fill with the counters. If we don't keep
+ *   counters, we fill it with zeros.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if libottery was
+ *   built without --enable-stats.
+ */
+int ottery_get_stats(struct ottery_stats *stats_out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,255 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+#ifndef OTTERY_HPP_HEADER_INCLUDED_
+#define OTTERY_HPP_HEADER_INCLUDED_
+
+/**
+ * @file ottery.hpp
+ *
+ * A C++ random number engine built on an ottery_state_nolock, for use with
+ * the distributions in <random>, std::shuffle, and friends.  Needs C++11;
+ * the std::span overloads need C++20.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define OTTERY_HPP_HAVE_SPAN_ 1
+#endif
+#endif
+
+#include "ottery_nolock.h"
+
+namespace ottery {
+
+/**
+ * Thrown when we can't set up an engine.  code() returns the OTTERY_ERR_*
+ * value that libottery gave us.
+ */
+class error : public std::runtime_error {
+ public:
+  explicit error(int code)
+    : std::runtime_error("libottery error " + std::to_string(code)),
+      code_(code) {}
+  /** Return the OTTERY_ERR_* value for this error. */
+  int code() const noexcept { return code_; }
+ private:
+  int code_;
+};
+
+/**
+ * A cryptographically strong random number engine that meets the
+ * UniformRandomBitGenerator requirements, so that you can hand it to
+ * std::uniform_int_distribution, std::shuffle, and so on.
+ *
+ * Each engine owns an ottery_state_nolock of its own, allocated with
+ * ottery_st_new_nolock() and seeded from the operating system, and wiped
+ * when the engine is destroyed.  operator() draws through a fast view of
+ * that state (see ottery_st_fast_view_init_nolock()), so most calls are
+ * inline and never enter the library.
+ *
+ * Like the state, an engine is not thread safe: give each thread its own.
+ * Engines can be moved but not copied, since a copy would repeat the
+ * original's output.  A moved-from engine may only be destroyed or
+ * assigned to.
+ */
+class engine {
+ public:
+  /** Every call to operator() returns a uniformly chosen result_type. */
+  typedef uint64_t result_type;
+
+  /** Smallest value that operator() returns. */
+  static constexpr result_type min() { return 0; }
+  /** Largest value that operator() returns. */
+  static constexpr result_type max() { return UINT64_MAX; }
+
+  /**
+   * Set up a new engine with the default configuration.  Throws
+   * ottery::error on failure.
+   */
+  engine() : engine(nullptr) {}
+
+  /**
+   * Set up a new engine.  Throws ottery::error on failure.
+   *
+   * @param cfg Either NULL, or an ottery_config structure that has been
+   *   initialized with ottery_config_init().
+   */
+  explicit engine(const struct ottery_config *cfg) : st_(nullptr) {
+    int err = ottery_st_new_nolock(&st_, cfg);
+    if (!err && (err = ottery_st_fast_view_init_nolock(&view_, st_))) {
+      ottery_st_free_nolock(st_);
+      st_ = nullptr;
+    }
+    if (err)
+      fail_(err);
+  }
+
+  engine(const engine &) = delete;
+  engine &operator=(const engine &) = delete;
+
+  engine(engine &&other) noexcept : st_(other.st_), view_(other.view_) {
+    other.release_();
+  }
+
+  engine &operator=(engine &&other) noexcept {
+    if (this != &other) {
+      reset_();
+      st_ = other.st_;
+      view_ = other.view_;
+      other.release_();
+    }
+    return *this;
+  }
+
+  ~engine() { reset_(); }
+
+  /** Return a random number between min() and max() included, chosen
+   * uniformly. */
+  result_type operator()() {
+    return ottery_fast_rand_uint64_nolock(&view_);
+  }
+
+  /** Return a random 32-bit number, chosen uniformly. */
+  uint32_t next_uint32() {
+    return ottery_fast_rand_uint32_nolock(&view_);
+  }
+
+  /**
+   * Fill n objects at out with random bits.  T must be an integer type or
+   * a byte type; arrays of uint32_t and uint64_t (or their signed
+   * counterparts) go through ottery_st_rand_uint32_array_nolock() and
+   * ottery_st_rand_uint64_array_nolock().  T can't be bool: most random
+   * bytes aren't valid bool values.
+   *
+   * These bytes come straight from the state, not from the fast view, so
+   * they don't disturb what operator() returns next.
+   */
+  template <class T>
+  void fill(T *out, std::size_t n) {
+    static_assert((std::is_integral<T>::value &&
+                   !std::is_same<typename std::remove_cv<T>::type,
+                                 bool>::value) ||
+                  is_byte_<T>::value,
+                  "ottery::engine::fill needs non-bool integers or bytes");
+    fill_(out, n, fill_tag_<T>());
+  }
+
+#ifdef OTTERY_HPP_HAVE_SPAN_
+  /** As fill(out.data(), out.size()). */
+  template <class T, std::size_t Extent>
+  void fill(std::span<T, Extent> out) {
+    fill(out.data(), out.size());
+  }
+#endif
+
+  /** Fill n bytes at out with random bytes. */
+  void bytes(void *out, std::size_t n) {
+    ottery_st_rand_bytes_nolock(st_, out, n);
+  }
+
+  /**
+   * Return the state that this engine owns, for use with the rest of the
+   * ottery_st_*_nolock() functions.  It stays ours: don't wipe or free it.
+   */
+  struct ottery_state_nolock *state() noexcept { return st_; }
+
+ private:
+  /** The state we own, or NULL if we've been moved from. */
+  struct ottery_state_nolock *st_;
+  /** A fast view of st_, for operator() and next_uint32(). */
+  struct ottery_fast_view_nolock view_;
+
+  /** Tags telling fill() which library function to use for T. */
+  struct fill_bytes_tag_ {};
+  struct fill_u32_tag_ {};
+  struct fill_u64_tag_ {};
+
+  template <class T, bool = std::is_integral<T>::value &&
+                            !std::is_same<T, bool>::value>
+  struct unsigned_of_ { typedef T type; };
+  template <class T>
+  struct unsigned_of_<T, true> {
+    typedef typename std::make_unsigned<T>::type type;
+  };
+
+  template <class T>
+  struct is_byte_ {
+    static const bool value =
+#if __cplusplus >= 201703L
+      std::is_same<typename std::remove_cv<T>::type, std::byte>::value;
+#else
+      false;
+#endif
+  };
+
+  template <class T>
+  using fill_tag_ = typename std::conditional<
+    std::is_same<typename unsigned_of_<T>::type, uint32_t>::value,
+    fill_u32_tag_,
+    typename std::conditional<
+      std::is_same<typename unsigned_of_<T>::type, uint64_t>::value,
+      fill_u64_tag_, fill_bytes_tag_>::type>::type;
+
+  template <class T>
+  void fill_(T *out, std::size_t n, fill_bytes_tag_) {
+    ottery_st_rand_bytes_nolock(st_, out, n * sizeof(T));
+  }
+  template <class T>
+  void fill_(T *out, std::size_t n, fill_u32_tag_) {
+    ottery_st_rand_uint32_array_nolock(st_, reinterpret_cast<uint32_t *>(out),
+                                       n);
+  }
+  template <class T>
+  void fill_(T *out, std::size_t n, fill_u64_tag_) {
+    ottery_st_rand_uint64_array_nolock(st_, reinterpret_cast<uint64_t *>(out),
+                                       n);
+  }
+
+  /** Forget our state without freeing it, after moving it elsewhere.  The
+   * view's bytes have been copied too, so wipe ours. */
+  void release_() noexcept {
+    st_ = nullptr;
+    ottery_fast_view_wipe_nolock(&view_);
+  }
+
+  /** Wipe and release our state and view, if we have them. */
+  void reset_() noexcept {
+    if (st_) {
+      ottery_fast_view_wipe_nolock(&view_);
+      ottery_st_free_nolock(st_);
+      st_ = nullptr;
+    }
+  }
+
+  /** Report a failure to construct an engine. */
+  [[noreturn]] static void fail_(int err) {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+    throw error(err);
+#else
+    (void)err;
+    std::abort();
+#endif
+  }
+};
+
+}
+
+#endif
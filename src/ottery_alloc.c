@@ -0,0 +1,287 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+/**
+ * @file ottery_alloc.c
+ *
+ * Functions to allocate ottery_state structures on cache lines of their
+ * own, optionally in memory that is locked and left out of core dumps.
+ */
+#define OTTERY_INTERNAL
+#include "ottery-internal.h"
+#include "ottery.h"
+#include "ottery_st.h"
+#include "ottery_nolock.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+/* We get pages with VirtualAlloc, and lock them with VirtualLock. */
+#define OTTERY_PAGES_WIN32
+#elif defined(HAVE_SYS_MMAN_H) && (defined(MAP_ANON) || defined(MAP_ANONYMOUS))
+/* We get pages with mmap, and lock them with mlock. */
+#define OTTERY_PAGES_MMAP
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#endif
+
+#if defined(OTTERY_PAGES_MMAP) && defined(MADV_DONTDUMP)
+/** Advice that tells the kernel to leave pages out of core dumps. */
+#define DONTDUMP_ADVICE MADV_DONTDUMP
+#elif defined(OTTERY_PAGES_MMAP) && defined(MADV_NOCORE)
+#define DONTDUMP_ADVICE MADV_NOCORE
+#endif
+
+/**
+ * Bookkeeping for a block of states allocated by ottery_st_new_array(). It
+ * sits in the first cache line of the block, just before the first state.
+ */
+struct ottery_st_allocation {
+  /** Total number of bytes in the block, including this header. */
+  size_t len;
+  /** Number of states in the block. */
+  size_t n_states;
+  /** The pointer we got from malloc, or NULL if we got whole pages from the
+   * operating system. */
+  void *malloc_ptr;
+  /** True iff we locked the block into memory. */
+  int locked;
+  /** True iff the states in the block are ottery_state_nolock states. */
+  int nolock;
+};
+
+/** Bytes that we reserve for the header at the start of a block. */
+#define HEADER_LEN OTTERY_CACHE_LINE_LEN
+/** Distance between consecutive states in a block: a whole number of cache
+ * lines. */
+#define STATE_STRIDE                                                    \
+  ((sizeof(struct ottery_state) + OTTERY_CACHE_LINE_LEN - 1) &          \
+   ~(size_t)(OTTERY_CACHE_LINE_LEN - 1))
+
+/** Return the idx'th state in the block with header h. */
+#define ALLOCATION_STATE(h, idx)                                        \
+  ((struct ottery_state *)(((uint8_t *)(h)) + HEADER_LEN + (idx) * STATE_STRIDE))
+/** Return the header of the block whose first state is st. */
+#define STATE_ALLOCATION(st)                                            \
+  ((struct ottery_st_allocation *)(((uint8_t *)(st)) - HEADER_LEN))
+
+int
+ottery_config_set_alloc_flags(struct ottery_config *cfg, unsigned flags)
+{
+  unsigned supported = 0;
+#if defined(OTTERY_PAGES_MMAP) || defined(OTTERY_PAGES_WIN32)
+  supported |= OTTERY_ALLOC_MLOCK;
+#endif
+#ifdef DONTDUMP_ADVICE
+  supported |= OTTERY_ALLOC_DONTDUMP;
+#endif
+  if (flags & ~supported)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  cfg->alloc_flags = flags;
+  return 0;
+}
+
+/**
+ * Release a block of states, after they have all been wiped.
+ */
+static void
+ottery_st_allocation_free_(struct ottery_st_allocation *h)
+{
+  const size_t len = h->len;
+  void *malloc_ptr = h->malloc_ptr;
+#ifdef OTTERY_PAGES_MMAP
+  const int locked = h->locked;
+#endif
+
+  ottery_memclear_(h, HEADER_LEN);
+  if (malloc_ptr) {
+    free(malloc_ptr);
+    return;
+  }
+#if defined(OTTERY_PAGES_WIN32)
+  /* VirtualFree unlocks the pages too. */
+  VirtualFree(h, 0, MEM_RELEASE);
+  (void) len;
+#elif defined(OTTERY_PAGES_MMAP)
+  if (locked)
+    munlock(h, len);
+  munmap(h, len);
+#else
+  (void) len;
+#endif
+}
+
+/**
+ * Get a zeroed, cache-line-aligned block of len bytes for some states, and
+ * fill in its header.  Lock it and keep it out of core dumps as flags (a
+ * bitwise OR of OTTERY_ALLOC_* values) say.
+ *
+ * @return The header of the new block, or NULL on failure, in which case we
+ *   set *err_out to an OTTERY_ERR_* code.
+ */
+static struct ottery_st_allocation *
+ottery_st_allocation_new_(size_t len, unsigned flags, int *err_out)
+{
+  struct ottery_st_allocation *h = NULL;
+  void *malloc_ptr = NULL;
+
+  *err_out = OTTERY_ERR_INTERNAL;
+
+#if defined(OTTERY_PAGES_WIN32)
+  h = VirtualAlloc(NULL, len, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+#elif defined(OTTERY_PAGES_MMAP)
+  h = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if (h == MAP_FAILED)
+    h = NULL;
+#endif
+  if (!h) {
+    /* We can only lock or advise whole pages. */
+    size_t misalign;
+    if (flags)
+      return NULL;
+    if (!(malloc_ptr = malloc(len + OTTERY_CACHE_LINE_LEN)))
+      return NULL;
+    misalign = ((uintptr_t)malloc_ptr) & (OTTERY_CACHE_LINE_LEN - 1);
+    h = (void *)(((uint8_t *)malloc_ptr) +
+                 ((OTTERY_CACHE_LINE_LEN - misalign) &
+                  (OTTERY_CACHE_LINE_LEN - 1)));
+    memset(h, 0, len);
+  }
+  h->len = len;
+  h->malloc_ptr = malloc_ptr;
+
+#ifdef DONTDUMP_ADVICE
+  if ((flags & OTTERY_ALLOC_DONTDUMP) && madvise(h, len, DONTDUMP_ADVICE)) {
+    ottery_st_allocation_free_(h);
+    return NULL;
+  }
+#endif
+  if (flags & OTTERY_ALLOC_MLOCK) {
+#if defined(OTTERY_PAGES_WIN32)
+    h->locked = (VirtualLock(h, len) != 0);
+#elif defined(OTTERY_PAGES_MMAP)
+    h->locked = (mlock(h, len) == 0);
+#endif
+    if (!h->locked) {
+      ottery_st_allocation_free_(h);
+      *err_out = OTTERY_ERR_MLOCK;
+      return NULL;
+    }
+  }
+  return h;
+}
+
+/** Wipe st, which is a state in a block with header h. */
+static void
+ottery_st_allocation_wipe_state_(const struct ottery_st_allocation *h,
+                                 struct ottery_state *st)
+{
+  if (h->nolock)
+    ottery_st_wipe_nolock(st);
+  else
+    ottery_st_wipe(st);
+}
+
+/**
+ * Implementation for ottery_st_new_array() and ottery_st_new_nolock():
+ * allocate n states in one block, and initialize them with or without
+ * locks as nolock says.
+ */
+static int
+ottery_st_new_array_impl_(struct ottery_state **states_out, size_t n,
+                          const struct ottery_config *cfg, int nolock)
+{
+  struct ottery_st_allocation *h;
+  const unsigned flags = cfg ? cfg->alloc_flags : 0;
+  size_t i;
+  int err;
+
+  if (!states_out || n < 1 || n > (SIZE_MAX - HEADER_LEN) / STATE_STRIDE)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (!(h = ottery_st_allocation_new_(HEADER_LEN + n * STATE_STRIDE, flags,
+                                      &err)))
+    return err;
+  h->nolock = nolock;
+
+  for (i = 0; i < n; ++i) {
+    struct ottery_state *st = ALLOCATION_STATE(h, i);
+    err = nolock ? ottery_st_init_nolock(st, cfg) : ottery_st_init(st, cfg);
+    if (err) {
+      while (i--)
+        ottery_st_allocation_wipe_state_(h, ALLOCATION_STATE(h, i));
+      ottery_st_allocation_free_(h);
+      return err;
+    }
+  }
+  h->n_states = n;
+  for (i = 0; i < n; ++i)
+    states_out[i] = ALLOCATION_STATE(h, i);
+  return 0;
+}
+
+int
+ottery_st_new_array(struct ottery_state **states_out, size_t n,
+                    const struct ottery_config *cfg)
+{
+  return ottery_st_new_array_impl_(states_out, n, cfg, 0);
+}
+
+int
+ottery_st_new(struct ottery_state **st_out, const struct ottery_config *cfg)
+{
+  return ottery_st_new_array(st_out, 1, cfg);
+}
+
+int
+ottery_st_new_nolock(struct ottery_state_nolock **st_out,
+                     const struct ottery_config *cfg)
+{
+  return ottery_st_new_array_impl_(st_out, 1, cfg, 1);
+}
+
+void
+ottery_st_free_array(struct ottery_state **states, size_t n)
+{
+  struct ottery_st_allocation *h;
+  size_t i;
+
+  if (!states || !n || !states[0])
+    return;
+  h = STATE_ALLOCATION(states[0]);
+  for (i = 0; i < h->n_states; ++i)
+    ottery_st_allocation_wipe_state_(h, ALLOCATION_STATE(h, i));
+  ottery_st_allocation_free_(h);
+  for (i = 0; i < n; ++i)
+    states[i] = NULL;
+}
+
+void
+ottery_st_free(struct ottery_state *st)
+{
+  ottery_st_free_array(&st, 1);
+}
+
+void
+ottery_st_free_nolock(struct ottery_state_nolock *st)
+{
+  ottery_st_free_array(&st, 1);
+}
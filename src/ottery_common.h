@@ -47,6 +47,11 @@ struct ottery_config;
 #define OTTERY_ERR_INVALID_ARGUMENT      0x0005
 /** An ottery_state structure was not aligned to a 16-byte boundary. */
 #define OTTERY_ERR_STATE_ALIGNMENT       0x0006
+/** We couldn't lock a newly allocated state into memory, as
+ * OTTERY_ALLOC_MLOCK asked. */
+#define OTTERY_ERR_MLOCK                 0x0007
+/** We couldn't write to a file descriptor; errno says why. */
+#define OTTERY_ERR_WRITE                 0x0008
 
 /** FATAL ERROR: An ottery_st function other than ottery_st_init() was
  * called on and uninitialized state. */
@@ -143,6 +148,31 @@ int ottery_config_init(struct ottery_config *cfg);
 int ottery_config_force_implementation(struct ottery_config *cfg,
                                        const char *impl);
 
+/**
+ * Pick the fastest pseudorandom function for this CPU by trying each one
+ * that we could use.
+ *
+ * By default, libottery picks an implementation based on which instructions
+ * the CPU supports, and on a fixed idea of which implementations are
+ * faster.  That idea is sometimes wrong: the best choice can depend on the
+ * particular CPU model.  This function instead spends a little time
+ * measuring every implementation that's eligible to run.  It remembers the
+ * answer, so only the first call for each value of impl is slow.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and before passing that structure to
+ * ottery_st_init() or ottery_init().  It is not threadsafe.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param impl The name of a pseudorandom function, as for
+ *    ottery_config_force_implementation().  We only consider
+ *    implementations that match it.  If it is NULL, we use
+ *    OTTERY_PRF_CHACHA20.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on
+ *    failure.
+ */
+int ottery_config_autotune(struct ottery_config *cfg, const char *impl);
+
 /**
  * Set a device file to use as a source of strong entropy.
  *
@@ -196,6 +226,12 @@ struct sockaddr;
  * ottery_config_init(), and before passing that structure to
  * ottery_st_init() or ottery_init().
  *
+ * Each state keeps its connection to the daemon open between reseeds, and
+ * reconnects if the daemon closes it.  We ask for all the bytes of a seed
+ * at once, in as many 255-byte requests as it takes, so a reseed usually
+ * costs one round trip.  If the daemon gives us fewer bytes than we asked
+ * for, we keep them and ask for the rest.
+ *
  * TODO: This is not implemented for Windows yet.
  *
  * @param cfg The configuration structure to configure.
@@ -218,13 +254,19 @@ void ottery_config_set_egd_socket(struct ottery_config *cfg,
  * @{ */
 /** A unix-style /dev/urandom device. */
 #define OTTERY_ENTROPY_SRC_RANDOMDEV      0x0010000
-/** The Windows CryptGenRandom call. */
+/** The Windows system RNG: BCryptGenRandom, or CryptGenRandom where that
+ * isn't available. */
 #define OTTERY_ENTROPY_SRC_CRYPTGENRANDOM 0x0020000
 /** The Intel RDRAND instruction. */
 #define OTTERY_ENTROPY_SRC_RDRAND         0x0040000
 /** Some local server obeying the EGD protocol.  Has no effect unless
  * ottery_config_set_egd_socket was called. */
 #define OTTERY_ENTROPY_SRC_EGD            0x0080000
+/** The getrandom() or getentropy() call, or arc4random_buf() where neither
+ * of those exists.  Not used if a urandom device or fd was configured
+ * with ottery_config_set_urandom_device() or ottery_config_set_urandom_fd().
+ */
+#define OTTERY_ENTROPY_SRC_GETRANDOM      0x0100000
 /** @} */
 
 /**
@@ -268,6 +310,337 @@ void ottery_config_disable_entropy_sources(struct ottery_config *cfg,
 void ottery_config_mark_entropy_sources_weak(struct ottery_config *cfg,
                                              uint32_t weak_source);
 
+/**
+ * @name Ways to manage the libottery global state.
+ *
+ * These can be passed to ottery_config_set_global_mode.
+ *
+ * @{ */
+/** Use a single global state, protected by a lock. This is the default. */
+#define OTTERY_GLOBAL_MODE_SHARED      0
+/** Give every thread its own lazily-initialized state, so that the
+ * ottery_rand_* functions never need to take a lock. */
+#define OTTERY_GLOBAL_MODE_PER_THREAD  1
+/** Keep one locked state for each CPU, and have each thread use the state
+ * for the CPU it is running on. */
+#define OTTERY_GLOBAL_MODE_SHARDED     2
+/** @} */
+
+/**
+ * Choose how the implicit global state behind the ottery_rand_* functions
+ * is managed.
+ *
+ * This setting only has an effect on an ottery_config that is passed to
+ * ottery_init(); ottery_st_init() ignores it.
+ *
+ * With OTTERY_GLOBAL_MODE_PER_THREAD, each thread that calls an ottery_rand_*
+ * function gets its own non-locking PRNG state, seeded separately from the
+ * operating system the first time that thread needs it, and wiped when the
+ * thread exits.  This costs a little over a kilobyte of memory for each such
+ * thread, but removes all lock contention from the global API.
+ *
+ * With OTTERY_GLOBAL_MODE_SHARDED, ottery_init() sets up one locked PRNG
+ * state for each CPU that the system has, each seeded separately from the
+ * operating system.  Each call to an ottery_rand_* function uses the state
+ * for the CPU that the calling thread is running on, or a neighboring one if
+ * that state is busy.  This keeps different cores from fighting over the
+ * same cache lines, costs a fixed amount of memory however many threads you
+ * have, and works with any number of short-lived threads.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and pass that structure to ottery_init(). The
+ * structure is copied, but any pointers it contains (as from
+ * ottery_config_set_urandom_device() or ottery_config_set_egd_socket()) must
+ * remain valid for as long as any thread might need to set up its state.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param mode One of the OTTERY_GLOBAL_MODE_* values.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if the mode is
+ *    unrecognized or not supported on this platform.
+ */
+int ottery_config_set_global_mode(struct ottery_config *cfg, int mode);
+
+/**
+ * @name Ways to erase output that has already been returned.
+ *
+ * These can be passed to ottery_config_set_clear_mode.
+ *
+ * @{ */
+/** Erase every byte from the state's buffer as soon as we return it.  This
+ * is the default. */
+#define OTTERY_CLEAR_MODE_EACH_YIELD   0
+/** Erase returned bytes from the state's buffer in 64-byte chunks, once the
+ * whole chunk has been used. */
+#define OTTERY_CLEAR_MODE_BY_LINE      1
+/** Never erase returned bytes from the state's buffer. Not recommended. */
+#define OTTERY_CLEAR_MODE_NONE         2
+/** @} */
+
+/**
+ * Choose how a state erases random bytes from its buffer after it has
+ * returned them.
+ *
+ * Erasing the bytes is what gives you backtracking resistance: once they're
+ * gone, an attacker who later gets a copy of the state can't learn what
+ * they were.  By default (OTTERY_CLEAR_MODE_EACH_YIELD), every call erases
+ * the bytes it returns, which can be a noticeable fraction of the work for
+ * very small requests.
+ *
+ * With OTTERY_CLEAR_MODE_BY_LINE, we only erase once a whole 64-byte chunk
+ * of the buffer has been used, and we erase the whole chunk at once.  So at
+ * most 63 bytes of old output are still in memory at any time; you can
+ * erase those too by calling ottery_st_prevent_backtracking().
+ *
+ * With OTTERY_CLEAR_MODE_NONE, returned bytes stay in the buffer until it is
+ * refilled, as if libottery were built with --disable-clear-after-yield.
+ * (If it <em>was</em> built that way, every mode acts like this one.)
+ *
+ * This setting has no effect on ottery_lean_state, which always uses
+ * OTTERY_CLEAR_MODE_EACH_YIELD.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and pass that structure to ottery_st_init() or
+ * ottery_init().
+ *
+ * @param cfg The configuration structure to configure.
+ * @param mode One of the OTTERY_CLEAR_MODE_* values.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if the mode is
+ *    unrecognized.
+ */
+int ottery_config_set_clear_mode(struct ottery_config *cfg, int mode);
+
+/**
+ * Make each state mix fresh entropy from the CPU (RDSEED, or RDRAND if we
+ * don't have RDSEED) into its key from time to time.
+ *
+ * Normally a state only gets entropy from the operating system when it is
+ * first seeded, after a fork, and when you call ottery_st_add_seed() with
+ * a NULL seed.  If an attacker learns the state, they can predict its
+ * output until then.  With this option, we also mix 16 bytes of CPU
+ * entropy into the next key whenever we rekey after generating at least
+ * every_n_blocks blocks, or at least every_msec milliseconds after the
+ * last mix.
+ *
+ * We fetch CPU entropy 256 bytes at a time, enough for 16 mixes.
+ * ottery_st_refill() fetches the next batch without holding the state's
+ * lock.  Otherwise, we fetch it while rekeying.  Each mix costs a 16-byte
+ * XOR on top of the usual rekey, and bypasses any block that
+ * ottery_st_refill() computed ahead of time.  Each batch costs 32 RDSEED
+ * or RDRAND instructions, typically a few microseconds.  With
+ * every_msec, each rekey also reads the clock.  If the CPU ever runs out
+ * of entropy, we skip that mix and try again at the next rekey.
+ *
+ * This is opportunistic: it is not a substitute for reseeding from the
+ * operating system.  It doesn't apply to ottery_lean_state, or to CPUs
+ * without RDRAND.  It doesn't apply if ottery_config_disable_entropy_sources()
+ * disables OTTERY_ENTROPY_SRC_RDRAND either.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param every_n_blocks Mix after this many blocks, or 0 to never mix
+ *    because of how many blocks we've made.
+ * @param every_msec Mix after this many milliseconds, or 0 to never mix
+ *    because of how much time has passed.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if this CPU has
+ *    no fast entropy source, in which case we leave cfg unchanged.
+ */
+int ottery_config_set_prediction_resistance(struct ottery_config *cfg,
+                                            unsigned every_n_blocks,
+                                            unsigned every_msec);
+
+/**
+ * Turn fast start on or off.
+ *
+ * Normally, whenever a state seeds itself from the operating system (when
+ * it is initialized, and after a fork), it asks every enabled entropy
+ * source before it returns a single byte.  With an EGD server configured,
+ * that can take milliseconds, and the global API pays for it on the first
+ * call that needs a state.
+ *
+ * With fast start, we seed from the first strong source that works
+ * (ordinarily the operating system's RNG) and start serving output at once.
+ * We mix in the other sources later: on the next call to ottery_st_refill(),
+ * or on the first call after the state has used up its first buffer of
+ * output, whichever comes first.  ottery_st_add_seed() with a NULL seed
+ * asks every source anyway, so it mixes them in too.  If a deferred source
+ * fails, we don't try it again until the next time we seed from the
+ * operating system: the state is already strongly seeded.
+ *
+ * Fast start doesn't apply to ottery_lean_state.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param enable True to turn fast start on; false (the default) to turn it
+ *   off.
+ */
+void ottery_config_set_fast_start(struct ottery_config *cfg, int enable);
+
+/**
+ * @name Ways to wipe the stack after running the PRF.
+ *
+ * These can be passed to ottery_config_set_wipe_stack_mode.
+ *
+ * @{ */
+/** Wipe the stack once at the end of each call that runs the PRF.  This is
+ * the default. */
+#define OTTERY_WIPE_STACK_EACH_CALL    0
+/** Wipe the stack after every block of PRF output. */
+#define OTTERY_WIPE_STACK_EACH_BLOCK   1
+/** Never wipe the stack. */
+#define OTTERY_WIPE_STACK_NONE         2
+/** @} */
+
+/**
+ * Choose how often a state scrubs the stack after running the PRF.
+ *
+ * The PRF implementations may leave copies of key material in stack memory
+ * that they have since released.  A correct program will never look at that
+ * memory, but a program that leaks uninitialized stack might.  So after we
+ * generate PRF output, we overwrite a fixed-size region of the stack with
+ * zeros.
+ *
+ * By default (OTTERY_WIPE_STACK_EACH_CALL), we do this once before returning
+ * from each call that ran the PRF.  Blocks generated within one call all
+ * reuse the same stack, so each one overwrites what the last one left.
+ * With OTTERY_WIPE_STACK_EACH_BLOCK, we wipe after every single block, as
+ * older versions of libottery did; this makes large requests slower.  With
+ * OTTERY_WIPE_STACK_NONE, we never wipe, as if libottery were built with
+ * OTTERY_NO_WIPE_STACK.  (If it <em>was</em> built that way, every mode acts
+ * like this one.)
+ *
+ * This setting has no effect on ottery_lean_state.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and pass that structure to ottery_st_init() or
+ * ottery_init().
+ *
+ * @param cfg The configuration structure to configure.
+ * @param mode One of the OTTERY_WIPE_STACK_* values.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if the mode is
+ *    unrecognized.
+ */
+int ottery_config_set_wipe_stack_mode(struct ottery_config *cfg, int mode);
+
+/**
+ * @name Flags for allocating states.
+ *
+ * These can be passed to ottery_config_set_alloc_flags.
+ *
+ * @{ */
+/** Lock the memory for the states into RAM, so it never goes to swap. */
+#define OTTERY_ALLOC_MLOCK     0x01
+/** Leave the memory for the states out of core dumps. */
+#define OTTERY_ALLOC_DONTDUMP  0x02
+/** @} */
+
+/**
+ * Choose how ottery_st_new() and ottery_st_new_array() get the memory for
+ * the states that they make.
+ *
+ * With OTTERY_ALLOC_MLOCK, we lock the states into RAM, and fail with
+ * OTTERY_ERR_MLOCK if the operating system won't let us.  With
+ * OTTERY_ALLOC_DONTDUMP, we ask the operating system to leave them out of
+ * core dumps.  Either way, we give them pages of their own, shared only
+ * with other states from the same call.  Only the states themselves are
+ * covered: if you also use ottery_config_set_buffer_blocks() or
+ * ottery_st_refill(), the extra buffers they need come from malloc().
+ *
+ * These flags don't affect ottery_st_init(), which uses whatever memory
+ * you give it, or the global state.
+ *
+ * @param cfg The configuration structure to configure.
+ * @param flags A bitwise OR of OTTERY_ALLOC_* values, or 0 for none of them.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if a flag is
+ *    unrecognized or not supported on this platform.
+ */
+int ottery_config_set_alloc_flags(struct ottery_config *cfg, unsigned flags);
+
+/** Largest number of entropy sources that struct ottery_stats describes
+ * separately. */
+#define OTTERY_STATS_MAX_SOURCES 8
+
+/**
+ * Performance counters for a libottery state, as returned by
+ * ottery_st_get_stats() and ottery_get_stats().
+ *
+ * libottery only keeps these counters if it was built with --enable-stats;
+ * see OTTERY_BLDFLG_STATS.  All of them start at zero when the state is
+ * initialized.
+ */
+struct ottery_stats {
+  /** Number of random bytes that we have returned, or used up internally
+   * for things like ottery_st_rand_range(). */
+  uint64_t bytes_out;
+  /** Number of blocks of output that we have taken from the PRF. */
+  uint64_t prf_blocks;
+  /** Number of times that we have refilled the buffer and rekeyed the PRF
+   * from its own output. */
+  uint64_t rekeys;
+  /** Number of times that we have seeded the state from the operating
+   * system, including the first time and the times after a fork. */
+  uint64_t reseeds;
+  /** Number of those reseeds that happened because we noticed a fork. */
+  uint64_t postfork_reseeds;
+  /** Number of calls to ottery_st_add_seed() or ottery_add_seed(). */
+  uint64_t add_seed_calls;
+  /** Number of times that we have acquired the state's lock. */
+  uint64_t lock_acquisitions;
+  /** Number of those times that the lock was busy, so that we had to
+   * wait. */
+  uint64_t lock_contended;
+  /** Number of times that we have mixed fast CPU entropy into the key; see
+   * ottery_config_set_prediction_resistance(). */
+  uint64_t pr_mixes;
+  /** Number of entropy sources that this build knows about. */
+  unsigned n_entropy_sources;
+  /** For each entropy source, its OTTERY_ENTROPY_SRC_* value. */
+  uint32_t entropy_source[OTTERY_STATS_MAX_SOURCES];
+  /** For each entropy source, how many times we have called it. */
+  uint64_t entropy_calls[OTTERY_STATS_MAX_SOURCES];
+  /** For each entropy source, how many of those calls failed. */
+  uint64_t entropy_failures[OTTERY_STATS_MAX_SOURCES];
+  /** For each entropy source, the total time those calls took, in
+   * nanoseconds. */
+  uint64_t entropy_nsec[OTTERY_STATS_MAX_SOURCES];
+};
+
+/** Value that ottery_reservoir_slots() gives for items that should be
+ * dropped from the reservoir. */
+#define OTTERY_RESERVOIR_SKIP ((size_t)-1)
+
+/** Largest value that ottery_config_set_buffer_blocks() will accept. */
+#define OTTERY_MAX_BUFFER_BLOCKS 64
+
+/**
+ * Choose how many blocks of PRF output each state generates at once.
+ *
+ * Every time a state runs out of buffered output, it generates some more,
+ * and uses the first few bytes of what it generated to rekey the PRF.  By
+ * default, it generates one block at a time--between 256 and 1024 bytes,
+ * depending on the PRF.  That keeps the state small, which is good for
+ * programs that want a few random numbers now and then without pushing
+ * their other data out of the cache.
+ *
+ * Programs that want a lot of random numbers will do better with a larger
+ * buffer: with n blocks, a state rekeys once every n blocks, and throws away
+ * the rekeying bytes once every n blocks, instead of every time.  Something
+ * like 16 blocks (4-16 KB) works well.  The buffer is allocated separately
+ * from the state, which stays the same size.
+ *
+ * This has no effect on how good the output is, but it does change which
+ * bytes you get for a given seed.
+ *
+ * To use this function, you call it on an ottery_config structure after
+ * ottery_config_init(), and pass that structure to ottery_st_init() or
+ * ottery_init().
+ *
+ * @param cfg The configuration structure to configure.
+ * @param n_blocks The number of blocks of PRF output to buffer, from 1
+ *    through OTTERY_MAX_BUFFER_BLOCKS.  The default is 1.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if n_blocks is out
+ *    of range.
+ */
+int ottery_config_set_buffer_blocks(struct ottery_config *cfg,
+                                    unsigned n_blocks);
+
 /** Size reserved for struct ottery_config */
 #define OTTERY_CONFIG_DUMMY_SIZE_ 1024
 
@@ -326,6 +699,12 @@ size_t ottery_get_sizeof_config(void);
 #define OTTERY_BLDFLG_NO_WIPE_STACK        0x00000010
 /** Set if SIMD support was disabled. This will make libottery slower. */
 #define OTTERY_BLDFLG_NO_SIMD              0x00010000
+/** Set if libottery keeps performance counters for each state, so that
+ * ottery_st_get_stats() works. */
+#define OTTERY_BLDFLG_STATS                0x00020000
+/** Set if libottery was built with a single, fixed PRF (see the
+ * --with-fixed-prf configure option), so that it can't use any other. */
+#define OTTERY_BLDFLG_FIXED_PRF            0x00040000
 /** @} */
 
 /** A bitmask of any flags that might affect safe and secure program
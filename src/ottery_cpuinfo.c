@@ -28,25 +28,41 @@
 #if defined(__arm__) || \
   defined(_M_ARM)
 #define ARM
+#elif defined(__aarch64__) || \
+  defined(_M_ARM64)
+#define ARM
+#define ARM64
+#endif
+
+#if defined(ARM) && defined(HAVE_SYS_AUXV_H)
+#include <sys/auxv.h>
+#endif
+#if defined(ARM) && defined(__APPLE__) && defined(HAVE_SYSCTLBYNAME)
+#include <sys/types.h>
+#include <sys/sysctl.h>
 #endif
 
 #if defined(X86)
 #ifdef _MSC_VER
 #include <intrin.h>
-#define cpuid(a,b) __cpuid((b), (a))
+#define cpuid(a,b) __cpuidex((b), (a), 0)
+#define cpuid_count(a,c,b) __cpuidex((b), (a), (c))
+#define xgetbv(index) ((uint64_t)_xgetbv(index))
 #else
+/** Run the cpuid instruction with eax set to index and ecx set to subindex,
+ * and store the resulting eax, ebx, ecx, and edx in regs. */
 static void
-cpuid(int index, int regs[4])
+cpuid_count(int index, int subindex, int regs[4])
 {
   unsigned int eax, ebx, ecx, edx;
 #ifdef X86_64
   __asm("cpuid" : "=a"(eax), "=b" (ebx), "=c"(ecx), "=d"(edx)
-        : "0"(index));
+        : "0"(index), "2"(subindex));
 #else
   __asm volatile(
                "xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
                : "=a" (eax), "=r" (ebx), "=c" (ecx), "=d" (edx)
-               : "0" (index)
+               : "0" (index), "2" (subindex)
                : "cc" );
 #endif
 
@@ -55,7 +71,59 @@ cpuid(int index, int regs[4])
   regs[2] = ecx;
   regs[3] = edx;
 }
+#define cpuid(a,b) cpuid_count((a), 0, (b))
+
+/** Return the value of the extended control register 'index'.  Only call
+ * this if cpuid says that OSXSAVE is set. */
+static uint64_t
+xgetbv(unsigned index)
+{
+  uint32_t eax, edx;
+  __asm volatile(".byte 0x0f, 0x01, 0xd0" /* xgetbv */
+                 : "=a"(eax), "=d"(edx) : "c"(index));
+  return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+/** XCR0 bits: the OS saves the SSE and AVX registers. */
+#define XCR0_AVX 0x06
+/** XCR0 bits: the OS saves the SSE, AVX, and AVX-512 registers. */
+#define XCR0_AVX512 0xe6
+#endif
+
+#if defined(ARM)
+/* The AT_HWCAP bit that tells us whether we have NEON.  Linux and FreeBSD
+ * agree on these. */
+#ifdef ARM64
+#define HWCAP_NEON_BIT (1<<1)  /* HWCAP_ASIMD */
+#else
+#define HWCAP_NEON_BIT (1<<12) /* HWCAP_NEON */
+#endif
+
+/**
+ * Ask the operating system whether this CPU has NEON.  Return 1 if it does,
+ * 0 if it doesn't, and -1 if we can't tell.
+ */
+static int
+arm_have_neon(void)
+{
+#if defined(HAVE_GETAUXVAL) && defined(AT_HWCAP)
+  return (getauxval(AT_HWCAP) & HWCAP_NEON_BIT) != 0;
+#elif defined(HAVE_ELF_AUX_INFO) && defined(AT_HWCAP)
+  unsigned long hwcap = 0;
+  if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+    return -1;
+  return (hwcap & HWCAP_NEON_BIT) != 0;
+#elif defined(__APPLE__) && defined(HAVE_SYSCTLBYNAME)
+  int val = 0;
+  size_t len = sizeof(val);
+  if (sysctlbyname("hw.optional.neon", &val, &len, NULL, 0) != 0)
+    return -1;
+  return val != 0;
+#else
+  return -1;
 #endif
+}
 #endif
 
 static uint32_t disabled_cpu_capabilities = 0;
@@ -66,12 +134,26 @@ ottery_disable_cpu_capabilities_(uint32_t disable)
   disabled_cpu_capabilities |= disable;
 }
 
-uint32_t
-ottery_get_cpu_capabilities_(void)
+/** Set in cpu_capabilities once we have filled it in. */
+#define CPU_CAPABILITIES_KNOWN (1u<<31)
+/** Cached result of ottery_get_cpu_capabilities_uncached(), with
+ * CPU_CAPABILITIES_KNOWN set; or 0 if we haven't asked yet.  Keeping the
+ * flag in the same word means that nobody can see it without the
+ * capabilities that go with it. */
+static uint32_t cpu_capabilities = 0;
+
+/** Ask the CPU (or the OS) what it can do.  This can be slow, so we only do
+ * it once. */
+static uint32_t
+ottery_get_cpu_capabilities_uncached(void)
 {
 #ifdef X86
   uint32_t cap = 0;
   int res[4];
+  int max_leaf;
+  uint64_t xcr0 = 0;
+  cpuid(0, res);
+  max_leaf = res[0];
   cpuid(1, res);
   if (res[3] & (1<<26))
     cap |= OTTERY_CPUCAP_SIMD;
@@ -81,8 +163,41 @@ ottery_get_cpu_capabilities_(void)
     cap |= OTTERY_CPUCAP_AES;
   if (res[2] & (1<<30))
     cap |= OTTERY_CPUCAP_RAND;
+  /* The wide registers are no use unless the OS saves them for us on
+   * context switches; XGETBV tells us whether it does. */
+  if ((res[2] & (1<<27)) && (res[2] & (1<<28)))
+    xcr0 = xgetbv(0);
+  if (max_leaf >= 7) {
+    cpuid_count(7, 0, res);
+    if (res[1] & (1<<18))
+      cap |= OTTERY_CPUCAP_RDSEED;
+    if ((xcr0 & XCR0_AVX) == XCR0_AVX) {
+      if (res[1] & (1<<5))
+        cap |= OTTERY_CPUCAP_AVX2;
+      if ((res[1] & (1<<16)) && (xcr0 & XCR0_AVX512) == XCR0_AVX512)
+        cap |= OTTERY_CPUCAP_AVX512;
+    }
+  }
+#elif defined(ARM)
+  uint32_t cap = 0;
+  /* If we can't tell, assume that we have NEON, as we always used to. */
+  if (arm_have_neon() != 0)
+    cap |= OTTERY_CPUCAP_SIMD;
 #else
   uint32_t cap = OTTERY_CPUCAP_SIMD;
 #endif
-  return cap & ~disabled_cpu_capabilities;
+  return cap;
+}
+
+uint32_t
+ottery_get_cpu_capabilities_(void)
+{
+  uint32_t cap = ATOMIC_LOAD_ACQUIRE(&cpu_capabilities);
+  /* If two threads get here at once, they both ask the CPU, and they both
+   * store the same value. */
+  if (!cap) {
+    cap = ottery_get_cpu_capabilities_uncached() | CPU_CAPABILITIES_KNOWN;
+    ATOMIC_STORE_RELEASE(&cpu_capabilities, cap);
+  }
+  return cap & ~CPU_CAPABILITIES_KNOWN & ~disabled_cpu_capabilities;
 }
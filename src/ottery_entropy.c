@@ -24,6 +24,7 @@
 #define FL(x)  OTTERY_ENTROPY_FL_  ## x
 
 #include "ottery_entropy_cryptgenrandom.c"
+#include "ottery_entropy_getrandom.c"
 #include "ottery_entropy_urandom.c"
 #include "ottery_entropy_rdrand.c"
 #include "ottery_entropy_egd.c"
@@ -35,6 +36,9 @@ static struct ottery_randbytes_source {
             uint8_t *, size_t);
   uint32_t flags;
 } RAND_SOURCES[] = {
+#ifdef ENTROPY_SOURCE_GETRANDOM
+  ENTROPY_SOURCE_GETRANDOM,
+#endif
 #ifdef ENTROPY_SOURCE_CRYPTGENRANDOM
   ENTROPY_SOURCE_CRYPTGENRANDOM,
 #endif
@@ -62,12 +66,31 @@ ottery_get_entropy_(const struct ottery_entropy_config *config,
                      uint32_t select_sources,
                      uint8_t *bytes, size_t n, size_t *buflen,
                      uint32_t *flags_out)
+{
+  return ottery_get_entropy_partial_(config, state, select_sources, 0, 0,
+                                     bytes, n, buflen, flags_out);
+}
+
+int
+ottery_get_entropy_partial_(const struct ottery_entropy_config *config,
+                            struct ottery_entropy_state *state,
+                            uint32_t select_sources,
+                            uint32_t have_flags, int stop_when_strong,
+                            uint8_t *bytes, size_t n, size_t *buflen,
+                            uint32_t *flags_out)
 {
   ssize_t err = OTTERY_ERR_INIT_STRONG_RNG, last_err = 0;
   int i;
-  uint32_t got = 0;
+  /* Pretend that we already ran the sources in have_flags' domains, so
+   * that we skip them. */
+  const uint32_t have_domains = have_flags & OTTERY_ENTROPY_DOM_MASK;
+  uint32_t got = have_domains;
   uint8_t *next;
   const uint32_t disabled_sources = config ? config->disabled_sources : 0;
+#ifdef OTTERY_STATS
+  struct ottery_stats *stats = state ? state->stats : NULL;
+  uint64_t start = 0;
+#endif
 
   memset(bytes, 0, *buflen);
   next = bytes;
@@ -88,7 +111,19 @@ ottery_get_entropy_(const struct ottery_entropy_config *config,
     /* If we can't write these bytes, don't try. */
     if (next + n > bytes + *buflen)
       break;
+#ifdef OTTERY_STATS
+    if (stats)
+      start = ottery_monotonic_nsec_();
+#endif
     err = RAND_SOURCES[i].fn(config, state, next, n);
+#ifdef OTTERY_STATS
+    if (stats && i < OTTERY_STATS_MAX_SOURCES) {
+      stats->entropy_nsec[i] += ottery_monotonic_nsec_() - start;
+      ++stats->entropy_calls[i];
+      if (err)
+        ++stats->entropy_failures[i];
+    }
+#endif
     if (err == 0) {
       uint32_t flags = RAND_SOURCES[i].flags;
       if (config && (flags & config->weak_sources))
@@ -96,17 +131,130 @@ ottery_get_entropy_(const struct ottery_entropy_config *config,
 
       got |= flags;
       next += n;
+      if (stop_when_strong && (flags & OTTERY_ENTROPY_FL_STRONG))
+        break;
     } else {
       last_err = err;
     }
   }
 
   /* Do not report success unless at least one source was strong. */
-  if (0 == (got & OTTERY_ENTROPY_FL_STRONG))
+  if (0 == ((got | have_flags) & OTTERY_ENTROPY_FL_STRONG))
     return last_err ? last_err : OTTERY_ERR_INIT_STRONG_RNG;
 
-  *flags_out = got;
+  *flags_out = got & ~have_domains;
   *buflen = next - bytes;
 
   return 0;
 }
+
+int
+ottery_have_fast_entropy_(const struct ottery_entropy_config *config)
+{
+#ifdef ENTROPY_SOURCE_RDRAND
+  if (config && (config->disabled_sources & OTTERY_ENTROPY_SRC_RDRAND))
+    return 0;
+  return (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RAND) != 0;
+#else
+  (void) config;
+  return 0;
+#endif
+}
+
+int
+ottery_get_fast_entropy_(uint8_t *out, size_t n)
+{
+#ifdef ENTROPY_SOURCE_RDRAND
+  return ottery_get_fast_entropy_rdrand(out, n);
+#else
+  (void) out;
+  (void) n;
+  return OTTERY_ERR_INIT_STRONG_RNG;
+#endif
+}
+
+#ifdef OTTERY_STATS
+void
+ottery_entropy_stats_init_(struct ottery_stats *stats)
+{
+  unsigned i;
+  for (i = 0; RAND_SOURCES[i].fn && i < OTTERY_STATS_MAX_SOURCES; ++i)
+    stats->entropy_source[i] = RAND_SOURCES[i].flags &
+      ~(OTTERY_ENTROPY_FLAG_MASK|OTTERY_ENTROPY_DOM_MASK);
+  stats->n_entropy_sources = i;
+}
+#endif
+
+void
+ottery_entropy_state_snapshot_(struct ottery_entropy_state *dst,
+                               struct ottery_entropy_state *src,
+                               struct ottery_stats *scratch)
+{
+  memcpy(dst, src, sizeof(*dst));
+  src->egd_fd_is_cached = 0;
+#ifdef OTTERY_STATS
+  if (src->stats) {
+    memset(scratch, 0, sizeof(*scratch));
+    dst->stats = scratch;
+  }
+#else
+  (void) scratch;
+#endif
+}
+
+void
+ottery_entropy_state_merge_(struct ottery_entropy_state *dst,
+                            struct ottery_entropy_state *src)
+{
+#ifdef ENTROPY_SOURCE_URANDOM
+  if (src->urandom_fd_is_cached &&
+      !(dst->urandom_fd_is_cached && dst->urandom_fd == src->urandom_fd)) {
+    if (dst->urandom_fd_is_cached) {
+      /* Somebody else cached an fd while we were busy; keep theirs. */
+      close(src->urandom_fd);
+    } else {
+      dst->urandom_fd = src->urandom_fd;
+      dst->urandom_fd_inode = src->urandom_fd_inode;
+      dst->urandom_fd_is_cached = 1;
+    }
+  }
+  if (!dst->urandom_fd_inode)
+    dst->urandom_fd_inode = src->urandom_fd_inode;
+#endif
+#ifdef ENTROPY_SOURCE_EGD
+  if (src->egd_fd_is_cached) {
+    if (dst->egd_fd_is_cached) {
+      close(src->egd_fd);
+    } else {
+      dst->egd_fd = src->egd_fd;
+      dst->egd_pid = src->egd_pid;
+      dst->egd_fd_is_cached = 1;
+    }
+  }
+#endif
+#ifdef OTTERY_STATS
+  if (dst->stats && src->stats && src->stats != dst->stats) {
+    unsigned i;
+    for (i = 0; i < OTTERY_STATS_MAX_SOURCES; ++i) {
+      dst->stats->entropy_calls[i] += src->stats->entropy_calls[i];
+      dst->stats->entropy_failures[i] += src->stats->entropy_failures[i];
+      dst->stats->entropy_nsec[i] += src->stats->entropy_nsec[i];
+    }
+  }
+#endif
+  ottery_memclear_(src, sizeof(*src));
+}
+
+void
+ottery_entropy_state_clear_(struct ottery_entropy_state *state)
+{
+#ifdef ENTROPY_SOURCE_URANDOM
+  if (state->urandom_fd_is_cached)
+    close(state->urandom_fd);
+#endif
+#ifdef ENTROPY_SOURCE_EGD
+  if (state->egd_fd_is_cached)
+    close(state->egd_fd);
+#endif
+  ottery_memclear_(state, sizeof(*state));
+}
@@ -16,6 +16,65 @@
 #include "ottery.h"
 
 #ifdef _WIN32
+#include <windows.h>
+
+#ifdef HAVE_BCRYPTGENRANDOM
+#include <bcrypt.h>
+
+/** Generate random bytes using the Windows BCryptGenRandom operating-system
+ * RNG. */
+static int
+ottery_get_entropy_cryptgenrandom(const struct ottery_entropy_config *cfg,
+                          struct ottery_entropy_state *state,
+                          uint8_t *out, size_t outlen)
+{
+  /* With BCRYPT_USE_SYSTEM_PREFERRED_RNG, there's no provider to open or
+   * close: every call goes straight to the system RNG. */
+  (void) cfg;
+  (void) state;
+
+  while (outlen) {
+    const ULONG n = outlen > 0x40000000 ? 0x40000000 : (ULONG)outlen;
+    if (0 != BCryptGenRandom(NULL, out, n, BCRYPT_USE_SYSTEM_PREFERRED_RNG))
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    out += n;
+    outlen -= n;
+  }
+  return 0;
+}
+
+#else
+#include <wincrypt.h>
+
+/** A CryptoAPI provider that we acquired once and kept for the lifetime of
+ * the process, or NULL if we haven't acquired one yet.  Acquiring a provider
+ * is far slower than using one, and providers are safe to share between
+ * threads. */
+static void * volatile ottery_cryptgenrandom_provider_ = NULL;
+
+/** Return a CryptoAPI provider to use, acquiring one if we haven't yet.
+ * Return 0 on failure. */
+static HCRYPTPROV
+ottery_cryptgenrandom_provider(void)
+{
+  HCRYPTPROV provider = (HCRYPTPROV) ottery_cryptgenrandom_provider_;
+  void *prev;
+  if (provider)
+    return provider;
+
+  if (0 == CryptAcquireContext(&provider, NULL, NULL, PROV_RSA_FULL,
+                               CRYPT_VERIFYCONTEXT))
+    return 0;
+  prev = InterlockedCompareExchangePointer(
+                        (void * volatile *) &ottery_cryptgenrandom_provider_,
+                        (void *) provider, NULL);
+  if (prev) {
+    /* Another thread got there first; use theirs. */
+    CryptReleaseContext(provider, 0);
+    provider = (HCRYPTPROV) prev;
+  }
+  return provider;
+}
 
 /** Generate random bytes using the Windows CryptGenRandom operating-system
  * RNG. */
@@ -27,21 +86,24 @@ ottery_get_entropy_cryptgenrandom(const struct ottery_entropy_config *cfg,
   /* On Windows, CryptGenRandom is supposed to be a well-seeded
    * cryptographically strong random number generator. */
   HCRYPTPROV provider;
-  int retval = 0;
   (void) cfg;
   (void) state;
 
-  if (0 == CryptAcquireContext(&provider, NULL, NULL, PROV_RSA_FULL,
-                               CRYPT_VERIFYCONTEXT))
+  if (0 == (provider = ottery_cryptgenrandom_provider()))
     return OTTERY_ERR_INIT_STRONG_RNG;
 
-  if (0 == CryptGenRandom(provider, outlen, out))
-    retval = OTTERY_ERR_ACCESS_STRONG_RNG;
-
-  CryptReleaseContext(provider, 0);
-  return retval;
+  while (outlen) {
+    const DWORD n = outlen > 0x40000000 ? 0x40000000 : (DWORD)outlen;
+    if (0 == CryptGenRandom(provider, n, out))
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    out += n;
+    outlen -= n;
+  }
+  return 0;
 }
 
+#endif
+
 #define ENTROPY_SOURCE_CRYPTGENRANDOM           \
   { ottery_get_entropy_cryptgenrandom,         \
       SRC(CRYPTGENRANDOM)|DOM(OS)|FL(STRONG) }
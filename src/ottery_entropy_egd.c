@@ -15,58 +15,162 @@
 #ifndef _WIN32
 /* TODO: Support win32. */
 #include <sys/socket.h>
+#include <errno.h>
+
+/** Largest number of bytes that one EGD request can ask for. */
+#define EGD_MAX_REQUEST 255
+/** Largest number of requests that we send to EGD before reading the
+ * replies. */
+#define EGD_MAX_PIPELINE 16
+
+/** Open a new connection to the EGD socket in cfg.  Return the socket, or
+ * -1 on failure. */
+static int
+ottery_egd_connect_(const struct ottery_entropy_config *cfg)
+{
+  int sock = socket(cfg->egd_sockaddr->sa_family, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+#ifdef FD_CLOEXEC
+  (void) fcntl(sock, F_SETFD, FD_CLOEXEC);
+#endif
+#ifdef SO_NOSIGPIPE
+  {
+    int one = 1;
+    (void) setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+  }
+#endif
+  if (connect(sock, cfg->egd_sockaddr, cfg->egd_socklen) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/** Send all n bytes at msg to sock.  Return 0 on success, -1 on failure. */
+static int
+ottery_egd_send_all_(int sock, const uint8_t *msg, size_t n)
+{
+#ifdef MSG_NOSIGNAL
+  const int send_flags = MSG_NOSIGNAL;
+#else
+  const int send_flags = 0;
+#endif
+  while (n) {
+    ssize_t r = send(sock, msg, n, send_flags);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    msg += r;
+    n -= (size_t)r;
+  }
+  return 0;
+}
+
+/**
+ * Read outlen bytes from the EGD server on sock into out.  We send up to
+ * EGD_MAX_PIPELINE requests at a time before waiting for any replies, so a
+ * whole seed usually costs one round trip.  If the server gives us fewer
+ * bytes than we asked for, we keep them and ask again for the rest, until
+ * it has nothing left to give.
+ *
+ * Set *broken to true if the connection is no good any more.
+ *
+ * @return Zero on success, or OTTERY_ERR_ACCESS_STRONG_RNG on failure.
+ */
+static int
+ottery_egd_request_(int sock, uint8_t *out, size_t outlen, int *broken)
+{
+  uint8_t msg[EGD_MAX_PIPELINE * 2];
+
+  while (outlen) {
+    size_t n_req = 0, asked = 0, got = 0, i;
+    while (n_req < EGD_MAX_PIPELINE && asked < outlen) {
+      size_t m = outlen - asked;
+      if (m > EGD_MAX_REQUEST)
+        m = EGD_MAX_REQUEST;
+      msg[n_req*2] = 1;                   /* nonblocking request */
+      msg[n_req*2+1] = (unsigned char) m; /* for m bytes */
+      asked += m;
+      ++n_req;
+    }
+    if (ottery_egd_send_all_(sock, msg, n_req * 2) < 0) {
+      *broken = 1;
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    }
+    /* We must read every reply, even after a short one, or we'll lose our
+     * place in the stream. */
+    for (i = 0; i < n_req; ++i) {
+      uint8_t len;
+      if (ottery_read_n_bytes_from_file_(sock, &len, 1) != 1 ||
+          len > msg[i*2+1] ||
+          ottery_read_n_bytes_from_file_(sock, out, len) != (ssize_t)len) {
+        *broken = 1;
+        return OTTERY_ERR_ACCESS_STRONG_RNG;
+      }
+      out += len;
+      outlen -= len;
+      got += len;
+    }
+    if (got == 0)
+      /* The server is out of entropy for now. */
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+  }
+  return 0;
+}
 
 /** Implement an entropy-source that uses the EGD protocol.  The
  * Entropy-Gathering Daemon is program (actually, one of several programs)
  * that watches system events, periodically runs commands whose outputs have
  * high variance, and so on.  It communicates over a simple socket-based
- * protocol, of which we use only a tiny piece. */
+ * protocol, of which we use only a tiny piece.
+ *
+ * If we have a state, we keep our connection open there for next time.  If
+ * that connection turns out to be dead, we reconnect once. */
 static int
 ottery_get_entropy_egd(const struct ottery_entropy_config *cfg,
                        struct ottery_entropy_state *state,
                        uint8_t *out, size_t outlen)
 {
-  int sock, n, result;
-  unsigned char msg[2];
-  (void) state;
+  int sock = -1, reused = 0, broken, result;
 
   if (! cfg || ! cfg->egd_sockaddr || ! cfg->egd_socklen)
     return OTTERY_ERR_INIT_STRONG_RNG;
-  if (outlen > 255)
-    return OTTERY_ERR_ACCESS_STRONG_RNG;
 
-  sock = socket(cfg->egd_sockaddr->sa_family, SOCK_STREAM, 0);
-  if (sock < 0)
-    return OTTERY_ERR_INIT_STRONG_RNG;
-
-  if (connect(sock, cfg->egd_sockaddr, cfg->egd_socklen) < 0) {
-    result = OTTERY_ERR_INIT_STRONG_RNG;
-    goto out;
+  if (state && state->egd_fd_is_cached) {
+    /* After a fork, our parent is still using its copy of the socket. */
+    if (state->egd_pid == getpid()) {
+      sock = state->egd_fd;
+      reused = 1;
+    } else {
+      close(state->egd_fd);
+    }
+    state->egd_fd_is_cached = 0;
   }
 
-  msg[0] = 1;                      /* nonblocking request */
-  msg[1] = (unsigned char) outlen; /* for outlen bytes */
-
-  if (write(sock, msg, 2) != 2 ||
-      read(sock, msg, 1)  != 1) {
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
-    goto out;
-  }
+ again:
+  if (sock < 0 && (sock = ottery_egd_connect_(cfg)) < 0)
+    return OTTERY_ERR_INIT_STRONG_RNG;
 
-  if (msg[0] != outlen) {
-    /* TODO Use any bytes we get, even if they aren't as many as we wanted. */
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
-    goto out;
+  broken = 0;
+  result = ottery_egd_request_(sock, out, outlen, &broken);
+  if (broken && reused) {
+    /* The server probably closed our idle connection; try a new one. */
+    close(sock);
+    sock = -1;
+    reused = 0;
+    goto again;
   }
 
-  n = ottery_read_n_bytes_from_file_(sock, out, outlen);
-  if (n < 0 || (size_t)n != outlen) {
-    result = OTTERY_ERR_ACCESS_STRONG_RNG;
-    goto out;
+  if (state && !broken) {
+    state->egd_fd = sock;
+    state->egd_pid = getpid();
+    state->egd_fd_is_cached = 1;
+  } else {
+    close(sock);
   }
-  result = 0;
- out:
-  close(sock);
   return result;
 }
 
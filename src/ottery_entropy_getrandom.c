@@ -0,0 +1,77 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#if !defined(_WIN32) && \
+  (defined(HAVE_GETRANDOM) || defined(HAVE_GETENTROPY) || \
+   defined(HAVE_ARC4RANDOM_BUF))
+
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+
+/** Largest number of bytes that getentropy() will give us at once. */
+#define GETENTROPY_MAX 256
+
+/** Generate random bytes using the operating system's system call for the
+ * purpose, without needing to open a file. */
+static int
+ottery_get_entropy_getrandom(const struct ottery_entropy_config *cfg,
+                             struct ottery_entropy_state *state,
+                             uint8_t *out, size_t outlen)
+{
+  /* Unlike /dev/urandom, getrandom() and getentropy() need no file
+   * descriptor, so they work inside a chroot or when we're out of fds.
+   * They also block until the kernel's RNG has been seeded, which is just
+   * what we'd want from /dev/urandom and can't get.
+   */
+  (void) state;
+
+  /* If the user told us which random device to use, they want us to use
+   * that one. */
+  if (cfg && (cfg->urandom_fname || cfg->urandom_fd_is_set))
+    return OTTERY_ERR_INIT_STRONG_RNG;
+
+#if defined(HAVE_GETRANDOM)
+  while (outlen) {
+    ssize_t r = getrandom(out, outlen, 0);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return OTTERY_ERR_INIT_STRONG_RNG;
+    }
+    if (r == 0 || (size_t)r > outlen)
+      return OTTERY_ERR_ACCESS_STRONG_RNG;
+    out += r;
+    outlen -= r;
+  }
+#elif defined(HAVE_GETENTROPY)
+  while (outlen) {
+    size_t n = outlen > GETENTROPY_MAX ? GETENTROPY_MAX : outlen;
+    if (getentropy(out, n) != 0)
+      return OTTERY_ERR_INIT_STRONG_RNG;
+    out += n;
+    outlen -= n;
+  }
+#else
+  arc4random_buf(out, outlen);
+#endif
+  return 0;
+}
+
+#define ENTROPY_SOURCE_GETRANDOM \
+  { ottery_get_entropy_getrandom, SRC(GETRANDOM)|DOM(OS)|FL(STRONG) }
+
+#endif
@@ -19,15 +19,89 @@
     defined(_M_IX86) || \
     defined(__INTEL_COMPILER)
 
-/** Helper: invoke the RDRAND instruction to get 4 random bytes in the output
- * value. Return 0 on success, and an error on failure. */
+/** How many times to retry RDRAND before we give up.  Intel says that
+ * ten tries in a row should only fail if the hardware is broken. */
+#define RDRAND_RETRIES 10
+/** How many times to retry RDSEED before we fall back to RDRAND.  RDSEED
+ * can run dry when many threads use it at once. */
+#define RDSEED_RETRIES 4
+
+#if defined(__x86_64) || defined(__x86_64__)
+/** The widest word that RDRAND and RDSEED will give us. */
+typedef uint64_t rdrand_word_t;
+/** Helper: invoke the RDRAND instruction once to get 8 random bytes in the
+ * output value. Return 0 on success, and an error on failure. */
+static int
+rdrand_once(rdrand_word_t *therand) {
+ unsigned char status;
+ __asm volatile(".byte 0x48, 0x0F, 0xC7, 0xF0 ; setc %1"
+ : "=a" (*therand), "=qm" (status));
+ return (status)==1 ? 0 : OTTERY_ERR_INIT_STRONG_RNG;
+}
+/** As rdrand_once, but with RDSEED. */
+static int
+rdseed_once(rdrand_word_t *therand) {
+ unsigned char status;
+ __asm volatile(".byte 0x48, 0x0F, 0xC7, 0xF8 ; setc %1"
+ : "=a" (*therand), "=qm" (status));
+ return (status)==1 ? 0 : OTTERY_ERR_INIT_STRONG_RNG;
+}
+#else
+typedef uint32_t rdrand_word_t;
+/** Helper: invoke the RDRAND instruction once to get 4 random bytes in the
+ * output value. Return 0 on success, and an error on failure. */
 static int
-rdrand(uint32_t *therand) {
+rdrand_once(rdrand_word_t *therand) {
  unsigned char status;
  __asm volatile(".byte 0x0F, 0xC7, 0xF0 ; setc %1"
  : "=a" (*therand), "=qm" (status));
  return (status)==1 ? 0 : OTTERY_ERR_INIT_STRONG_RNG;
 }
+/** As rdrand_once, but with RDSEED. */
+static int
+rdseed_once(rdrand_word_t *therand) {
+ unsigned char status;
+ __asm volatile(".byte 0x0F, 0xC7, 0xF8 ; setc %1"
+ : "=a" (*therand), "=qm" (status));
+ return (status)==1 ? 0 : OTTERY_ERR_INIT_STRONG_RNG;
+}
+#endif
+
+/** Helper: get a word from RDRAND, retrying if it's momentarily out of
+ * data. Return 0 on success, and an error on failure. */
+static int
+rdrand(rdrand_word_t *therand) {
+  int i;
+  for (i = 0; i < RDRAND_RETRIES; ++i) {
+    if (rdrand_once(therand) == 0)
+      return 0;
+  }
+  return OTTERY_ERR_INIT_STRONG_RNG;
+}
+
+/**
+ * Fill outlen bytes at out with words from RDSEED if use_rdseed is true,
+ * falling back to RDRAND for any word that RDSEED can't supply right away;
+ * or with words from RDRAND alone otherwise.
+ */
+static int
+rdrand_fill(uint8_t *out, size_t outlen, int use_rdseed)
+{
+  rdrand_word_t w;
+  while (outlen) {
+    const size_t n = outlen < sizeof(w) ? outlen : sizeof(w);
+    int i, got = 0;
+    for (i = 0; use_rdseed && !got && i < RDSEED_RETRIES; ++i)
+      got = (rdseed_once(&w) == 0);
+    if (!got && rdrand(&w))
+      return OTTERY_ERR_INIT_STRONG_RNG;
+    memcpy(out, &w, n);
+    out += n;
+    outlen -= n;
+  }
+  ottery_memclear_(&w, sizeof(w));
+  return 0;
+}
 
 /** Generate bytes using the Intel RDRAND instruction. */
 static int
@@ -35,25 +109,22 @@ ottery_get_entropy_rdrand(const struct ottery_entropy_config *cfg,
                           struct ottery_entropy_state *state,
                            uint8_t *out, size_t outlen)
 {
-  int err;
-  uint32_t *up = (uint32_t *) out;
   (void) cfg;
   (void) state;
   if (! (ottery_get_cpu_capabilities_() & OTTERY_CPUCAP_RAND))
     return OTTERY_ERR_INIT_STRONG_RNG;
-  while (outlen >= 4) {
-    if ((err = rdrand(up)))
-      return err;
-    up += 1;
-    outlen -= 4;
-  }
-  if (outlen) {
-    uint32_t tmp;
-    if ((err = rdrand(&tmp)))
-      return err;
-    memcpy(up, &tmp, outlen);
-  }
-  return 0;
+  return rdrand_fill(out, outlen, 0);
+}
+
+/** Generate bytes for prediction resistance: RDSEED if we have it, and
+ * RDRAND otherwise. */
+static int
+ottery_get_fast_entropy_rdrand(uint8_t *out, size_t outlen)
+{
+  const uint32_t cap = ottery_get_cpu_capabilities_();
+  if (! (cap & OTTERY_CPUCAP_RAND))
+    return OTTERY_ERR_INIT_STRONG_RNG;
+  return rdrand_fill(out, outlen, (cap & OTTERY_CPUCAP_RDSEED) != 0);
 }
 
 #define ENTROPY_SOURCE_RDRAND                                           \
@@ -35,6 +35,35 @@ ottery_read_n_bytes_from_file_(int fd, uint8_t *out, size_t n)
 }
 
 
+/**
+ * Make sure that fd refers to something we should be reading random bytes
+ * from: it must be a character device (if check_device is true), and it must
+ * be the same one we used last time with state (if state is provided).
+ *
+ * @return Zero if the fd is okay, or an error code otherwise.
+ */
+static int
+ottery_check_urandom_fd_(int fd, int check_device,
+                         struct ottery_entropy_state *state)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    return OTTERY_ERR_INIT_STRONG_RNG;
+  if (check_device) {
+    if (0 == (st.st_mode & S_IFCHR))
+      return OTTERY_ERR_INIT_STRONG_RNG;
+
+    if (state) {
+      if (0 == state->urandom_fd_inode) {
+        state->urandom_fd_inode = (uint64_t) st.st_ino;
+      } else if ((uint64_t)st.st_ino != state->urandom_fd_inode) {
+        return OTTERY_ERR_ACCESS_STRONG_RNG;
+      }
+    }
+  }
+  return 0;
+}
+
 /** Generate random bytes using the unix-style /dev/urandom RNG, or another
  * such device as configured in the configuration. */
 static int
@@ -62,7 +91,6 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
   ssize_t n;
   int result = 0;
   const char *urandom_fname;
-  struct stat st;
   int own_fd = 0;
   int check_device = !cfg || !cfg->allow_nondev_urandom;
 #ifndef O_CLOEXEC
@@ -71,6 +99,17 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
   if (cfg && cfg->urandom_fd_is_set && cfg->urandom_fd >= 0) {
     fd = cfg->urandom_fd;
   } else {
+    if (state && state->urandom_fd_is_cached) {
+      /* We opened the device before; see if the fd is still good. */
+      if (0 == ottery_check_urandom_fd_(state->urandom_fd, check_device,
+                                        state)) {
+        fd = state->urandom_fd;
+        goto read;
+      }
+      /* Somebody closed or replaced our fd.  Whatever it is now, it isn't
+       * ours, so we mustn't close it: just forget it and open a new one. */
+      state->urandom_fd_is_cached = 0;
+    }
     if (cfg && cfg->urandom_fname)
       urandom_fname = cfg->urandom_fname;
     else
@@ -81,33 +120,26 @@ ottery_get_entropy_urandom(const struct ottery_entropy_config *cfg,
     if (fd < 0)
       return OTTERY_ERR_INIT_STRONG_RNG;
   }
-  if (fstat(fd, &st) < 0) {
-    result = OTTERY_ERR_INIT_STRONG_RNG;
+  if ((result = ottery_check_urandom_fd_(fd, check_device, state)))
     goto end;
-  }
-  if (check_device) {
-    if (0 == (st.st_mode & S_IFCHR)) {
-      result = OTTERY_ERR_INIT_STRONG_RNG;
-      goto end;
-    }
-
-    if (state) {
-      if (0 == state->urandom_fd_inode) {
-        state->urandom_fd_inode = (uint64_t) st.st_ino;
-      } else if ((uint64_t)st.st_ino != state->urandom_fd_inode) {
-        close(fd);
-        return OTTERY_ERR_ACCESS_STRONG_RNG;
-      }
-    }
-  }
 
+ read:
   n = ottery_read_n_bytes_from_file_(fd, out, outlen);
   if (n < 0 || (size_t)n != outlen)
     result = OTTERY_ERR_ACCESS_STRONG_RNG;
 
  end:
-  if (own_fd)
-    close(fd);
+  if (own_fd) {
+    if (result == 0 && state && check_device) {
+      /* Keep the fd around, so we don't need to open it again next time.
+       * Only do this when we check the device: otherwise nothing would tell
+       * us if somebody closed our fd and opened some other file on it. */
+      state->urandom_fd = fd;
+      state->urandom_fd_is_cached = 1;
+    } else {
+      close(fd);
+    }
+  }
   return result;
 }
 
@@ -0,0 +1,341 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+/**
+ * @file ottery_fd.c
+ *
+ * Functions to write a stream of random bytes to a file descriptor,
+ * generating each buffer while the one before it is being written.
+ */
+#define OTTERY_INTERNAL
+#include "ottery-internal.h"
+#include "ottery.h"
+#include "ottery_st.h"
+#include "ottery_nolock.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/** Buffer size for pipes, sockets, and devices, unless we learn better. */
+#define FD_BUFFER_LEN_DEFAULT (64*1024)
+/** Buffer size for regular files and block devices. */
+#define FD_BUFFER_LEN_FILE (1024*1024)
+/** Largest buffer size that we'll use. */
+#define FD_BUFFER_LEN_MAX (4*1024*1024)
+
+/**
+ * Return the size of buffer to use when writing to fd: big enough that we
+ * make few system calls, and a whole number of the fd's preferred blocks.
+ */
+static size_t
+ottery_fd_buffer_len_(int fd)
+{
+  struct stat st;
+  size_t len = FD_BUFFER_LEN_DEFAULT;
+
+  if (fstat(fd, &st) < 0)
+    return len;
+#ifdef S_ISBLK
+  if (S_ISBLK(st.st_mode))
+    len = FD_BUFFER_LEN_FILE;
+#endif
+  if (S_ISREG(st.st_mode))
+    len = FD_BUFFER_LEN_FILE;
+#if defined(S_ISFIFO) && defined(F_GETPIPE_SZ)
+  if (S_ISFIFO(st.st_mode)) {
+    /* A write of exactly the pipe's capacity fills it in one go. */
+    int pipe_len = fcntl(fd, F_GETPIPE_SZ);
+    if (pipe_len > 0)
+      len = (size_t)pipe_len;
+  }
+#endif
+#ifndef _WIN32
+  if (st.st_blksize > 0) {
+    const size_t blksize = (size_t)st.st_blksize;
+    len = (len + blksize - 1) / blksize * blksize;
+  }
+#endif
+  if (len > FD_BUFFER_LEN_MAX)
+    len = FD_BUFFER_LEN_MAX;
+  return len;
+}
+
+/** Return the size of a memory page. */
+static size_t
+ottery_page_len_(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  long len = sysconf(_SC_PAGESIZE);
+  return len > 0 ? (size_t)len : 4096;
+#endif
+}
+
+/**
+ * Write all n bytes at buf to fd, retrying after short writes and
+ * interrupted system calls.
+ *
+ * @return Zero on success, or the errno value on failure.
+ */
+static int
+ottery_fd_write_all_(int fd, const uint8_t *buf, size_t n)
+{
+  while (n) {
+#ifdef _WIN32
+    int r = _write(fd, buf, n > INT_MAX ? INT_MAX : (unsigned)n);
+#else
+    ssize_t r = write(fd, buf, n);
+#endif
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (r == 0)
+      return EIO;
+    buf += r;
+    n -= (size_t)r;
+  }
+  return 0;
+}
+
+/**
+ * Everything we need to write random bytes to a file descriptor: the
+ * state, the buffers, and (if we're using one) the writer thread.
+ */
+struct ottery_fd_writer {
+  /** The state to generate bytes from. */
+  struct ottery_state *st;
+  /** True iff st has a lock, so that we should use the locking
+   * functions on it. */
+  int locked;
+  /** The file descriptor to write to. */
+  int fd;
+  /** Length of each buffer. */
+  size_t buffer_len;
+  /** Two page-aligned buffers of buffer_len bytes each. */
+  uint8_t *buffers[2];
+  /** The pointer we got from malloc, for both buffers. */
+  void *allocation;
+#ifdef OTTERY_TLS_PTHREADS
+  /** Protects the fields below. */
+  pthread_mutex_t mutex;
+  /** Signalled whenever one of the fields below changes. */
+  pthread_cond_t cond;
+  /** For each buffer, the number of bytes in it waiting to be written,
+   * or 0 if it's free for us to fill. */
+  size_t pending[2];
+  /** True iff we have handed over the last buffer. */
+  int finished;
+#endif
+  /** Zero, or the errno value from the first write that failed. */
+  int err;
+};
+
+/** Fill n bytes of buf with random bytes from w's state. */
+static void
+ottery_fd_writer_fill_(struct ottery_fd_writer *w, uint8_t *buf, size_t n)
+{
+  if (w->locked)
+    ottery_st_rand_bytes(w->st, buf, n);
+  else
+    ottery_st_rand_bytes_nolock(w->st, buf, n);
+}
+
+/**
+ * Write nbytes of random bytes through w, one buffer at a time, without a
+ * separate thread.
+ */
+static void
+ottery_fd_writer_run_serial_(struct ottery_fd_writer *w, uint64_t nbytes)
+{
+  while (nbytes && !w->err) {
+    const size_t n = nbytes < w->buffer_len ? (size_t)nbytes : w->buffer_len;
+    ottery_fd_writer_fill_(w, w->buffers[0], n);
+    w->err = ottery_fd_write_all_(w->fd, w->buffers[0], n);
+    nbytes -= n;
+  }
+}
+
+#ifdef OTTERY_TLS_PTHREADS
+/**
+ * Writer thread: write each buffer that the generating thread hands over,
+ * in turn, until it says it's finished or a write fails.
+ */
+static void *
+ottery_fd_writer_thread_(void *arg)
+{
+  struct ottery_fd_writer *w = arg;
+  int idx = 0;
+
+  pthread_mutex_lock(&w->mutex);
+  for (;;) {
+    size_t n;
+    int err;
+    while (!w->pending[idx] && !w->finished)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (!(n = w->pending[idx]))
+      break;
+    pthread_mutex_unlock(&w->mutex);
+
+    err = ottery_fd_write_all_(w->fd, w->buffers[idx], n);
+
+    pthread_mutex_lock(&w->mutex);
+    w->pending[idx] = 0;
+    pthread_cond_signal(&w->cond);
+    if (err) {
+      w->err = err;
+      break;
+    }
+    idx ^= 1;
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+/**
+ * Write nbytes of random bytes through w, generating each buffer in this
+ * thread while a writer thread writes the one before it.
+ *
+ * @return Zero on success, or -1 if we couldn't start the writer thread,
+ *   in which case we haven't written anything.
+ */
+static int
+ottery_fd_writer_run_threaded_(struct ottery_fd_writer *w, uint64_t nbytes)
+{
+  pthread_t thread;
+  int idx = 0;
+
+  if (pthread_mutex_init(&w->mutex, NULL))
+    return -1;
+  if (pthread_cond_init(&w->cond, NULL)) {
+    pthread_mutex_destroy(&w->mutex);
+    return -1;
+  }
+  w->pending[0] = w->pending[1] = 0;
+  w->finished = 0;
+  if (pthread_create(&thread, NULL, ottery_fd_writer_thread_, w)) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    return -1;
+  }
+
+  while (nbytes) {
+    const size_t n = nbytes < w->buffer_len ? (size_t)nbytes : w->buffer_len;
+    int failed;
+    /* Wait until the writer is done with this buffer. */
+    pthread_mutex_lock(&w->mutex);
+    while (w->pending[idx] && !w->err)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    failed = (w->err != 0);
+    pthread_mutex_unlock(&w->mutex);
+    if (failed)
+      break;
+
+    ottery_fd_writer_fill_(w, w->buffers[idx], n);
+
+    pthread_mutex_lock(&w->mutex);
+    w->pending[idx] = n;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    nbytes -= n;
+    idx ^= 1;
+  }
+
+  pthread_mutex_lock(&w->mutex);
+  w->finished = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(thread, NULL);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->mutex);
+  return 0;
+}
+#endif
+
+/**
+ * Implementation for ottery_st_write_fd() and ottery_st_write_fd_nolock().
+ */
+static int
+ottery_st_write_fd_impl_(struct ottery_state *st, int fd, uint64_t nbytes,
+                         int locked)
+{
+  struct ottery_fd_writer w;
+  const size_t page_len = ottery_page_len_();
+  size_t misalign;
+  uint8_t *mem;
+
+  if (ottery_st_check_init_(st))
+    return OTTERY_ERR_STATE_INIT;
+  if (fd < 0)
+    return OTTERY_ERR_INVALID_ARGUMENT;
+  if (!nbytes)
+    return 0;
+
+  memset(&w, 0, sizeof(w));
+  w.st = st;
+  w.locked = locked;
+  w.fd = fd;
+  w.buffer_len = ottery_fd_buffer_len_(fd);
+  /* Round up to whole pages, so that the second buffer is aligned too. */
+  w.buffer_len = (w.buffer_len + page_len - 1) & ~(page_len - 1);
+  if (!(w.allocation = malloc(w.buffer_len * 2 + page_len)))
+    return OTTERY_ERR_INTERNAL;
+  misalign = ((uintptr_t)w.allocation) & (page_len - 1);
+  mem = ((uint8_t *)w.allocation) + ((page_len - misalign) & (page_len - 1));
+  w.buffers[0] = mem;
+  w.buffers[1] = mem + w.buffer_len;
+
+#ifdef OTTERY_TLS_PTHREADS
+  /* Only bother with a second thread if there's more than one buffer's
+   * worth to write. */
+  if (nbytes <= w.buffer_len ||
+      ottery_fd_writer_run_threaded_(&w, nbytes) < 0)
+    ottery_fd_writer_run_serial_(&w, nbytes);
+#else
+  ottery_fd_writer_run_serial_(&w, nbytes);
+#endif
+
+  ottery_memclear_(mem, w.buffer_len * 2);
+  free(w.allocation);
+  if (w.err) {
+    errno = w.err;
+    return OTTERY_ERR_WRITE;
+  }
+  return 0;
+}
+
+int
+ottery_st_write_fd(struct ottery_state *st, int fd, uint64_t nbytes)
+{
+  return ottery_st_write_fd_impl_(st, fd, nbytes, 1);
+}
+
+int
+ottery_st_write_fd_nolock(struct ottery_state_nolock *st, int fd,
+                          uint64_t nbytes)
+{
+  return ottery_st_write_fd_impl_(st, fd, nbytes, 0);
+}
@@ -12,10 +12,20 @@
       <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 #define OTTERY_INTERNAL
-#include <stdlib.h>
 #include "ottery-internal.h"
 #include "ottery.h"
 #include "ottery_st.h"
+#include "ottery_nolock.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
 
 /**
  * Evaluate the condition 'x', while hinting to the compiler that it is
@@ -25,6 +35,9 @@
 
 /** Flag: true iff ottery_global_state_ is initialized. */
 static int ottery_global_state_initialized_ = 0;
+/** One of the OTTERY_GLOBAL_MODE_* values: tells us whether to use
+ * ottery_global_state_, a per-thread state, or a shard. */
+static int ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARED;
 /** A global state to use for the ottery_* functions that don't take a
  * state. */
 static struct ottery_state ottery_global_state_;
@@ -40,20 +53,379 @@ static struct ottery_state ottery_global_state_;
     }                                                       \
 } while (0)
 
-int
-ottery_init(const struct ottery_config *cfg)
+#ifdef OTTERY_TLS_PTHREADS
+/** Alignment for per-thread states: one cache line, so that no two
+ * threads ever write to the same line. */
+#define THREAD_STATE_ALIGN OTTERY_CACHE_LINE_LEN
+
+/** A per-thread state, along with the bookkeeping we need to tell whether
+ * it is still current. */
+struct ottery_thread_state {
+  /** The state itself. Must come first, so that it stays aligned. */
+  struct ottery_state_nolock st;
+  /** Value of ottery_thread_generation_ when we initialized st. */
+  unsigned generation;
+  /** The pointer we got from malloc, and need to pass to free. */
+  void *allocation;
+};
+
+/** Configuration to use when setting up a new per-thread state. */
+static struct ottery_config ottery_thread_config_;
+/** Incremented whenever the global state is reinitialized or wiped, so that
+ * each thread can tell that its state is out of date. */
+static unsigned ottery_thread_generation_ = 0;
+/** Key under which we store each thread's ottery_thread_state. */
+static pthread_key_t ottery_thread_key_;
+/** Used to create ottery_thread_key_ exactly once. */
+static pthread_once_t ottery_thread_key_once_ = PTHREAD_ONCE_INIT;
+/** True iff we managed to create ottery_thread_key_. */
+static int ottery_thread_key_ok_ = 0;
+
+/** Wipe and release a per-thread state. */
+static void
+ottery_thread_state_free_(void *arg)
 {
-  int n = ottery_st_init(&ottery_global_state_, cfg);
-  if (n == 0)
-    ottery_global_state_initialized_ = 1;
-  return n;
+  struct ottery_thread_state *ts = arg;
+  void *allocation;
+  if (!ts)
+    return;
+  allocation = ts->allocation;
+  ottery_st_wipe_nolock(&ts->st);
+  ottery_memclear_(ts, sizeof(*ts));
+  free(allocation);
+}
+
+/** Helper for pthread_once: create ottery_thread_key_. Per-thread states get
+ * wiped by ottery_thread_state_free_ as their threads exit. */
+static void
+ottery_thread_key_create_(void)
+{
+  if (pthread_key_create(&ottery_thread_key_, ottery_thread_state_free_) == 0)
+    ottery_thread_key_ok_ = 1;
+}
+
+/**
+ * Set up a new state for the calling thread using ottery_thread_config_,
+ * replacing any out-of-date state that it had before.
+ *
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+static int
+ottery_thread_state_new_(struct ottery_thread_state **out)
+{
+  struct ottery_thread_state *ts;
+  char *allocation;
+  size_t misalign;
+  int err;
+
+  if (pthread_once(&ottery_thread_key_once_, ottery_thread_key_create_) ||
+      !ottery_thread_key_ok_)
+    return OTTERY_ERR_LOCK_INIT;
+
+  ottery_thread_state_free_(pthread_getspecific(ottery_thread_key_));
+  pthread_setspecific(ottery_thread_key_, NULL);
+
+  /* Round the size up to a whole number of cache lines, too. */
+  allocation = malloc(((sizeof(*ts) + THREAD_STATE_ALIGN - 1) &
+                       ~(size_t)(THREAD_STATE_ALIGN - 1)) +
+                      THREAD_STATE_ALIGN);
+  if (!allocation)
+    return OTTERY_ERR_INTERNAL;
+  misalign = ((uintptr_t)allocation) & (THREAD_STATE_ALIGN - 1);
+  ts = (void *)(allocation +
+                ((THREAD_STATE_ALIGN - misalign) & (THREAD_STATE_ALIGN - 1)));
+  ts->allocation = allocation;
+  ts->generation = ottery_thread_generation_;
+
+  if ((err = ottery_st_init_nolock(&ts->st, &ottery_thread_config_))) {
+    ottery_memclear_(ts, sizeof(*ts));
+    free(allocation);
+    return err;
+  }
+  if (pthread_setspecific(ottery_thread_key_, ts)) {
+    ottery_thread_state_free_(ts);
+    return OTTERY_ERR_LOCK_INIT;
+  }
+
+  *out = ts;
+  return 0;
+}
+
+/**
+ * Return the calling thread's state, creating it if it doesn't exist or is
+ * out of date.  On failure, invoke the fatal error handler and return NULL.
+ */
+static inline struct ottery_state_nolock *
+ottery_get_thread_state_(void)
+{
+  struct ottery_thread_state *ts = NULL;
+  if (ottery_thread_key_ok_)
+    ts = pthread_getspecific(ottery_thread_key_);
+  if (UNLIKELY(!ts || ts->generation != ottery_thread_generation_)) {
+    int err;
+    if ((err = ottery_thread_state_new_(&ts))) {
+      ottery_fatal_error_(OTTERY_ERR_FLAG_GLOBAL_PRNG_INIT|err);
+      return NULL;
+    }
+  }
+  return &ts->st;
+}
+
+/** True iff the ottery_rand_* functions should use per-thread states. */
+#define USING_THREAD_STATES() \
+  (ottery_global_mode_ == OTTERY_GLOBAL_MODE_PER_THREAD)
+#else
+#define USING_THREAD_STATES() 0
+#define ottery_get_thread_state_() (NULL)
+#endif
+
+/** Return the number of CPUs that the system has configured; this is at
+ * least as large as any CPU number we will get from ottery_cpu_number_. */
+unsigned
+ottery_get_n_cpus_(void)
+{
+  long n = 0;
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  n = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_CONF)
+  n = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+  if (n < 1)
+    n = 1;
+  return (unsigned)n;
+}
+
+#ifdef OTTERY_SHARDED_STATES
+/** Largest number of shards that we will allocate, no matter how many CPUs
+ * we have. */
+#define MAX_SHARDS 1024
+/** Alignment for shards: one cache line, so that no two shards ever share
+ * a line. */
+#define SHARD_ALIGN OTTERY_CACHE_LINE_LEN
+
+/** One of the states that we use in OTTERY_GLOBAL_MODE_SHARDED. */
+struct __attribute__((aligned(SHARD_ALIGN))) ottery_shard {
+  struct ottery_state st;
+};
+
+/** Array of n_shards_ states used in OTTERY_GLOBAL_MODE_SHARDED, aligned to
+ * SHARD_ALIGN. */
+static struct ottery_shard *ottery_shards_ = NULL;
+/** Number of elements in ottery_shards_. */
+static unsigned ottery_n_shards_ = 0;
+/** The pointer we got from malloc for ottery_shards_. */
+static void *ottery_shards_allocation_ = NULL;
+
+/**
+ * Return the number of the CPU that we are probably running on right now.
+ * This is only a hint: we may have been moved to another CPU by the time
+ * the caller looks at it.
+ */
+static inline unsigned
+ottery_cpu_number_(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+  int cpu = sched_getcpu();
+  if (cpu >= 0)
+    return (unsigned)cpu;
+#elif defined(_WIN32) && defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+  return (unsigned)GetCurrentProcessorNumber();
+#endif
+  {
+    /* No way to ask which CPU we're on.  Instead, hash the location of our
+     * stack, so that at least different threads tend to use different
+     * shards. */
+    int on_stack;
+    uint32_t h = (uint32_t)(((uintptr_t)&on_stack) >> 16);
+    return (unsigned)(h * 0x9e3779b1u) >> 8;
+  }
+}
+
+/** Wipe and release all of the shards. */
+static void
+ottery_shards_free_(void)
+{
+  unsigned i;
+  for (i = 0; i < ottery_n_shards_; ++i)
+    ottery_st_wipe(&ottery_shards_[i].st);
+  free(ottery_shards_allocation_);
+  ottery_shards_ = NULL;
+  ottery_shards_allocation_ = NULL;
+  ottery_n_shards_ = 0;
 }
 
+/**
+ * Allocate and seed a new set of shards using cfg, replacing any that we
+ * had before.
+ *
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+static int
+ottery_shards_new_(const struct ottery_config *cfg)
+{
+  unsigned i, n = ottery_get_n_cpus_();
+  char *allocation;
+  size_t misalign;
+  int err;
+
+  if (n > MAX_SHARDS)
+    n = MAX_SHARDS;
+  ottery_shards_free_();
+
+  allocation = malloc(sizeof(struct ottery_shard) * n + SHARD_ALIGN);
+  if (!allocation)
+    return OTTERY_ERR_INTERNAL;
+  misalign = ((uintptr_t)allocation) & (SHARD_ALIGN - 1);
+  ottery_shards_ = (void *)(allocation +
+                            ((SHARD_ALIGN - misalign) & (SHARD_ALIGN - 1)));
+  ottery_shards_allocation_ = allocation;
+
+  for (i = 0; i < n; ++i) {
+    if ((err = ottery_st_init(&ottery_shards_[i].st, cfg))) {
+      ottery_n_shards_ = i;
+      ottery_shards_free_();
+      return err;
+    }
+  }
+  ottery_n_shards_ = n;
+  return 0;
+}
+
+/**
+ * Pick a shard for the calling thread, and return it locked.  We prefer the
+ * shard for the CPU that we're on, but if somebody else is holding it, we
+ * try its neighbor before we wait.
+ */
+static inline struct ottery_state *
+ottery_get_shard_(void)
+{
+  const unsigned n = ottery_n_shards_;
+  const unsigned idx = ottery_cpu_number_() % n;
+  struct ottery_state *st = &ottery_shards_[idx].st;
+  struct ottery_state *neighbor;
+  if (TRY_LOCK(&st->mutex)) {
+    OTTERY_STAT_ADD_(st, lock_acquisitions, 1);
+    return st;
+  }
+  neighbor = &ottery_shards_[(idx + 1) % n].st;
+  if (neighbor != st && TRY_LOCK(&neighbor->mutex)) {
+    OTTERY_STAT_ADD_(neighbor, lock_acquisitions, 1);
+    return neighbor;
+  }
+  ACQUIRE_LOCK(&st->mutex);
+  OTTERY_STAT_ADD_(st, lock_acquisitions, 1);
+  OTTERY_STAT_ADD_(st, lock_contended, 1);
+  return st;
+}
+
+/** True iff the ottery_rand_* functions should use the shards. */
+#define USING_SHARDS() \
+  (ottery_global_mode_ == OTTERY_GLOBAL_MODE_SHARDED)
+#else
+#define USING_SHARDS() 0
+#define ottery_get_shard_() (NULL)
+#endif
+
+/** True iff the ottery_rand_* functions should call the _nolock functions
+ * on a state from GET_NOLOCK_STATE(), rather than using
+ * ottery_global_state_. */
+#define USING_NOLOCK_STATES() (USING_THREAD_STATES() || USING_SHARDS())
+
+/** Set the variable 'st' to the state that the calling thread should use
+ * with the _nolock functions, or return 'rv' if we can't. */
+#define GET_NOLOCK_STATE(st, rv) do {                            \
+    (st) = USING_SHARDS() ? ottery_get_shard_()                  \
+                          : ottery_get_thread_state_();          \
+    if (UNLIKELY(!(st)))                                         \
+      return rv;                                                 \
+} while (0)
+
+/** Release a state that we got from GET_NOLOCK_STATE(). */
+#define PUT_NOLOCK_STATE(st) do {                \
+    if (USING_SHARDS())                          \
+      RELEASE_LOCK(&(st)->mutex);                \
+} while (0)
+
+/**
+ * Call "fn args" on the appropriate global state and return its result of
+ * type "type".  The expression "args" must refer to the state as "st".
+ */
+#define RETURN_GLOBAL(type, fn, args) do {                   \
+    struct ottery_state *st;                                 \
+    CHECK_INIT((type)0);                                     \
+    if (USING_NOLOCK_STATES()) {                             \
+      type result_;                                          \
+      GET_NOLOCK_STATE(st, (type)0);                         \
+      result_ = fn##_nolock args;                            \
+      PUT_NOLOCK_STATE(st);                                  \
+      return result_;                                        \
+    }                                                        \
+    st = &ottery_global_state_;                              \
+    return fn args;                                          \
+} while (0)
+
+/** As RETURN_GLOBAL, for a function that doesn't return anything. */
+#define CALL_GLOBAL(fn, args) do {                           \
+    struct ottery_state *st;                                 \
+    CHECK_INIT();                                            \
+    if (USING_NOLOCK_STATES()) {                             \
+      GET_NOLOCK_STATE(st, );                                \
+      fn##_nolock args;                                      \
+      PUT_NOLOCK_STATE(st);                                  \
+      return;                                                \
+    }                                                        \
+    st = &ottery_global_state_;                              \
+    fn args;                                                 \
+} while (0)
+
 int
-ottery_add_seed(const uint8_t *seed, size_t n)
+ottery_init(const struct ottery_config *cfg)
 {
-  CHECK_INIT(0);
-  return ottery_st_add_seed(&ottery_global_state_, seed, n);
+  int n;
+#ifdef OTTERY_SHARDED_STATES
+  if (ottery_global_mode_ == OTTERY_GLOBAL_MODE_SHARDED) {
+    ottery_global_state_initialized_ = 0;
+    ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARED;
+    ottery_shards_free_();
+  }
+  if (cfg && cfg->global_mode == OTTERY_GLOBAL_MODE_SHARDED) {
+    n = ottery_shards_new_(cfg);
+    if (n == 0) {
+      ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARDED;
+      ottery_global_state_initialized_ = 1;
+    }
+    return n;
+  }
+#endif
+#ifdef OTTERY_TLS_PTHREADS
+  if (cfg && cfg->global_mode == OTTERY_GLOBAL_MODE_PER_THREAD) {
+    struct ottery_thread_state *ts;
+    memcpy(&ottery_thread_config_, cfg, sizeof(ottery_thread_config_));
+    ++ottery_thread_generation_;
+    /* Set up the calling thread's state now, so that we can report any
+     * errors that other threads would get later. */
+    n = ottery_thread_state_new_(&ts);
+    if (n == 0) {
+      ottery_global_mode_ = OTTERY_GLOBAL_MODE_PER_THREAD;
+      ottery_global_state_initialized_ = 1;
+    }
+    return n;
+  }
+#endif
+  if (ottery_global_state_initialized_ &&
+      ottery_global_mode_ == OTTERY_GLOBAL_MODE_SHARED) {
+    /* Release whatever the old state was holding before we replace it. */
+    ottery_global_state_initialized_ = 0;
+    ottery_st_wipe(&ottery_global_state_);
+  }
+  n = ottery_st_init(&ottery_global_state_, cfg);
+  if (n == 0) {
+    ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARED;
+    ottery_global_state_initialized_ = 1;
+  }
+  return n;
 }
 
 void
@@ -61,51 +433,210 @@ ottery_wipe(void)
 {
   if (ottery_global_state_initialized_) {
     ottery_global_state_initialized_ = 0;
+#ifdef OTTERY_SHARDED_STATES
+    if (USING_SHARDS()) {
+      ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARED;
+      ottery_shards_free_();
+      return;
+    }
+#endif
+#ifdef OTTERY_TLS_PTHREADS
+    if (USING_THREAD_STATES()) {
+      /* Other threads will notice that their states are out-of-date, and
+       * wipe them, the next time they use them or when they exit. */
+      ++ottery_thread_generation_;
+      ottery_global_mode_ = OTTERY_GLOBAL_MODE_SHARED;
+      if (ottery_thread_key_ok_) {
+        ottery_thread_state_free_(pthread_getspecific(ottery_thread_key_));
+        pthread_setspecific(ottery_thread_key_, NULL);
+      }
+      return;
+    }
+#endif
     ottery_st_wipe(&ottery_global_state_);
   }
 }
 
+int
+ottery_add_seed(const uint8_t *seed, size_t n)
+{
+  RETURN_GLOBAL(int, ottery_st_add_seed, (st, seed, n));
+}
+
 void
 ottery_prevent_backtracking(void)
 {
-  CHECK_INIT();
-  ottery_st_prevent_backtracking(&ottery_global_state_);
+  CALL_GLOBAL(ottery_st_prevent_backtracking, (st));
+}
+
+int
+ottery_refill(void)
+{
+  RETURN_GLOBAL(int, ottery_st_refill, (st));
+}
+
+#if defined(OTTERY_STATS) && defined(OTTERY_SHARDED_STATES)
+/** Add the counters in src to those in dst. */
+static void
+ottery_stats_add_(struct ottery_stats *dst, const struct ottery_stats *src)
+{
+  unsigned i;
+  dst->bytes_out += src->bytes_out;
+  dst->prf_blocks += src->prf_blocks;
+  dst->rekeys += src->rekeys;
+  dst->reseeds += src->reseeds;
+  dst->postfork_reseeds += src->postfork_reseeds;
+  dst->add_seed_calls += src->add_seed_calls;
+  dst->lock_acquisitions += src->lock_acquisitions;
+  dst->lock_contended += src->lock_contended;
+  dst->pr_mixes += src->pr_mixes;
+  dst->n_entropy_sources = src->n_entropy_sources;
+  for (i = 0; i < src->n_entropy_sources; ++i) {
+    dst->entropy_source[i] = src->entropy_source[i];
+    dst->entropy_calls[i] += src->entropy_calls[i];
+    dst->entropy_failures[i] += src->entropy_failures[i];
+    dst->entropy_nsec[i] += src->entropy_nsec[i];
+  }
+}
+#endif
+
+int
+ottery_get_stats(struct ottery_stats *stats_out)
+{
+#if defined(OTTERY_STATS) && defined(OTTERY_SHARDED_STATES)
+  CHECK_INIT(OTTERY_ERR_STATE_INIT);
+  if (USING_SHARDS()) {
+    struct ottery_stats shard_stats;
+    unsigned i;
+    int err;
+    memset(stats_out, 0, sizeof(*stats_out));
+    for (i = 0; i < ottery_n_shards_; ++i) {
+      if ((err = ottery_st_get_stats(&ottery_shards_[i].st, &shard_stats)))
+        return err;
+      ottery_stats_add_(stats_out, &shard_stats);
+    }
+    return 0;
+  }
+#endif
+  RETURN_GLOBAL(int, ottery_st_get_stats, (st, stats_out));
 }
 
 void
 ottery_rand_bytes(void *out, size_t n)
 {
-  CHECK_INIT();
-  ottery_st_rand_bytes(&ottery_global_state_, out, n);
+  CALL_GLOBAL(ottery_st_rand_bytes, (st, out, n));
+}
+
+void
+ottery_rand_bytes_parallel(void *out, size_t n, unsigned max_threads)
+{
+  CALL_GLOBAL(ottery_st_rand_bytes_parallel, (st, out, n, max_threads));
 }
 
 unsigned
 ottery_rand_unsigned(void)
 {
-  CHECK_INIT(0);
-  return ottery_st_rand_unsigned(&ottery_global_state_);
+  RETURN_GLOBAL(unsigned, ottery_st_rand_unsigned, (st));
 }
+
 uint32_t
 ottery_rand_uint32(void)
 {
-  CHECK_INIT(0);
-  return ottery_st_rand_uint32(&ottery_global_state_);
+  RETURN_GLOBAL(uint32_t, ottery_st_rand_uint32, (st));
 }
+
 uint64_t
 ottery_rand_uint64(void)
 {
-  CHECK_INIT(0);
-  return ottery_st_rand_uint64(&ottery_global_state_);
+  RETURN_GLOBAL(uint64_t, ottery_st_rand_uint64, (st));
+}
+
+void
+ottery_rand_uint32_array(uint32_t *out, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_uint32_array, (st, out, n));
+}
+
+void
+ottery_rand_uint64_array(uint64_t *out, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_uint64_array, (st, out, n));
 }
+
 unsigned
 ottery_rand_range(unsigned top)
 {
-  CHECK_INIT(0);
-  return ottery_st_rand_range(&ottery_global_state_, top);
+  RETURN_GLOBAL(unsigned, ottery_st_rand_range, (st, top));
 }
+
 uint64_t
 ottery_rand_range64(uint64_t top)
 {
-  CHECK_INIT(0);
-  return ottery_st_rand_range64(&ottery_global_state_, top);
+  RETURN_GLOBAL(uint64_t, ottery_st_rand_range64, (st, top));
+}
+
+void
+ottery_rand_range_array(unsigned *out, size_t n, unsigned top)
+{
+  CALL_GLOBAL(ottery_st_rand_range_array, (st, out, n, top));
+}
+
+void
+ottery_rand_range_array_bounds(unsigned *out, const unsigned *tops, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_range_array_bounds, (st, out, tops, n));
+}
+
+void
+ottery_rand_range64_array(uint64_t *out, size_t n, uint64_t top)
+{
+  CALL_GLOBAL(ottery_st_rand_range64_array, (st, out, n, top));
+}
+
+void
+ottery_rand_range64_array_bounds(uint64_t *out, const uint64_t *tops, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_range64_array_bounds, (st, out, tops, n));
+}
+
+void
+ottery_shuffle(void *base, size_t nmemb, size_t size)
+{
+  CALL_GLOBAL(ottery_st_shuffle, (st, base, nmemb, size));
+}
+
+int
+ottery_sample_indices(size_t n, size_t k, size_t *out)
+{
+  RETURN_GLOBAL(int, ottery_st_sample_indices, (st, n, k, out));
+}
+
+void
+ottery_reservoir_slots(uint64_t n_seen, size_t k, size_t *slots, size_t n)
+{
+  CALL_GLOBAL(ottery_st_reservoir_slots, (st, n_seen, k, slots, n));
+}
+
+double
+ottery_rand_double(void)
+{
+  RETURN_GLOBAL(double, ottery_st_rand_double, (st));
+}
+
+float
+ottery_rand_float(void)
+{
+  RETURN_GLOBAL(float, ottery_st_rand_float, (st));
+}
+
+void
+ottery_rand_double_array(double *out, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_double_array, (st, out, n));
+}
+
+void
+ottery_rand_float_array(float *out, size_t n)
+{
+  CALL_GLOBAL(ottery_st_rand_float_array, (st, out, n));
 }
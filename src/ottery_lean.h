@@ -0,0 +1,168 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+#ifndef OTTERY_LEAN_H_HEADER_INCLUDED_
+#define OTTERY_LEAN_H_HEADER_INCLUDED_
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ottery_common.h"
+
+/** @file */
+
+struct ottery_config;
+struct ottery_lean_state;
+
+/** Size reserved for struct ottery_lean_state */
+#define OTTERY_LEAN_STATE_DUMMY_SIZE_ 256
+
+#ifndef OTTERY_INTERNAL
+/**
+ * The state for a small, non-thread-safe libottery PRNG.
+ *
+ * An ottery_state or ottery_state_nolock takes up about a kilobyte and a
+ * half.  That's fine for a few states, but too much if you want a separate
+ * PRNG for each of a million network connections.  An ottery_lean_state
+ * takes a few hundred bytes instead.  It buffers much less output at a
+ * time, so it has to run the PRF more often and rekeys more often, and it
+ * keeps a pointer to its ottery_config rather than a copy.
+ *
+ * Like struct ottery_state_nolock, this structure (and its associated
+ * functions) are not thread safe.  If you try to use this structure in more
+ * than one thread at a time, your program's behavior will be undefined.
+ *
+ * An ottery_lean_state structure is constucted with ottery_lean_init().  It
+ * MUST be aligned on a 16-byte boundary.
+ *
+ * The contents of this structure are opaque; The definition here is
+ * defined to be large enough so that programs that allocate it will get
+ * more than enough room.
+ */
+struct __attribute__((aligned(16))) ottery_lean_state {
+  /** Nothing to see here */
+  uint8_t dummy_[OTTERY_LEAN_STATE_DUMMY_SIZE_];
+};
+#endif
+
+/**
+ * Get the minimal size for allocating an ottery_lean_state.
+ *
+ * sizeof(ottery_lean_state) will give an overestimate to allow binary
+ * compatibility with future versions of libottery. Use this function instead
+ * to get the minimal number of bytes to allocate.
+ *
+ * @return The minimal number of bytes to use when allocating an
+ *   ottery_lean_state structure.
+ */
+size_t ottery_get_sizeof_lean_state(void);
+
+/**
+ * Initialize an ottery_lean_state structure.
+ *
+ * You must call this function on any ottery_lean_state structure before
+ * calling any other functions on it.
+ *
+ * Unlike ottery_st_init(), this function does not copy the configuration:
+ * the state uses it again whenever it needs to reseed itself from the
+ * operating system (for example, after a fork).  So if you pass an
+ * ottery_config, it must remain valid and unchanged for as long as you use
+ * the state.  You can share the same ottery_config among as many lean states
+ * as you like.
+ *
+ * If the configuration names a PRF whose blocks are too large for a lean
+ * state, we use a small-output version of the same algorithm instead.
+ *
+ * @param st The ottery_lean_state to initialize.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_lean_init(struct ottery_lean_state *st,
+                     const struct ottery_config *cfg);
+
+/**
+ * Destroy an ottery_lean_state structure.
+ *
+ * An ottery_lean_state holds no resources besides its own memory, but
+ * you should call this before freeing it, so that no secrets are left
+ * behind.
+ *
+ * @param st The state to wipe.
+ */
+void ottery_lean_wipe(struct ottery_lean_state *st);
+
+/**
+ * Use an ottery_lean_state structure to fill a buffer with random bytes.
+ *
+ * @param st The state structure to use.
+ * @param buf The buffer to fill.
+ * @param n The number of bytes to write.
+ */
+void ottery_lean_rand_bytes(struct ottery_lean_state *st, void *buf, size_t n);
+/**
+ * Use an ottery_lean_state structure to generate a random number of type
+ * unsigned.
+ *
+ * @param st The state structure to use.
+ * @return A random number between 0 and UINT_MAX included,
+ *   chosen uniformly.
+ */
+unsigned ottery_lean_rand_unsigned(struct ottery_lean_state *st);
+/**
+ * Use an ottery_lean_state structure to generate a random number of type
+ * uint32_t.
+ *
+ * @param st The state structure to use.
+ * @return A random number between 0 and UINT32_MAX included,
+ *   chosen uniformly.
+ */
+uint32_t ottery_lean_rand_uint32(struct ottery_lean_state *st);
+/**
+ * Use an ottery_lean_state structure to generate a random number of type
+ * uint64_t.
+ *
+ * @param st The state structure to use.
+ * @return A random number between 0 and UINT64_MAX included,
+ *   chosen uniformly.
+ */
+uint64_t ottery_lean_rand_uint64(struct ottery_lean_state *st);
+/**
+ * Use an ottery_lean_state structure to generate a random number of type
+ * unsigned in a given range.
+ *
+ * @param st The state structure to use.
+ * @param top The upper bound of the range (inclusive).
+ * @return A random number no larger than top, and no less than 0,
+ *   chosen uniformly.
+ */
+unsigned ottery_lean_rand_range(struct ottery_lean_state *st, unsigned top);
+/**
+ * Use an ottery_lean_state structure to generate a random number of type
+ * uint64_t in a given range.
+ *
+ * @param st The state structure to use.
+ * @param top The upper bound of the range (inclusive).
+ * @return A random number no larger than top, and no less than 0,
+ *   chosen uniformly.
+ */
+uint64_t ottery_lean_rand_range64(struct ottery_lean_state *st, uint64_t top);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
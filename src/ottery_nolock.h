@@ -14,6 +14,7 @@
 #ifndef OTTERY_NOLOCK_H_HEADER_INCLUDED_
 #define OTTERY_NOLOCK_H_HEADER_INCLUDED_
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -81,6 +82,23 @@ size_t ottery_get_sizeof_state_nolock(void);
  */
 int ottery_st_init_nolock(struct ottery_state_nolock *st, const struct ottery_config *cfg);
 
+/**
+ * Initialize an ottery_state_nolock structure from a seed that you supply,
+ * without asking the operating system for any entropy.
+ *
+ * See ottery_st_init_from_seed() for details, and for a warning.
+ *
+ * @param st The ottery_state_nolock to initialize.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().
+ * @param seed The bytes to seed the state with.
+ * @param n The number of bytes in seed.  It must not be zero.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_init_from_seed_nolock(struct ottery_state_nolock *st,
+                                    const struct ottery_config *cfg,
+                                    const uint8_t *seed, size_t n);
+
 /**
  * Add more entropy to an ottery_state_nolock structure.
  *
@@ -101,6 +119,19 @@ int ottery_st_init_nolock(struct ottery_state_nolock *st, const struct ottery_co
  */
 int ottery_st_add_seed_nolock(struct ottery_state_nolock *st, const uint8_t *seed, size_t n);
 
+/**
+ * Allocate and initialize a new ottery_state_nolock structure.
+ *
+ * As ottery_st_new(), except that the state has no lock.
+ *
+ * @param st_out On success, set to point to the new state.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_new_nolock(struct ottery_state_nolock **st_out,
+                         const struct ottery_config *cfg);
+
 /**
  * Destroy an ottery_state_nolock structure and release any resources that it
  * might hold.
@@ -112,6 +143,13 @@ int ottery_st_add_seed_nolock(struct ottery_state_nolock *st, const uint8_t *see
  */
 void ottery_st_wipe_nolock(struct ottery_state_nolock *st);
 
+/**
+ * Wipe and release a state that was allocated with ottery_st_new_nolock().
+ *
+ * @param st The state to free, or NULL.
+ */
+void ottery_st_free_nolock(struct ottery_state_nolock *st);
+
 /**
  * Explicitly prevent backtracking attacks. (Usually needless).
  *
@@ -121,15 +159,87 @@ void ottery_st_wipe_nolock(struct ottery_state_nolock *st);
  *
  * You should not usually need to call this function: Libottery provides
  * backtracking resistance by default, so unless you have manually recompiled
- * with the OTTERY_NO_CLEAR_AFTER_YIELD option, this function isn't
- * necessary and has no effect.  Even *with* OTTERY_NO_CLEAR_AFTER_YIELD,
- * this function isn't necessary in ordinary operation: the libottery state is
- * implicitly "stirred" every 1k or so.
+ * with the OTTERY_NO_CLEAR_AFTER_YIELD option, or picked a different mode
+ * with ottery_config_set_clear_mode(), this function isn't necessary and has
+ * no effect.  Even then, this function isn't necessary in ordinary
+ * operation: the libottery state is implicitly "stirred" every 1k or so.
  *
  * @param st The state to stir.
  */
 void ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st);
 
+/**
+ * Precompute the next block of output for the state, so that the next call
+ * that runs out of buffered output doesn't have to wait for the PRF.
+ *
+ * Whenever a state runs out of buffered output, it generates a new block and
+ * immediately rekeys itself from the start of that block.  Usually, that
+ * happens inside whichever call to ottery_st_rand_*_nolock() needed the
+ * bytes.  Once this function has been called, that call just copies the
+ * precomputed block and key into place instead.
+ *
+ * The precomputed block is derived from the current key, so keeping it
+ * around doesn't give an attacker who compromises the state anything that
+ * they couldn't compute from the state anyway: bytes that have already been
+ * returned remain unrecoverable.  If the state is reseeded or stirred before
+ * the block is used, the block is discarded and wiped.
+ * ottery_st_wipe_nolock() wipes it too.
+ *
+ * You might call this from a helper thread, or whenever your program is
+ * idle.  The first call allocates room for a whole output buffer (up to 1k
+ * per block set with ottery_config_set_buffer_blocks()) plus about half a
+ * kilobyte of saved PRF state; all of it is released by
+ * ottery_st_wipe_nolock().
+ *
+ * @param st The state to refill.
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_st_refill_nolock(struct ottery_state_nolock *st);
+
+/**
+ * Initialize a new ottery_state_nolock from some of the output of an
+ * existing one.
+ *
+ * See ottery_st_split() for details.
+ *
+ * @param parent The state to take the child's seed from.
+ * @param child The state to initialize.  It must not be initialized
+ *   already, and it must not be the parent.
+ * @param stream_id A number that tells this child apart from its siblings.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_split_nolock(struct ottery_state_nolock *parent,
+                           struct ottery_state_nolock *child,
+                           uint64_t stream_id);
+
+/**
+ * Skip ahead in an ottery_state_nolock's stream.
+ *
+ * See ottery_st_seek() for details.
+ *
+ * @param st The state to advance.
+ * @param block_offset The number of PRF blocks to skip.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if block_offset
+ *   is so large that the PRF's block counter would wrap around.
+ */
+int ottery_st_seek_nolock(struct ottery_state_nolock *st,
+                          uint64_t block_offset);
+
+/**
+ * Get the performance counters for an ottery_state_nolock.
+ *
+ * This only works if libottery was built with --enable-stats.  An
+ * ottery_state_nolock never counts any lock acquisitions.
+ *
+ * @param st The state to look at.
+ * @param stats_out A structure to fill with the state's counters. If we
+ *   don't keep counters, we fill it with zeros.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if libottery was
+ *   built without --enable-stats.
+ */
+int ottery_st_get_stats_nolock(struct ottery_state_nolock *st,
+                               struct ottery_stats *stats_out);
+
 /**
  * Use an ottery_state_nolock structure to fill a buffer with random bytes.
  *
@@ -138,6 +248,38 @@ void ottery_st_prevent_backtracking_nolock(struct ottery_state_nolock *st);
  * @param n The number of bytes to write.
  */
 void ottery_st_rand_bytes_nolock(struct ottery_state_nolock *st, void *buf, size_t n);
+
+/**
+ * Use an ottery_state_nolock structure to fill a large buffer with random
+ * bytes, using several threads at once.
+ *
+ * See ottery_st_rand_bytes_parallel() for details.  The state itself is
+ * only used from the calling thread.
+ *
+ * @param st The state structure to use.
+ * @param buf The buffer to fill.
+ * @param n The number of bytes to write.
+ * @param max_threads The most threads to use, counting the calling thread,
+ *   or 0 for one per CPU.
+ */
+void ottery_st_rand_bytes_parallel_nolock(struct ottery_state_nolock *st,
+                                          void *buf, size_t n,
+                                          unsigned max_threads);
+
+/**
+ * Use an ottery_state_nolock structure to write random bytes to a file
+ * descriptor.
+ *
+ * See ottery_st_write_fd() for details.  The state is only used from the
+ * calling thread.
+ *
+ * @param st The state structure to use.
+ * @param fd The file descriptor to write to.  It must be in blocking mode.
+ * @param nbytes The number of bytes to write.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_write_fd_nolock(struct ottery_state_nolock *st, int fd,
+                              uint64_t nbytes);
 /**
  * Use an ottery_state_nolock structure to generate a random number of type unsigned.
  *
@@ -162,6 +304,28 @@ uint32_t ottery_st_rand_uint32_nolock(struct ottery_state_nolock *st);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_uint64_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint32_t.  This is much faster than calling
+ * ottery_st_rand_uint32_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_uint32_array_nolock(struct ottery_state_nolock *st,
+                                        uint32_t *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint64_t.  This is much faster than calling
+ * ottery_st_rand_uint64_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_uint64_array_nolock(struct ottery_state_nolock *st,
+                                        uint64_t *out, size_t n);
 /**
  * Use an ottery_state_nolock structure to generate a random number of type unsigned
  * in a given range.
@@ -182,6 +346,264 @@ unsigned ottery_st_rand_range_nolock(struct ottery_state_nolock *st, unsigned to
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_range64_nolock(struct ottery_state_nolock *st, uint64_t top);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type unsigned in a given range.  This is much faster than calling
+ * ottery_st_rand_range_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range_array_nolock(struct ottery_state_nolock *st,
+                                       unsigned *out, size_t n, unsigned top);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type unsigned, each in its own range.  This is much faster than calling
+ * ottery_st_rand_range_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_range_array_bounds_nolock(struct ottery_state_nolock *st,
+                                              unsigned *out,
+                                              const unsigned *tops, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint64_t in a given range.  This is much faster than calling
+ * ottery_st_rand_range64_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range64_array_nolock(struct ottery_state_nolock *st,
+                                         uint64_t *out, size_t n,
+                                         uint64_t top);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type uint64_t, each in its own range.  This is much faster than calling
+ * ottery_st_rand_range64_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_range64_array_bounds_nolock(struct ottery_state_nolock *st,
+                                                uint64_t *out,
+                                                const uint64_t *tops,
+                                                size_t n);
+/**
+ * Use an ottery_state_nolock structure to put the nmemb elements of an
+ * array into a uniformly random order.  This is much faster than calling
+ * ottery_st_rand_range64_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_st_shuffle_nolock(struct ottery_state_nolock *st, void *base,
+                              size_t nmemb, size_t size);
+/**
+ * Use an ottery_state_nolock structure to choose k distinct indices from
+ * [0, n), uniformly at random and in a random order.
+ *
+ * This takes time and temporary memory in proportion to k, not n.
+ *
+ * @param st The state structure to use.
+ * @param n The number of indices to choose from.
+ * @param k The number of indices to choose.  Must be no more than n.
+ * @param out An array of k elements to hold the indices.
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_st_sample_indices_nolock(struct ottery_state_nolock *st, size_t n,
+                                    size_t k, size_t *out);
+/**
+ * Use an ottery_state_nolock structure to run reservoir sampling over a
+ * stream.  See ottery_st_reservoir_slots() for details.
+ *
+ * @param st The state structure to use.
+ * @param n_seen The number of items in the stream before these ones.
+ * @param k The size of the reservoir.
+ * @param slots The array to fill.
+ * @param n The number of items to handle.
+ */
+void ottery_st_reservoir_slots_nolock(struct ottery_state_nolock *st,
+                                      uint64_t n_seen, size_t k,
+                                      size_t *slots, size_t n);
+/**
+ * Use an ottery_state_nolock structure to generate a random number of type
+ * double, chosen uniformly from [0.0, 1.0).
+ *
+ * @param st The state structure to use.
+ * @return A random multiple of 2^-52 no less than 0.0 and less than 1.0.
+ */
+double ottery_st_rand_double_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to generate a random number of type
+ * float, chosen uniformly from [0.0, 1.0).
+ *
+ * @param st The state structure to use.
+ * @return A random multiple of 2^-23 no less than 0.0 and less than 1.0.
+ */
+float ottery_st_rand_float_nolock(struct ottery_state_nolock *st);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type double, as returned by ottery_st_rand_double_nolock().  This is
+ * much faster than calling ottery_st_rand_double_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_double_array_nolock(struct ottery_state_nolock *st,
+                                        double *out, size_t n);
+/**
+ * Use an ottery_state_nolock structure to fill an array with random numbers
+ * of type float, as returned by ottery_st_rand_float_nolock().  This is much
+ * faster than calling ottery_st_rand_float_nolock() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_float_array_nolock(struct ottery_state_nolock *st,
+                                       float *out, size_t n);
+
+/** Number of bytes that an ottery_fast_view_nolock draws at a time. */
+#define OTTERY_FAST_VIEW_LEN 128
+
+/**
+ * A small cache of output from an ottery_state_nolock, so that
+ * ottery_fast_rand_uint32_nolock() and ottery_fast_rand_uint64_nolock()
+ * can run inline.  Most draws cost a bounds check, two loads to check for
+ * a fork, a copy and a wipe.  Only one draw in every
+ * OTTERY_FAST_VIEW_LEN bytes calls into the library, to fetch the next
+ * OTTERY_FAST_VIEW_LEN bytes with ottery_st_rand_bytes_nolock().
+ *
+ * The view keeps its own copy of the bytes, so you can keep using the
+ * state directly, or through other views, while you use it.  The bytes
+ * have already left the state, though.  Until you draw them they sit in
+ * the view, where anybody who can read your memory can see them, so wipe
+ * the view with ottery_fast_view_wipe_nolock() when you're done.  Don't
+ * copy a view, or the copies will return the same numbers.
+ *
+ * If we get no warning of a fork other than getpid(), as on Windows, every
+ * draw just calls ottery_st_rand_uint32_nolock() or
+ * ottery_st_rand_uint64_nolock().
+ *
+ * Everything in here is private; set it up with
+ * ottery_st_fast_view_init_nolock().
+ */
+struct ottery_fast_view_nolock {
+  /** Bytes that we haven't drawn yet, starting at pos_. */
+  uint8_t buf_[OTTERY_FAST_VIEW_LEN];
+  /** Index of the next byte to draw from buf_. */
+  unsigned pos_;
+  /** Value of *fork_gen_ when we filled buf_. */
+  uint32_t fork_gen_value_;
+  /** Becomes zero when we fork, if the kernel can tell us so; otherwise
+   * stays nonzero iff the library notices forks without getpid(). */
+  const volatile uint8_t *fork_page_;
+  /** Changes in the child when we fork. */
+  const volatile uint32_t *fork_gen_;
+  /** The state to take bytes from. */
+  struct ottery_state_nolock *st_;
+};
+
+/**
+ * Set up a fast view of an ottery_state_nolock.
+ *
+ * @param view The view to set up.
+ * @param st The state to take bytes from.  It must stay initialized for as
+ *   long as you use the view.
+ * @return Zero on success, or OTTERY_ERR_STATE_INIT if st isn't
+ *   initialized.
+ */
+int ottery_st_fast_view_init_nolock(struct ottery_fast_view_nolock *view,
+                                    struct ottery_state_nolock *st);
+
+/**
+ * Wipe a fast view, along with any bytes in it that we haven't drawn yet.
+ *
+ * @param view The view to wipe.
+ */
+void ottery_fast_view_wipe_nolock(struct ottery_fast_view_nolock *view);
+
+/**
+ * Helper for ottery_fast_rand_uint32_nolock() and
+ * ottery_fast_rand_uint64_nolock(): fill a view with fresh bytes.  Return
+ * 1 on success, or 0 if we can't use a fast view in this process.
+ */
+int ottery_fast_view_refill_nolock_(struct ottery_fast_view_nolock *view);
+
+/** Helper: load *p so that we also see whatever the thread that stored it
+ * wrote first.  In a child process, the library counts a fork in *fork_gen_
+ * before it marks *fork_page_ again, so if we see the mark, we see the new
+ * count too. */
+#if defined(__GNUC__) || defined(__clang__)
+#define OTTERY_FAST_VIEW_LOAD_(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+#define OTTERY_FAST_VIEW_LOAD_(p) (*(p))
+#endif
+
+/** Helper: true iff view has at least n bytes left, and we haven't forked
+ * since it got them. */
+#define OTTERY_FAST_VIEW_READY_(view, n)                          \
+  ((view)->pos_ <= OTTERY_FAST_VIEW_LEN - (n) &&                  \
+   OTTERY_FAST_VIEW_LOAD_((view)->fork_page_) &&                  \
+   *(view)->fork_gen_ == (view)->fork_gen_value_)
+
+/**
+ * Use a fast view to generate a random number of type uint32_t.  This
+ * gives the same numbers as ottery_st_rand_uint32_nolock() would, but not
+ * in the same order with respect to other uses of the state.
+ *
+ * @param view The fast view to use.
+ * @return A random number between 0 and UINT32_MAX included,
+ *   chosen uniformly.
+ */
+static inline uint32_t
+ottery_fast_rand_uint32_nolock(struct ottery_fast_view_nolock *view)
+{
+  uint32_t result;
+  if (!OTTERY_FAST_VIEW_READY_(view, sizeof(result)) &&
+      !ottery_fast_view_refill_nolock_(view))
+    return ottery_st_rand_uint32_nolock(view->st_);
+  memcpy(&result, view->buf_ + view->pos_, sizeof(result));
+  memset(view->buf_ + view->pos_, 0, sizeof(result));
+  view->pos_ += sizeof(result);
+  return result;
+}
+
+/**
+ * Use a fast view to generate a random number of type uint64_t.  As
+ * ottery_fast_rand_uint32_nolock().
+ *
+ * @param view The fast view to use.
+ * @return A random number between 0 and UINT64_MAX included,
+ *   chosen uniformly.
+ */
+static inline uint64_t
+ottery_fast_rand_uint64_nolock(struct ottery_fast_view_nolock *view)
+{
+  uint64_t result;
+  if (!OTTERY_FAST_VIEW_READY_(view, sizeof(result)) &&
+      !ottery_fast_view_refill_nolock_(view))
+    return ottery_st_rand_uint64_nolock(view->st_);
+  memcpy(&result, view->buf_ + view->pos_, sizeof(result));
+  memset(view->buf_ + view->pos_, 0, sizeof(result));
+  view->pos_ += sizeof(result);
+  return result;
+}
 
 #ifdef __cplusplus
 }
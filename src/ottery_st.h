@@ -75,6 +75,70 @@ size_t ottery_get_sizeof_state(void);
  */
 int ottery_st_init(struct ottery_state *st, const struct ottery_config *cfg);
 
+/**
+ * Initialize an ottery_state structure from a seed that you supply, without
+ * asking the operating system for any entropy.
+ *
+ * Two states initialized with the same seed and configuration yield the
+ * same output, so long as they use the same PRF implementation.  (The SIMD
+ * implementations of a PRF differ in their block sizes, and so in their
+ * output; use ottery_config_force_implementation() to pick one if you need
+ * the same output on different machines.)  That's useful for
+ * reproducible simulations; it's terrible for anything that needs to be
+ * unpredictable, unless the seed is itself secret and random.
+ *
+ * If the process forks, the state in the child reseeds itself from the
+ * operating system as usual, and stops being reproducible.  So does a
+ * call to ottery_st_add_seed() with a NULL seed.
+ *
+ * See also ottery_st_split() and ottery_st_seek(), for giving each of
+ * several threads a stream of its own.
+ *
+ * @param st The ottery_state to initialize.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().  Its entropy settings only
+ *   matter for later reseeds.
+ * @param seed The bytes to seed the state with.
+ * @param n The number of bytes in seed.  It must not be zero.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_init_from_seed(struct ottery_state *st,
+                             const struct ottery_config *cfg,
+                             const uint8_t *seed, size_t n);
+
+/**
+ * Allocate and initialize a new ottery_state structure.
+ *
+ * The state is aligned to a cache line, and padded out to a whole number of
+ * them, so that no other data shares a line with it.  To lock the state into
+ * memory or keep it out of core dumps, see ottery_config_set_alloc_flags().
+ *
+ * @param st_out On success, set to point to the new state.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_new(struct ottery_state **st_out,
+                  const struct ottery_config *cfg);
+
+/**
+ * Allocate and initialize n new ottery_state structures at once.
+ *
+ * This works like calling ottery_st_new() n times, except that the states
+ * share a single allocation.  They still each get cache lines of their own,
+ * but when they are locked into memory, they share the locked pages.
+ * Each state is seeded separately.
+ *
+ * @param states_out An array of n pointers. On success, we set each one to
+ *   point to a new state.
+ * @param n The number of states to create. Must be at least 1.
+ * @param cfg Either NULL, or an ottery_config structure that has been
+ *   initialized with ottery_config_init().
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_new_array(struct ottery_state **states_out, size_t n,
+                        const struct ottery_config *cfg);
+
 /**
  * Add more entropy to an ottery_state structure.
  *
@@ -106,6 +170,23 @@ int ottery_st_add_seed(struct ottery_state *st, const uint8_t *seed, size_t n);
  */
 void ottery_st_wipe(struct ottery_state *st);
 
+/**
+ * Wipe and release a state that was allocated with ottery_st_new().
+ *
+ * @param st The state to free, or NULL.
+ */
+void ottery_st_free(struct ottery_state *st);
+
+/**
+ * Wipe and release every state that was allocated by one call to
+ * ottery_st_new_array().
+ *
+ * @param states The array of pointers that ottery_st_new_array() filled
+ *   in, unchanged.
+ * @param n The number of states that we allocated in that call.
+ */
+void ottery_st_free_array(struct ottery_state **states, size_t n);
+
 /**
  * Explicitly prevent backtracking attacks. (Usually needless).
  *
@@ -115,15 +196,112 @@ void ottery_st_wipe(struct ottery_state *st);
  *
  * You should not usually need to call this function: Libottery provides
  * backtracking resistance by default, so unless you have manually recompiled
- * with the OTTERY_NO_CLEAR_AFTER_YIELD option, this function isn't
- * necessary and has no effect.  Even *with* OTTERY_NO_CLEAR_AFTER_YIELD,
- * this function isn't necessary in ordinary operation: the libottery state is
- * implicitly "stirred" every 1k or so.
+ * with the OTTERY_NO_CLEAR_AFTER_YIELD option, or picked a different mode
+ * with ottery_config_set_clear_mode(), this function isn't necessary and has
+ * no effect.  Even then, this function isn't necessary in ordinary
+ * operation: the libottery state is implicitly "stirred" every 1k or so.
  *
  * @param st The state to stir.
  */
 void ottery_st_prevent_backtracking(struct ottery_state *st);
 
+/**
+ * Precompute the next block of output for the state, so that the next call
+ * that runs out of buffered output doesn't have to wait for the PRF.
+ *
+ * Whenever a state runs out of buffered output, it generates a new block and
+ * immediately rekeys itself from the start of that block.  Usually, that
+ * happens inside whichever call to ottery_st_rand_*() needed the bytes.
+ * Once this function has been called, that call just copies the precomputed
+ * block and key into place instead.
+ *
+ * The precomputed block is derived from the current key, so keeping it
+ * around doesn't give an attacker who compromises the state anything that
+ * they couldn't compute from the state anyway: bytes that have already been
+ * returned remain unrecoverable.  If the state is reseeded or stirred before
+ * the block is used, the block is discarded and wiped.  ottery_st_wipe()
+ * wipes it too.
+ *
+ * You might call this from a helper thread, or whenever your program is
+ * idle.  The first call allocates room for a whole output buffer (up to 1k
+ * per block set with ottery_config_set_buffer_blocks()) plus about half a
+ * kilobyte of saved PRF state; all of it is released by ottery_st_wipe().
+ * The PRF itself runs without holding the lock, so other threads can keep
+ * using the state meanwhile; if they use it up first, our block is thrown
+ * away.
+ *
+ * If the state uses prediction resistance (see
+ * ottery_config_set_prediction_resistance()) and has used up at least half
+ * of its batch of CPU entropy, this function also fetches the next batch,
+ * again without holding the lock.
+ *
+ * @param st The state to refill.
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_st_refill(struct ottery_state *st);
+
+/**
+ * Initialize a new ottery_state from some of the output of an existing one.
+ *
+ * The child gets the parent's PRF and configuration, and a seed made from
+ * prf.state_bytes bytes of the parent's output along with stream_id.  The
+ * seed never comes from the operating system, so if the parent is
+ * reproducible (see ottery_st_init_from_seed()), so are its children, as
+ * long as you make the same calls in the same order.  Children with
+ * different stream_id values get unrelated output, even if they were split
+ * from the parent at the same point.
+ *
+ * Taking the seed advances the parent just as drawing that many bytes with
+ * ottery_st_rand_bytes() would.  Nothing that the parent yields later has
+ * anything to do with the child's seed.
+ *
+ * @param parent The state to take the child's seed from.
+ * @param child The state to initialize.  It must not be initialized
+ *   already, and it must not be the parent.
+ * @param stream_id A number that tells this child apart from its siblings.
+ * @return Zero on success, or one of the OTTERY_ERR_* error codes on failure.
+ */
+int ottery_st_split(struct ottery_state *parent, struct ottery_state *child,
+                    uint64_t stream_id);
+
+/**
+ * Skip ahead in an ottery_state's stream.
+ *
+ * Throw away any buffered output, skip over the next block_offset blocks
+ * that the PRF would generate, and then rekey the state from the block
+ * after those.
+ *
+ * States that start out the same (for example, from the same
+ * ottery_st_init_from_seed() call) and then skip ahead by offsets that
+ * differ by at least the number of blocks in their buffers will never
+ * yield the same output.  So you can give thread i its own reproducible
+ * stream by seeding its state like everybody else's, and then skipping by
+ * i times that many blocks.
+ *
+ * @param st The state to advance.
+ * @param block_offset The number of PRF blocks to skip.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if block_offset
+ *   is so large that the PRF's block counter would wrap around.  For the
+ *   ChaCha PRFs, that happens well short of 2^32 blocks: as early as 2^28,
+ *   depending on the implementation.
+ */
+int ottery_st_seek(struct ottery_state *st, uint64_t block_offset);
+
+/**
+ * Get the performance counters for an ottery_state.
+ *
+ * This only works if libottery was built with --enable-stats.  Counting
+ * costs a little time on every call, so it's off by default.
+ *
+ * @param st The state to look at.
+ * @param stats_out A structure to fill with the state's counters. If we
+ *   don't keep counters, we fill it with zeros.
+ * @return Zero on success, or OTTERY_ERR_INVALID_ARGUMENT if libottery was
+ *   built without --enable-stats.
+ */
+int ottery_st_get_stats(struct ottery_state *st,
+                        struct ottery_stats *stats_out);
+
 /**
  * Use an ottery_state structure to fill a buffer with random bytes.
  *
@@ -132,6 +310,59 @@ void ottery_st_prevent_backtracking(struct ottery_state *st);
  * @param n The number of bytes to write.
  */
 void ottery_st_rand_bytes(struct ottery_state *st, void *buf, size_t n);
+
+/**
+ * Use an ottery_state structure to fill a large buffer with random bytes,
+ * using several threads at once.
+ *
+ * We take a private copy of the key, reserve the range of counter values
+ * that the request needs, and rekey the state, all before we start
+ * generating.  Then we release the lock on the state, and split the counter
+ * range across up to max_threads threads, including the calling thread.
+ *
+ * The PRF's counter only covers about 256 GB of output per key.  Requests
+ * larger than that get split into segments that each fit, and we rekey the
+ * state after each one; so their output isn't the same as
+ * ottery_st_rand_bytes() would give.  For smaller requests, the bytes, and
+ * the state afterwards, are exactly the same.
+ *
+ * The threads only last for the duration of the call.  We use a single
+ * thread for requests under a megabyte, where starting more isn't worth it;
+ * and we give each thread at least 256 KB to generate.  On platforms where
+ * we don't know how to start threads, this is the same as
+ * ottery_st_rand_bytes().
+ *
+ * @param st The state structure to use.
+ * @param buf The buffer to fill.
+ * @param n The number of bytes to write.
+ * @param max_threads The most threads to use, counting the calling thread,
+ *   or 0 for one per CPU.
+ */
+void ottery_st_rand_bytes_parallel(struct ottery_state *st, void *buf,
+                                   size_t n, unsigned max_threads);
+
+/**
+ * Use an ottery_state structure to write random bytes to a file
+ * descriptor.
+ *
+ * We generate the bytes into a pair of page-aligned buffers, sized for the
+ * kind of file that fd refers to: a megabyte for regular files and block
+ * devices, and the pipe's capacity (or 64 KB) for pipes and everything
+ * else.  Where we have threads, we generate each buffer while another
+ * thread writes the one before it.  We retry short writes, and writes that
+ * a signal interrupted.
+ *
+ * We fill each buffer with one ottery_st_rand_bytes() call, and wipe the
+ * buffers before we return.
+ *
+ * @param st The state structure to use.
+ * @param fd The file descriptor to write to.  It must be in blocking mode.
+ * @param nbytes The number of bytes to write.
+ * @return Zero on success.  OTTERY_ERR_WRITE if a write failed, in which
+ *   case errno says why, and we may have written some of the bytes.
+ *   OTTERY_ERR_INVALID_ARGUMENT if fd is negative.
+ */
+int ottery_st_write_fd(struct ottery_state *st, int fd, uint64_t nbytes);
 /**
  * Use an ottery_state structure to generate a random number of type unsigned.
  *
@@ -156,6 +387,28 @@ uint32_t ottery_st_rand_uint32(struct ottery_state *st);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_uint64(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * uint32_t.  This is much faster than calling ottery_st_rand_uint32() for
+ * each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_uint32_array(struct ottery_state *st, uint32_t *out,
+                                 size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * uint64_t.  This is much faster than calling ottery_st_rand_uint64() for
+ * each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_uint64_array(struct ottery_state *st, uint64_t *out,
+                                 size_t n);
 /**
  * Use an ottery_state structure to generate a random number of type unsigned
  * in a given range.
@@ -176,6 +429,141 @@ unsigned ottery_st_rand_range(struct ottery_state *st, unsigned top);
  *   chosen uniformly.
  */
 uint64_t ottery_st_rand_range64(struct ottery_state *st, uint64_t top);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * unsigned in a given range.  This is much faster than calling
+ * ottery_st_rand_range() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range_array(struct ottery_state *st, unsigned *out,
+                                size_t n, unsigned top);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * unsigned, each in its own range.  This is much faster than calling
+ * ottery_st_rand_range() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_range_array_bounds(struct ottery_state *st, unsigned *out,
+                                       const unsigned *tops, size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * uint64_t in a given range.  This is much faster than calling
+ * ottery_st_rand_range64() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ * @param top The upper bound of the range (inclusive).
+ */
+void ottery_st_rand_range64_array(struct ottery_state *st, uint64_t *out,
+                                  size_t n, uint64_t top);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * uint64_t, each in its own range.  This is much faster than calling
+ * ottery_st_rand_range64() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param tops An array of n upper bounds (inclusive); out[i] will be
+ *   no larger than tops[i].
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_range64_array_bounds(struct ottery_state *st,
+                                         uint64_t *out, const uint64_t *tops,
+                                         size_t n);
+/**
+ * Use an ottery_state structure to put the nmemb elements of an array into
+ * a uniformly random order.  All the random indices come from a single
+ * lock acquisition, so this is much faster than calling
+ * ottery_st_rand_range64() for each element.
+ *
+ * @param st The state structure to use.
+ * @param base The array to shuffle.
+ * @param nmemb The number of elements in the array.
+ * @param size The size of each element, in bytes.
+ */
+void ottery_st_shuffle(struct ottery_state *st, void *base, size_t nmemb,
+                       size_t size);
+/**
+ * Use an ottery_state structure to choose k distinct indices from
+ * [0, n), uniformly at random and in a random order.
+ *
+ * This takes time and temporary memory in proportion to k, not n.
+ *
+ * @param st The state structure to use.
+ * @param n The number of indices to choose from.
+ * @param k The number of indices to choose.  Must be no more than n.
+ * @param out An array of k elements to hold the indices.
+ * @return Zero on success, or an error code on failure.
+ */
+int ottery_st_sample_indices(struct ottery_state *st, size_t n, size_t k,
+                             size_t *out);
+/**
+ * Use an ottery_state structure to run reservoir sampling over a stream:
+ * decide what happens to each of the next n items after n_seen items have
+ * already gone by, when keeping a reservoir of k items.
+ *
+ * On return, slots[i] is the reservoir slot that item (n_seen + i) should
+ * be stored in, replacing whatever was there, or OTTERY_RESERVOIR_SKIP if
+ * the item should be dropped.  The first k items of a stream always go in
+ * their own slots.  This is much faster than calling
+ * ottery_st_rand_range64() for each item.
+ *
+ * @param st The state structure to use.
+ * @param n_seen The number of items in the stream before these ones.
+ * @param k The size of the reservoir.
+ * @param slots The array to fill.
+ * @param n The number of items to handle.
+ */
+void ottery_st_reservoir_slots(struct ottery_state *st, uint64_t n_seen,
+                               size_t k, size_t *slots, size_t n);
+/**
+ * Use an ottery_state structure to generate a random number of type double,
+ * chosen uniformly from [0.0, 1.0).
+ *
+ * @param st The state structure to use.
+ * @return A random multiple of 2^-52 no less than 0.0 and less than 1.0.
+ */
+double ottery_st_rand_double(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to generate a random number of type float,
+ * chosen uniformly from [0.0, 1.0).
+ *
+ * @param st The state structure to use.
+ * @return A random multiple of 2^-23 no less than 0.0 and less than 1.0.
+ */
+float ottery_st_rand_float(struct ottery_state *st);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * double, as returned by ottery_st_rand_double().  This is much faster than
+ * calling ottery_st_rand_double() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_double_array(struct ottery_state *st, double *out,
+                                 size_t n);
+/**
+ * Use an ottery_state structure to fill an array with random numbers of type
+ * float, as returned by ottery_st_rand_float().  This is much faster than
+ * calling ottery_st_rand_float() for each element.
+ *
+ * @param st The state structure to use.
+ * @param out The array to fill.
+ * @param n The number of elements to write.
+ */
+void ottery_st_rand_float_array(struct ottery_state *st, float *out,
+                                size_t n);
 
 #ifdef __cplusplus
 }
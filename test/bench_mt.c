@@ -0,0 +1,388 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+/**
+ * @file bench_mt.c
+ *
+ * Benchmark libottery with several threads at once.  Each thread makes a
+ * mix of small and large requests, timing every one, from one of:
+ *   - the global state, in each global mode that this build supports;
+ *   - a single locked ottery_state that all the threads share;
+ *   - a separate ottery_state_nolock for each thread.
+ *
+ * For each API and number of threads, we report the aggregate throughput
+ * and a histogram of the time per call.
+ */
+#include "ottery-internal.h"
+#include "ottery.h"
+#include "ottery_st.h"
+#include "ottery_nolock.h"
+#include "bench_timer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Number of log2-nanosecond buckets in a latency histogram. */
+#define N_BUCKETS 40
+
+/** Ways that a benchmark thread can get its random bytes. */
+enum mt_api {
+  API_GLOBAL_SHARED,
+  API_GLOBAL_PER_THREAD,
+  API_GLOBAL_SHARDED,
+  API_LOCKED,
+  API_NOLOCK,
+  N_APIS
+};
+
+static const char *const API_NAMES[N_APIS] = {
+  "global-shared", "global-per-thread", "global-sharded", "locked", "nolock",
+};
+
+/** Settings for a run, taken from the command line. */
+static struct {
+  /** Number of calls each thread makes. */
+  unsigned long calls;
+  /** Size of the large requests. */
+  size_t large_size;
+  /** One call in this many is a large request; the rest ask for a
+   * uint32_t. */
+  unsigned large_every;
+  /** True iff we should print every histogram bucket. */
+  int histogram;
+} opts = { 200000, 4096, 16, 0 };
+
+/** The state that all the threads share for API_LOCKED. */
+static struct ottery_state *shared_state = NULL;
+/** Protects n_ready and go. */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when n_ready or go changes. */
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+/** Number of threads that are ready to start work. */
+static int n_ready = 0;
+/** True once the threads may start work. */
+static int go = 0;
+
+/** Called by each benchmark thread: wait until all the threads are ready,
+ * so that they begin work at the same time. */
+static void
+wait_for_start(void)
+{
+  pthread_mutex_lock(&start_lock);
+  ++n_ready;
+  pthread_cond_broadcast(&start_cond);
+  while (!go)
+    pthread_cond_wait(&start_cond, &start_lock);
+  pthread_mutex_unlock(&start_lock);
+}
+
+/** Called by the main thread: wait until n_threads threads are ready, and
+ * then let them all start. */
+static void
+start_threads(int n_threads)
+{
+  pthread_mutex_lock(&start_lock);
+  while (n_ready < n_threads)
+    pthread_cond_wait(&start_cond, &start_lock);
+  go = 1;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&start_lock);
+}
+
+/** What each benchmark thread needs to know, and what it found out. */
+struct mt_thread {
+  pthread_t thread;
+  enum mt_api api;
+  /** Calls that took between 2^i and 2^(i+1) nanoseconds. */
+  uint64_t buckets[N_BUCKETS];
+  /** Longest time that any call took. */
+  uint64_t max_nsec;
+  /** Bytes that this thread generated in total. */
+  uint64_t bytes;
+};
+
+/** Return the histogram bucket for a call that took nsec nanoseconds. */
+static int
+bucket_for(uint64_t nsec)
+{
+  int b = 0;
+  while (nsec > 1 && b < N_BUCKETS - 1) {
+    nsec >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+static void *
+mt_thread_main(void *arg)
+{
+  struct mt_thread *t = arg;
+  struct ottery_state_nolock *st_nolock = NULL;
+  void *allocation = NULL;
+  unsigned char *buf;
+  volatile uint32_t sink = 0;
+  unsigned long i;
+
+  if (!(buf = malloc(opts.large_size)))
+    abort();
+  if (t->api == API_NOLOCK) {
+    if (posix_memalign(&allocation, OTTERY_CACHE_LINE_LEN,
+                       ottery_get_sizeof_state_nolock()))
+      abort();
+    st_nolock = allocation;
+    if (ottery_st_init_nolock(st_nolock, NULL))
+      abort();
+  }
+
+  wait_for_start();
+
+  for (i = 0; i < opts.calls; ++i) {
+    const int large = (i % opts.large_every) == opts.large_every - 1;
+    uint64_t start, elapsed;
+    start = bench_now_nsec();
+    switch (t->api) {
+    case API_GLOBAL_SHARED:
+    case API_GLOBAL_PER_THREAD:
+    case API_GLOBAL_SHARDED:
+      if (large)
+        ottery_rand_bytes(buf, opts.large_size);
+      else
+        sink += ottery_rand_uint32();
+      break;
+    case API_LOCKED:
+      if (large)
+        ottery_st_rand_bytes(shared_state, buf, opts.large_size);
+      else
+        sink += ottery_st_rand_uint32(shared_state);
+      break;
+    case API_NOLOCK:
+      if (large)
+        ottery_st_rand_bytes_nolock(st_nolock, buf, opts.large_size);
+      else
+        sink += ottery_st_rand_uint32_nolock(st_nolock);
+      break;
+    default:
+      abort();
+    }
+    elapsed = bench_now_nsec() - start;
+    ++t->buckets[bucket_for(elapsed)];
+    if (elapsed > t->max_nsec)
+      t->max_nsec = elapsed;
+    t->bytes += large ? opts.large_size : sizeof(uint32_t);
+  }
+
+  if (st_nolock) {
+    ottery_st_wipe_nolock(st_nolock);
+    free(allocation);
+  }
+  free(buf);
+  return NULL;
+}
+
+/** Return an upper bound on the pct'th percentile of the n calls counted
+ * in buckets, in nanoseconds. */
+static uint64_t
+histogram_percentile(const uint64_t *buckets, uint64_t n, double pct)
+{
+  const uint64_t want = (uint64_t)(n * pct / 100.0);
+  uint64_t seen = 0;
+  int b;
+  for (b = 0; b < N_BUCKETS; ++b) {
+    seen += buckets[b];
+    if (seen > want)
+      break;
+  }
+  return ((uint64_t)2) << (b < N_BUCKETS ? b : N_BUCKETS - 1);
+}
+
+/** Set up whatever api needs.  Return 0 on success, or -1 if this build
+ * doesn't support it. */
+static int
+api_setup(enum mt_api api)
+{
+  struct ottery_config cfg;
+  int mode;
+  ottery_config_init(&cfg);
+  switch (api) {
+  case API_LOCKED:
+    return ottery_st_new(&shared_state, &cfg) ? -1 : 0;
+  case API_NOLOCK:
+    return 0;
+  case API_GLOBAL_PER_THREAD:
+    mode = OTTERY_GLOBAL_MODE_PER_THREAD;
+    break;
+  case API_GLOBAL_SHARDED:
+    mode = OTTERY_GLOBAL_MODE_SHARDED;
+    break;
+  default:
+    mode = OTTERY_GLOBAL_MODE_SHARED;
+    break;
+  }
+  if (ottery_config_set_global_mode(&cfg, mode))
+    return -1;
+  return ottery_init(&cfg) ? -1 : 0;
+}
+
+/** Release whatever api_setup(api) set up. */
+static void
+api_teardown(enum mt_api api)
+{
+  if (api == API_LOCKED) {
+    ottery_st_free(shared_state);
+    shared_state = NULL;
+  } else if (api != API_NOLOCK) {
+    ottery_wipe();
+  }
+}
+
+/** Run n_threads threads using api, and print the results. */
+static void
+run_benchmark(enum mt_api api, int n_threads)
+{
+  struct mt_thread *threads;
+  uint64_t buckets[N_BUCKETS];
+  uint64_t bytes = 0, max_nsec = 0, start, elapsed;
+  const uint64_t calls = (uint64_t)opts.calls * n_threads;
+  int i, b;
+
+  if (api_setup(api) < 0) {
+    printf("%-18s %7d   (not supported in this build)\n",
+           API_NAMES[api], n_threads);
+    return;
+  }
+
+  threads = calloc(n_threads, sizeof(*threads));
+  if (!threads)
+    abort();
+  n_ready = go = 0;
+  for (i = 0; i < n_threads; ++i) {
+    threads[i].api = api;
+    if (pthread_create(&threads[i].thread, NULL, mt_thread_main, &threads[i]))
+      abort();
+  }
+  start_threads(n_threads);
+  start = bench_now_nsec();
+  for (i = 0; i < n_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+  elapsed = bench_now_nsec() - start;
+
+  memset(buckets, 0, sizeof(buckets));
+  for (i = 0; i < n_threads; ++i) {
+    for (b = 0; b < N_BUCKETS; ++b)
+      buckets[b] += threads[i].buckets[b];
+    bytes += threads[i].bytes;
+    if (threads[i].max_nsec > max_nsec)
+      max_nsec = threads[i].max_nsec;
+  }
+
+  printf("%-18s %7d %12.0f %10.1f %8lu %8lu %8lu %8lu %10lu\n",
+         API_NAMES[api], n_threads,
+         calls * 1e9 / elapsed, bytes * 1e3 / elapsed,
+         (unsigned long)histogram_percentile(buckets, calls, 50),
+         (unsigned long)histogram_percentile(buckets, calls, 90),
+         (unsigned long)histogram_percentile(buckets, calls, 99),
+         (unsigned long)histogram_percentile(buckets, calls, 99.9),
+         (unsigned long)max_nsec);
+  if (opts.histogram) {
+    for (b = 0; b < N_BUCKETS; ++b) {
+      if (buckets[b])
+        printf("    < %12lu nsec: %10lu calls (%5.2f%%)\n",
+               (unsigned long)(((uint64_t)2) << b),
+               (unsigned long)buckets[b], buckets[b] * 100.0 / calls);
+    }
+  }
+  fflush(stdout);
+
+  free(threads);
+  api_teardown(api);
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Usage: %s [--threads=N] [--api=NAME] [--calls=N]\n"
+          "          [--large-size=BYTES] [--large-every=N] [--histogram]\n"
+          "Without --threads, we try 1, 2, 4, ... threads up to the number\n"
+          "of CPUs.  APIs are:", argv0);
+  {
+    int i;
+    for (i = 0; i < N_APIS; ++i)
+      fprintf(stderr, " %s", API_NAMES[i]);
+  }
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int only_threads = 0, only_api = -1, n_cpus, n, i, api;
+
+  for (i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strncmp(arg, "--threads=", 10)) {
+      only_threads = atoi(arg + 10);
+    } else if (!strncmp(arg, "--calls=", 8)) {
+      opts.calls = strtoul(arg + 8, NULL, 0);
+    } else if (!strncmp(arg, "--large-size=", 13)) {
+      opts.large_size = strtoul(arg + 13, NULL, 0);
+    } else if (!strncmp(arg, "--large-every=", 14)) {
+      opts.large_every = (unsigned)strtoul(arg + 14, NULL, 0);
+    } else if (!strcmp(arg, "--histogram")) {
+      opts.histogram = 1;
+    } else if (!strncmp(arg, "--api=", 6)) {
+      for (api = 0; api < N_APIS; ++api) {
+        if (!strcmp(arg + 6, API_NAMES[api]))
+          only_api = api;
+      }
+      if (only_api < 0)
+        usage(argv[0]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (only_threads < 0 || opts.calls < 1 || opts.large_size < 1 ||
+      opts.large_every < 1)
+    usage(argv[0]);
+
+  n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus < 1)
+    n_cpus = 1;
+
+  printf("# libottery %s; clock %s; %lu calls per thread; "
+         "every %uth call asks for %lu bytes, the rest for a uint32_t\n",
+         ottery_get_version_string(), bench_clock_name(), opts.calls,
+         opts.large_every, (unsigned long)opts.large_size);
+  printf("# Latencies are upper bounds of log2 histogram buckets.\n");
+  printf("%-18s %7s %12s %10s %8s %8s %8s %8s %10s\n",
+         "api", "threads", "calls/sec", "MB/sec",
+         "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+
+  for (api = 0; api < N_APIS; ++api) {
+    if (only_api >= 0 && api != only_api)
+      continue;
+    if (only_threads) {
+      run_benchmark(api, only_threads);
+      continue;
+    }
+    for (n = 1; n < n_cpus; n *= 2)
+      run_benchmark(api, n);
+    run_benchmark(api, n_cpus);
+  }
+
+  return 0;
+}
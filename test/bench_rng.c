@@ -14,6 +14,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 
 #ifdef _WIN32
@@ -35,40 +36,115 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "bench_timer.h"
+
+/*
+ * Timing.
+ *
+ * We take BENCH_SAMPLES separate timings of every benchmark, after a
+ * warmup, and report percentiles across them, so that a single preemption
+ * or frequency change doesn't spoil the result.
+ */
+
+/** Number of timed samples we take of each benchmark. */
+#define BENCH_SAMPLES 31
+
+/** Timings for BENCH_SAMPLES runs of a benchmark. */
+struct bench_samples {
+  /** Number of calls we made in each sample. */
+  uint64_t calls;
+  /** Nanoseconds that each sample took. */
+  uint64_t nsec[BENCH_SAMPLES];
+  /** Cycles that each sample took, or all zeros if we can't count them. */
+  uint64_t cycles[BENCH_SAMPLES];
+};
+
+static int
+bench_cmp_u64(const void *a_, const void *b_)
+{
+  const uint64_t *a = a_, *b = b_;
+  return (*a > *b) - (*a < *b);
+}
+
+/** Return the pct'th percentile of the n values in v.  Sorts v. */
+static uint64_t
+bench_percentile(uint64_t *v, int n, int pct)
+{
+  qsort(v, n, sizeof(uint64_t), bench_cmp_u64);
+  return v[(pct * (n - 1) + 50) / 100];
+}
+
+/** Return the pct'th percentile of the time per call in res, in
+ * nanoseconds. */
+static double
+bench_nsec_per_call(const struct bench_samples *res, int pct)
+{
+  uint64_t v[BENCH_SAMPLES];
+  memcpy(v, res->nsec, sizeof(v));
+  return bench_percentile(v, BENCH_SAMPLES, pct) / (double)res->calls;
+}
+
+/** Return the median number of cycles per call in res. */
+static double
+bench_cycles_per_call(const struct bench_samples *res)
+{
+  uint64_t v[BENCH_SAMPLES];
+  memcpy(v, res->cycles, sizeof(v));
+  return bench_percentile(v, BENCH_SAMPLES, 50) / (double)res->calls;
+}
+
+/** Sink for results that we compute only so that the compiler can't throw
+ * away the calls that make them. */
+static volatile unsigned bench_sink;
+
+/**
+ * Run 'body' calls_per_sample times once to warm up, and then
+ * BENCH_SAMPLES more times with timing, storing the timings in
+ * (struct bench_samples) res.
+ */
+#define BENCH_RUN(res, calls_per_sample, body) do {               \
+    uint64_t i_, t_, c_;                                          \
+    int s_;                                                       \
+    (res).calls = (calls_per_sample);                             \
+    for (i_ = 0; i_ < (res).calls; ++i_) {                        \
+      body;                                                       \
+    }                                                             \
+    for (s_ = 0; s_ < BENCH_SAMPLES; ++s_) {                      \
+      c_ = bench_cycles();                                        \
+      t_ = bench_now_nsec();                                      \
+      for (i_ = 0; i_ < (res).calls; ++i_) {                      \
+        body;                                                     \
+      }                                                           \
+      (res).nsec[s_] = bench_now_nsec() - t_;                     \
+      (res).cycles[s_] = bench_cycles() - c_;                     \
+    }                                                             \
+  } while (0)
+
+/** Print the median time per call for a benchmark called 'name'. */
+static void
+bench_report(const char *name, const struct bench_samples *res)
+{
+  printf("%s: %f nsec per call\n", name, bench_nsec_per_call(res, 50));
+}
 
 #define N 10000000
 
 #define TIME_UNSIGNED_RNG(rng_fn) do {                           \
-    struct timeval start, end;                                   \
+    struct bench_samples res;                                    \
     unsigned accumulator = 0;                                    \
-    int i;                                                       \
-    gettimeofday(&start, NULL);                                  \
-    for (i = 0; i < N; ++i) {                                    \
-      accumulator += (unsigned)(rng_fn);                         \
-    }                                                            \
-    gettimeofday(&end, NULL);                                    \
-    uint64_t usec = end.tv_sec - start.tv_sec;                   \
-    usec *= 1000000;                                             \
-    usec += end.tv_usec - start.tv_usec;                         \
-    printf("%s: %f nsec per call\n", __func__, (usec*1000.0)/N); \
+    BENCH_RUN(res, N / BENCH_SAMPLES,                            \
+              accumulator += (unsigned)(rng_fn));                \
+    bench_sink = accumulator;                                    \
+    bench_report(__func__, &res);                                \
 } while (0)
 
 #define N2 100000
 
 #define TIME_BUF(buf_sz, rng_fn) do {                             \
-    struct timeval start, end;                                    \
+    struct bench_samples res;                                     \
     unsigned char buf[buf_sz];                                    \
-    int i;                                                        \
-    gettimeofday(&start, NULL);                                   \
-    for (i = 0; i < N2; ++i) {                                    \
-      rng_fn;                                                     \
-    }                                                             \
-    gettimeofday(&end, NULL);                                     \
-    uint64_t usec = end.tv_sec - start.tv_sec;                    \
-    usec *= 1000000;                                              \
-    usec += end.tv_usec - start.tv_usec;                          \
-    printf("%s: %f nsec per call\n", __func__, (usec*1000.0)/N2); \
-                                                                  \
+    BENCH_RUN(res, N2 / BENCH_SAMPLES, rng_fn);                   \
+    bench_report(__func__, &res);                                 \
 } while (0)
 
 
@@ -78,6 +154,9 @@ struct ottery_state s20;
 struct ottery_state_nolock s8nl;
 struct ottery_state_nolock s12nl;
 struct ottery_state_nolock s20nl;
+struct ottery_state_nolock s20nl_clearline;
+struct ottery_state_nolock s20nl_clearnone;
+struct ottery_state_nolock s20nl_wipeblock;
 
 #ifndef NO_URANDOM
 int urandom_fd = -1;
@@ -161,6 +240,9 @@ CHACHA_SUITE(chacharand20, &s20, );
 CHACHA_SUITE(chacharand8nl, &s8nl, _nolock );
 CHACHA_SUITE(chacharand12nl, &s12nl, _nolock );
 CHACHA_SUITE(chacharand20nl, &s20nl, _nolock );
+CHACHA_SUITE(chacharand20nl_clearline, &s20nl_clearline, _nolock );
+CHACHA_SUITE(chacharand20nl_clearnone, &s20nl_clearnone, _nolock );
+CHACHA_SUITE(chacharand20nl_wipeblock, &s20nl_wipeblock, _nolock );
 
 void
 time_rdrandom(void)
@@ -356,23 +438,251 @@ time_rdrandom_buf1024(void)
 }
 
 
+/*
+ * Size sweeps.
+ *
+ * With --sweep, instead of the benchmarks above, we time ottery_st_rand_bytes()
+ * for every PRF flavor that this CPU can run, at every power-of-two request
+ * size in a range, and print the results as a table, as CSV, or as JSON.
+ */
+
+/** Every PRF flavor that libottery might have been built with. */
+static const char *const SWEEP_FLAVORS[] = {
+  "CHACHA8-NOSIMD-DEFAULT", "CHACHA12-NOSIMD-DEFAULT", "CHACHA20-NOSIMD-DEFAULT",
+  "CHACHA8-SIMD-DEFAULT", "CHACHA12-SIMD-DEFAULT", "CHACHA20-SIMD-DEFAULT",
+  "CHACHA8-SIMD-SSSE3", "CHACHA12-SIMD-SSSE3", "CHACHA20-SIMD-SSSE3",
+  "CHACHA8-SIMD-AVX2", "CHACHA12-SIMD-AVX2", "CHACHA20-SIMD-AVX2",
+  "CHACHA8-SIMD-AVX512", "CHACHA12-SIMD-AVX512", "CHACHA20-SIMD-AVX512",
+  "CHACHA8-SIMD-NEON-WIDE", "CHACHA12-SIMD-NEON-WIDE",
+  "CHACHA20-SIMD-NEON-WIDE",
+  NULL
+};
+
+/** Ways to print the results of a sweep. */
+enum sweep_format { SWEEP_TEXT, SWEEP_CSV, SWEEP_JSON };
+
+/** Smallest and largest request sizes we sweep over by default. */
+#define SWEEP_MIN_SIZE 1
+#define SWEEP_MAX_SIZE (16*1024*1024)
+/** Each sample in a sweep asks for at least this many bytes in total. */
+#define SWEEP_SAMPLE_BYTES (64*1024)
+
+/** Number of results we have printed so far in this sweep. */
+static int sweep_n_results = 0;
+
+/** Print the start of a sweep's output. */
+static void
+sweep_print_header(enum sweep_format fmt)
+{
+  switch (fmt) {
+  case SWEEP_TEXT:
+    printf("# libottery %s; clock %s; %d samples; cycles from %s\n",
+           ottery_get_version_string(), bench_clock_name(), BENCH_SAMPLES,
+#ifdef BENCH_HAVE_CYCLES
+           "rdtsc"
+#else
+           "nowhere"
+#endif
+           );
+    printf("%-24s %9s %12s %12s %12s %12s %10s\n",
+           "flavor", "size", "ns/call p50", "ns/call p90", "ns/call p99",
+           "cycles/byte", "MB/s");
+    break;
+  case SWEEP_CSV:
+    printf("prf,flavor,size,calls_per_sample,samples,"
+           "ns_per_call_p50,ns_per_call_p90,ns_per_call_p99,"
+           "cycles_per_byte_p50,mb_per_sec_p50\n");
+    break;
+  case SWEEP_JSON:
+    printf("{\n  \"libottery_version\": \"%s\",\n"
+           "  \"clock\": \"%s\",\n"
+           "  \"cycle_counter\": %s,\n"
+           "  \"samples\": %d,\n"
+           "  \"results\": [",
+           ottery_get_version_string(), bench_clock_name(),
+#ifdef BENCH_HAVE_CYCLES
+           "\"rdtsc\"",
+#else
+           "null",
+#endif
+           BENCH_SAMPLES);
+    break;
+  }
+}
+
+/** Print the end of a sweep's output. */
+static void
+sweep_print_footer(enum sweep_format fmt)
+{
+  if (fmt == SWEEP_JSON)
+    printf("\n  ]\n}\n");
+}
+
+/** Print the timings in res, for requests of 'size' bytes from flavor. */
+static void
+sweep_print_result(enum sweep_format fmt, const char *flavor, size_t size,
+                   const struct bench_samples *res)
+{
+  const double p50 = bench_nsec_per_call(res, 50);
+  const double p90 = bench_nsec_per_call(res, 90);
+  const double p99 = bench_nsec_per_call(res, 99);
+  const double mbps = p50 > 0 ? (size * 1000.0) / p50 : 0;
+#ifdef BENCH_HAVE_CYCLES
+  const double cpb = bench_cycles_per_call(res) / size;
+#else
+  const double cpb = 0;
+#endif
+  const int prf_len = (int)strcspn(flavor, "-");
+
+  switch (fmt) {
+  case SWEEP_TEXT:
+    printf("%-24s %9lu %12.2f %12.2f %12.2f %12.3f %10.1f\n",
+           flavor, (unsigned long)size, p50, p90, p99, cpb, mbps);
+    break;
+  case SWEEP_CSV:
+    printf("%.*s,%s,%lu,%lu,%d,%.2f,%.2f,%.2f,%.4f,%.1f\n",
+           prf_len, flavor, flavor, (unsigned long)size,
+           (unsigned long)res->calls, BENCH_SAMPLES, p50, p90, p99, cpb, mbps);
+    break;
+  case SWEEP_JSON:
+    printf("%s\n    {\"prf\": \"%.*s\", \"flavor\": \"%s\", \"size\": %lu, "
+           "\"calls_per_sample\": %lu, "
+           "\"ns_per_call\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f}, ",
+           sweep_n_results ? "," : "", prf_len, flavor, flavor,
+           (unsigned long)size, (unsigned long)res->calls, p50, p90, p99);
+#ifdef BENCH_HAVE_CYCLES
+    printf("\"cycles_per_byte_p50\": %.4f, ", cpb);
+#else
+    printf("\"cycles_per_byte_p50\": null, ");
+#endif
+    printf("\"mb_per_sec_p50\": %.1f}", mbps);
+    break;
+  }
+  ++sweep_n_results;
+  fflush(stdout);
+}
+
+/**
+ * Time every request size from min_size to max_size, doubling each time,
+ * for the PRF flavor named 'flavor'.  Do nothing if this CPU or this build
+ * can't run that flavor.
+ */
+static void
+sweep_flavor(enum sweep_format fmt, const char *flavor,
+             size_t min_size, size_t max_size, unsigned char *buf)
+{
+  struct ottery_config cfg;
+  struct ottery_state *st;
+  struct bench_samples res;
+  size_t size;
+
+  ottery_config_init(&cfg);
+  if (ottery_config_force_implementation(&cfg, flavor))
+    return;
+  if (ottery_st_new(&st, &cfg)) {
+    fprintf(stderr, "Couldn't initialize a state for %s\n", flavor);
+    return;
+  }
+
+  for (size = min_size; size && size <= max_size; size *= 2) {
+    const uint64_t calls =
+      size < SWEEP_SAMPLE_BYTES ? SWEEP_SAMPLE_BYTES / size : 1;
+    BENCH_RUN(res, calls, ottery_st_rand_bytes(st, buf, size));
+    sweep_print_result(fmt, flavor, size, &res);
+  }
+
+  ottery_st_free(st);
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Usage: %s [--sweep [--format=text|csv|json] [--flavor=NAME]\n"
+          "          [--min-size=BYTES] [--max-size=BYTES]]\n", argv0);
+  exit(1);
+}
+
+/** Handle "bench_rng --sweep ...". */
+static int
+sweep_main(int argc, char **argv)
+{
+  enum sweep_format fmt = SWEEP_TEXT;
+  const char *only_flavor = NULL;
+  size_t min_size = SWEEP_MIN_SIZE, max_size = SWEEP_MAX_SIZE;
+  unsigned char *buf;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--sweep"))
+      continue;
+    else if (!strcmp(arg, "--format=text"))
+      fmt = SWEEP_TEXT;
+    else if (!strcmp(arg, "--format=csv"))
+      fmt = SWEEP_CSV;
+    else if (!strcmp(arg, "--format=json"))
+      fmt = SWEEP_JSON;
+    else if (!strncmp(arg, "--flavor=", 9))
+      only_flavor = arg + 9;
+    else if (!strncmp(arg, "--min-size=", 11))
+      min_size = strtoul(arg + 11, NULL, 0);
+    else if (!strncmp(arg, "--max-size=", 11))
+      max_size = strtoul(arg + 11, NULL, 0);
+    else
+      usage(argv[0]);
+  }
+  if (min_size < 1 || max_size < min_size)
+    usage(argv[0]);
+
+  if (!(buf = malloc(max_size))) {
+    fprintf(stderr, "Couldn't allocate %lu bytes\n", (unsigned long)max_size);
+    return 1;
+  }
+
+  sweep_print_header(fmt);
+  for (i = 0; SWEEP_FLAVORS[i]; ++i) {
+    const char *flavor = SWEEP_FLAVORS[i];
+    /* --flavor can name the flavor, or just the PRF, like CHACHA20. */
+    if (only_flavor && strcmp(only_flavor, flavor) &&
+        (strncmp(only_flavor, flavor, strlen(only_flavor)) ||
+         flavor[strlen(only_flavor)] != '-'))
+      continue;
+    sweep_flavor(fmt, flavor, min_size, max_size, buf);
+  }
+  sweep_print_footer(fmt);
+
+  free(buf);
+  return 0;
+}
+
 int
 main(int argc, char **argv)
 {
-  (void) argc;
-  (void) argv;
+  if (argc > 1)
+    return sweep_main(argc, argv);
 #ifndef NO_OPENSSL
   RAND_poll();
 #endif
   struct ottery_config cfg_chacha8;
   struct ottery_config cfg_chacha12;
   struct ottery_config cfg_chacha20;
+  struct ottery_config cfg_clearline;
+  struct ottery_config cfg_clearnone;
+  struct ottery_config cfg_wipeblock;
   ottery_config_init(&cfg_chacha8);
   ottery_config_force_implementation(&cfg_chacha8, OTTERY_PRF_CHACHA8);
   ottery_config_init(&cfg_chacha12);
   ottery_config_force_implementation(&cfg_chacha12, OTTERY_PRF_CHACHA12);
   ottery_config_init(&cfg_chacha20);
   ottery_config_force_implementation(&cfg_chacha20, OTTERY_PRF_CHACHA20);
+  cfg_clearline = cfg_chacha20;
+  ottery_config_set_clear_mode(&cfg_clearline, OTTERY_CLEAR_MODE_BY_LINE);
+  cfg_clearnone = cfg_chacha20;
+  ottery_config_set_clear_mode(&cfg_clearnone, OTTERY_CLEAR_MODE_NONE);
+  cfg_wipeblock = cfg_chacha20;
+  ottery_config_set_wipe_stack_mode(&cfg_wipeblock,
+                                    OTTERY_WIPE_STACK_EACH_BLOCK);
 
   ottery_st_init(&s8, &cfg_chacha8);
   ottery_st_init(&s12, &cfg_chacha12);
@@ -380,6 +690,9 @@ main(int argc, char **argv)
   ottery_st_init_nolock(&s8nl, &cfg_chacha8);
   ottery_st_init_nolock(&s12nl, &cfg_chacha12);
   ottery_st_init_nolock(&s20nl, &cfg_chacha20);
+  ottery_st_init_nolock(&s20nl_clearline, &cfg_clearline);
+  ottery_st_init_nolock(&s20nl_clearnone, &cfg_clearnone);
+  ottery_st_init_nolock(&s20nl_wipeblock, &cfg_wipeblock);
 
   time_chacharand8();
   time_chacharand8_u64();
@@ -417,6 +730,23 @@ main(int argc, char **argv)
   time_chacharand20nl_buf16();
   time_chacharand20nl_buf1024();
 
+  /* Compare the ways of erasing output after we yield it. (chacharand20nl
+   * above used the default, OTTERY_CLEAR_MODE_EACH_YIELD.) */
+  time_chacharand20nl_clearline();
+  time_chacharand20nl_clearline_u64();
+  time_chacharand20nl_clearline_onebyte();
+  time_chacharand20nl_clearline_buf16();
+
+  time_chacharand20nl_clearnone();
+  time_chacharand20nl_clearnone_u64();
+  time_chacharand20nl_clearnone_onebyte();
+  time_chacharand20nl_clearnone_buf16();
+
+  /* Compare wiping the stack after every block with the default,
+   * OTTERY_WIPE_STACK_EACH_CALL. */
+  time_chacharand20nl_wipeblock_buf16();
+  time_chacharand20nl_wipeblock_buf1024();
+
   time_arc4random();
   time_arc4random_u64();
   time_arc4random_onebyte();
@@ -0,0 +1,91 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+/**
+ * @file bench_timer.h
+ *
+ * Clocks shared by the benchmark programs.  Include this after
+ * ottery-internal.h, so that HAVE_CLOCK_GETTIME is defined.
+ */
+#ifndef BENCH_TIMER_H_INCLUDED_
+#define BENCH_TIMER_H_INCLUDED_
+
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+/** Return a monotonic timestamp in nanoseconds.  Where we can, we use a
+ * clock that NTP doesn't slew. */
+static inline uint64_t
+bench_now_nsec(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)(now.QuadPart * (1000000000.0 / freq.QuadPart));
+#elif defined(HAVE_CLOCK_GETTIME) && \
+  (defined(CLOCK_MONOTONIC_RAW) || defined(CLOCK_MONOTONIC))
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec) * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/** Name of the clock that bench_now_nsec() uses. */
+static inline const char *
+bench_clock_name(void)
+{
+#ifdef _WIN32
+  return "QueryPerformanceCounter";
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_RAW)
+  return "CLOCK_MONOTONIC_RAW";
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  return "CLOCK_MONOTONIC";
+#else
+  return "gettimeofday";
+#endif
+}
+
+#if defined(__x86_64) || defined(__i386) || defined(_M_IX86)
+#define BENCH_HAVE_CYCLES
+/** Return the CPU's timestamp counter.  On recent CPUs this ticks at a
+ * constant rate, not with the core's actual clock. */
+static inline uint64_t
+bench_cycles(void)
+{
+  uint32_t lo, hi;
+  __asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return (((uint64_t)hi) << 32) | lo;
+}
+#else
+static inline uint64_t
+bench_cycles(void)
+{
+  return 0;
+}
+#endif
+
+#endif
@@ -16,7 +16,8 @@
  *
  * A broken EGD implementation that works just well enough to respond to
  * the "nonblocking request" request type and return (NON-RANDOM!)
- * prefixes of bits of "O Fortuna".
+ * prefixes of bits of "O Fortuna".  It accepts only one connection, and
+ * answers requests on it until the client hangs up.
  */
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -35,6 +36,7 @@ static const unsigned char o_fortuna[] =
 
 int bug_truncate_output = 0;
 int bug_short_output = 0;
+int bug_short_first_output = 0;
 int bug_no_output = 0;
 int bug_close_after_read = 0;
 int bug_close_before_read = 0;
@@ -58,8 +60,9 @@ reply(int fd)
     return -2;
   len = buf[1];
 
-  if (bug_short_output)
+  if (bug_short_output || bug_short_first_output)
     len /= 2;
+  bug_short_first_output = 0;
   if (bug_no_output)
     len = 0;
 
@@ -72,6 +75,10 @@ reply(int fd)
   if (write(fd, buf, n) != n)
     return -3;
 
+  /* Don't leave the client waiting for the rest of a truncated reply. */
+  if (bug_truncate_output)
+    return 0;
+
   return 1;
 }
 
@@ -81,6 +88,7 @@ struct bug_table_ent {
 } bug_table[] = {
   { "--truncate-output",   &bug_truncate_output },
   { "--short-output",      &bug_short_output },
+  { "--short-first-output", &bug_short_first_output },
   { "--no-output",         &bug_no_output },
   { "--close-after-read",  &bug_close_after_read },
   { "--close-before-read", &bug_close_before_read },
@@ -196,7 +204,8 @@ main(int argc, char **argv)
     return 1;
   }
 
-  (void) reply(fd);
+  while (reply(fd) > 0)
+    ;
 
   close(fd);
   close(listener);
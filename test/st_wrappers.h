@@ -18,6 +18,18 @@
   (USING_NOLOCK() ? ottery_st_rand_uint64_nolock(STATE_NOLOCK()) : \
    USING_STATE() ? ottery_st_rand_uint64(STATE()) : ottery_rand_uint64())
 
+#define OTTERY_RAND_UINT32_ARRAY(out, n)                                   \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_rand_uint32_array_nolock(STATE_NOLOCK(), (out), (n)) :        \
+   USING_STATE() ? ottery_st_rand_uint32_array(STATE(), (out), (n)) :      \
+   ottery_rand_uint32_array((out), (n)))
+
+#define OTTERY_RAND_UINT64_ARRAY(out, n)                                   \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_rand_uint64_array_nolock(STATE_NOLOCK(), (out), (n)) :        \
+   USING_STATE() ? ottery_st_rand_uint64_array(STATE(), (out), (n)) :      \
+   ottery_rand_uint64_array((out), (n)))
+
 #define OTTERY_RAND_RANGE(n)                                          \
   (USING_NOLOCK() ? ottery_st_rand_range_nolock(STATE_NOLOCK(),(n)) : \
    USING_STATE() ? ottery_st_rand_range(STATE(), (n)) : ottery_rand_range(n))
@@ -27,10 +39,82 @@
    USING_STATE() ? ottery_st_rand_range64(STATE(), (n)) :                \
    ottery_rand_range64(n))
 
+#define OTTERY_RAND_RANGE_ARRAY(out, n, top)                                 \
+  (USING_NOLOCK() ?                                                          \
+   ottery_st_rand_range_array_nolock(STATE_NOLOCK(), (out), (n), (top)) :    \
+   USING_STATE() ? ottery_st_rand_range_array(STATE(), (out), (n), (top)) :  \
+   ottery_rand_range_array((out), (n), (top)))
+
+#define OTTERY_RAND_RANGE_ARRAY_BOUNDS(out, tops, n)                 \
+  (USING_NOLOCK() ?                                                  \
+   ottery_st_rand_range_array_bounds_nolock(STATE_NOLOCK(),          \
+      (out), (tops), (n)) :                                          \
+   USING_STATE() ?                                                   \
+   ottery_st_rand_range_array_bounds(STATE(), (out), (tops), (n)) :  \
+   ottery_rand_range_array_bounds((out), (tops), (n)))
+
+#define OTTERY_RAND_RANGE64_ARRAY(out, n, top)                                 \
+  (USING_NOLOCK() ?                                                            \
+   ottery_st_rand_range64_array_nolock(STATE_NOLOCK(), (out), (n), (top)) :    \
+   USING_STATE() ? ottery_st_rand_range64_array(STATE(), (out), (n), (top)) :  \
+   ottery_rand_range64_array((out), (n), (top)))
+
+#define OTTERY_RAND_RANGE64_ARRAY_BOUNDS(out, tops, n)                 \
+  (USING_NOLOCK() ?                                                    \
+   ottery_st_rand_range64_array_bounds_nolock(STATE_NOLOCK(),          \
+      (out), (tops), (n)) :                                            \
+   USING_STATE() ?                                                     \
+   ottery_st_rand_range64_array_bounds(STATE(), (out), (tops), (n)) :  \
+   ottery_rand_range64_array_bounds((out), (tops), (n)))
+
+#define OTTERY_SHUFFLE(base, nmemb, size)                                  \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_shuffle_nolock(STATE_NOLOCK(), (base), (nmemb), (size)) :     \
+   USING_STATE() ? ottery_st_shuffle(STATE(), (base), (nmemb), (size)) :   \
+   ottery_shuffle((base), (nmemb), (size)))
+
+#define OTTERY_SAMPLE_INDICES(n, k, out)                                   \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_sample_indices_nolock(STATE_NOLOCK(), (n), (k), (out)) :      \
+   USING_STATE() ? ottery_st_sample_indices(STATE(), (n), (k), (out)) :    \
+   ottery_sample_indices((n), (k), (out)))
+
+#define OTTERY_RESERVOIR_SLOTS(n_seen, k, slots, n)                        \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_reservoir_slots_nolock(STATE_NOLOCK(),                        \
+      (n_seen), (k), (slots), (n)) :                                       \
+   USING_STATE() ?                                                         \
+   ottery_st_reservoir_slots(STATE(), (n_seen), (k), (slots), (n)) :       \
+   ottery_reservoir_slots((n_seen), (k), (slots), (n)))
+
+#define OTTERY_RAND_DOUBLE()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_double_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_double(STATE()) : ottery_rand_double())
+
+#define OTTERY_RAND_FLOAT()                                       \
+  (USING_NOLOCK() ? ottery_st_rand_float_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_rand_float(STATE()) : ottery_rand_float())
+
+#define OTTERY_RAND_DOUBLE_ARRAY(out, n)                                   \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_rand_double_array_nolock(STATE_NOLOCK(), (out), (n)) :        \
+   USING_STATE() ? ottery_st_rand_double_array(STATE(), (out), (n)) :      \
+   ottery_rand_double_array((out), (n)))
+
+#define OTTERY_RAND_FLOAT_ARRAY(out, n)                                    \
+  (USING_NOLOCK() ?                                                        \
+   ottery_st_rand_float_array_nolock(STATE_NOLOCK(), (out), (n)) :         \
+   USING_STATE() ? ottery_st_rand_float_array(STATE(), (out), (n)) :       \
+   ottery_rand_float_array((out), (n)))
+
 #define OTTERY_WIPE()                                       \
   (USING_NOLOCK() ? ottery_st_wipe_nolock(STATE_NOLOCK()) : \
    USING_STATE() ? ottery_st_wipe(STATE()) : ottery_wipe())
 
+#define OTTERY_REFILL()                                       \
+  (USING_NOLOCK() ? ottery_st_refill_nolock(STATE_NOLOCK()) : \
+   USING_STATE() ? ottery_st_refill(STATE()) : ottery_refill())
+
 #define OTTERY_STIR()                                       \
   (USING_NOLOCK() ? ottery_st_prevent_backtracking_nolock(STATE_NOLOCK()) : \
    USING_STATE() ? ottery_st_prevent_backtracking(STATE()) :            \
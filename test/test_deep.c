@@ -23,6 +23,7 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "ottery_lean.h"
 #include "ottery-internal.h"
 
 #include "tinytest.h"
@@ -128,7 +129,8 @@ struct ottery_prf dummy_prf =  {
   64, /* output_len */
   0, /* required cpucaps */
   dummy_prf_setup,
-  dummy_prf_generate
+  dummy_prf_generate,
+  NULL /* generate_blocks */
 };
 
 /* Assuming that we stir after every block, the first three blocks will
@@ -179,7 +181,7 @@ cleanup_state(const struct testcase_t *testcase, void *ptr)
   (void)ptr;
   if (state) {
     if (state->block_counter > 512 ||
-        state->pos >= state->prf.output_len ||
+        state->pos >= state->buffer_len ||
         state->pid != getpid()) {
       retval = 0;
     }
@@ -401,8 +403,95 @@ test_buf_long_1(void *arg)
 }
 
 
+static void
+test_buffer_blocks(void *arg)
+{
+  (void)arg;
+  struct ottery_config cfg;
+  char *allocation = malloc(ottery_get_sizeof_state() + 16);
+  const int misalign = (int) (((uintptr_t)allocation) & 0xf);
+  struct ottery_state *st =
+    (struct ottery_state *)(allocation + ((16-misalign)&0xf));
+  struct dummy_prf_state *dst = (void*)st->state;
+  char buf[256];
+
+  tt_int_op(0, ==, ottery_config_init(&cfg));
+  ottery_config_set_manual_prf_(&cfg, &dummy_prf);
+  ottery_config_set_urandom_device(&cfg, "/dev/zero");
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_buffer_blocks(&cfg, 0));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_buffer_blocks(&cfg, OTTERY_MAX_BUFFER_BLOCKS+1));
+  tt_int_op(0, ==, ottery_config_set_buffer_blocks(&cfg, 2));
+  tt_int_op(0, ==, ottery_st_init(st, &cfg));
+  tt_int_op(128, ==, st->buffer_len);
+
+  /* With two blocks in the buffer, we only rekey every 128 bytes. */
+  ottery_st_rand_bytes(st, buf, 123);
+  buf[123] = 0;
+  tt_str_op(buf, ==,
+            "again is there anyone who loves or pursues or desires to obt"
+            "ain pain of itself  because it is pain  but because occasionall");
+  tt_int_op(0, ==, st->block_counter);
+  tt_int_op(127, ==, st->pos);
+  tt_int_op(0, ==, dst->rotation[0]);
+  tt_int_op(13, ==, dst->rotation[1]);
+  tt_int_op(14, ==, dst->rotation[2]);
+  tt_int_op(17, ==, dst->rotation[3]);
+
+  /* The next buffer is the first two blocks with the key "Nor ". */
+  ottery_st_rand_bytes(st, buf, 1 + 60 + 62);
+  buf[123] = 0;
+  tt_str_op(buf, ==,
+            "y"
+            "atozn-wj gvvrr.rnlcee-kyo-zfvrg1oe.gueglef.fr-rvsvfvs-hf bpk"
+            "avb1pnwe bt1iggvls.1brqrufs1ig.zs-dria.1bhh1brqrufs1opqrsvceay");
+  tt_int_op(126, ==, st->pos);
+
+ end:
+  if (allocation) {
+    ottery_st_wipe(st);
+    free(allocation);
+  }
+}
+
+static void
+test_lean_state(void *arg)
+{
+  (void)arg;
+  struct ottery_config cfg;
+  __attribute__((aligned(16))) struct ottery_lean_state st;
+  struct dummy_prf_state *dst = (void*)st.state;
+  char buf[256];
+
+  tt_int_op(0, ==, ottery_config_init(&cfg));
+  ottery_config_set_manual_prf_(&cfg, &dummy_prf);
+  ottery_config_set_urandom_device(&cfg, "/dev/zero");
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  tt_int_op(0, ==, ottery_lean_init(&st, &cfg));
+  tt_ptr_op(st.prf, ==, &dummy_prf);
+
+  /* A lean state stirs after every block, just like a regular one. */
+  ottery_lean_rand_bytes(&st, buf, 60 + 60 + 59);
+  buf[179] = 0;
+  tt_str_op(buf, ==,
+            "again is there anyone who loves or pursues or desires to obt"
+            "atozn-wj gvvrr.rnlcee-kyo-zfvrg1oe.gueglef.fr-rvsvfvs-hf bpk"
+            "rtbne-jx1gijir!felpsv-xmf-mtmrt%fe!uletzvf!ti-ejjvsjj-ut1bc");
+  tt_int_op(63, ==, st.pos);
+  tt_int_op(5, ==, dst->rotation[0]);
+  tt_int_op(4, ==, dst->rotation[1]);
+  tt_int_op(1, ==, dst->rotation[2]);
+  tt_int_op(18, ==, dst->rotation[3]);
+
+ end:
+  ottery_lean_wipe(&st);
+}
 
 struct testcase_t misc_tests[] = {
+  { "lean_state", test_lean_state, TT_FORK, NULL, NULL },
+  { "buffer_blocks", test_buffer_blocks, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -432,6 +521,14 @@ struct testgroup_t groups[] = {
 int
 main(int argc, const char **argv)
 {
+#ifdef OTTERY_FIXED_PRF
+  /* Everything here runs on dummy_prf, which a build with a fixed PRF
+   * won't accept.  Tell automake that we skipped. */
+  (void)argc;
+  (void)argv;
+  return 77;
+#else
   setbuf(stdout, NULL);
   return tinytest_main(argc, argv, groups);
+#endif
 }
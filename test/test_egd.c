@@ -29,12 +29,14 @@ main(int argc, char **argv)
 {
   struct sockaddr_un sun;
   struct ottery_entropy_config cfg;
-  unsigned char buf[257];
-  size_t buflen = 257;
+  struct ottery_entropy_state state;
+  unsigned char buf[1025];
+  size_t buflen = sizeof(buf);
   long n;
   char *endp;
   uint32_t flags;
   int result;
+  int twice;
 
   /* Enable test over inet */
   if (argc < 3) {
@@ -42,10 +44,12 @@ main(int argc, char **argv)
     return 1;
   }
   n = strtol(argv[1], &endp, 10);
-  if (n < 0 || n > 256 || *endp) {
-    printf("First argument must be in 0..256\n");
+  if (n < 0 || n > 1024 || *endp) {
+    printf("First argument must be in 0..1024\n");
     return 1;
   }
+  /* With --twice, we ask twice over the same connection. */
+  twice = (argc > 3 && !strcmp(argv[3], "--twice"));
   if (strlen(argv[2])+1 >= sizeof(sun.sun_path)) {
     printf("Path is too long\n");
     return 1;
@@ -53,6 +57,7 @@ main(int argc, char **argv)
 
   memset(&sun, 0, sizeof(sun));
   memset(&cfg, 0, sizeof(cfg));
+  memset(&state, 0, sizeof(state));
 
   sun.sun_family = AF_UNIX;
   if (!strcmp(argv[2], "_BROKEN_FAMILY_"))
@@ -64,7 +69,8 @@ main(int argc, char **argv)
   cfg.disabled_sources =
     OTTERY_ENTROPY_ALL_SOURCES & ~OTTERY_ENTROPY_SRC_EGD;
 
-  result = ottery_get_entropy_(&cfg, NULL, 0, buf, (size_t) n, &buflen, &flags);
+  result = ottery_get_entropy_(&cfg, twice ? &state : NULL, 0,
+                               buf, (size_t) n, &buflen, &flags);
 
   if (result == 0 && buflen == (size_t)n) {
     int i;
@@ -74,6 +80,22 @@ main(int argc, char **argv)
     puts("");
   } else {
     printf("ERR:%d\n",result);
+    twice = 0;
+  }
+
+  if (twice) {
+    int i;
+    buflen = sizeof(buf);
+    result = ottery_get_entropy_(&cfg, &state, 0,
+                                 buf, (size_t) n, &buflen, &flags);
+    if (result == 0 && buflen == (size_t)n) {
+      printf("BYTES2:");
+      for (i=0; i<n; ++i) printf("%02x", buf[i]);
+      puts("");
+    } else {
+      printf("ERR2:%d\n",result);
+    }
+    ottery_entropy_state_clear_(&state);
   }
   return 0;
 }
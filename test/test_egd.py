@@ -109,14 +109,31 @@ class EGDTests(unittest.TestCase):
         d = parse_output(o)
         self.assertEquals(d['ERR'], '3') #init_strong_rng
 
-    def test_fail_toolong_256(self):
-        cleanup()
-        p = subprocess.Popen([TEST_EGD, "256", SOCKNAME],
-                             stdout=subprocess.PIPE)
-        o = p.stdout.read()
-        p.wait()
-        d = parse_output(o)
-        self.assertEquals(d['ERR'], '4') #access_strong_rng
+    def test_succeed_256(self):
+        # Two requests: 255 bytes, then 1 more.
+        d = run_egd(["256", SOCKNAME], [SOCKNAME])
+        self.assertEquals(d['FLAGS'], '80401')
+        self.assertEquals(d['BYTES'],
+                          b2a_hex(o_fortuna[:255] + o_fortuna[:1]).decode())
+
+    def test_succeed_600(self):
+        d = run_egd(["600", SOCKNAME], [SOCKNAME])
+        self.assertEquals(d['FLAGS'], '80401')
+        self.assertEquals(d['BYTES'],
+                          b2a_hex(o_fortuna[:255] * 2 + o_fortuna[:90]).decode())
+
+    def test_reuse_connection(self):
+        # The fake EGD only accepts one connection.
+        d = run_egd(["16", SOCKNAME, "--twice"], [SOCKNAME])
+        self.assertEquals(d['BYTES'], b2a_hex(o_fortuna[:16]).decode())
+        self.assertEquals(d['BYTES2'], b2a_hex(o_fortuna[:16]).decode())
+
+    def test_short_reply_retried(self):
+        # We keep the 8 bytes from the short reply, and ask for 8 more.
+        d = run_egd(["16", SOCKNAME], [SOCKNAME, "--short-first-output"])
+        self.assertEquals(d['FLAGS'], '80401')
+        self.assertEquals(d['BYTES'],
+                          b2a_hex(o_fortuna[:8] + o_fortuna[:8]).decode())
 
     def test_fail_short(self):
         d = run_egd(["16", SOCKNAME], [SOCKNAME, "--short-output"])
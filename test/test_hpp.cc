@@ -0,0 +1,170 @@
+/* Libottery by Nick Mathewson.
+
+   This software has been dedicated to the public domain under the CC0
+   public domain dedication.
+
+   To the extent possible under law, the person who associated CC0 with
+   libottery has waived all copyright and related or neighboring rights
+   to libottery.
+
+   You should have received a copy of the CC0 legalcode along with this
+   work in doc/cc0.txt.  If not, see
+      <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+/* Make sure that ottery.hpp compiles, and that ottery::engine works with
+ * the standard library the way we say it does. */
+
+#include "ottery.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+static int n_failed = 0;
+
+#define CHECK(expr)                                                     \
+  do {                                                                  \
+    if (!(expr)) {                                                      \
+      std::printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #expr);        \
+      ++n_failed;                                                       \
+    }                                                                   \
+  } while (0)
+
+static_assert(ottery::engine::min() == 0, "min");
+static_assert(ottery::engine::max() == UINT64_MAX, "max");
+static_assert(!std::is_copy_constructible<ottery::engine>::value,
+              "engines must not be copyable");
+static_assert(std::is_nothrow_move_constructible<ottery::engine>::value,
+              "engines must be movable");
+
+static void
+test_distributions()
+{
+  ottery::engine eng;
+  std::uniform_int_distribution<int> die(1, 6);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  int counts[7] = { 0 };
+  int i;
+
+  for (i = 0; i < 6000; ++i) {
+    const int r = die(eng);
+    CHECK(r >= 1 && r <= 6);
+    if (r >= 1 && r <= 6)
+      ++counts[r];
+    const double d = unit(eng);
+    CHECK(d >= 0.0 && d < 1.0);
+  }
+  /* Very loose: each face should come up about 1000 times. */
+  for (i = 1; i <= 6; ++i)
+    CHECK(counts[i] > 700 && counts[i] < 1300);
+
+  std::vector<int> v(100);
+  std::iota(v.begin(), v.end(), 0);
+  std::vector<int> orig(v);
+  std::shuffle(v.begin(), v.end(), eng);
+  CHECK(v != orig);
+  std::sort(v.begin(), v.end());
+  CHECK(v == orig);
+}
+
+static void
+test_distinct()
+{
+  ottery::engine a, b;
+  uint64_t xa[8], xb[8];
+  int i;
+  for (i = 0; i < 8; ++i) {
+    xa[i] = a();
+    xb[i] = b();
+  }
+  CHECK(std::memcmp(xa, xb, sizeof(xa)) != 0);
+  CHECK(a.next_uint32() != a.next_uint32() ||
+        a.next_uint32() != a.next_uint32());
+}
+
+static void
+test_move()
+{
+  ottery::engine a;
+  struct ottery_state_nolock *st = a.state();
+  CHECK(st != NULL);
+  (void)a();
+
+  ottery::engine b(std::move(a));
+  CHECK(a.state() == NULL);
+  CHECK(b.state() == st);
+  (void)b();
+
+  ottery::engine c;
+  c = std::move(b);
+  CHECK(b.state() == NULL);
+  CHECK(c.state() == st);
+  (void)c();
+  a = std::move(c);
+  CHECK(a.state() == st);
+}
+
+static void
+test_fill()
+{
+  ottery::engine eng;
+  std::vector<uint32_t> u32(1000, 0);
+  std::vector<int64_t> i64(1000, 0);
+  std::vector<uint16_t> u16(1000, 0);
+  unsigned char bytes[300];
+
+  eng.fill(u32.data(), u32.size());
+  eng.fill(i64.data(), i64.size());
+  eng.fill(u16.data(), u16.size());
+  std::memset(bytes, 0, sizeof(bytes));
+  eng.fill(bytes, sizeof(bytes));
+  CHECK(std::count(u32.begin(), u32.end(), 0u) < 2);
+  CHECK(std::count(i64.begin(), i64.end(), 0) < 2);
+  CHECK(std::count(u16.begin(), u16.end(), 0) < 10);
+  CHECK(std::count(bytes, bytes + sizeof(bytes), 0) < 10);
+#if __cplusplus >= 201703L
+  std::byte raw[64] = {};
+  eng.fill(raw, sizeof(raw));
+  CHECK(std::count(raw, raw + sizeof(raw), std::byte(0)) < 5);
+#endif
+#if __cplusplus >= 202002L && defined(__cpp_lib_span)
+  std::fill(u32.begin(), u32.end(), 0);
+  eng.fill(std::span<uint32_t>(u32));
+  CHECK(std::count(u32.begin(), u32.end(), 0u) < 2);
+#endif
+}
+
+static void
+test_config()
+{
+  struct ottery_config cfg;
+  ottery_config_init(&cfg);
+  ottery_config_set_urandom_device(&cfg, "/dev/please-dont-add-this-device");
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  try {
+    ottery::engine eng(&cfg);
+    CHECK(!"constructed an engine with no entropy");
+  } catch (const ottery::error &e) {
+    CHECK(e.code() == OTTERY_ERR_INIT_STRONG_RNG);
+  }
+}
+
+int
+main()
+{
+  test_distributions();
+  test_distinct();
+  test_move();
+  test_fill();
+  test_config();
+  if (n_failed) {
+    std::printf("%d checks failed.\n", n_failed);
+    return 1;
+  }
+  std::puts("OK");
+  return 0;
+}
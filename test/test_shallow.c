@@ -23,11 +23,13 @@
 #include "ottery.h"
 #include "ottery_st.h"
 #include "ottery_nolock.h"
+#include "ottery_lean.h"
 
 #include "tinytest.h"
 #include "tinytest_macros.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,9 +45,21 @@
 char *state_allocation = NULL;
 struct ottery_state *state = NULL;
 int state_nolock = 0;
+int global_per_thread = 0;
+int global_sharded = 0;
+
+/* A PRF to ask for when we don't want the default one.  A build with a
+ * fixed PRF only has the one. */
+#ifdef OTTERY_FIXED_PRF
+#define OTHER_PRF_NAME (OTTERY_FIXED_PRF.name)
+#else
+#define OTHER_PRF_NAME OTTERY_PRF_CHACHA8
+#endif
 
 #define OT_ENABLE_STATE TT_FIRST_USER_FLAG
 #define OT_ENABLE_STATE_NOLOCK ((TT_FIRST_USER_FLAG<<1)|OT_ENABLE_STATE)
+#define OT_GLOBAL_PER_THREAD (TT_FIRST_USER_FLAG<<2)
+#define OT_GLOBAL_SHARDED (TT_FIRST_USER_FLAG<<3)
 
 void *
 setup_state(const struct testcase_t *testcase)
@@ -58,11 +72,30 @@ setup_state(const struct testcase_t *testcase)
     state_allocation = malloc(ottery_get_sizeof_state() + 16);
     const int misalign = (int) (((uintptr_t)state_allocation) & 0xf);
     state = (struct ottery_state *)(state_allocation + ((16-misalign)&0xf));
-    if (testcase->flags & OT_ENABLE_STATE_NOLOCK)
+    /* OT_ENABLE_STATE_NOLOCK includes OT_ENABLE_STATE, so check for all
+     * of its bits. */
+    state_nolock = ((testcase->flags & OT_ENABLE_STATE_NOLOCK) ==
+                    OT_ENABLE_STATE_NOLOCK);
+    if (state_nolock)
       ottery_st_init_nolock(STATE_NOLOCK(), NULL);
     else
       ottery_st_init(state, NULL);
-    state_nolock = (testcase->flags & OT_ENABLE_STATE_NOLOCK);
+  } else if (testcase->flags & OT_GLOBAL_PER_THREAD) {
+    struct ottery_config cfg;
+    ottery_config_init(&cfg);
+    if (ottery_config_set_global_mode(&cfg, OTTERY_GLOBAL_MODE_PER_THREAD))
+      return NULL;
+    if (ottery_init(&cfg))
+      return NULL;
+    global_per_thread = 1;
+  } else if (testcase->flags & OT_GLOBAL_SHARDED) {
+    struct ottery_config cfg;
+    ottery_config_init(&cfg);
+    if (ottery_config_set_global_mode(&cfg, OTTERY_GLOBAL_MODE_SHARDED))
+      return NULL;
+    if (ottery_init(&cfg))
+      return NULL;
+    global_sharded = 1;
   }
   return (void*) 1;
 }
@@ -74,7 +107,7 @@ cleanup_state(const struct testcase_t *testcase, void *ptr)
   (void)ptr;
   if (state) {
     if (state->block_counter > 512 ||
-        state->pos >= state->prf.output_len ||
+        state->pos >= state->buffer_len ||
         state->pid != getpid()) {
       retval = 0;
     }
@@ -251,6 +284,67 @@ puts("+++!");
 
   close(cfg.urandom_fd);
 
+  /* When we open the device ourselves, we keep the fd open. */
+  memset(&cfg, 0, sizeof(cfg));
+  memset(&state, 0, sizeof(state));
+  cfg.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n, &flags));
+  tt_int_op(state.urandom_fd_is_cached, ==, 1);
+  tt_int_op(state.urandom_fd, >=, 0);
+  {
+    const int cached_fd = state.urandom_fd;
+    int devnullfd;
+    n = sizeof(buf);
+    tt_int_op(0, ==,
+              ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n, &flags));
+    tt_int_op(state.urandom_fd, ==, cached_fd);
+
+    /* If somebody replaces it, we notice, and open the device again without
+     * touching their fd. */
+    devnullfd = open("/dev/null", O_RDONLY);
+    tt_int_op(devnullfd, >=, 0);
+    tt_int_op(cached_fd, ==, dup2(devnullfd, cached_fd));
+    close(devnullfd);
+    n = sizeof(buf);
+    tt_int_op(0, ==,
+              ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n, &flags));
+    tt_int_op(state.urandom_fd_is_cached, ==, 1);
+    tt_int_op(state.urandom_fd, !=, cached_fd);
+    tt_int_op(0, ==, fcntl(cached_fd, F_GETFD) < 0);
+    close(cached_fd);
+    ottery_entropy_state_clear_(&state);
+    tt_int_op(state.urandom_fd_is_cached, ==, 0);
+  }
+
+  /* But not if it needn't be a device, since then we couldn't tell whether
+   * it was still ours. */
+  cfg.allow_nondev_urandom = 1;
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg, &state, 0, buf, 12, &n, &flags));
+  tt_int_op(state.urandom_fd_is_cached, ==, 0);
+
+#endif
+
+#if !defined(_WIN32) && \
+  (defined(HAVE_GETRANDOM) || defined(HAVE_GETENTROPY) || \
+   defined(HAVE_ARC4RANDOM_BUF))
+  /* We can get entropy without any device at all... */
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.disabled_sources = ALL_ENTROPY_BUT(GETRANDOM);
+  flags = 0;
+  n = sizeof(buf);
+  tt_int_op(0, ==, ottery_get_entropy_(&cfg, NULL, 0, buf, 64, &n, &flags));
+  tt_int_op(n, ==, 64);
+  tt_assert(flags & OTTERY_ENTROPY_SRC_GETRANDOM);
+  tt_assert(flags & OTTERY_ENTROPY_DOM_OS);
+  tt_assert(flags & OTTERY_ENTROPY_FL_STRONG);
+
+  /* ...but not if the user asked for a particular device. */
+  cfg.urandom_fname = "/dev/urandom";
+  n = sizeof(buf);
+  tt_int_op(OTTERY_ERR_INIT_STRONG_RNG, ==,
+            ottery_get_entropy_(&cfg, NULL, 0, buf, 64, &n, &flags));
 #endif
 
   /* Make sure at least one OS source works in another way. */
@@ -332,6 +426,357 @@ test_rand_big_buf(void *arg)
   test_single_buf(4096);
 }
 
+static void
+test_rand_bulk_blocks(void *arg)
+{
+#ifdef OTTERY_FIXED_PRF
+  /* We can't turn off generate_blocks in a PRF we don't store. */
+  (void)arg;
+  tt_skip();
+ end:
+  ;
+#else
+  static const char *impls[] = {
+    "CHACHA20-NOSIMD", "CHACHA20-SIMD-DEFAULT", "CHACHA20-SIMD-SSSE3",
+    "CHACHA20-SIMD-AVX2", "CHACHA20-SIMD-AVX512", NULL
+  };
+  const size_t n = 10000;
+  struct ottery_config cfg;
+  struct ottery_state st_orig;
+  uint8_t *b1 = malloc(n + 16), *b2 = malloc(n + 16);
+  unsigned offset, i;
+  (void)arg;
+
+  tt_assert(b1);
+  tt_assert(b2);
+  if (!state)
+    tt_skip();
+
+  for (i = 0; impls[i]; ++i) {
+    ottery_config_init(&cfg);
+    if (ottery_config_force_implementation(&cfg, impls[i]))
+      continue;
+    TT_BLATHER(("Trying %s", impls[i]));
+    tt_int_op(0, ==, OTTERY_INIT(&cfg));
+    tt_assert(state->prf.generate_blocks != NULL);
+    for (offset = 0; offset < 16; offset += 3) {
+      /* Make sure that generating blocks straight into the output gives
+       * the same bytes as generating them one at a time into the buffer. */
+      OTTERY_RAND_BYTES(b1, offset * 7 + 1);
+      memcpy(&st_orig, state, sizeof(st_orig));
+      OTTERY_RAND_BYTES(b1 + offset, n);
+      memcpy(state, &st_orig, sizeof(st_orig));
+      state->prf.generate_blocks = NULL;
+      OTTERY_RAND_BYTES(b2, n);
+      tt_assert(0 == memcmp(b1 + offset, b2, n));
+      /* And that we left the state the same way. */
+      memcpy(state, &st_orig, sizeof(st_orig));
+      OTTERY_RAND_BYTES(b1 + offset, n);
+      OTTERY_RAND_BYTES(b1, 100);
+      memcpy(state, &st_orig, sizeof(st_orig));
+      state->prf.generate_blocks = NULL;
+      OTTERY_RAND_BYTES(b2, n);
+      OTTERY_RAND_BYTES(b2, 100);
+      tt_assert(0 == memcmp(b1, b2, 100));
+      state->prf.generate_blocks = st_orig.prf.generate_blocks;
+    }
+  }
+
+ end:
+  if (b1)
+    free(b1);
+  if (b2)
+    free(b2);
+#endif
+}
+
+static void
+test_refill(void *arg)
+{
+  /* chacha_merged and the Krovetz code treat the PRF state differently, so
+   * try each of them, with a buffer of several blocks: chacha_merged leaves
+   * the counter of the last block it made in the state. */
+  static const char *impls[] = {
+    NULL, "CHACHA20-NOSIMD", "CHACHA8-NOSIMD", "CHACHA20-SIMD-DEFAULT",
+    "CHACHA20-SIMD-AVX2", "CHACHA20-SIMD-AVX512", NULL
+  };
+  uint8_t b1[20000], b2[20000], seed[16];
+  uint8_t next_key[MAX_STATE_LEN];
+  uint8_t *buf_orig = NULL;
+  struct ottery_config cfg;
+  struct ottery_state st_orig;
+  struct ottery_spare_block *spare;
+  size_t off;
+  unsigned i;
+  (void)arg;
+
+  if (!state) {
+    /* Just make sure that it works for the global state. */
+    tt_int_op(0, ==, OTTERY_REFILL());
+    OTTERY_RAND_BYTES(b1, sizeof(b1));
+    tt_int_op(0, ==, OTTERY_REFILL());
+    OTTERY_RAND_BYTES(b1, sizeof(b1));
+    goto end;
+  }
+
+  for (i = 0; i == 0 || impls[i]; ++i) {
+    if (impls[i]) {
+      ottery_config_init(&cfg);
+      if (ottery_config_force_implementation(&cfg, impls[i]))
+        continue;
+      tt_int_op(0, ==, ottery_config_set_buffer_blocks(&cfg, 4));
+      TT_BLATHER(("Trying %s", impls[i]));
+      tt_int_op(0, ==, OTTERY_INIT(&cfg));
+    }
+
+    /* Refilling before every request mustn't change the output.  The
+     * buffer may live outside the state, so save it too. */
+    free(buf_orig);
+    buf_orig = malloc(state->buffer_len);
+    tt_assert(buf_orig);
+    memcpy(&st_orig, state, sizeof(st_orig));
+    memcpy(buf_orig, state->buffer, state->buffer_len);
+    for (off = 0; off < sizeof(b1); off += 100) {
+      tt_int_op(0, ==, OTTERY_REFILL());
+      tt_assert(state->spare && state->spare->ready);
+      OTTERY_RAND_BYTES(b1 + off, 100);
+    }
+    spare = state->spare;
+    memcpy(state, &st_orig, sizeof(st_orig));
+    memcpy(state->buffer, buf_orig, state->buffer_len);
+    for (off = 0; off < sizeof(b2); off += 100)
+      OTTERY_RAND_BYTES(b2 + off, 100);
+    tt_assert(0 == memcmp(b1, b2, sizeof(b1)));
+    tt_assert(NULL == state->spare);
+
+    /* Using up the buffer uses the spare. */
+    state->spare = spare;
+    tt_int_op(0, ==, OTTERY_REFILL());
+    tt_assert(spare->ready);
+    memcpy(next_key, spare->state, ST_PRF(state).state_len);
+    OTTERY_RAND_BYTES(b1, state->buffer_len);
+    tt_assert(! spare->ready);
+    tt_assert(0 == memcmp(next_key, state->state, ST_PRF(state).state_len));
+
+    /* Adding a seed must discard the spare. */
+    tt_int_op(0, ==, OTTERY_REFILL());
+    tt_assert(spare->ready);
+    memset(seed, 7, sizeof(seed));
+    tt_int_op(0, ==, OTTERY_ADD_SEED(seed, sizeof(seed)));
+    tt_assert(! spare->ready);
+
+    /* So must a big request that doesn't go through the buffer. */
+    tt_int_op(0, ==, OTTERY_REFILL());
+    tt_assert(spare->ready);
+    OTTERY_RAND_BYTES(b1, sizeof(b1));
+    tt_assert(! spare->ready);
+  }
+
+ end:
+  if (buf_orig)
+    free(buf_orig);
+}
+
+static void
+test_rand_unlocked_bulk(void *arg)
+{
+  static const size_t sizes[] = { 5000, 10000, 65536, 100003 };
+  const size_t n = 100003;
+  struct ottery_state st_orig;
+  uint8_t *b1 = malloc(n + 100), *b2 = malloc(n + 100);
+  unsigned i;
+  (void)arg;
+
+  tt_assert(b1);
+  tt_assert(b2);
+  tt_assert(state && !state_nolock);
+
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    /* A large request that generates most of its output after dropping
+     * the lock needs to give the same bytes, and leave the state the same
+     * way, as one that doesn't. */
+    ottery_st_rand_bytes(state, b1, i * 11 + 1);
+    memcpy(&st_orig, state, sizeof(st_orig));
+    ottery_st_rand_bytes(state, b1, sizes[i]);
+    ottery_st_rand_bytes(state, b1 + sizes[i], 100);
+    memcpy(state, &st_orig, sizeof(st_orig));
+    ottery_st_rand_bytes_nolock(state, b2, sizes[i]);
+    ottery_st_rand_bytes_nolock(state, b2 + sizes[i], 100);
+    tt_assert(0 == memcmp(b1, b2, sizes[i] + 100));
+    tt_int_op(state->pos, <, state->buffer_len);
+  }
+
+ end:
+  if (b1)
+    free(b1);
+  if (b2)
+    free(b2);
+}
+
+static void
+test_buffer_blocks(void *arg)
+{
+  static const size_t sizes[] = { 1, 500, 10000, 40000, 100003 };
+  const size_t n = 100003;
+  struct ottery_config cfg;
+  struct ottery_state st1, st2;
+  uint8_t *b1 = malloc(n), *b2 = malloc(n);
+  unsigned i;
+  (void)arg;
+
+  tt_assert(b1);
+  tt_assert(b2);
+
+  /* Seed both states the same way, so they give the same output. */
+  ottery_config_init(&cfg);
+  ottery_config_set_urandom_device(&cfg, "/dev/zero");
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  tt_int_op(0, ==, ottery_config_set_buffer_blocks(&cfg, 16));
+  tt_int_op(0, ==, ottery_st_init(&st1, &cfg));
+  tt_int_op(0, ==, ottery_st_init(&st2, &cfg));
+  tt_int_op(st1.buffer_len, ==, 16 * ST_PRF(&st1).output_len);
+  tt_assert(st1.buffer != st1.inline_buffer);
+
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    /* The locked path, which can generate outside the lock, has to agree
+     * with the nolock path. */
+    ottery_st_rand_bytes(&st1, b1, sizes[i]);
+    ottery_st_rand_bytes_nolock(&st2, b2, sizes[i]);
+    tt_assert(0 == memcmp(b1, b2, sizes[i]));
+    tt_int_op(ottery_st_rand_uint32(&st1), ==,
+              ottery_st_rand_uint32_nolock(&st2));
+    tt_int_op(st1.pos, <, st1.buffer_len);
+
+    /* And so does a precomputed buffer. */
+    tt_int_op(0, ==, ottery_st_refill(&st1));
+    tt_assert(st1.spare->ready);
+    ottery_st_rand_bytes(&st1, b1, st1.buffer_len);
+    ottery_st_rand_bytes_nolock(&st2, b2, st2.buffer_len);
+    tt_assert(! st1.spare->ready);
+    tt_assert(0 == memcmp(b1, b2, st1.buffer_len));
+  }
+
+  ottery_st_wipe(&st1);
+  ottery_st_wipe(&st2);
+  tt_ptr_op(st1.buffer_allocation, ==, NULL);
+
+ end:
+  if (b1)
+    free(b1);
+  if (b2)
+    free(b2);
+}
+
+/** Return true iff the n bytes at p are all zero. */
+static int
+all_zero(const uint8_t *p, size_t n)
+{
+  while (n--)
+    if (*p++)
+      return 0;
+  return 1;
+}
+
+static void
+test_clear_mode(void *arg)
+{
+#ifdef OTTERY_NO_CLEAR_AFTER_YIELD
+  (void)arg;
+  tt_skip();
+ end:
+  ;
+#else
+  struct ottery_config cfg;
+  struct ottery_state st;
+  uint64_t u;
+  int i;
+  (void)arg;
+
+  memset(&st, 0, sizeof(st));
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_clear_mode(&cfg, 99));
+
+  /* By default, everything we've yielded since the last stir is gone, even
+   * when a draw straddles a new block. */
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  for (i = 0; i < 1000; ++i) {
+    if (i & 1)
+      ottery_st_rand_uint64(&st);
+    else
+      ottery_st_rand_uint32(&st);
+    tt_assert(all_zero(st.buffer, st.pos));
+  }
+  ottery_st_wipe(&st);
+
+  /* By line, we erase 64-byte chunks once we've used them up. */
+  tt_int_op(0, ==, ottery_config_set_clear_mode(&cfg, OTTERY_CLEAR_MODE_BY_LINE));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_int_op(st.pos, <, 64);
+  while (st.pos < 64 + 8) {
+    u = ottery_st_rand_uint32(&st);
+    tt_assert(0 == memcmp(&u, st.buffer + st.pos - 4, 4) ||
+              st.pos == 64);
+  }
+  tt_assert(all_zero(st.buffer, 64));
+  tt_assert(! all_zero(st.buffer + 64, st.pos - 64));
+  /* ...and prevent_backtracking takes care of the rest. */
+  ottery_st_prevent_backtracking(&st);
+  tt_assert(all_zero(st.buffer, st.pos));
+  ottery_st_wipe(&st);
+
+  /* And with no clearing at all, the bytes just sit there. */
+  tt_int_op(0, ==, ottery_config_set_clear_mode(&cfg, OTTERY_CLEAR_MODE_NONE));
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  u = ottery_st_rand_uint64(&st);
+  tt_assert(0 == memcmp(&u, st.buffer + st.pos - 8, 8));
+  ottery_st_prevent_backtracking(&st);
+  tt_assert(all_zero(st.buffer, st.pos));
+
+ end:
+  ottery_st_wipe(&st);
+#endif
+}
+
+static void
+test_wipe_stack_mode(void *arg)
+{
+  static const int modes[] = {
+    OTTERY_WIPE_STACK_EACH_CALL,
+    OTTERY_WIPE_STACK_EACH_BLOCK,
+    OTTERY_WIPE_STACK_NONE,
+  };
+  struct ottery_config cfg;
+  struct ottery_state st;
+  uint8_t buf[4096 + 17];
+  unsigned i;
+  (void)arg;
+
+  memset(&st, 0, sizeof(st));
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_wipe_stack_mode(&cfg, 99));
+  tt_int_op(OTTERY_WIPE_STACK_EACH_CALL, ==, cfg.wipe_stack_mode);
+
+  /* Every mode has to work on the short path, the long path, and when
+   * we use a spare block. */
+  for (i = 0; i < sizeof(modes)/sizeof(modes[0]); ++i) {
+    tt_int_op(0, ==, ottery_config_set_wipe_stack_mode(&cfg, modes[i]));
+    tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+    tt_int_op(modes[i], ==, st.wipe_stack_mode);
+    memset(buf, 0, sizeof(buf));
+    ottery_st_rand_bytes(&st, buf, sizeof(buf));
+    tt_assert(! all_zero(buf + sizeof(buf) - 16, 16));
+    ottery_st_rand_uint64(&st);
+    tt_int_op(0, ==, ottery_st_refill(&st));
+    ottery_st_rand_bytes(&st, buf, 3);
+    ottery_st_wipe(&st);
+  }
+
+ end:
+  ottery_st_wipe(&st);
+}
+
 static void
 test_rand_uint(void *arg)
 {
@@ -395,6 +840,296 @@ test_rand_uint(void *arg)
   ;
 }
 
+static void
+test_rand_uint_array(void *arg)
+{
+  static const size_t sizes[] = { 0, 1, 3, 100, 1000 };
+  uint32_t a32[1002];
+  uint64_t a64[1002];
+  unsigned i;
+  size_t j;
+  (void)arg;
+
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    const size_t n = sizes[i];
+    uint32_t acc32 = 0, dec32 = (uint32_t)-1;
+    uint64_t acc64 = 0, dec64 = (uint64_t)-1;
+    int k;
+    for (k = 0; k < 100; ++k) {
+      memset(a32, 0, sizeof(a32));
+      memset(a64, 0, sizeof(a64));
+      OTTERY_RAND_UINT32_ARRAY(a32 + 1, n);
+      OTTERY_RAND_UINT64_ARRAY(a64 + 1, n);
+      /* Make sure that it doesn't write outside of its range. */
+      tt_assert(a32[0] == 0);
+      tt_assert(a32[n+1] == 0);
+      tt_assert(a64[0] == 0);
+      tt_assert(a64[n+1] == 0);
+      for (j = 1; j <= n; ++j) {
+        acc32 |= a32[j];
+        dec32 &= a32[j];
+        acc64 |= a64[j];
+        dec64 &= a64[j];
+      }
+      if (n >= 100)
+        break;
+    }
+    if (n) {
+      tt_assert(acc32 == (uint32_t)-1);
+      tt_assert(acc64 == (uint64_t)-1);
+      tt_assert(dec32 == 0);
+      tt_assert(dec64 == 0);
+    }
+  }
+
+ end:
+  ;
+}
+
+static void
+test_range_array(void *arg)
+{
+  unsigned a[1002];
+  uint64_t a64[1002];
+  unsigned tops[1000];
+  uint64_t tops64[1000];
+  int count[6];
+  const uint64_t quite_big = ((uint64_t)1)<<60;
+  int got_a_big_one = 0, got_a_big_small_one = 0;
+  unsigned i;
+  (void)arg;
+
+  memset(count, 0, sizeof(count));
+  memset(a, 0, sizeof(a));
+  memset(a64, 0, sizeof(a64));
+
+  /* Same bound for every element. */
+  OTTERY_RAND_RANGE_ARRAY(a + 1, 1000, 5);
+  OTTERY_RAND_RANGE64_ARRAY(a64 + 1, 1000, quite_big);
+  tt_int_op(a[0], ==, 0);
+  tt_int_op(a[1001], ==, 0);
+  tt_assert(a64[0] == 0);
+  tt_assert(a64[1001] == 0);
+  for (i = 1; i <= 1000; ++i) {
+    tt_int_op(a[i], <=, 5);
+    count[a[i]] += 1;
+    tt_assert(a64[i] <= quite_big);
+    if (a64[i] > (((uint64_t)1)<<40))
+      ++got_a_big_one;
+  }
+  for (i = 0; i <= 5; ++i) {
+    tt_int_op(0, !=, count[i]);
+  }
+  tt_int_op(got_a_big_one, !=, 0);
+
+  OTTERY_RAND_RANGE_ARRAY(a, 1000, 0);
+  OTTERY_RAND_RANGE64_ARRAY(a64, 1000, 0);
+  for (i = 0; i < 1000; ++i) {
+    tt_int_op(a[i], ==, 0);
+    tt_assert(a64[i] == 0);
+  }
+  /* Nothing should happen for an empty array. */
+  a[0] = 77;
+  OTTERY_RAND_RANGE_ARRAY(a, 0, 5);
+  tt_int_op(a[0], ==, 77);
+
+  /* A different bound for every element, including the extremes. */
+  for (i = 0; i < 1000; ++i) {
+    switch (i % 4) {
+      case 0: tops[i] = 0; tops64[i] = 0; break;
+      case 1: tops[i] = i; tops64[i] = ((uint64_t)i) << 32; break;
+      case 2: tops[i] = 3000000000U; tops64[i] = quite_big; break;
+      case 3: tops[i] = UINT_MAX; tops64[i] = UINT64_MAX; break;
+    }
+  }
+  memset(a, 0, sizeof(a));
+  memset(a64, 0, sizeof(a64));
+  OTTERY_RAND_RANGE_ARRAY_BOUNDS(a + 1, tops, 1000);
+  OTTERY_RAND_RANGE64_ARRAY_BOUNDS(a64 + 1, tops64, 1000);
+  tt_int_op(a[0], ==, 0);
+  tt_int_op(a[1001], ==, 0);
+  tt_assert(a64[0] == 0);
+  tt_assert(a64[1001] == 0);
+  got_a_big_one = 0;
+  for (i = 0; i < 1000; ++i) {
+    tt_int_op(a[i+1], <=, tops[i]);
+    tt_assert(a64[i+1] <= tops64[i]);
+    if (i % 4 == 2 && a[i+1] > 2000000000U)
+      ++got_a_big_small_one;
+    if (i % 4 == 3 && a64[i+1] > quite_big)
+      ++got_a_big_one;
+  }
+  tt_int_op(got_a_big_small_one, !=, 0);
+  tt_int_op(got_a_big_one, !=, 0);
+
+ end:
+  ;
+}
+
+static void
+test_shuffle_sample(void *arg)
+{
+  unsigned a[1000];
+  uint8_t seen[1000];
+  uint8_t odd[100][3], big[10][100];
+  size_t idx[1000], slots[1000];
+  int first_count[10];
+  unsigned i, j, trial;
+  (void)arg;
+
+  /* A shuffle is a permutation, and not (usually) the identity. */
+  for (i = 0; i < 1000; ++i)
+    a[i] = i;
+  OTTERY_SHUFFLE(a, 1000, sizeof(unsigned));
+  memset(seen, 0, sizeof(seen));
+  j = 0;
+  for (i = 0; i < 1000; ++i) {
+    tt_int_op(a[i], <, 1000);
+    tt_int_op(seen[a[i]], ==, 0);
+    seen[a[i]] = 1;
+    if (a[i] == i)
+      ++j;
+  }
+  tt_int_op(j, <, 10);
+
+  /* Elements whose size isn't a word, or is bigger than our buffer. */
+  for (i = 0; i < 100; ++i)
+    memset(odd[i], i, sizeof(odd[i]));
+  for (i = 0; i < 10; ++i)
+    memset(big[i], i, sizeof(big[i]));
+  OTTERY_SHUFFLE(odd, 100, sizeof(odd[0]));
+  OTTERY_SHUFFLE(big, 10, sizeof(big[0]));
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < 100; ++i) {
+    tt_int_op(odd[i][0], <, 100);
+    tt_int_op(odd[i][0], ==, odd[i][2]);
+    tt_int_op(seen[odd[i][0]], ==, 0);
+    seen[odd[i][0]] = 1;
+  }
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(big[i][0], <, 10);
+    tt_int_op(big[i][0], ==, big[i][99]);
+    tt_int_op(seen[big[i][0]], ==, 0);
+    seen[big[i][0]] = 1;
+  }
+
+  /* Nothing should happen for tiny arrays. */
+  a[0] = 77;
+  OTTERY_SHUFFLE(a, 0, sizeof(unsigned));
+  OTTERY_SHUFFLE(a, 1, sizeof(unsigned));
+  tt_int_op(a[0], ==, 77);
+
+  /* Samples are distinct and in range. */
+  tt_int_op(0, ==, OTTERY_SAMPLE_INDICES(1000000, 1000, idx));
+  for (i = 0; i < 1000; ++i) {
+    tt_assert(idx[i] < 1000000);
+    for (j = 0; j < i; ++j)
+      tt_assert(idx[i] != idx[j]);
+  }
+  /* Taking every index gives a permutation. */
+  tt_int_op(0, ==, OTTERY_SAMPLE_INDICES(1000, 1000, idx));
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < 1000; ++i) {
+    tt_assert(idx[i] < 1000);
+    tt_int_op(seen[idx[i]], ==, 0);
+    seen[idx[i]] = 1;
+  }
+  tt_int_op(0, ==, OTTERY_SAMPLE_INDICES(10, 0, idx));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            OTTERY_SAMPLE_INDICES(10, 11, idx));
+
+  /* Loosely: every index should come first about equally often. */
+  memset(first_count, 0, sizeof(first_count));
+  for (trial = 0; trial < 2000; ++trial) {
+    tt_int_op(0, ==, OTTERY_SAMPLE_INDICES(10, 3, idx));
+    ++first_count[idx[0]];
+  }
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(first_count[i], >, 100);
+    tt_int_op(first_count[i], <, 300);
+  }
+
+  /* The first k items of a stream fill the reservoir; after that, items
+   * either replace something or get dropped. */
+  OTTERY_RESERVOIR_SLOTS(0, 10, slots, 1000);
+  j = 0;
+  for (i = 0; i < 10; ++i)
+    tt_int_op(slots[i], ==, i);
+  for (i = 10; i < 1000; ++i) {
+    tt_assert(slots[i] < 10 || slots[i] == OTTERY_RESERVOIR_SKIP);
+    if (slots[i] != OTTERY_RESERVOIR_SKIP)
+      ++j;
+  }
+  /* We should keep about 10*(H(1000)-H(10)), or about 46, of them. */
+  tt_int_op(j, >, 20);
+  tt_int_op(j, <, 90);
+  OTTERY_RESERVOIR_SLOTS(((uint64_t)1)<<40, 10, slots, 1000);
+  for (i = 0; i < 1000; ++i)
+    tt_assert(slots[i] == OTTERY_RESERVOIR_SKIP);
+
+ end:
+  ;
+}
+
+static void
+test_rand_float(void *arg)
+{
+  double d[1002];
+  float f[1002];
+  int dcount[10], fcount[10];
+  int i;
+  (void)arg;
+
+  memset(dcount, 0, sizeof(dcount));
+  memset(fcount, 0, sizeof(fcount));
+  for (i = 0; i < 1000; ++i) {
+    double dv = OTTERY_RAND_DOUBLE();
+    float fv = OTTERY_RAND_FLOAT();
+    tt_assert(dv >= 0.0 && dv < 1.0);
+    tt_assert(fv >= 0.0f && fv < 1.0f);
+    dcount[(int)(dv * 10)] += 1;
+    fcount[(int)(fv * 10)] += 1;
+  }
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(dcount[i], !=, 0);
+    tt_int_op(fcount[i], !=, 0);
+  }
+
+  memset(dcount, 0, sizeof(dcount));
+  memset(fcount, 0, sizeof(fcount));
+  d[0] = d[1001] = 7.0;
+  f[0] = f[1001] = 7.0f;
+  OTTERY_RAND_DOUBLE_ARRAY(d + 1, 1000);
+  OTTERY_RAND_FLOAT_ARRAY(f + 1, 1000);
+  /* Make sure that it doesn't write outside of its range. */
+  tt_assert(d[0] == 7.0 && d[1001] == 7.0);
+  tt_assert(f[0] == 7.0f && f[1001] == 7.0f);
+  for (i = 1; i <= 1000; ++i) {
+    tt_assert(d[i] >= 0.0 && d[i] < 1.0);
+    tt_assert(f[i] >= 0.0f && f[i] < 1.0f);
+    /* Every value should be a multiple of 2^-52 or 2^-23 respectively. */
+    tt_assert(d[i] * 4503599627370496.0 ==
+              (double)(uint64_t)(d[i] * 4503599627370496.0));
+    tt_assert(f[i] * 8388608.0f == (float)(uint32_t)(f[i] * 8388608.0f));
+    dcount[(int)(d[i] * 10)] += 1;
+    fcount[(int)(f[i] * 10)] += 1;
+  }
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(dcount[i], !=, 0);
+    tt_int_op(fcount[i], !=, 0);
+  }
+
+  /* Nothing should happen for an empty array. */
+  OTTERY_RAND_DOUBLE_ARRAY(d, 0);
+  OTTERY_RAND_FLOAT_ARRAY(f, 0);
+  tt_assert(d[0] == 7.0);
+  tt_assert(f[0] == 7.0f);
+
+ end:
+  ;
+}
+
 static void
 test_range(void *arg)
 {
@@ -432,41 +1167,47 @@ test_range(void *arg)
   ;
 }
 
-void
-test_fork(void *arg)
+static void
+test_fork_generation(void *arg)
 {
-  (void) arg;
 #if defined(_WIN32) || defined(OTTERY_NO_PID_CHECK)
+  (void)arg;
   tt_skip();
  end:
   ;
 #else
-  uint8_t buf[256];
-  uint8_t buf2[256];
+  __attribute__((aligned(16))) struct ottery_state st;
+  uint8_t key[MAX_STATE_LEN];
+  int reseeded = 0;
   int fd[2] = { -1, -1 };
   pid_t p;
+  (void)arg;
+
+  tt_int_op(0, ==, ottery_st_init(&st, NULL));
+  ottery_st_rand_unsigned(&st);
 
   if (pipe(fd) < 0)
     tt_abort_perror("pipe");
 
-  if (!state)
-    ottery_init(NULL);
-
+  memcpy(key, st.state, sizeof(key));
   if ((p = fork()) == 0) {
-    /* child */
-    OTTERY_RAND_BYTES(buf, sizeof(buf));
-    if (write(fd[1], buf, sizeof(buf)) < 0) {
+    /* child: using the state should notice the fork, and reseed. */
+    ottery_st_rand_unsigned(&st);
+    reseeded = (st.pid == getpid() && memcmp(key, st.state, sizeof(key)));
+    if (write(fd[1], &reseeded, sizeof(reseeded)) < 0) {
       perror("write");
     }
     exit(0);
   } else if (p == -1) {
     tt_abort_perror("fork");
   }
-  /* parent. */
-  OTTERY_RAND_BYTES(buf, sizeof(buf));
-  tt_int_op(sizeof(buf2), ==, read(fd[0], buf2, sizeof(buf2)));
-  tt_assert(memcmp(buf, buf2, sizeof(buf)))
-  tt_assert(memcmp(buf, buf2, 16))
+  tt_int_op(sizeof(reseeded), ==, read(fd[0], &reseeded, sizeof(reseeded)));
+  tt_int_op(reseeded, ==, 1);
+
+  /* In the parent, nothing happens. */
+  memcpy(key, st.state, sizeof(key));
+  ottery_st_rand_unsigned(&st);
+  tt_assert(0 == memcmp(key, st.state, sizeof(key)));
 
  end:
   if (fd[0] >= 0)
@@ -476,8 +1217,155 @@ test_fork(void *arg)
 #endif
 }
 
-void
-test_bad_init(void *arg)
+static void
+test_lean_state(void *arg)
+{
+  __attribute__((aligned(16))) struct ottery_lean_state st1, st2;
+  struct ottery_config cfg;
+  char *ptr = NULL;
+  uint8_t buf1[1000], buf2[1000];
+  uint8_t key[LEAN_STATE_LEN];
+  int i, reseeded = 0;
+  int fd[2] = { -1, -1 };
+  pid_t p;
+  (void)arg;
+
+  tt_int_op(ottery_get_sizeof_lean_state(), <=, OTTERY_LEAN_STATE_DUMMY_SIZE_);
+
+  /* By default we use a small version of ChaCha20. */
+  tt_int_op(0, ==, ottery_lean_init(&st1, NULL));
+  tt_str_op(st1.prf->name, ==, "CHACHA20");
+  tt_int_op(st1.prf->output_len, <=, LEAN_OUTPUT_LEN);
+  tt_int_op(st1.pos, <, st1.prf->output_len);
+
+  /* We can share a configuration, and we use the PRF that it asks for even
+   * if its usual implementation is too big. */
+  ottery_config_init(&cfg);
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg, OTHER_PRF_NAME));
+  tt_int_op(0, ==, ottery_lean_init(&st2, &cfg));
+  tt_str_op(st2.prf->name, ==, OTHER_PRF_NAME);
+  tt_ptr_op(st2.config, ==, &cfg);
+
+  /* Different states give different output, across lots of rekeying. */
+  ottery_lean_rand_bytes(&st1, buf1, sizeof(buf1));
+  ottery_lean_rand_bytes(&st2, buf2, sizeof(buf2));
+  tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+  tt_int_op(st1.pos, <, st1.prf->output_len);
+  for (i = 0; i < 1000; ++i) {
+    tt_int_op(ottery_lean_rand_range(&st1, 6), <=, 6);
+    tt_assert(ottery_lean_rand_range64(&st2, 1000000000000ULL) <=
+              1000000000000ULL);
+    ottery_lean_rand_unsigned(&st1);
+    ottery_lean_rand_uint32(&st1);
+    ottery_lean_rand_uint64(&st2);
+    tt_int_op(st1.pos, <, st1.prf->output_len);
+  }
+
+  /* Lean states need alignment too. */
+  ptr = malloc(sizeof(struct ottery_lean_state) + 1);
+  tt_assert(ptr);
+  tt_int_op(OTTERY_ERR_STATE_ALIGNMENT, ==,
+            ottery_lean_init((void*)((((uintptr_t)ptr) & 0xf) ? ptr : ptr+1),
+                             NULL));
+
+#if !defined(_WIN32) && !defined(OTTERY_NO_PID_CHECK)
+  /* A lean state reseeds after a fork, just like any other. */
+  if (pipe(fd) < 0)
+    tt_abort_perror("pipe");
+  memcpy(key, st1.state, sizeof(key));
+  if ((p = fork()) == 0) {
+    ottery_lean_rand_unsigned(&st1);
+    reseeded = (st1.pid == getpid() && memcmp(key, st1.state, sizeof(key)));
+    if (write(fd[1], &reseeded, sizeof(reseeded)) < 0) {
+      perror("write");
+    }
+    exit(0);
+  } else if (p == -1) {
+    tt_abort_perror("fork");
+  }
+  tt_int_op(sizeof(reseeded), ==, read(fd[0], &reseeded, sizeof(reseeded)));
+  tt_int_op(reseeded, ==, 1);
+#else
+  (void)key;
+  (void)p;
+  (void)reseeded;
+#endif
+
+  ottery_lean_wipe(&st1);
+  ottery_lean_wipe(&st2);
+  tt_int_op(st1.magic, ==, 0);
+
+ end:
+  if (ptr)
+    free(ptr);
+  if (fd[0] >= 0)
+    close(fd[0]);
+  if (fd[1] >= 0)
+    close(fd[1]);
+}
+
+void
+test_fork(void *arg)
+{
+  (void) arg;
+#if defined(_WIN32) || defined(OTTERY_NO_PID_CHECK)
+  tt_skip();
+ end:
+  ;
+#else
+  uint8_t buf[256];
+  uint8_t buf2[256];
+  int fd[2] = { -1, -1 };
+  pid_t p;
+
+  if (pipe(fd) < 0)
+    tt_abort_perror("pipe");
+
+  if (!state && !global_per_thread && !global_sharded)
+    ottery_init(NULL);
+
+  if ((p = fork()) == 0) {
+    /* child */
+    OTTERY_RAND_BYTES(buf, sizeof(buf));
+    if (write(fd[1], buf, sizeof(buf)) < 0) {
+      perror("write");
+    }
+    exit(0);
+  } else if (p == -1) {
+    tt_abort_perror("fork");
+  }
+  /* parent. */
+  OTTERY_RAND_BYTES(buf, sizeof(buf));
+  tt_int_op(sizeof(buf2), ==, read(fd[0], buf2, sizeof(buf2)));
+  tt_assert(memcmp(buf, buf2, sizeof(buf)))
+  tt_assert(memcmp(buf, buf2, 16))
+
+ end:
+  if (fd[0] >= 0)
+    close(fd[0]);
+  if (fd[1] >= 0)
+    close(fd[1]);
+#endif
+}
+
+/* What initializing with a broken PRF gives us.  A build with a fixed PRF
+ * rejects any other PRF before it looks at it. */
+#ifdef OTTERY_FIXED_PRF
+#define BAD_PRF_ERR OTTERY_ERR_INVALID_ARGUMENT
+#else
+#define BAD_PRF_ERR OTTERY_ERR_INTERNAL
+#endif
+
+/* A PRF that initializing with should work: ChaCha20, unless the build
+ * has some other fixed PRF. */
+#ifdef OTTERY_FIXED_PRF
+#define GOOD_PRF_NAME (OTTERY_FIXED_PRF.name)
+#else
+#define GOOD_PRF_NAME OTTERY_PRF_CHACHA20
+#endif
+
+void
+test_bad_init(void *arg)
 {
   (void)arg;
 
@@ -488,25 +1376,25 @@ test_bad_init(void *arg)
   tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
             ottery_config_force_implementation(&cfg, "rc4"));
   tt_int_op(0, ==,
-            ottery_config_force_implementation(&cfg, "CHACHA20"));
+            ottery_config_force_implementation(&cfg, GOOD_PRF_NAME));
 
   memcpy(&bad_prf, &ottery_prf_chacha20_merged_, sizeof(struct ottery_prf));
   bad_prf.state_len = 1024;
   ottery_config_set_manual_prf_(&cfg, &bad_prf);
-  tt_int_op(OTTERY_ERR_INTERNAL, ==, OTTERY_INIT(&cfg));
+  tt_int_op(BAD_PRF_ERR, ==, OTTERY_INIT(&cfg));
 
   memcpy(&bad_prf, &ottery_prf_chacha20_merged_, sizeof(struct ottery_prf));
   bad_prf.state_bytes = 2000;
   ottery_config_set_manual_prf_(&cfg, &bad_prf);
-  tt_int_op(OTTERY_ERR_INTERNAL, ==, OTTERY_INIT(&cfg));
+  tt_int_op(BAD_PRF_ERR, ==, OTTERY_INIT(&cfg));
 
   memcpy(&bad_prf, &ottery_prf_chacha20_merged_, sizeof(struct ottery_prf));
   bad_prf.output_len = 8;
   ottery_config_set_manual_prf_(&cfg, &bad_prf);
-  tt_int_op(OTTERY_ERR_INTERNAL, ==, OTTERY_INIT(&cfg));
+  tt_int_op(BAD_PRF_ERR, ==, OTTERY_INIT(&cfg));
 
   ottery_config_init(&cfg);
-  ottery_config_force_implementation(&cfg, "CHACHA20");
+  ottery_config_force_implementation(&cfg, GOOD_PRF_NAME);
   tt_int_op(0, ==, OTTERY_INIT(&cfg));
 
   ottery_config_set_urandom_device(&cfg,"/dev/please-dont-add-this-device");
@@ -627,6 +1515,20 @@ test_select_prf(void *arg)
 
   tt_int_op(0, ==, ottery_config_init(&cfg));
 
+#ifdef OTTERY_FIXED_PRF
+  /* We can only select the PRF that we were built with. */
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg, NULL));
+  tt_ptr_op(cfg.impl, ==, &OTTERY_FIXED_PRF);
+  tt_int_op(0, ==, ottery_config_force_implementation(&cfg,
+                                                   OTTERY_FIXED_PRF.flav));
+  tt_ptr_op(cfg.impl, ==, &OTTERY_FIXED_PRF);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_force_implementation(&cfg,
+              strcmp(OTTERY_FIXED_PRF.name, "CHACHA8") ? "CHACHA8" :
+                                                         "CHACHA12"));
+  tt_int_op(OTTERY_BLDFLG_FIXED_PRF, ==,
+            ottery_get_build_flags() & OTTERY_BLDFLG_FIXED_PRF);
+#else
   /* Select by name. */
   tt_int_op(0, ==, ottery_config_force_implementation(&cfg, "CHACHA8"));
   tt_ptr_op(cfg.impl, !=, NULL);
@@ -655,6 +1557,60 @@ test_select_prf(void *arg)
   tt_int_op(0, ==, ottery_config_force_implementation(&cfg, NULL));
   tt_ptr_op(cfg.impl, !=, NULL);
   tt_ptr_op(cfg.impl, ==, &ottery_prf_chacha20_merged_);
+#endif
+
+ end:
+  ;
+}
+
+static void
+test_autotune(void *arg)
+{
+  struct ottery_config cfg;
+  const struct ottery_prf *prf;
+  (void)arg;
+
+  tt_int_op(0, ==, ottery_config_init(&cfg));
+
+#ifdef OTTERY_FIXED_PRF
+  /* There's only one candidate. */
+  (void)prf;
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, OTTERY_FIXED_PRF.name));
+  tt_ptr_op(cfg.impl, ==, &OTTERY_FIXED_PRF);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_autotune(&cfg, "rc4"));
+#else
+  /* The default is ChaCha20. */
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, NULL));
+  tt_ptr_op(cfg.impl, !=, NULL);
+  tt_str_op(cfg.impl->name, ==, "CHACHA20");
+  TT_BLATHER(("The fastest CHACHA20 is %s", cfg.impl->flav));
+
+  /* Asking again gives the same (cached) answer. */
+  prf = cfg.impl;
+  tt_int_op(0, ==, ottery_config_init(&cfg));
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, OTTERY_PRF_CHACHA20));
+  tt_ptr_op(cfg.impl, ==, prf);
+
+  /* We only pick implementations that match what we asked for. */
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, "CHACHA8"));
+  tt_str_op(cfg.impl->name, ==, "CHACHA8");
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, "CHACHA12-NOSIMD"));
+  tt_ptr_op(cfg.impl, ==, &ottery_prf_chacha12_merged_);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_autotune(&cfg, "rc4"));
+
+  /* The result is usable. */
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, NULL));
+  tt_int_op(0, ==, ottery_init(&cfg));
+  ottery_rand_unsigned();
+
+  /* Without SIMD, we can't use a SIMD implementation, even if we picked
+   * one before. */
+  ottery_disable_cpu_capabilities_(OTTERY_CPUCAP_SIMD);
+  tt_int_op(0, ==, ottery_config_autotune(&cfg, NULL));
+  tt_ptr_op(cfg.impl, ==, &ottery_prf_chacha20_merged_);
+#endif
 
  end:
   ;
@@ -725,6 +1681,7 @@ test_fatal(void *arg)
   tt_int_op(0, ==, ottery_st_init(&st, NULL));
   ottery_st_rand_unsigned(&st);
   st.pid = getpid() + 100; /* force a postfork reseed. */
+  --st.fork_generation; /* ...however we detect forks. */
   st.entropy_config.urandom_fname = "/dev/null"; /* make reseed impossible */
   st.entropy_config.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
   tt_int_op(got_fatal_err, ==, 0);
@@ -736,6 +1693,7 @@ test_fatal(void *arg)
   tt_int_op(0, ==, ottery_st_init_nolock(&st_nl, NULL));
   ottery_st_rand_unsigned_nolock(&st_nl);
   st_nl.pid = getpid() + 100; /* force a postfork reseed. */
+  --st_nl.fork_generation; /* ...however we detect forks. */
   st_nl.entropy_config.urandom_fname = "/dev/null"; /* make reseed impossible */
   st_nl.entropy_config.disabled_sources = ALL_ENTROPY_BUT(RANDOMDEV);
   tt_int_op(got_fatal_err, ==, 0);
@@ -751,6 +1709,115 @@ test_fatal(void *arg)
   ;
 }
 
+#ifdef OTTERY_TLS_PTHREADS
+#define N_THREADS 4
+static void *
+thread_rand_bytes(void *arg)
+{
+  ottery_rand_bytes(arg, 64);
+  return NULL;
+}
+#endif
+
+static void
+test_global_per_thread(void *arg)
+{
+  struct ottery_config cfg;
+  (void) arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_global_mode(&cfg, 99));
+#ifndef OTTERY_TLS_PTHREADS
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_global_mode(&cfg, OTTERY_GLOBAL_MODE_PER_THREAD));
+#else
+  {
+    pthread_t threads[N_THREADS];
+    uint8_t bufs[N_THREADS+1][64];
+    int i, j;
+
+    tt_int_op(0, ==,
+              ottery_config_set_global_mode(&cfg,
+                                            OTTERY_GLOBAL_MODE_PER_THREAD));
+    tt_int_op(0, ==, ottery_init(&cfg));
+
+    for (i = 0; i < N_THREADS; ++i) {
+      tt_int_op(0, ==, pthread_create(&threads[i], NULL, thread_rand_bytes,
+                                      bufs[i]));
+    }
+    ottery_rand_bytes(bufs[N_THREADS], 64);
+    for (i = 0; i < N_THREADS; ++i)
+      tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+    /* Every thread got its own independently seeded state. */
+    for (i = 0; i <= N_THREADS; ++i) {
+      for (j = i + 1; j <= N_THREADS; ++j) {
+        tt_assert(memcmp(bufs[i], bufs[j], 64));
+      }
+    }
+
+    /* After a wipe, we go back to using a single shared state. */
+    ottery_wipe();
+    ottery_rand_bytes(bufs[0], 64);
+    tt_assert(memcmp(bufs[0], bufs[N_THREADS], 64));
+  }
+#endif
+
+ end:
+  ;
+}
+
+static void
+test_global_sharded(void *arg)
+{
+  struct ottery_config cfg;
+  (void) arg;
+
+  ottery_config_init(&cfg);
+#ifdef OTTERY_NO_LOCKS
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_global_mode(&cfg, OTTERY_GLOBAL_MODE_SHARDED));
+#else
+  tt_int_op(0, ==,
+            ottery_config_set_global_mode(&cfg, OTTERY_GLOBAL_MODE_SHARDED));
+  tt_int_op(0, ==, ottery_init(&cfg));
+#ifdef OTTERY_TLS_PTHREADS
+  {
+    pthread_t threads[N_THREADS];
+    uint8_t bufs[N_THREADS+1][64];
+    int i, j;
+
+    for (i = 0; i < N_THREADS; ++i) {
+      tt_int_op(0, ==, pthread_create(&threads[i], NULL, thread_rand_bytes,
+                                      bufs[i]));
+    }
+    ottery_rand_bytes(bufs[N_THREADS], 64);
+    for (i = 0; i < N_THREADS; ++i)
+      tt_int_op(0, ==, pthread_join(threads[i], NULL));
+
+    /* Whichever shards they used, no two threads got the same bytes. */
+    for (i = 0; i <= N_THREADS; ++i) {
+      for (j = i + 1; j <= N_THREADS; ++j) {
+        tt_assert(memcmp(bufs[i], bufs[j], 64));
+      }
+    }
+
+    /* Reinitializing replaces the shards; so does a wipe. */
+    tt_int_op(0, ==, ottery_init(&cfg));
+    ottery_rand_bytes(bufs[0], 64);
+    tt_assert(memcmp(bufs[0], bufs[N_THREADS], 64));
+    ottery_wipe();
+    ottery_rand_bytes(bufs[1], 64);
+    tt_assert(memcmp(bufs[0], bufs[1], 64));
+  }
+#endif
+#endif
+
+ end:
+  ;
+}
+
 static void
 test_build_flags(void *arg)
 {
@@ -805,24 +1872,587 @@ struct testcase_t misc_tests[] = {
   { "osrandom", test_osrandom, TT_FORK, NULL, NULL },
   { "get_sizeof", test_get_sizeof, 0, NULL, NULL },
   { "select_prf", test_select_prf, TT_FORK, 0, NULL },
+  { "autotune", test_autotune, TT_FORK, 0, NULL },
   { "fatal", test_fatal, TT_FORK, NULL, NULL },
+  { "fork_generation", test_fork_generation, TT_FORK, NULL, NULL },
+  { "lean_state", test_lean_state, TT_FORK, NULL, NULL },
+  { "global_per_thread", test_global_per_thread, TT_FORK, NULL, NULL },
+  { "global_sharded", test_global_sharded, TT_FORK, NULL, NULL },
   { "build_flags", test_build_flags, 0, NULL, NULL },
   { "versions", test_versions, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
+static void
+test_st_new(void *arg)
+{
+  struct ottery_config cfg;
+  struct ottery_state *st = NULL;
+  struct ottery_state_nolock *st_nl = NULL;
+  struct ottery_state *states[5] = { NULL };
+  uint64_t u[5];
+  unsigned i, j;
+  int err;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_alloc_flags(&cfg, 0x80));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_st_new_array(states, 0, &cfg));
+
+  tt_int_op(0, ==, ottery_st_new(&st, NULL));
+  tt_int_op(0, ==, ((uintptr_t)st) & (OTTERY_CACHE_LINE_LEN - 1));
+  tt_int_op(ottery_st_rand_uint64(st), !=, ottery_st_rand_uint64(st));
+  ottery_st_free(st);
+  st = NULL;
+  ottery_st_free(NULL);
+
+  /* Same for a state without a lock. */
+  tt_int_op(0, ==, ottery_st_new_nolock(&st_nl, NULL));
+  tt_int_op(0, ==, ((uintptr_t)st_nl) & (OTTERY_CACHE_LINE_LEN - 1));
+  tt_int_op(ottery_st_rand_uint64_nolock(st_nl), !=,
+            ottery_st_rand_uint64_nolock(st_nl));
+  ottery_st_free_nolock(st_nl);
+  ottery_st_free_nolock(NULL);
+
+  /* Each state in an array gets its own cache lines, and its own seed. */
+  tt_int_op(0, ==, ottery_st_new_array(states, 5, &cfg));
+  for (i = 0; i < 5; ++i) {
+    tt_int_op(0, ==, ((uintptr_t)states[i]) & (OTTERY_CACHE_LINE_LEN - 1));
+    if (i)
+      tt_int_op((uint8_t*)states[i] - (uint8_t*)states[i-1], >=,
+                ottery_get_sizeof_state());
+    u[i] = ottery_st_rand_uint64(states[i]);
+    for (j = 0; j < i; ++j)
+      tt_assert(u[i] != u[j]);
+  }
+  ottery_st_free_array(states, 5);
+  tt_ptr_op(states[0], ==, NULL);
+
+  /* Locking may fail if RLIMIT_MEMLOCK is low, but it must not fail any
+   * other way. */
+  if (ottery_config_set_alloc_flags(&cfg, OTTERY_ALLOC_MLOCK) == 0) {
+    err = ottery_st_new_array(states, 5, &cfg);
+    tt_assert(err == 0 || err == OTTERY_ERR_MLOCK);
+    if (err == 0) {
+      ottery_st_rand_uint64(states[4]);
+      ottery_st_free_array(states, 5);
+    }
+  }
+  if (ottery_config_set_alloc_flags(&cfg, OTTERY_ALLOC_DONTDUMP) == 0) {
+    tt_int_op(0, ==, ottery_st_new(&st, &cfg));
+    ottery_st_rand_uint64(st);
+  }
+
+ end:
+  ottery_st_free(st);
+}
+
+static void
+test_split_seek(void *arg)
+{
+  struct ottery_config cfg;
+  static const char *impls[] = {
+    "CHACHA20-NOSIMD", "CHACHA20-SIMD-DEFAULT", "CHACHA20-SIMD-AVX2",
+    "CHACHA20-SIMD-AVX512", NULL
+  };
+  struct ottery_state st1, st2, ch1, ch2, ch3;
+  const uint8_t seed[] = "reproducible seed";
+  uint8_t buf1[2048], buf2[2048], buf3[2048];
+  uint32_t max_idx;
+  unsigned i;
+  (void)arg;
+
+  /* No entropy source may be touched. */
+  ottery_config_init(&cfg);
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_ALL_SOURCES);
+  tt_int_op(0, ==, ottery_config_set_buffer_blocks(&cfg, 2));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_st_init_from_seed(&st1, &cfg, seed, 0));
+
+  /* The same seed gives the same stream; a different one doesn't. */
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st1, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st2, &cfg, seed, sizeof(seed)));
+  ottery_st_rand_bytes(&st1, buf1, sizeof(buf1));
+  ottery_st_rand_bytes(&st2, buf2, sizeof(buf2));
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+  ottery_st_wipe(&st2);
+  tt_int_op(0, ==, ottery_st_init_from_seed_nolock(&st2, &cfg, seed,
+                                                   sizeof(seed) - 1));
+  ottery_st_rand_bytes_nolock(&st2, buf2, sizeof(buf2));
+  tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+  ottery_st_wipe_nolock(&st2);
+
+  /* Children are reproducible, and differ by stream_id. */
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st1, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st2, &cfg, seed, sizeof(seed)));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==, ottery_st_split(&st1, &st1, 0));
+  tt_int_op(0, ==, ottery_st_split(&st1, &ch1, 7));
+  tt_int_op(0, ==, ottery_st_split(&st2, &ch2, 7));
+  tt_int_op(0, ==, ottery_st_split_nolock(&st2, &ch3, 8));
+  ottery_st_rand_bytes(&ch1, buf1, sizeof(buf1));
+  ottery_st_rand_bytes(&ch2, buf2, sizeof(buf2));
+  ottery_st_rand_bytes(&ch3, buf3, sizeof(buf3));
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+  tt_assert(0 != memcmp(buf1, buf3, sizeof(buf1)));
+  /* Splitting advances the parent, identically each time. */
+  ottery_st_rand_bytes(&st1, buf1, sizeof(buf1));
+  ottery_st_rand_bytes(&st2, buf2, sizeof(buf2));
+  tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+  ottery_st_wipe(&ch1);
+  ottery_st_wipe(&ch2);
+  ottery_st_wipe_nolock(&ch3);
+  ottery_st_wipe(&st1);
+  ottery_st_wipe(&st2);
+
+  /* Seeking is reproducible, and seeking by different offsets gives
+   * different streams. */
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st1, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st2, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&ch1, &cfg, seed, sizeof(seed)));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_st_seek(&st1, ((uint64_t)1) << 32));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_st_seek(&st1, UINT64_MAX));
+  tt_int_op(0, ==, ottery_st_seek(&st1, 1000));
+  tt_int_op(0, ==, ottery_st_seek_nolock(&st2, 1000));
+  tt_int_op(0, ==, ottery_st_seek(&ch1, 1002));
+  ottery_st_rand_bytes(&st1, buf1, sizeof(buf1));
+  ottery_st_rand_bytes(&st2, buf2, sizeof(buf2));
+  ottery_st_rand_bytes(&ch1, buf3, sizeof(buf3));
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+  tt_assert(0 != memcmp(buf1, buf3, sizeof(buf1)));
+  ottery_st_wipe(&st1);
+  ottery_st_wipe(&st2);
+  ottery_st_wipe(&ch1);
+
+  /* The ChaCha PRFs turn each counter value into several ChaCha block
+   * counters, so seeking has to stop well short of 2^32 blocks.  With 16 of
+   * them, as in chacha_merged, the stream would start over at 2^28. */
+  tt_int_op(PRF_MAX_IDX(ottery_prf_chacha20_merged_), ==,
+            (((uint32_t)1) << 28) - 1);
+  for (i = 0; impls[i]; ++i) {
+    if (ottery_config_force_implementation(&cfg, impls[i]))
+      continue;
+    TT_BLATHER(("Trying %s", impls[i]));
+    tt_int_op(0, ==, ottery_st_init_from_seed(&st1, &cfg, seed, sizeof(seed)));
+    tt_int_op(0, ==, ottery_st_init_from_seed(&st2, &cfg, seed, sizeof(seed)));
+    max_idx = PRF_MAX_IDX(ST_PRF(&st1));
+    tt_int_op(max_idx, <=, UINT32_MAX / 4);
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+              ottery_st_seek(&st1, ((uint64_t)max_idx) + 1));
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==, ottery_st_seek(&st1, max_idx));
+    /* The last offset that leaves room for the two-block buffer. */
+    tt_int_op(0, ==, ottery_st_seek(&st1, max_idx - 1));
+    ottery_st_rand_bytes(&st1, buf1, sizeof(buf1));
+    ottery_st_rand_bytes(&st2, buf2, sizeof(buf2));
+    tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+    ottery_st_wipe(&st1);
+    ottery_st_wipe(&st2);
+  }
+
+ end:
+  ;
+}
+
+static void
+test_rand_bytes_parallel(void *arg)
+{
+  struct ottery_state st1, st2;
+  const uint8_t seed[] = "parallel";
+  const size_t sizes[] = { 100, 1024*1024 - 1, 3*1024*1024 + 17 };
+  const unsigned threads[] = { 0, 1, 3, 64 };
+  const size_t buflen = 3*1024*1024 + 64;
+  uint8_t *b1 = NULL, *b2 = NULL;
+  unsigned i, j;
+  (void)arg;
+
+  b1 = malloc(buflen);
+  b2 = malloc(buflen);
+  tt_assert(b1 && b2);
+
+  /* We give exactly the same output, and leave the state exactly the same,
+   * as ottery_st_rand_bytes(). */
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st1, NULL, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed_nolock(&st2, NULL, seed,
+                                                   sizeof(seed)));
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    for (j = 0; j < sizeof(threads)/sizeof(threads[0]); ++j) {
+      const size_t n = sizes[i];
+      memset(b1, 0, buflen);
+      memset(b2, 0, buflen);
+      /* Unaligned output too. */
+      ottery_st_rand_bytes(&st1, b1 + j, n);
+      if (j & 1)
+        ottery_st_rand_bytes_parallel(&st2, b2 + j, n, threads[j]);
+      else
+        ottery_st_rand_bytes_parallel_nolock(&st2, b2 + j, n, threads[j]);
+      tt_assert(0 == memcmp(b1, b2, buflen));
+      tt_int_op(ottery_st_rand_uint64(&st1), ==, ottery_st_rand_uint64(&st2));
+    }
+  }
+
+  /* The global version works as well. */
+  memset(b1, 0, buflen);
+  memset(b2, 0, buflen);
+  ottery_rand_bytes_parallel(b1, buflen, 0);
+  tt_assert(0 != memcmp(b1 + buflen - 64, b2, 64));
+
+ end:
+  free(b1);
+  free(b2);
+}
+
+static void
+test_write_fd(void *arg)
+{
+  struct ottery_state st;
+  char tempfile[] = "ottery_test_temp.XXXXXXXX";
+  const size_t n = 3*1024*1024 + 5;
+  uint8_t *buf = NULL, zero[4096];
+  int fd = -1, pipe_fd[2] = { -1, -1 };
+  ssize_t r;
+  size_t got = 0;
+  (void)arg;
+
+  memset(zero, 0, sizeof(zero));
+  tt_int_op(0, ==, ottery_st_init(&st, NULL));
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==, ottery_st_write_fd(&st, -1, 10));
+
+  /* A regular file gets every byte, and they aren't zero. */
+  fd = mkstemp(tempfile);
+  tt_int_op(fd, >=, 0);
+  unlink(tempfile);
+  tt_int_op(0, ==, ottery_st_write_fd(&st, fd, n));
+  tt_int_op(0, ==, ottery_st_write_fd_nolock(&st, fd, 0));
+  tt_int_op((off_t)n, ==, lseek(fd, 0, SEEK_CUR));
+  tt_assert((buf = malloc(n)));
+  tt_int_op((off_t)0, ==, lseek(fd, 0, SEEK_SET));
+  while (got < n && (r = read(fd, buf + got, n - got)) > 0)
+    got += r;
+  tt_int_op(got, ==, n);
+  tt_assert(memcmp(buf + n - sizeof(zero), zero, sizeof(zero)));
+  close(fd);
+  fd = -1;
+
+  /* So does a pipe. */
+  if (pipe(pipe_fd) < 0)
+    tt_abort_perror("pipe");
+  tt_int_op(0, ==, ottery_st_write_fd_nolock(&st, pipe_fd[1], 1000));
+  close(pipe_fd[1]);
+  pipe_fd[1] = -1;
+  got = 0;
+  while ((r = read(pipe_fd[0], buf + got, n - got)) > 0)
+    got += r;
+  tt_int_op(got, ==, 1000);
+
+  /* A descriptor we can't write to gives an error, and errno. */
+  fd = open("/dev/null", O_RDONLY);
+  tt_int_op(fd, >=, 0);
+  errno = 0;
+  tt_int_op(OTTERY_ERR_WRITE, ==, ottery_st_write_fd(&st, fd, 3*1024*1024));
+  tt_int_op(errno, ==, EBADF);
+
+ end:
+  if (fd >= 0)
+    close(fd);
+  if (pipe_fd[0] >= 0)
+    close(pipe_fd[0]);
+  if (pipe_fd[1] >= 0)
+    close(pipe_fd[1]);
+  free(buf);
+}
+
+static void
+test_stats(void *arg)
+{
+  struct ottery_config cfg;
+  struct ottery_state *st = NULL;
+  struct ottery_stats stats;
+  uint8_t buf[4096];
+  uint64_t calls = 0, blocks, rekeys;
+  unsigned i;
+  (void)arg;
+
+  if (!(ottery_get_build_flags() & OTTERY_BLDFLG_STATS)) {
+    tt_int_op(0, ==, ottery_st_new(&st, NULL));
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+              ottery_st_get_stats(st, &stats));
+    tt_int_op(0, ==, stats.bytes_out);
+    tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==, ottery_get_stats(&stats));
+    goto end;
+  }
+
+  ottery_config_init(&cfg);
+  tt_int_op(0, ==, ottery_config_set_buffer_blocks(&cfg, 4));
+  tt_int_op(0, ==, ottery_st_new(&st, &cfg));
+  tt_int_op(0, ==, ottery_st_get_stats(st, &stats));
+  tt_int_op(1, ==, stats.reseeds);
+  tt_int_op(0, ==, stats.bytes_out);
+  tt_int_op(0, ==, stats.add_seed_calls);
+  tt_int_op(stats.n_entropy_sources, >=, 1);
+  tt_int_op(stats.n_entropy_sources, <=, OTTERY_STATS_MAX_SOURCES);
+  for (i = 0; i < stats.n_entropy_sources; ++i) {
+    tt_int_op(stats.entropy_failures[i], <=, stats.entropy_calls[i]);
+    calls += stats.entropy_calls[i];
+  }
+  tt_int_op(calls, >=, 1);
+
+  ottery_st_rand_uint64(st);
+  ottery_st_rand_bytes(st, buf, 10);
+  tt_int_op(0, ==, ottery_st_get_stats(st, &stats));
+  tt_int_op(8 + 10, ==, stats.bytes_out);
+  blocks = stats.prf_blocks;
+  rekeys = stats.rekeys;
+
+  ottery_st_rand_bytes(st, buf, sizeof(buf));
+  tt_int_op(0, ==, ottery_st_add_seed(st, (const uint8_t*)"xyzzy", 5));
+  tt_int_op(0, ==, ottery_st_get_stats(st, &stats));
+  tt_int_op(8 + 10 + sizeof(buf), ==, stats.bytes_out);
+  tt_int_op(stats.prf_blocks, >, blocks);
+  tt_int_op(stats.rekeys, >=, rekeys + 2);
+  tt_int_op(1, ==, stats.add_seed_calls);
+  /* One acquisition per call, including the ottery_st_get_stats() calls. */
+  tt_int_op(7, ==, stats.lock_acquisitions);
+  tt_int_op(0, ==, stats.lock_contended);
+
+  stats.bytes_out = 0;
+  tt_int_op(0, ==, ottery_get_stats(&stats));
+  tt_int_op(stats.reseeds, >=, 1);
+
+ end:
+  ottery_st_free(st);
+}
+
+static void
+test_prediction_resistance(void *arg)
+{
+  struct ottery_config cfg;
+  struct ottery_state st1, st2, st3;
+  struct ottery_stats stats;
+  const uint8_t seed[] = "reproducible seed";
+  uint8_t buf1[4096], buf2[4096], buf3[4096];
+  size_t i;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  tt_int_op(0, ==, ottery_config_set_prediction_resistance(&cfg, 0, 0));
+  if (ottery_config_set_prediction_resistance(&cfg, 4, 0)) {
+    tt_skip();
+  }
+  /* Nothing else may come from the CPU once we disable RDRAND. */
+  ottery_config_disable_entropy_sources(&cfg, OTTERY_ENTROPY_SRC_RDRAND);
+  tt_int_op(OTTERY_ERR_INVALID_ARGUMENT, ==,
+            ottery_config_set_prediction_resistance(&cfg, 4, 0));
+
+  /* Identically seeded states give the same output only without
+   * prediction resistance. */
+  ottery_config_init(&cfg);
+  ottery_config_disable_entropy_sources(&cfg,
+                  OTTERY_ENTROPY_ALL_SOURCES & ~OTTERY_ENTROPY_SRC_RDRAND);
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st1, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_config_set_prediction_resistance(&cfg, 4, 0));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st2, &cfg, seed, sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed(&st3, &cfg, seed, sizeof(seed)));
+  /* The first few blocks come before the first mix. */
+  ottery_st_rand_bytes(&st1, buf1, 64);
+  ottery_st_rand_bytes(&st2, buf2, 64);
+  ottery_st_rand_bytes(&st3, buf3, 64);
+  tt_assert(0 == memcmp(buf1, buf2, 64));
+  tt_assert(0 == memcmp(buf2, buf3, 64));
+  tt_int_op(0, ==, ottery_st_refill(&st2));
+  /* A single big request comes from one key, so we use small ones. */
+  for (i = 0; i < sizeof(buf1); i += 64) {
+    ottery_st_rand_bytes(&st1, buf1 + i, 64);
+    ottery_st_rand_bytes(&st2, buf2 + i, 64);
+    ottery_st_rand_bytes(&st3, buf3 + i, 64);
+  }
+  tt_assert(0 != memcmp(buf1, buf2, sizeof(buf1)));
+  tt_assert(0 != memcmp(buf1, buf3, sizeof(buf1)));
+  tt_assert(0 != memcmp(buf2, buf3, sizeof(buf1)));
+
+  if (ottery_get_build_flags() & OTTERY_BLDFLG_STATS) {
+    tt_int_op(0, ==, ottery_st_get_stats(&st1, &stats));
+    tt_int_op(0, ==, stats.pr_mixes);
+    tt_int_op(0, ==, ottery_st_get_stats(&st2, &stats));
+    tt_int_op(stats.pr_mixes, >=, 1);
+    tt_int_op(stats.pr_mixes, <=, stats.rekeys);
+  }
+  ottery_st_wipe(&st1);
+  ottery_st_wipe(&st2);
+  ottery_st_wipe(&st3);
+
+ end:
+  ;
+}
+
+static void
+test_fast_start(void *arg)
+{
+  struct ottery_config cfg;
+  struct ottery_state st;
+  uint8_t buf[64];
+  size_t i;
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  /* We need a second domain to defer: the CPU will do. */
+  if (!ottery_have_fast_entropy_(&cfg.entropy_config))
+    tt_skip();
+
+  /* Normally, we ask every source up front. */
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_OS);
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU);
+  tt_int_op(st.entropy_deferred, ==, ENTROPY_DEFERRED_NONE);
+  ottery_st_wipe(&st);
+
+  /* With fast start, we stop after the OS, and say so. */
+  ottery_config_set_fast_start(&cfg, 1);
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_OS);
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_FL_STRONG);
+  tt_assert(!(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU));
+  tt_int_op(st.entropy_deferred, ==, ENTROPY_DEFERRED_WAITING);
+  ottery_st_rand_bytes(&st, buf, sizeof(buf));
+  tt_assert(!(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU));
+  /* Once we've used up the first buffer, we mix in the rest. */
+  for (i = 0; i < 4096; i += sizeof(buf))
+    ottery_st_rand_bytes(&st, buf, sizeof(buf));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_OS);
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU);
+  tt_int_op(st.entropy_deferred, ==, ENTROPY_DEFERRED_NONE);
+  ottery_st_wipe(&st);
+
+  /* Refilling mixes them in right away... */
+  tt_int_op(0, ==, ottery_st_init(&st, &cfg));
+  tt_assert(!(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU));
+  tt_int_op(0, ==, ottery_st_refill(&st));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU);
+  tt_int_op(st.entropy_deferred, ==, ENTROPY_DEFERRED_NONE);
+  ottery_st_wipe(&st);
+
+  /* ... as does a reseed from the OS... */
+  tt_int_op(0, ==, ottery_st_init_nolock(&st, &cfg));
+  tt_assert(!(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU));
+  tt_int_op(0, ==, ottery_st_add_seed_nolock(&st, NULL, 0));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU);
+  tt_int_op(st.entropy_deferred, ==, ENTROPY_DEFERRED_NONE);
+  ottery_st_wipe_nolock(&st);
+
+  /* ... but adding a seed of our own doesn't. */
+  tt_int_op(0, ==, ottery_st_init_nolock(&st, &cfg));
+  tt_int_op(0, ==, ottery_st_add_seed_nolock(&st, buf, sizeof(buf)));
+  tt_assert(!(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU));
+  tt_int_op(0, ==, ottery_st_refill_nolock(&st));
+  tt_assert(st.entropy_src_flags & OTTERY_ENTROPY_DOM_CPU);
+  ottery_st_wipe_nolock(&st);
+
+ end:
+  ;
+}
+
+static void
+test_fast_view(void *arg)
+{
+  struct ottery_config cfg;
+  __attribute__((aligned(16))) struct ottery_state_nolock st1, st2;
+  struct ottery_fast_view_nolock view;
+  const uint8_t seed[] = "reproducible seed";
+  uint32_t buf1[OTTERY_FAST_VIEW_LEN / 2], buf2[OTTERY_FAST_VIEW_LEN / 2];
+  uint64_t v;
+  unsigned i;
+#if !defined(_WIN32) && !defined(OTTERY_NO_PID_CHECK)
+  uint32_t child_val = 0;
+  int fd[2] = { -1, -1 };
+  pid_t p;
+#endif
+  (void)arg;
+
+  ottery_config_init(&cfg);
+  /* The child needs an entropy source, to reseed after the fork. */
+  tt_int_op(0, ==, ottery_st_init_from_seed_nolock(&st1, &cfg, seed,
+                                                   sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_init_from_seed_nolock(&st2, &cfg, seed,
+                                                   sizeof(seed)));
+  tt_int_op(0, ==, ottery_st_fast_view_init_nolock(&view, &st1));
+
+  /* A view hands out the state's bytes in OTTERY_FAST_VIEW_LEN-byte
+   * pieces. */
+  for (i = 0; i < sizeof(buf1) / sizeof(buf1[0]); ++i)
+    buf1[i] = ottery_fast_rand_uint32_nolock(&view);
+  ottery_st_rand_bytes_nolock(&st2, buf2, OTTERY_FAST_VIEW_LEN);
+  ottery_st_rand_bytes_nolock(&st2, buf2 + OTTERY_FAST_VIEW_LEN / 4,
+                              OTTERY_FAST_VIEW_LEN);
+  tt_assert(0 == memcmp(buf1, buf2, sizeof(buf1)));
+  v = ottery_fast_rand_uint64_nolock(&view);
+  ottery_st_rand_bytes_nolock(&st2, buf2, OTTERY_FAST_VIEW_LEN);
+  tt_assert(0 == memcmp(&v, buf2, 8));
+
+  /* And the state keeps working on its own, without repeating them. */
+  ottery_st_rand_bytes_nolock(&st1, buf1, 8);
+  ottery_st_rand_bytes_nolock(&st2, buf2, 8);
+  tt_assert(0 == memcmp(buf1, buf2, 8));
+
+#if !defined(_WIN32) && !defined(OTTERY_NO_PID_CHECK)
+  /* After a fork, a view in the child doesn't hand out what it had left. */
+  if (pipe(fd) < 0)
+    tt_abort_perror("pipe");
+  if ((p = fork()) == 0) {
+    child_val = ottery_fast_rand_uint32_nolock(&view);
+    if (write(fd[1], &child_val, sizeof(child_val)) < 0)
+      perror("write");
+    exit(0);
+  } else if (p == -1) {
+    tt_abort_perror("fork");
+  }
+  /* Close our end, so that we don't wait forever if the child dies. */
+  close(fd[1]);
+  tt_int_op(sizeof(child_val), ==, read(fd[0], &child_val, sizeof(child_val)));
+  tt_int_op(child_val, !=, ottery_fast_rand_uint32_nolock(&view));
+  close(fd[0]);
+#endif
+
+  ottery_fast_view_wipe_nolock(&view);
+  ottery_st_wipe_nolock(&st1);
+  ottery_st_wipe_nolock(&st2);
+ end:
+  ;
+}
+
 #define COMMON_TESTS(flags)                                            \
   { "range", test_range, TT_FORK|flags, &setup, NULL },                \
   { "unsigned", test_rand_uint, TT_FORK|flags, &setup, NULL },         \
+  { "uint_array", test_rand_uint_array, TT_FORK|flags, &setup, NULL }, \
+  { "range_array", test_range_array, TT_FORK|flags, &setup, NULL },    \
+  { "shuffle_sample", test_shuffle_sample, TT_FORK|flags, &setup, NULL }, \
+  { "float", test_rand_float, TT_FORK|flags, &setup, NULL },           \
   { "little_buf", test_rand_little_buf, TT_FORK|flags, &setup, NULL }, \
   { "big_buf", test_rand_big_buf, TT_FORK|flags, &setup, NULL },       \
+  { "bulk_blocks", test_rand_bulk_blocks, TT_FORK|flags, &setup, NULL }, \
   { "fork", test_fork, TT_FORK|flags, &setup, NULL },                  \
   { "bad_init", test_bad_init, TT_FORK|flags, &setup, NULL, },         \
-  { "reseed_and_stir", test_reseed_stir, TT_FORK|flags, &setup, NULL, }
+  { "reseed_and_stir", test_reseed_stir, TT_FORK|flags, &setup, NULL, }, \
+  { "refill", test_refill, TT_FORK|flags, &setup, NULL, }
 
 struct testcase_t stateful_tests[] = {
   COMMON_TESTS(OT_ENABLE_STATE),
+  { "unlocked_bulk", test_rand_unlocked_bulk, TT_FORK|OT_ENABLE_STATE, &setup,
+    NULL },
   { "misaligned_init", test_misaligned_init, 0, NULL, NULL },
+  { "buffer_blocks", test_buffer_blocks, TT_FORK, NULL, NULL },
+  { "clear_mode", test_clear_mode, TT_FORK, NULL, NULL },
+  { "wipe_stack_mode", test_wipe_stack_mode, TT_FORK, NULL, NULL },
+  { "st_new", test_st_new, TT_FORK, NULL, NULL },
+  { "split_seek", test_split_seek, TT_FORK, NULL, NULL },
+  { "rand_bytes_parallel", test_rand_bytes_parallel, TT_FORK, NULL, NULL },
+  { "write_fd", test_write_fd, TT_FORK, NULL, NULL },
+  { "stats", test_stats, TT_FORK, NULL, NULL },
+  { "prediction_resistance", test_prediction_resistance, TT_FORK, NULL,
+    NULL },
+  { "fast_view", test_fast_view, TT_FORK, NULL, NULL },
+  { "fast_start", test_fast_start, TT_FORK, NULL, NULL },
   END_OF_TESTCASES,
 };
 
@@ -836,11 +2466,23 @@ struct testcase_t global_tests[] = {
   END_OF_TESTCASES,
 };
 
+struct testcase_t global_thread_tests[] = {
+  COMMON_TESTS(OT_GLOBAL_PER_THREAD),
+  END_OF_TESTCASES,
+};
+
+struct testcase_t global_sharded_tests[] = {
+  COMMON_TESTS(OT_GLOBAL_SHARDED),
+  END_OF_TESTCASES,
+};
+
 struct testgroup_t groups[] = {
   { "misc/", misc_tests },
   { "state/", stateful_tests },
   { "nolock/", nolock_tests },
   { "global/", global_tests },
+  { "global_thread/", global_thread_tests },
+  { "global_sharded/", global_sharded_tests },
   END_OF_GROUPS
 };
 
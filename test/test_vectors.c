@@ -92,6 +92,28 @@ const struct ottery_prf *prfs_best[] = {
 #define prfs_best prfs_midrange
 #endif
 
+#ifdef HAVE_SIMD_CHACHA_3
+const struct ottery_prf *prfs_avx2[] = {
+  &ottery_prf_chacha8_krovetz_3_,
+  &ottery_prf_chacha12_krovetz_3_,
+  &ottery_prf_chacha20_krovetz_3_,
+  NULL
+};
+#else
+#define prfs_avx2 prfs_best
+#endif
+
+#ifdef HAVE_SIMD_CHACHA_4
+const struct ottery_prf *prfs_avx512[] = {
+  &ottery_prf_chacha8_krovetz_4_,
+  &ottery_prf_chacha12_krovetz_4_,
+  &ottery_prf_chacha20_krovetz_4_,
+  NULL
+};
+#else
+#define prfs_avx512 prfs_best
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -100,6 +122,17 @@ main(int argc, char **argv)
     prfs = prfs_no_simd;
   if (argc > 1 && !strcmp(argv[1], "midrange"))
     prfs = prfs_midrange;
+  if (argc > 1 && !strcmp(argv[1], "avx2"))
+    prfs = prfs_avx2;
+  if (argc > 1 && !strcmp(argv[1], "avx512"))
+    prfs = prfs_avx512;
+
+  /* We can't run these on a CPU that doesn't support them. */
+  if ((prfs[0]->required_cpucap & ottery_get_cpu_capabilities_()) !=
+      prfs[0]->required_cpucap) {
+    fprintf(stderr, "%s isn't supported on this CPU\n", prfs[0]->flav);
+    prfs = prfs_best;
+  }
 
   X("helloworld!helloworld!helloworld", "!hellowo", 0);
   X("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",